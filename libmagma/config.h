@@ -32,6 +32,9 @@
 /* Define to 1 if you have the `fuse' library (-lfuse). */
 #define HAVE_LIBFUSE 1
 
+/* Define to 1 if you have the `lsetxattr' function. */
+#define HAVE_LSETXATTR 1
+
 /* Define to 1 if `lstat' has the bug that it succeeds when given the
    zero-length file name argument. */
 /* #undef HAVE_LSTAT_EMPTY_STRING_BUG */
@@ -219,8 +219,7 @@ int magma_validate_connection(GSocket *socket, GSocketAddress *peer, const char
 	gchar policy = magma_acl_match(socket, path, magma_acl);
 	g_rw_lock_reader_unlock(&magma_acl_rwlock);
 
-	GInetAddress *inet_address = g_inet_socket_address_get_address((GInetSocketAddress *) peer);
-	gchar *printable = g_inet_address_to_string((GInetAddress *) inet_address);
+	gchar *printable = magma_get_peer_name(peer);
 
 	if ('n' == policy) {
 		dbg(LOG_INFO, DEBUG_PFUSE, "operation %c denied on %s from %s", optype, path, printable);
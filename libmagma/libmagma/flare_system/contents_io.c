@@ -0,0 +1,275 @@
+/*
+   MAGMA -- flare_system/contents_io.c
+   Copyright (C) 2006-2013 Tx0 <tx0@strumentiresistenti.org>
+
+   Read and write the contents file of a flare. If liburing is
+   available and the kernel supports it, the open, the read or write
+   and the close are submitted to an io_uring as one linked chain on
+   a direct descriptor: one system call per request instead of three,
+   with the completions of concurrent requests reaped in batches by a
+   single thread. Otherwise, or if the ring can't be set up, plain
+   open(), pread()/pwrite() and close() are used.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include "../magma.h"
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+
+/** the operations of a request chain, also the low bits of the CQE user data */
+#define MAGMA_CONTENTS_IO_OPEN	0
+#define MAGMA_CONTENTS_IO_RW	1
+#define MAGMA_CONTENTS_IO_CLOSE	2
+#define MAGMA_CONTENTS_IO_STAGES 3
+
+/**
+ * A request submitted to the ring. Allocated on the stack of
+ * the calling thread, which sleeps until all its CQEs are reaped.
+ */
+typedef struct {
+	int results[MAGMA_CONTENTS_IO_STAGES];
+	int remaining;
+	GMutex lock;
+	GCond cond;
+} magma_contents_io_request;
+
+static struct io_uring magma_contents_ring;
+static gboolean magma_contents_ring_ready = FALSE;
+
+/** serializes the submission side of the ring */
+static GMutex magma_contents_submit_mutex;
+
+/** direct descriptor slots not in use by any request */
+static GAsyncQueue *magma_contents_free_slots;
+
+/**
+ * Reap completions, waking each request once its chain is over
+ */
+static gpointer magma_contents_io_reaper(gpointer data)
+{
+	(void) data;
+	struct io_uring_cqe *cqes[MAGMA_CONTENTS_IO_DEPTH];
+
+	for (;;) {
+		struct io_uring_cqe *cqe = NULL;
+		if (io_uring_wait_cqe(&magma_contents_ring, &cqe) < 0) continue;
+
+		unsigned count = io_uring_peek_batch_cqe(&magma_contents_ring, cqes, MAGMA_CONTENTS_IO_DEPTH), i;
+		for (i = 0; i < count; i++) {
+			guintptr user_data = (guintptr) io_uring_cqe_get_data(cqes[i]);
+			magma_contents_io_request *request = (magma_contents_io_request *) (user_data & ~(guintptr) 3);
+			int stage = user_data & 3;
+
+			g_mutex_lock(&request->lock);
+			request->results[stage] = cqes[i]->res;
+			if (!--request->remaining) g_cond_signal(&request->cond);
+			g_mutex_unlock(&request->lock);
+		}
+
+		io_uring_cq_advance(&magma_contents_ring, count);
+	}
+
+	return (NULL);
+}
+
+/**
+ * Set up the ring, checking the kernel knows every operation used
+ */
+static gpointer magma_contents_io_setup(gpointer data)
+{
+	(void) data;
+
+	if (io_uring_queue_init(MAGMA_CONTENTS_IO_DEPTH * MAGMA_CONTENTS_IO_STAGES, &magma_contents_ring, 0) < 0) {
+		dbg(LOG_INFO, DEBUG_FLARE, "io_uring not available, using plain system calls for contents I/O");
+		return (NULL);
+	}
+
+	struct io_uring_probe *probe = io_uring_get_probe_ring(&magma_contents_ring);
+	gboolean supported = probe &&
+		io_uring_opcode_supported(probe, IORING_OP_OPENAT) &&
+		io_uring_opcode_supported(probe, IORING_OP_READ) &&
+		io_uring_opcode_supported(probe, IORING_OP_WRITE) &&
+		io_uring_opcode_supported(probe, IORING_OP_CLOSE);
+	if (probe) io_uring_free_probe(probe);
+
+	if (!supported || io_uring_register_files_sparse(&magma_contents_ring, MAGMA_CONTENTS_IO_DEPTH) < 0) {
+		dbg(LOG_INFO, DEBUG_FLARE, "io_uring lacks direct descriptors, using plain system calls for contents I/O");
+		io_uring_queue_exit(&magma_contents_ring);
+		return (NULL);
+	}
+
+	magma_contents_free_slots = g_async_queue_new();
+	int slot;
+	for (slot = 0; slot < MAGMA_CONTENTS_IO_DEPTH; slot++)
+		g_async_queue_push(magma_contents_free_slots, GINT_TO_POINTER(slot + 1));
+
+	g_thread_unref(g_thread_new("Contents I/O", magma_contents_io_reaper, NULL));
+
+	magma_contents_ring_ready = TRUE;
+	dbg(LOG_INFO, DEBUG_FLARE, "Contents I/O on io_uring, %d requests deep", MAGMA_CONTENTS_IO_DEPTH);
+	return (NULL);
+}
+
+/**
+ * Submit open, read or write, and close as one linked chain
+ *
+ * @return the bytes read or written, -1 on error with errno set
+ */
+static ssize_t magma_contents_io_submit(const gchar *contents, gchar *buf, size_t size, off_t offset, gboolean write)
+{
+	magma_contents_io_request request;
+	memset(&request, 0, sizeof(request));
+	request.remaining = MAGMA_CONTENTS_IO_STAGES;
+	g_mutex_init(&request.lock);
+	g_cond_init(&request.cond);
+
+	/* waits here when MAGMA_CONTENTS_IO_DEPTH requests are in flight */
+	unsigned slot = GPOINTER_TO_INT(g_async_queue_pop(magma_contents_free_slots)) - 1;
+
+	g_mutex_lock(&magma_contents_submit_mutex);
+
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&magma_contents_ring);
+	io_uring_prep_openat_direct(sqe, AT_FDCWD, contents, O_RDWR|O_CREAT, S_IRWXU, slot);
+	io_uring_sqe_set_data(sqe, (gchar *) &request + MAGMA_CONTENTS_IO_OPEN);
+	sqe->flags |= IOSQE_IO_LINK;
+
+	sqe = io_uring_get_sqe(&magma_contents_ring);
+	if (write) {
+		io_uring_prep_write(sqe, slot, buf, size, offset);
+	} else {
+		io_uring_prep_read(sqe, slot, buf, size, offset);
+	}
+	io_uring_sqe_set_data(sqe, (gchar *) &request + MAGMA_CONTENTS_IO_RW);
+	sqe->flags |= IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+
+	/* hard linked: the close runs even after a short or failed read or write */
+	sqe = io_uring_get_sqe(&magma_contents_ring);
+	io_uring_prep_close_direct(sqe, slot);
+	io_uring_sqe_set_data(sqe, (gchar *) &request + MAGMA_CONTENTS_IO_CLOSE);
+
+	io_uring_submit(&magma_contents_ring);
+
+	g_mutex_unlock(&magma_contents_submit_mutex);
+
+	g_mutex_lock(&request.lock);
+	while (request.remaining) g_cond_wait(&request.cond, &request.lock);
+	g_mutex_unlock(&request.lock);
+
+	g_mutex_clear(&request.lock);
+	g_cond_clear(&request.cond);
+
+	/*
+	 * a failed open cancels the rest of the chain, leaving the slot
+	 * empty; if the close didn't run, the slot is cleared here
+	 */
+	int open_result = request.results[MAGMA_CONTENTS_IO_OPEN];
+	int result = request.results[MAGMA_CONTENTS_IO_RW];
+
+	if (open_result >= 0 && request.results[MAGMA_CONTENTS_IO_CLOSE] < 0) {
+		int fds[1] = { -1 };
+		io_uring_register_files_update(&magma_contents_ring, slot, fds, 1);
+	}
+
+	g_async_queue_push(magma_contents_free_slots, GINT_TO_POINTER(slot + 1));
+
+	if (open_result < 0) {
+		errno = -open_result;
+		return (-1);
+	}
+
+	if (result < 0) {
+		errno = -result;
+		return (-1);
+	}
+
+	return (result);
+}
+
+static GOnce magma_contents_io_once = G_ONCE_INIT;
+
+#endif /* HAVE_LIBURING */
+
+/**
+ * Tell if contents I/O goes through io_uring
+ *
+ * @return TRUE if the ring is set up, FALSE when using system calls
+ */
+gboolean magma_contents_io_uring()
+{
+#ifdef HAVE_LIBURING
+	g_once(&magma_contents_io_once, magma_contents_io_setup, NULL);
+	return (magma_contents_ring_ready);
+#else
+	return (FALSE);
+#endif
+}
+
+/**
+ * Read from the contents file of a flare, creating it if missing
+ *
+ * @param contents the contents file path
+ * @param buf where data are read
+ * @param size the bytes to read
+ * @param offset the offset to read from
+ * @return the bytes read, -1 on error with errno set
+ */
+ssize_t magma_contents_pread(const gchar *contents, gchar *buf, size_t size, off_t offset)
+{
+#ifdef HAVE_LIBURING
+	if (magma_contents_io_uring()) return (magma_contents_io_submit(contents, buf, size, offset, FALSE));
+#endif
+
+	int fd = open(contents, O_RDWR|O_CREAT, S_IRWXU);
+	if (fd is -1) return (-1);
+
+	ssize_t res = pread(fd, buf, size, offset);
+
+	int saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+
+	return (res);
+}
+
+/**
+ * Write to the contents file of a flare, creating it if missing
+ *
+ * @param contents the contents file path
+ * @param buf the data to write
+ * @param size the bytes to write
+ * @param offset the offset to write to
+ * @return the bytes written, -1 on error with errno set
+ */
+ssize_t magma_contents_pwrite(const gchar *contents, const gchar *buf, size_t size, off_t offset)
+{
+#ifdef HAVE_LIBURING
+	if (magma_contents_io_uring()) return (magma_contents_io_submit(contents, (gchar *) buf, size, offset, TRUE));
+#endif
+
+	int fd = open(contents, O_RDWR|O_CREAT, S_IRWXU);
+	if (fd is -1) return (-1);
+
+	ssize_t res = pwrite(fd, buf, size, offset);
+
+	int saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+
+	return (res);
+}
+
+// vim:ts=4:nocindent:autoindent
@@ -0,0 +1,481 @@
+/*
+   MAGMA -- journal.c
+   Copyright (C) 2006-2015 Tx0 <tx0@strumentiresistenti.org>
+
+   Flare operation journal. Every mutating flare operation applied
+   on this node is recorded in the journal_<nickname> table with a
+   monotonically increasing sequence number. Records are queued and
+   written in batches by a dedicated thread. The journal suffix can
+   be replayed to bring a redundant node up to date without copying
+   the whole key space.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include "../magma.h"
+
+/**
+ * The queue of entries waiting to be written and the
+ * thread writing them
+ */
+GAsyncQueue *magma_journal_queue;
+GThread *magma_journal_thread;
+
+/**
+ * magma_journal_mutex protects the sequence counters and
+ * guarantees that entries are queued in sequence order.
+ * magma_journal_cond is signaled each time a batch hits
+ * the disk.
+ */
+GMutex magma_journal_mutex;
+GCond magma_journal_cond;
+
+/** the last sequence number assigned */
+static guint64 magma_journal_sequence = 0;
+
+/** the last sequence number written to SQL */
+static guint64 magma_journal_committed = 0;
+
+/** the oldest sequence number still held in the journal */
+static guint64 magma_journal_first = 1;
+
+/**
+ * Allocate a new journal entry. All the optional fields are
+ * zeroed and can be set by the caller before calling
+ * magma_journal_append().
+ *
+ * @param optype the operation type (MAGMA_OP_TYPE_*)
+ * @param path the path of the flare involved
+ * @return the new entry
+ */
+magma_journal_entry *magma_journal_new_entry(magma_optype optype, const gchar *path)
+{
+	magma_journal_entry *entry = g_new0(magma_journal_entry, 1);
+	entry->optype = optype;
+	entry->path = g_strdup(path);
+	return (entry);
+}
+
+/**
+ * Free a journal entry
+ *
+ * @param entry the entry to be freed
+ */
+void magma_journal_free_entry(magma_journal_entry *entry)
+{
+	if (!entry) return;
+	g_free(entry->path);
+	g_free(entry->to_path);
+	g_free(entry);
+}
+
+/**
+ * Assign the next sequence number to an entry and queue it
+ * for writing. The entry is owned by the journal afterwards.
+ *
+ * @param entry the entry to be recorded
+ * @return the sequence number assigned to the entry
+ */
+guint64 magma_journal_append(magma_journal_entry *entry)
+{
+	if (!entry) return (0);
+
+	g_mutex_lock(&magma_journal_mutex);
+	entry->sequence = ++magma_journal_sequence;
+	g_async_queue_push(magma_journal_queue, entry);
+	g_mutex_unlock(&magma_journal_mutex);
+
+	dbg(LOG_INFO, DEBUG_SQL, "Journal #%lu: %s %s",
+		entry->sequence, magma_explain_optype(entry->optype), entry->path);
+
+	return (entry->sequence);
+}
+
+/**
+ * Write entries [first, first + count) of a batch using a single
+ * multi-row insert, which sqlite executes as one transaction.
+ *
+ * @param batch a GPtrArray of magma_journal_entry
+ * @param first the index of the first entry to be written
+ * @param count how many entries to write
+ * @return TRUE if written, FALSE otherwise
+ */
+static gboolean magma_journal_write_entries(GPtrArray *batch, guint first, guint count)
+{
+	GString *query = g_string_new(NULL);
+	g_string_append_printf(query,
+		"insert into journal_%s (id, optype, path, to_path, mode, rdev, new_uid, new_gid, "
+			"atime, mtime, write_offset, write_size) values ",
+		magma_environment.nickname);
+
+	guint i;
+	for (i = first; i < first + count; i++) {
+		magma_journal_entry *entry = g_ptr_array_index(batch, i);
+
+		gchar *path = magma_sql_quote(entry->path);
+		gchar *to_path = magma_sql_quote(entry->to_path);
+		if (!path || !to_path) {
+			dbg(LOG_ERR, DEBUG_SQL, "Error quoting journal entry #%lu", entry->sequence);
+			g_free(path);
+			g_free(to_path);
+			g_string_free(query, TRUE);
+			return (FALSE);
+		}
+
+		g_string_append_printf(query,
+			"%s(%lu, %d, %s, %s, %u, %lu, %u, %u, %ld, %ld, %ld, %lu)",
+			(i > first) ? ", " : "",
+			entry->sequence,
+			entry->optype,
+			path,
+			to_path,
+			entry->mode,
+			entry->rdev,
+			entry->new_uid,
+			entry->new_gid,
+			entry->atime,
+			entry->mtime,
+			entry->write_offset,
+			entry->write_size);
+
+		g_free(path);
+		g_free(to_path);
+	}
+
+	dbi_result result = magma_sql_query(query->str);
+	g_string_free(query, TRUE);
+
+	if (!result) return (FALSE);
+	dbi_result_free(result);
+	return (TRUE);
+}
+
+/**
+ * Write a batch of entries. A batch which fails is kept and written
+ * again by the caller; after MAGMA_JOURNAL_WRITE_RETRIES failures its
+ * entries are written one by one, so a single entry SQL refuses can't
+ * hold back the whole journal: that entry is logged and left out.
+ *
+ * @param batch a GPtrArray of magma_journal_entry
+ * @param failures how many times this batch already failed
+ * @return TRUE if the batch is done with, FALSE if it must be written again
+ */
+static gboolean magma_journal_write_batch(GPtrArray *batch, guint failures)
+{
+	if (!batch->len) return (TRUE);
+	if (magma_journal_write_entries(batch, 0, batch->len)) return (TRUE);
+
+	if (failures + 1 < MAGMA_JOURNAL_WRITE_RETRIES) {
+		dbg(LOG_ERR, DEBUG_SQL, "Error writing %u journal entries, retrying", batch->len);
+		return (FALSE);
+	}
+
+	guint i;
+	for (i = 0; i < batch->len; i++) {
+		if (magma_journal_write_entries(batch, i, 1)) continue;
+
+		magma_journal_entry *entry = g_ptr_array_index(batch, i);
+		dbg(LOG_ERR, DEBUG_SQL, "Journal entry #%lu (%s %s) can't be written and is lost",
+			entry->sequence, magma_explain_optype(entry->optype), entry->path);
+	}
+
+	return (TRUE);
+}
+
+/**
+ * Drop the oldest entries when the journal exceeds
+ * MAGMA_JOURNAL_MAX_ENTRIES. Nodes asking to replay from
+ * a dropped sequence will receive the whole key space.
+ */
+static void magma_journal_enforce_limit()
+{
+	if (magma_journal_committed < magma_journal_first + MAGMA_JOURNAL_MAX_ENTRIES) return;
+
+	guint64 first = magma_journal_committed - MAGMA_JOURNAL_MAX_ENTRIES + 1;
+	magma_journal_trim(first - 1);
+}
+
+/**
+ * The journal writer thread. Pops entries from the queue and
+ * writes them in batches of at most MAGMA_JOURNAL_BATCH_SIZE
+ * entries. A partial batch is written when the queue stays
+ * idle for MAGMA_JOURNAL_FLUSH_INTERVAL microseconds. The
+ * committed sequence advances only once a batch is written.
+ */
+gpointer magma_journal_kernel(gpointer data)
+{
+	(void) data;
+
+	GPtrArray *batch = g_ptr_array_sized_new(MAGMA_JOURNAL_BATCH_SIZE);
+	guint failures = 0;
+
+	while (1) {
+		/* a batch which failed is written again as it is, once the interval is over */
+		magma_journal_entry *entry = NULL;
+		if (!failures) entry = g_async_queue_timeout_pop(magma_journal_queue, MAGMA_JOURNAL_FLUSH_INTERVAL);
+		else g_usleep(MAGMA_JOURNAL_FLUSH_INTERVAL);
+
+		if (entry) g_ptr_array_add(batch, entry);
+
+		if (!batch->len) continue;
+		if (entry && batch->len < MAGMA_JOURNAL_BATCH_SIZE) continue;
+
+		if (!magma_journal_write_batch(batch, failures)) {
+			failures++;
+			continue;
+		}
+		failures = 0;
+
+		magma_journal_entry *last = g_ptr_array_index(batch, batch->len - 1);
+
+		g_mutex_lock(&magma_journal_mutex);
+		magma_journal_committed = last->sequence;
+		g_cond_broadcast(&magma_journal_cond);
+		g_mutex_unlock(&magma_journal_mutex);
+
+		guint i;
+		for (i = 0; i < batch->len; i++) magma_journal_free_entry(g_ptr_array_index(batch, i));
+		g_ptr_array_set_size(batch, 0);
+
+		magma_journal_enforce_limit();
+	}
+
+	return (NULL);
+}
+
+/**
+ * Wait until every entry appended so far has been written to SQL
+ *
+ * @return the last sequence number written
+ */
+guint64 magma_journal_flush()
+{
+	g_mutex_lock(&magma_journal_mutex);
+	guint64 target = magma_journal_sequence;
+	while (magma_journal_committed < target) {
+		g_cond_wait(&magma_journal_cond, &magma_journal_mutex);
+	}
+	g_mutex_unlock(&magma_journal_mutex);
+
+	return (target);
+}
+
+/**
+ * @return the last sequence number assigned
+ */
+guint64 magma_journal_last_sequence()
+{
+	g_mutex_lock(&magma_journal_mutex);
+	guint64 sequence = magma_journal_sequence;
+	g_mutex_unlock(&magma_journal_mutex);
+	return (sequence);
+}
+
+/**
+ * @return the oldest sequence number still in the journal
+ */
+guint64 magma_journal_first_sequence()
+{
+	g_mutex_lock(&magma_journal_mutex);
+	guint64 sequence = magma_journal_first;
+	g_mutex_unlock(&magma_journal_mutex);
+	return (sequence);
+}
+
+/**
+ * Delete all the entries up to a sequence number, included
+ *
+ * @param sequence the last sequence number to be deleted
+ */
+void magma_journal_trim(guint64 sequence)
+{
+	gchar *query = g_strdup_printf("delete from journal_%s where id <= %lu",
+		magma_environment.nickname, sequence);
+
+	dbi_result result = magma_sql_query(query);
+	dbi_result_free(result);
+	g_free(query);
+
+	g_mutex_lock(&magma_journal_mutex);
+	if (sequence >= magma_journal_first) magma_journal_first = sequence + 1;
+	g_mutex_unlock(&magma_journal_mutex);
+
+	dbg(LOG_INFO, DEBUG_SQL, "Journal trimmed up to #%lu", sequence);
+}
+
+/**
+ * Replay the journal suffix (since, until] calling func on each
+ * entry in sequence order. The journal is flushed first and then
+ * read in pages of MAGMA_JOURNAL_BATCH_SIZE entries.
+ *
+ * @param since the last sequence number already known by the caller
+ * @param until the last sequence number to replay, 0 for the end of the journal
+ * @param func the function called on each entry, which returns FALSE
+ *        when the entry was not applied and the replay must stop there
+ * @param user_data passed as is to func
+ * @return the sequence number of the last entry applied
+ */
+guint64 magma_journal_replay(guint64 since, guint64 until, magma_journal_replay_func func, gpointer user_data)
+{
+	guint64 last = magma_journal_flush();
+	if (!until || until > last) until = last;
+
+	while (since < until) {
+		gchar *query = g_strdup_printf(
+			"select id, optype, path, to_path, mode, rdev, new_uid, new_gid, "
+				"atime, mtime, write_offset, write_size "
+				"from journal_%s where id > %lu and id <= %lu order by id limit %d",
+			magma_environment.nickname, since, until, MAGMA_JOURNAL_BATCH_SIZE);
+
+		dbi_result result = magma_sql_query(query);
+		g_free(query);
+
+		if (!result) break;
+
+		guint rows = 0;
+		gboolean applied = TRUE;
+		while (applied && dbi_result_next_row(result)) {
+			magma_journal_entry entry;
+			memset(&entry, 0, sizeof(magma_journal_entry));
+
+			entry.sequence		= magma_sql_fetch_integer64(result, 1);
+			entry.optype		= magma_sql_fetch_integer(result, 2);
+			entry.path			= magma_sql_fetch_string (result, 3);
+			entry.to_path		= magma_sql_fetch_string (result, 4);
+			entry.mode			= magma_sql_fetch_integer(result, 5);
+			entry.rdev			= magma_sql_fetch_integer(result, 6);
+			entry.new_uid		= magma_sql_fetch_integer(result, 7);
+			entry.new_gid		= magma_sql_fetch_integer(result, 8);
+			entry.atime			= magma_sql_fetch_integer(result, 9);
+			entry.mtime			= magma_sql_fetch_integer(result, 10);
+			entry.write_offset	= magma_sql_fetch_integer64(result, 11);
+			entry.write_size	= magma_sql_fetch_integer(result, 12);
+
+			applied = func(&entry, user_data);
+
+			if (applied) since = entry.sequence;
+			free(entry.path);
+			free(entry.to_path);
+			rows++;
+		}
+
+		dbi_result_free(result);
+
+		/* no more rows: the suffix has holes or has been trimmed meanwhile */
+		if (!rows || !applied) break;
+	}
+
+	return (since);
+}
+
+/**
+ * Load the last sequence number received from a node
+ * while catching up on its journal
+ *
+ * @param node_name the nickname of the node
+ * @return the sequence number, 0 if the node never sent its journal
+ */
+guint64 magma_journal_load_checkpoint(const gchar *node_name)
+{
+	gchar *node = magma_sql_quote(node_name);
+	if (!node) return (0);
+
+	gchar *query = g_strdup_printf(
+		"select sequence from journal_checkpoint_%s where node = %s",
+		magma_environment.nickname, node);
+	g_free(node);
+
+	guint64 sequence = 0;
+	dbi_result result = magma_sql_query(query);
+	if (result && dbi_result_next_row(result)) {
+		sequence = magma_sql_fetch_integer64(result, 1);
+	}
+
+	dbi_result_free(result);
+	g_free(query);
+
+	return (sequence);
+}
+
+/**
+ * Save the last sequence number received from a node
+ *
+ * @param node_name the nickname of the node
+ * @param sequence the sequence number
+ */
+void magma_journal_save_checkpoint(const gchar *node_name, guint64 sequence)
+{
+	gchar *node = magma_sql_quote(node_name);
+	if (!node) return;
+
+	gchar *query = g_strdup_printf(
+		"insert or replace into journal_checkpoint_%s (node, sequence) values (%s, %lu)",
+		magma_environment.nickname, node, sequence);
+	g_free(node);
+
+	dbi_result result = magma_sql_query(query);
+	dbi_result_free(result);
+	g_free(query);
+}
+
+/**
+ * Initialize the journal: create the checkpoint table, restore
+ * the sequence counters from SQL and start the writer thread.
+ * Must be called after magma_init_sql().
+ */
+void magma_init_journal()
+{
+	gchar *query = g_strdup_printf(
+		"create table if not exists journal_checkpoint_%s ("
+			"node char(1024) primary key, "
+			"sequence bigint not null default 0"
+		")",
+		magma_environment.nickname);
+
+	dbi_result result = magma_sql_query(query);
+	if (!result) exit (1);
+	dbi_result_free(result);
+	g_free(query);
+
+	/*
+	 * sqlite_sequence remembers the highest id ever used, so the
+	 * sequence does not restart even if the journal has been
+	 * trimmed down to nothing
+	 */
+	query = g_strdup_printf(
+		"select coalesce(min(id), 0), "
+			"coalesce((select seq from sqlite_sequence where name = 'journal_%s'), 0) "
+			"from journal_%s",
+		magma_environment.nickname, magma_environment.nickname);
+
+	result = magma_sql_query(query);
+	if (result && dbi_result_next_row(result)) {
+		guint64 first = magma_sql_fetch_integer64(result, 1);
+		magma_journal_sequence = magma_sql_fetch_integer64(result, 2);
+		magma_journal_first = first ? first : magma_journal_sequence + 1;
+	}
+	dbi_result_free(result);
+	g_free(query);
+
+	magma_journal_committed = magma_journal_sequence;
+
+	magma_journal_queue = g_async_queue_new();
+	magma_journal_thread = g_thread_new("Journal writer", magma_journal_kernel, NULL);
+
+	dbg(LOG_INFO, DEBUG_SQL, "Journal initialized, entries #%lu to #%lu",
+		magma_journal_first, magma_journal_sequence);
+}
+
+// vim:ts=4:nocindent:autoindent
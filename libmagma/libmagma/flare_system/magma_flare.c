@@ -406,6 +406,12 @@ int magma_mknod(uid_t uid, gid_t gid, magma_ttl ttl, const char *path, mode_t mo
 					/* add flare to parent */
 					magma_whole_add_flare_to_parent(path);
 
+					/* record the operation */
+					magma_journal_entry *entry = magma_journal_new_entry(MAGMA_OP_TYPE_MKNOD, path);
+					entry->mode = mode;
+					entry->rdev = rdev;
+					magma_journal_append(entry);
+
 					response.header.err_no = 0;
 					dbg(LOG_INFO, DEBUG_PFUSE, "MKNOD %s OK!", path);
 				}
@@ -472,6 +478,7 @@ int magma_unlink(uid_t uid, gid_t gid, magma_ttl ttl, const char *path)
 				magma_erase_flare_from_disk(flare);
 				magma_dispose_flare(flare);
 				magma_whole_remove_flare_from_parent(path);
+				magma_journal_record(MAGMA_OP_TYPE_UNLINK, path);
 
 				response.header.res = 0;
 				dbg(LOG_INFO, DEBUG_PFUSE, "UNLINK OK!");
@@ -537,6 +544,11 @@ int magma_truncate(uid_t uid, gid_t gid, magma_ttl ttl, const char *path, off_t
 					magma_touch_flare(flare, MAGMA_TOUCH_MTIME, 0, 0);
 					magma_flare_update_stat(flare);
 					magma_dispose_flare(flare);
+
+					magma_journal_entry *entry = magma_journal_new_entry(MAGMA_OP_TYPE_TRUNCATE, path);
+					entry->write_offset = offset;
+					magma_journal_append(entry);
+
 					dbg(LOG_INFO, DEBUG_PFUSE, "TRUNCATE OK!");
 				}
 			}
@@ -591,6 +603,12 @@ int magma_utime(uid_t uid, gid_t gid, magma_ttl ttl, const char *path, time_t at
 				magma_touch_flare(flare, MAGMA_TOUCH_ATIME|MAGMA_TOUCH_MTIME, atime, mtime);
 				magma_save_flare(flare, FALSE);
 				magma_dispose_flare(flare);
+
+				magma_journal_entry *entry = magma_journal_new_entry(MAGMA_OP_TYPE_UTIME, path);
+				entry->atime = atime;
+				entry->mtime = mtime;
+				magma_journal_append(entry);
+
 				dbg(LOG_INFO, DEBUG_FLARE, "UTIME %s OK!", path);
 			}
 		}
@@ -671,6 +689,11 @@ int magma_chmod(uid_t uid, gid_t gid, magma_ttl ttl, const char *path, mode_t mo
 				if (response.header.res isNot -1) {
 					magma_flare_update_stat(flare);
 					magma_dispose_flare(flare);
+
+					magma_journal_entry *entry = magma_journal_new_entry(MAGMA_OP_TYPE_CHMOD, path);
+					entry->mode = mode;
+					magma_journal_append(entry);
+
 					dbg(LOG_INFO, DEBUG_PFUSE, "CHMOD %s OK!", path);
 				}
 			}
@@ -743,6 +766,11 @@ int magma_chown(uid_t uid, gid_t gid, magma_ttl ttl, const char *path, uid_t new
 					response.header.err_no = errno;
 					dbg(LOG_ERR, DEBUG_PFUSE, "CHOWN %s: %s", path, strerror(response.header.err_no));
 				} else {
+					magma_journal_entry *entry = magma_journal_new_entry(MAGMA_OP_TYPE_CHOWN, path);
+					entry->new_uid = newuid;
+					entry->new_gid = newgid;
+					magma_journal_append(entry);
+
 					dbg(LOG_INFO, DEBUG_PFUSE, "CHOWN %s OK!", path);
 				}
 				magma_dispose_flare(flare);
@@ -845,6 +873,41 @@ int magma_open(uid_t uid, gid_t gid, const char *path, int flags)
 	return response.header.res;
 }
 
+/**
+ * The local part of a read(), on a flare already resolved
+ * by path or by file handle.
+ */
+int magma_read_flare(uid_t uid, gid_t gid, magma_flare_t *flare, size_t size, off_t offset, char *buf)
+{
+	int res = -1;
+
+	if (magma_isdir(flare)) {
+		errno = EINVAL;
+		dbg(LOG_ERR, DEBUG_PFUSE, "READ(%s): flare is a directory", flare->path);
+	} else if (!magma_check_flare(flare)) {
+		errno = ENOENT;
+		dbg(LOG_ERR, DEBUG_PFUSE, "READ(%s): flare is not on disk", flare->path);
+	} else {
+		uint8_t perm = 0;
+		if ((perm = magma_check_permission(flare, uid, gid, MAGMA_OPERATION_R)) != 0) {
+			dbg(LOG_INFO, DEBUG_PFUSE, "READ operation not permitted");
+			magma_explain_permission(perm);
+			errno = EACCES;
+		} else {
+			memset(buf, 0, size);
+			res = magma_contents_pread(flare->contents, buf, size, offset);
+			if ( res is -1 ) {
+				dbg(LOG_ERR, DEBUG_PFUSE, "READ: can't read %s: %s", flare->path, strerror(errno));
+			} else {
+				errno = 0;
+				dbg(LOG_INFO, DEBUG_PFUSE, "READ: read %d/%lu bytes from %s", res, size, flare->path);
+			}
+		}
+	}
+
+	return (res);
+}
+
 int magma_read(uid_t uid, gid_t gid, const char *path, size_t size, off_t offset, char *buf)
 {
 	magma_flare_response response;
@@ -877,39 +940,9 @@ int magma_read(uid_t uid, gid_t gid, const char *path, size_t size, off_t offset
 			response.header.res = -1;
 			response.header.err_no = ENOMEM;
 			dbg(LOG_ERR, DEBUG_PFUSE, "READ(%s): Error allocating memory for flare", path);
-		} else if (magma_isdir(flare)) {
-			response.header.res = -1;
-			response.header.err_no = EINVAL;
-			dbg(LOG_ERR, DEBUG_PFUSE, "READ(%s): flare is a directory", path);
-		} else if (!magma_check_flare(flare)) {
-			response.header.res = -1;
-			response.header.err_no = ENOENT;
-			dbg(LOG_ERR, DEBUG_PFUSE, "READ(%s): flare is not on disk", path);
 		} else {
-			uint8_t perm = 0;
-			if ((perm = magma_check_permission(flare, uid, gid, MAGMA_OPERATION_R)) != 0) {
-				dbg(LOG_INFO, DEBUG_PFUSE, "READ operation not permitted");
-				magma_explain_permission(perm);
-				response.header.res = -1;
-				response.header.err_no = EACCES;
-			} else {
-				int fd = magma_open_flare_contents(flare);
-				if (fd is -1) {
-					response.header.err_no = errno;
-					response.header.res = -1;
-					dbg(LOG_ERR, DEBUG_PFUSE, "READ can't open() %s: %s", path, strerror(response.header.err_no));
-				} else {
-					memset(buf, 0, size);
-					response.header.res = pread(fd, buf, size, offset);
-					if ( response.header.res is -1 ) {
-						response.header.err_no = errno;
-						dbg(LOG_ERR, DEBUG_PFUSE, "READ: can't pread() %s: %s", path, strerror(response.header.err_no));
-					} else {
-						dbg(LOG_INFO, DEBUG_PFUSE, "READ: pread() returned %d/%lu bytes from %s", response.header.res, size, path);
-					}
-					close(fd);
-				}
-			}
+			response.header.res = magma_read_flare(uid, gid, flare, size, offset, buf);
+			response.header.err_no = errno;
 		}
 		magma_dispose_flare(flare);
 	}
@@ -921,7 +954,8 @@ int magma_read(uid_t uid, gid_t gid, const char *path, size_t size, off_t offset
 
 		GSocketAddress *peer;
 		GSocket *socket = magma_open_client_connection(owner->ip_addr, owner->port, &peer);
-		magma_pktqs_read(socket, peer, uid, gid, size, offset, path, &response);
+		response.header.res = magma_pktqs_read_chunked(socket, peer, uid, gid, size, offset, path, buf, &response);
+		if (response.header.res isNot -1) response.header.err_no = 0;
 		magma_close_client_connection(socket, peer);
 
 	}
@@ -930,6 +964,51 @@ int magma_read(uid_t uid, gid_t gid, const char *path, size_t size, off_t offset
 	return response.header.res;
 }
 
+/**
+ * The local part of a write(), on a flare already resolved
+ * by path or by file handle.
+ */
+int magma_write_flare(uid_t uid, gid_t gid, magma_flare_t *flare, size_t size, off_t offset, char *buf)
+{
+	int res = -1;
+
+	if (flare->type && magma_isdir(flare)) {
+		errno = EISDIR;
+		dbg(LOG_ERR, DEBUG_PFUSE, "WRITE %s: is a directory", flare->path);
+		return (res);
+	}
+
+	if (!flare->type) {
+		dbg(LOG_ERR, DEBUG_PFUSE, "WRITE: flare %s wasn't casted", flare->path);
+		magma_cast_to_file(flare);
+	}
+
+	uint8_t perm = 0;
+	if ((perm = magma_check_permission(flare, uid, gid, MAGMA_OPERATION_W)) != 0) {
+		dbg(LOG_INFO, DEBUG_PFUSE, "WRITE operation not permitted");
+		magma_explain_permission(perm);
+		errno = EACCES;
+		return (res);
+	}
+
+	res = magma_contents_pwrite(flare->contents, buf, size, offset);
+	if ( res is -1 ) {
+		dbg(LOG_ERR, DEBUG_PFUSE, "WRITE can't write %s: %s", flare->path, strerror(errno));
+	} else {
+		magma_touch_flare(flare, MAGMA_TOUCH_MTIME, 0, 0);
+
+		magma_journal_entry *entry = magma_journal_new_entry(MAGMA_OP_TYPE_WRITE, flare->path);
+		entry->write_offset = offset;
+		entry->write_size = res;
+		magma_journal_append(entry);
+
+		errno = 0;
+		dbg(LOG_INFO, DEBUG_PFUSE, "WRITE %s OK! (%d bytes)", flare->path, res);
+	}
+
+	return (res);
+}
+
 int magma_write(uid_t uid, gid_t gid, magma_ttl ttl, const char *path, size_t size, off_t offset, char *buf)
 {
 	magma_flare_response response;
@@ -946,7 +1025,8 @@ int magma_write(uid_t uid, gid_t gid, magma_ttl ttl, const char *path, size_t si
 		GSocketAddress *peer;
 		GSocket *socket = magma_open_client_connection(owner->ip_addr, owner->port, &peer);
 
-		magma_pktqs_write(socket, peer, MAGMA_DEFAULT_TTL, uid, gid, size, offset, path, buf, &response);
+		response.header.res = magma_pktqs_write_chunked(socket, peer, MAGMA_DEFAULT_TTL, uid, gid, size, offset, path, buf, &response);
+		if (response.header.res isNot -1) response.header.err_no = 0;
 		magma_close_client_connection(socket, peer);
 	
 	} else {
@@ -957,41 +1037,9 @@ int magma_write(uid_t uid, gid_t gid, magma_ttl ttl, const char *path, size_t si
 			response.header.res = -1;
 			response.header.err_no = ENOMEM;
 			dbg(LOG_ERR, DEBUG_PFUSE, "WRITE: Error allocating memory for flare");
-		} else if (flare->type && magma_isdir(flare)) {
-			response.header.res = -1;
-			response.header.err_no = EISDIR;
-			dbg(LOG_ERR, DEBUG_PFUSE, "WRITE %s: is a directory", path);
 		} else {
-			if (!flare->type) {
-				dbg(LOG_ERR, DEBUG_PFUSE, "WRITE: flare %s wasn't casted", path);
-				magma_cast_to_file(flare);
-			}
-
-			uint8_t perm = 0;
-			if ((perm = magma_check_permission(flare, uid, gid, MAGMA_OPERATION_W)) != 0) {
-				dbg(LOG_INFO, DEBUG_PFUSE, "WRITE operation not permitted");
-				magma_explain_permission(perm);
-				response.header.res = -1;
-				response.header.err_no = EACCES;
-			} else {
-
-				int contentsfd = magma_open_flare_contents(flare);
-				if (contentsfd != -1) {
-					response.header.res = pwrite(contentsfd, buf, size, offset);
-					if ( response.header.res is -1 ) {
-						response.header.err_no = errno;
-						dbg(LOG_ERR, DEBUG_PFUSE, "WRITE can't pwrite() %s: %s", path, strerror(response.header.err_no));
-					} else {
-						magma_touch_flare(flare, MAGMA_TOUCH_MTIME, 0, 0);
-						dbg(LOG_INFO, DEBUG_PFUSE, "WRITE %s OK! (%d bytes)", path, response.header.res);
-					}
-					close(contentsfd);
-	
-				} else {
-					response.header.err_no = errno;
-					response.header.res = -1;
-				}
-			}
+			response.header.res = magma_write_flare(uid, gid, flare, size, offset, buf);
+			response.header.err_no = errno;
 		}
 		magma_dispose_flare(flare);
 	}
@@ -1070,6 +1118,11 @@ int magma_mkdir(uid_t uid, gid_t gid, magma_ttl ttl, const char *path, mode_t mo
 					/* add flare to parent */
 					magma_whole_add_flare_to_parent(path);
 
+					/* record the operation */
+					magma_journal_entry *entry = magma_journal_new_entry(MAGMA_OP_TYPE_MKDIR, path);
+					entry->mode = mode;
+					magma_journal_append(entry);
+
 					response.header.err_no = 0;
 					dbg(LOG_INFO, DEBUG_PFUSE, "MKDIR %s OK!", path);
 				}
@@ -1146,6 +1199,7 @@ int magma_rmdir(uid_t uid, gid_t gid, magma_ttl ttl, const char *path)
 				magma_dispose_flare(flare);
 				magma_dispose_flare(parent);
 				magma_whole_remove_flare_from_parent(path);
+				magma_journal_record(MAGMA_OP_TYPE_RMDIR, path);
 				response.header.res = 0;
 				dbg(LOG_ERR, DEBUG_PFUSE, "RMDIR: OK!");
 			}
@@ -1225,9 +1279,6 @@ int magma_readlink(uid_t uid, gid_t gid, const char *path, char *buf, size_t siz
 	 */
 	if ((!im_owner && !im_red_owner) || (im_red_owner && response.header.res is -1)) {
 
-		gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-		memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
-
 		GSocketAddress *peer;
 		GSocket *socket = magma_open_client_connection(owner->ip_addr, owner->port, &peer);
 		magma_pktqs_readlink(socket, peer, uid, gid, path, &response);
@@ -1334,6 +1385,11 @@ int magma_symlink(uid_t uid, gid_t gid, magma_ttl ttl, const char *from, const c
 						/* add flare to parent */
 						magma_whole_add_flare_to_parent(to);
 
+						/* record the operation */
+						magma_journal_entry *entry = magma_journal_new_entry(MAGMA_OP_TYPE_SYMLINK, to);
+						entry->to_path = g_strdup(from);
+						magma_journal_append(entry);
+
 						response.header.err_no = 0;
 						dbg(LOG_INFO, DEBUG_PFUSE, "MKNOD %s OK!", to);
 					}
@@ -1649,8 +1705,7 @@ void magma_send_udp_failure(
 	magma_transaction_id tid,
 	magma_flags flags)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	gchar *ptr = magma_format_response_header(buffer, -1, err_no, tid, flags);
 
@@ -37,6 +37,54 @@
 #define MAGMA_TERMINAL_TTL 1
 
 extern void magma_init_server_flare();
+
+/**
+ * Replication to redundant nodes (see magma_queue_replica())
+ */
+#define MAGMA_REPLICA_WORKERS 4				/** lanes, each with its worker, per destination node */
+#define MAGMA_REPLICA_QUEUE_LENGTH 1024		/** operations waiting in a lane before the caller blocks */
+
+typedef void (*magma_replica_function)(magma_flare_request *, magma_volcano *);
+extern gboolean magma_queue_replica(magma_replica_function replica_function, magma_flare_request *request, magma_volcano *node);
+
+/**
+ * The duplicate request cache (see operation_cache.c)
+ */
+#define MAGMA_OPERATION_CACHE_SHARDS 16
+#define MAGMA_OPERATION_CACHE_RATE 5000			/** default changes per second to be remembered */
+#define MAGMA_OPERATION_CACHE_EXPIRE 60			/** seconds a result is answered again */
+
+/** seconds a client keeps retransmitting: the longest timeout for every try */
+#define MAGMA_OPERATION_CACHE_SPAN ((MAGMA_RTO_MAX / G_USEC_PER_SEC) * MAGMA_RETRY_LIMIT)
+
+/**
+ * An operation, as told by its sender and transaction ID. Packed
+ * without holes, so it can be hashed and compared byte by byte.
+ */
+typedef struct {
+	guint8 address[16];		/** IPv4 or IPv6 address, or the digest of a local socket name */
+	guint16 port;
+	guint16 family;
+	magma_transaction_id tid;
+} magma_operation_key;
+
+/**
+ * The result of an operation: the whole reply of the operations
+ * which answer the header only
+ */
+typedef struct {
+	gint32 res;
+	guint16 err_no;
+} magma_operation_result;
+
+extern void magma_init_operation_cache();
+extern void magma_operation_cache_configure(guint rate, guint expire);
+extern guint magma_operation_key_hash(gconstpointer key);
+extern gboolean magma_operation_key_equal(gconstpointer a, gconstpointer b);
+extern void magma_operation_cache_make_key(GSocketAddress *peer, magma_transaction_id tid, magma_operation_key *key);
+extern magma_operation_result *magma_operation_cache_lookup(magma_operation_key *key, magma_operation_result *result);
+extern magma_operation_result *magma_operation_cache_claim(magma_operation_key *key, magma_operation_result *result);
+extern void magma_operation_cache_save_result(magma_operation_key *key, gint32 res, guint16 err_no);
 extern void magma_flare_system_init();
 extern void magma_build_network(int bootstrap, char *bootserver, int bootport, int start_balancer);
 
@@ -209,6 +257,21 @@ extern int magma_open(uid_t uid, gid_t gid, const char *path, int flags);
  */
 extern int magma_read(uid_t uid, gid_t gid, const char *path, size_t size, off_t offset, char *buf);
 
+/**
+ * The local part of magma_read(), on a flare already resolved:
+ * the file handle operations don't know the path they serve
+ * until the flare is found in the cache.
+ *
+ * @param uid UID requesting the operation
+ * @param gid GID requesting the operation
+ * @param flare the flare to read
+ * @param size requested data length
+ * @param offset requested data position inside the flare
+ * @param buf memory region to store read data
+ * @return bytes read, -1 on error and sets errno
+ */
+extern int magma_read_flare(uid_t uid, gid_t gid, magma_flare_t *flare, size_t size, off_t offset, char *buf);
+
 /**
  * write() equivalent. Write some data to a regular file.
  * relating to flare path.
@@ -224,6 +287,20 @@ extern int magma_read(uid_t uid, gid_t gid, const char *path, size_t size, off_t
  */
 extern int magma_write(uid_t uid, gid_t gid, magma_ttl ttl, const char *path, size_t size, off_t offset, char *buf);
 
+/**
+ * The local part of magma_write(), on a flare already resolved.
+ * The operation is never proxied.
+ *
+ * @param uid UID requesting the operation
+ * @param gid GID requesting the operation
+ * @param flare the flare to write
+ * @param size data length
+ * @param offset data position inside the flare
+ * @param buf data to be written
+ * @return bytes written, -1 on error and sets errno
+ */
+extern int magma_write_flare(uid_t uid, gid_t gid, magma_flare_t *flare, size_t size, off_t offset, char *buf);
+
 /**
  * mkdir() equivalent. Create a new directory flare.
  *
@@ -363,10 +440,13 @@ extern void magma_clean_shutdown();
 
 extern void magma_send_udp_failure(GSocket *socket, GSocketAddress *peer, int err_no, magma_transaction_id tid, magma_flags flags);
 
+extern void magma_node_transmit_flare(GSocket *socket, GSocketAddress *peer, const gchar *path);
 extern void magma_node_transmit_key(GSocket *socket, GSocketAddress *peer, const gchar *flare_key);
 
 extern void magma_update_myself_from_lava(magma_lava *new_lava);
 
+extern void magma_journal_catch_up();
+
 #endif /* MAGMA_FLARE_H */
 
 // vim:ts=4:nocindent:autoindent
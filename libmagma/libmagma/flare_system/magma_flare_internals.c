@@ -443,6 +443,13 @@ void magma_flare_system_init()
 	/* set initial state to off */
 	magma_environment.state = magma_network_loading;
 
+#ifndef HAVE_LSETXATTR
+	if (magma_environment.metadata_xattr) {
+		dbg(LOG_ERR, DEBUG_BOOT, "Extended attributes not supported, flare metadata are kept in SQL only");
+		magma_environment.metadata_xattr = 0;
+	}
+#endif
+
 	/* register signal handlers */
 	/* signal(9, magma_cleanup); */  /* kill */
 	signal(2,  magma_cleanup); /* SIGINT */
@@ -510,6 +517,9 @@ void magma_flare_system_init()
 	/* init the SQL backend */
 	magma_init_sql();
 
+	/* init the operation journal */
+	magma_init_journal();
+
 	/* load console commands */
 	magma_init_console();
 
@@ -1108,6 +1118,23 @@ void magma_print_flare(magma_flare_t *flare)
 	}
 }
 
+/**
+ * Resolve a file handle: the binary hash of a path and the
+ * generation of its flare, as given by OPEN_HANDLE. Neither
+ * the path is hashed nor the flare loaded: a flare which left
+ * the cache is a stale handle.
+ *
+ * @param hash the binary hash of the flare path
+ * @param generation the flare generation
+ * @return the flare, NULL if not cached or of another generation
+ */
+magma_flare_t *magma_search_by_handle(const unsigned char *hash, guint32 generation)
+{
+	magma_flare_t *flare = magma_search_by_hash(hash);
+	if (!flare || flare->generation isNot generation) return (NULL);
+	return (magma_duplicate_flare(flare));
+}
+
 /**
  * searches flares from internal cache. if an entry
  * is not available, a null pointer is returned.
@@ -1281,6 +1308,18 @@ magma_flare_t *magma_add_to_cache(magma_flare_t *flare)
 	 */
 	g_mutex_lock(&magma_lookup_mutex);
 
+	/*
+	 * a flare entering the cache for the first time gets a new
+	 * generation; the counter starts from the clock so that a
+	 * restarted node doesn't hand out the same generations again
+	 */
+	static guint32 magma_last_generation = 0;
+	if (!flare->generation) {
+		if (!magma_last_generation) magma_last_generation = (guint32) time(NULL);
+		flare->generation = ++magma_last_generation;
+		if (!flare->generation) flare->generation = ++magma_last_generation;
+	}
+
 	/*
 	 * add the flare to the hash table
 	 */
@@ -1432,6 +1471,9 @@ gboolean magma_save_flare(magma_flare_t *flare, gboolean init_flare)
 		chmod(flare->contents, flare->st.st_mode);
 		magma_flare_sql_save(flare);
 		magma_load_flare(flare);
+	} else if (magma_environment.metadata_xattr) {
+		/* keep uid and gid changes */
+		magma_flare_xattr_save(flare);
 	}
 
 	/*
@@ -1504,9 +1546,84 @@ int magma_erase_flare(magma_flare_t *flare)
 	return res;
 }
 
+#ifdef HAVE_LSETXATTR
+
+/**
+ * Save flare metadata (type, uid, gid, commit path and commit time)
+ * in the MAGMA_METADATA_XATTR extended attribute of its contents file.
+ * Flares not yet committed to SQL are skipped, since their commit
+ * time is assigned by the SQL layer.
+ *
+ * @param flare the flare
+ * @return TRUE on success, FALSE otherwise
+ */
+gboolean magma_flare_xattr_save(magma_flare_t *flare)
+{
+	if (!flare->type || !flare->commit_path || !flare->commit_time) return (FALSE);
+
+	/* commit path goes last since it can contain spaces */
+	gchar *value = g_strdup_printf("%c %u %u %s %s",
+		flare->type, flare->st.st_uid, flare->st.st_gid, flare->commit_time, flare->commit_path);
+
+	int res = lsetxattr(flare->contents, MAGMA_METADATA_XATTR, value, strlen(value), 0);
+	g_free(value);
+
+	if (res is -1) {
+		dbg(LOG_INFO, DEBUG_FLARE, "Can't save metadata of %s in xattr: %s", flare->path, strerror(errno));
+		return (FALSE);
+	}
+
+	return (TRUE);
+}
+
+/**
+ * Load flare metadata from the MAGMA_METADATA_XATTR extended
+ * attribute of its contents file.
+ *
+ * @param flare the flare
+ * @return TRUE if the metadata has been loaded, FALSE otherwise
+ */
+gboolean magma_flare_xattr_load(magma_flare_t *flare)
+{
+	gchar value[MAGMA_TERMINATED_PATH_LENGTH + 64];
+
+	ssize_t size = lgetxattr(flare->contents, MAGMA_METADATA_XATTR, value, sizeof(value) - 1);
+	if (size <= 0) return (FALSE);
+	value[size] = '\0';
+
+	gchar type = 0, commit_time[32];
+	guint32 uid = 0, gid = 0;
+	int commit_path_offset = 0;
+
+	if (sscanf(value, "%c %u %u %31s %n", &type, &uid, &gid, commit_time, &commit_path_offset) < 4 || !commit_path_offset) {
+		dbg(LOG_ERR, DEBUG_FLARE, "Malformed metadata xattr on %s", flare->path);
+		return (FALSE);
+	}
+
+	flare->type = type;
+	flare->st.st_uid = uid;
+	flare->st.st_gid = gid;
+	flare->commit_time = g_strdup(commit_time);
+	flare->commit_path = g_strdup(value + commit_path_offset);
+
+	return (TRUE);
+}
+
+#else
+
+gboolean magma_flare_xattr_save(magma_flare_t *flare) { (void) flare; return (FALSE); }
+gboolean magma_flare_xattr_load(magma_flare_t *flare) { (void) flare; return (FALSE); }
+
+#endif /* HAVE_LSETXATTR */
+
 /**
  * Load a flare from disk.
  *
+ * If magma_environment.metadata_xattr is set, metadata are first looked up
+ * in the contents file extended attributes and SQL is queried only
+ * if they are missing. Metadata found in SQL are then copied into
+ * the extended attributes for the next load.
+ *
  * @param flare the flare to be loaded
  * @return 1 on success, 0 otherwise (errno is set accordingly)
  */
@@ -1517,31 +1634,46 @@ void magma_load_flare(magma_flare_t *flare)
 	 */
 	magma_flare_update_stat(flare);
 
-	/*
-	 * load flare metadata from flare_<hostname> table
-	 * if at least one of the metadata involved is missing
-	 */
-	dbg(LOG_INFO, DEBUG_FLARE,
-		"Loading flare metadata from SQL "
-		"[type: %c] [com.path: %s] [com.time: %s] [uid: %d] [gid: %d]",
-		flare->type, flare->commit_path, flare->commit_time, flare->st.st_uid, flare->st.st_gid
-	);
+	gboolean loaded = FALSE;
 
-	gchar *query = g_strdup_printf(
-		"select type, commit_path, commit_time, uid, gid from flare_%s where path = '%s'",
-		myself.node_name, flare->path);
+	if (magma_environment.metadata_xattr) loaded = magma_flare_xattr_load(flare);
 
-	dbi_result result = magma_sql_query(query);
-	g_free(query);
+	if (!loaded) {
+		/*
+		 * load flare metadata from flare_<hostname> table
+		 * if at least one of the metadata involved is missing
+		 */
+		dbg(LOG_INFO, DEBUG_FLARE,
+			"Loading flare metadata from SQL "
+			"[type: %c] [com.path: %s] [com.time: %s] [uid: %d] [gid: %d]",
+			flare->type, flare->commit_path, flare->commit_time, flare->st.st_uid, flare->st.st_gid
+		);
 
-	if (result && dbi_result_next_row(result)) {
-		gchar *type = magma_sql_fetch_string(result, 1);
-		flare->type = type[0];
-		g_free(type);
+		gchar *query = g_strdup_printf(
+			"select type, commit_path, commit_time, uid, gid from flare_%s where path = '%s'",
+			myself.node_name, flare->path);
 
-		flare->commit_path = magma_sql_fetch_string(result, 2);
-		flare->commit_time = magma_sql_fetch_string(result, 3);
+		dbi_result result = magma_sql_query(query);
+		g_free(query);
 
+		if (result && dbi_result_next_row(result)) {
+			gchar *type = magma_sql_fetch_string(result, 1);
+			flare->type = type[0];
+			g_free(type);
+
+			flare->commit_path = magma_sql_fetch_string(result, 2);
+			flare->commit_time = magma_sql_fetch_string(result, 3);
+			flare->st.st_uid = magma_sql_fetch_integer(result, 4);
+			flare->st.st_gid = magma_sql_fetch_integer(result, 5);
+
+			dbi_result_free(result);
+			loaded = TRUE;
+
+			if (magma_environment.metadata_xattr) magma_flare_xattr_save(flare);
+		}
+	}
+
+	if (loaded) {
 		/*
 		 * set the flare type in the struct stat st_mode field
 		 */
@@ -1561,10 +1693,6 @@ void magma_load_flare(magma_flare_t *flare)
 		 */
 		flare->commit_url = (flare->type && flare->commit_path && flare->commit_time) ?
 			g_strdup_printf("%c://%s@%s", flare->type, flare->commit_path, flare->commit_time) : NULL;
-		flare->st.st_uid = magma_sql_fetch_integer(result, 4);
-		flare->st.st_gid = magma_sql_fetch_integer(result, 5);
-
-		dbi_result_free(result);
 
 		/*
 		 * upcast this flare adding informations specific to object type
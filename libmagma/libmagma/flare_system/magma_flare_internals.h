@@ -133,6 +133,13 @@ extern void magma_flare_update_stat(magma_flare_t *flare);
 
 #define magma_open_flare_contents(flare) open(flare->contents, O_RDWR|O_CREAT, S_IRWXU)
 
+/** requests on the contents files in flight at once, when using io_uring */
+#define MAGMA_CONTENTS_IO_DEPTH 64
+
+extern gboolean magma_contents_io_uring();
+extern ssize_t magma_contents_pread(const gchar *contents, gchar *buf, size_t size, off_t offset);
+extern ssize_t magma_contents_pwrite(const gchar *contents, const gchar *buf, size_t size, off_t offset);
+
 /* some macro just to shorten typing and clarify the code */
 #if MAGMA_STRUCT_STAT_TYPE_MACROS
 
@@ -324,6 +331,7 @@ extern magma_flare_t *magma_cache;
 
 extern magma_flare_t *magma_search(const char *path);
 extern magma_flare_t *magma_search_by_hash(const unsigned char *hash);
+extern magma_flare_t *magma_search_by_handle(const unsigned char *hash, guint32 generation);
 extern magma_flare_t *magma_search_or_create(const char *hash);
 
 extern magma_flare_t *magma_add_to_cache(magma_flare_t *flare);
@@ -361,6 +369,9 @@ extern magma_volcano *magma_route_key(const char *key, magma_volcano *node);
 /* route a file path inside main key space or redundant key space */
 extern magma_volcano *magma_route_path(const char *path);
 
+/* route a flare by the hash it carries, without hashing its path again */
+extern magma_volcano *magma_route_flare(magma_flare_t *flare);
+
 /* return true if nodes are equal, false otherwise */
 extern int magma_compare_nodes(const magma_volcano *n1, const magma_volcano *n2);
 
@@ -385,19 +396,132 @@ extern gchar *magma_point_filename_in_path(gchar *path);
 
 extern void magma_init_sql();
 
+/*
+ * if magma_environment.metadata_xattr is set (magmad -X), flare type,
+ * uid, gid and commit info are also kept in an extended attribute of
+ * the contents file and magma_load_flare() reads them from there,
+ * querying SQL only if the attribute is missing. SQL remains the
+ * index used to page through the key-space. Requires lsetxattr() and
+ * a hash directory on a filesystem supporting user.* xattrs.
+ */
+
+/** the extended attribute holding flare metadata */
+#define MAGMA_METADATA_XATTR "user.magma.metadata"
+
+extern gboolean magma_flare_xattr_save(magma_flare_t *flare);
+extern gboolean magma_flare_xattr_load(magma_flare_t *flare);
+
+/** flare records loaded at once when the key-space is transmitted */
+#define MAGMA_METADATA_PAGE_SIZE 256
+
 extern void magma_flare_sql_save(magma_flare_t *flare);
 extern void magma_flare_sql_delete(magma_flare_t *flare);
 extern void magma_flare_sql_load(magma_flare_t *flare);
+extern guint16 magma_flare_sql_load_page(const gchar *after_hash, magma_flare_metadata *rows, guint16 max_rows);
+extern gboolean magma_flare_sql_save_batch(magma_flare_metadata *rows, guint16 count);
 extern void magma_sql_save_volcano(magma_volcano *v);
 extern void magma_sql_delete_volcano(magma_volcano *v);
 
 extern dbi_result magma_sql_query(gchar *query);
+extern gchar *magma_sql_quote(const gchar *string);
+
+/**
+ * SQL statistics are kept for each kind of statement
+ */
+typedef enum {
+	MAGMA_SQL_SELECT = 0,
+	MAGMA_SQL_INSERT,
+	MAGMA_SQL_UPDATE,
+	MAGMA_SQL_DELETE,
+	MAGMA_SQL_OTHER,
+	MAGMA_SQL_KINDS
+} magma_sql_kind;
+
+/** execution time histogram buckets, see magma_sql_account() */
+#define MAGMA_SQL_HISTOGRAM_BUCKETS 20
+
+/** default slow statement threshold in microseconds */
+#define MAGMA_SQL_SLOW_THRESHOLD 100000
+
+typedef struct {
+	guint64 count;			/* statements run */
+	guint64 errors;			/* statements failed */
+	guint64 wait_time;		/* total time spent waiting for magma_sql_mutex (us) */
+	guint64 exec_time;		/* total time spent executing (us) */
+	guint64 max_wait;		/* longest wait (us) */
+	guint64 max_exec;		/* longest execution (us) */
+	guint64 histogram[MAGMA_SQL_HISTOGRAM_BUCKETS];
+} magma_sql_stats;
+
+extern gint64 magma_sql_slow_threshold;
+extern const gchar *magma_sql_kind_name(magma_sql_kind kind);
+extern void magma_sql_get_stats(magma_sql_stats *stats);
+extern void magma_sql_reset_stats();
 extern dbi_result magma_sql_query_on_connection(gchar *query, dbi_conn dbi, GMutex *mutex);
 
 extern guint32 magma_sql_fetch_integer(dbi_result result, int index);
+extern guint64 magma_sql_fetch_integer64(dbi_result result, int index);
 extern double magma_sql_fetch_double(dbi_result result, int index);
 extern gchar *magma_sql_fetch_string(dbi_result result, int index);
 
+/****************************************************\
+ * JOURNAL (see journal.c)                          *
+\****************************************************/
+
+/** max number of entries written by a single SQL statement */
+#define MAGMA_JOURNAL_BATCH_SIZE 256
+
+/** max time (in microseconds) an entry waits before being written */
+#define MAGMA_JOURNAL_FLUSH_INTERVAL 50000
+
+/** failed writes of a batch before its entries are written one by one */
+#define MAGMA_JOURNAL_WRITE_RETRIES 5
+
+/** older entries are dropped when the journal grows past this size */
+#define MAGMA_JOURNAL_MAX_ENTRIES 1000000
+
+/**
+ * A journal record. Fields not pertaining to optype are left zero.
+ * write_offset is also used to record the new size of a truncate().
+ */
+typedef struct {
+	guint64 sequence;
+	magma_optype optype;
+	gchar *path;
+	gchar *to_path;			/* magma_symlink() */
+	mode_t mode;			/* magma_chmod(), magma_mknod(), magma_mkdir() */
+	dev_t rdev;				/* magma_mknod() */
+	uid_t new_uid;			/* magma_chown() */
+	gid_t new_gid;			/* magma_chown() */
+	time_t atime;			/* magma_utime() */
+	time_t mtime;			/* magma_utime() */
+	off_t write_offset;		/* magma_write(), magma_truncate() */
+	size_t write_size;		/* magma_write() */
+} magma_journal_entry;
+
+/** a replay function returns FALSE to stop the replay */
+typedef gboolean (*magma_journal_replay_func)(magma_journal_entry *entry, gpointer user_data);
+
+extern void magma_init_journal();
+
+extern magma_journal_entry *magma_journal_new_entry(magma_optype optype, const gchar *path);
+extern void magma_journal_free_entry(magma_journal_entry *entry);
+extern guint64 magma_journal_append(magma_journal_entry *entry);
+extern guint64 magma_journal_flush();
+extern guint64 magma_journal_last_sequence();
+extern guint64 magma_journal_first_sequence();
+extern void magma_journal_trim(guint64 sequence);
+extern guint64 magma_journal_replay(guint64 since, guint64 until, magma_journal_replay_func func, gpointer user_data);
+
+extern guint64 magma_journal_load_checkpoint(const gchar *node_name);
+extern void magma_journal_save_checkpoint(const gchar *node_name, guint64 sequence);
+
+/**
+ * Shortcut to record an operation which needs no field
+ * other than its path
+ */
+#define magma_journal_record(optype, path) magma_journal_append(magma_journal_new_entry(optype, path))
+
 extern GAsyncQueue *magma_add_flare_queue;
 extern GAsyncQueue *magma_remove_flare_queue;
 
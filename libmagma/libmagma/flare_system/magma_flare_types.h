@@ -48,7 +48,7 @@ typedef guint16 magma_readdir_entry;
 typedef guint32 magma_flags;
 typedef gint32  magma_result;
 typedef guint16 magma_errno;
-typedef guint16 magma_transaction_id;
+typedef guint32 magma_transaction_id;
 typedef guint8  magma_ttl;
 
 /** cast structure for directory flares */
@@ -147,6 +147,12 @@ typedef struct magma_flare {
 	/** has been upcasted? */
 	int is_upcasted;
 
+	/**
+	 * set when the flare enters the cache: a file handle naming
+	 * an older flare with the same path is stale
+	 */
+	guint32 generation;
+
 #if MAGMA_DECLARE_FLARE_ITEM_FIELD
 	/** additional informations for item hosted by this flare */
 	union {
@@ -161,6 +167,23 @@ typedef struct magma_flare {
 
 } magma_flare_t;
 
+/**
+ * The SQL record of a flare, as streamed between nodes
+ * when a whole key-space is transferred (see
+ * magma_node_transmit_keyspace_to_node()). mode is not
+ * stored in SQL and is taken from the contents file.
+ */
+typedef struct {
+	gchar hash[SHA_READABLE_DIGEST_LENGTH];
+	gchar type;
+	gchar path[1025];
+	magma_uid uid;
+	magma_gid gid;
+	magma_mode mode;
+	gchar commit_path[1025];
+	gchar commit_time[32];
+} magma_flare_metadata;
+
 /**
  * Glib-based magma_DIR_t struct.
  *
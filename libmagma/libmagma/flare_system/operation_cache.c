@@ -0,0 +1,305 @@
+/*
+   MAGMA -- flare_system/operation_cache.c
+   Copyright (C) 2006-2013 Tx0 <tx0@strumentiresistenti.org>
+
+   The duplicate request cache: the results of the operations which
+   change the filesystem, so a retransmitted request is answered
+   again instead of being executed twice.
+
+   Results are keyed by the peer address, port and transaction ID,
+   packed in binary, and spread on MAGMA_OPERATION_CACHE_SHARDS shards,
+   each one with its own lock and a fixed ring of slots: a new result
+   takes the place of the oldest one, so memory stays flat whatever
+   the load. The rings hold all the changes made at the configured
+   rate while a client may still retransmit, MAGMA_OPERATION_CACHE_SPAN
+   seconds. A result older than MAGMA_OPERATION_CACHE_EXPIRE seconds
+   is not answered any more, since the client has given up on it.
+
+   An operation is claimed before being executed, leaving a running
+   marker in its slot: a retransmission arriving meanwhile waits for
+   the result instead of executing the operation once more.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include "../magma.h"
+
+/**
+ * A cached result
+ */
+typedef struct {
+	magma_operation_key key;
+	magma_operation_result result;
+	gint64 saved;			/** monotonic time, 0 if the slot is free */
+	gboolean running;		/** claimed, the result is not there yet */
+} magma_operation_entry;
+
+/**
+ * A shard: the index points into the ring, next is the oldest slot
+ */
+typedef struct {
+	GMutex lock;
+	GCond done;				/** a running operation saved its result */
+	GHashTable *index;
+	magma_operation_entry *ring;
+	guint slots;			/** grows if every slot is running */
+	guint next;
+} magma_operation_shard;
+
+static magma_operation_shard magma_operation_shards[MAGMA_OPERATION_CACHE_SHARDS];
+
+/** initial slots in the ring of each shard */
+static guint magma_operation_cache_slots = 0;
+
+/** microseconds a result is answered again */
+static gint64 magma_operation_cache_expire = MAGMA_OPERATION_CACHE_EXPIRE * G_USEC_PER_SEC;
+
+/**
+ * FNV-1a on the packed key
+ */
+guint magma_operation_key_hash(gconstpointer key)
+{
+	const guint8 *byte = key;
+	guint32 hash = 2166136261U;
+
+	gsize i = 0;
+	for (; i < sizeof(magma_operation_key); i++) {
+		hash ^= byte[i];
+		hash *= 16777619U;
+	}
+
+	return (hash);
+}
+
+gboolean magma_operation_key_equal(gconstpointer a, gconstpointer b)
+{
+	return ((memcmp(a, b, sizeof(magma_operation_key)) is 0) ? TRUE : FALSE);
+}
+
+/**
+ * Size the cache to remember rate changes per second for
+ * MAGMA_OPERATION_CACHE_SPAN seconds. Must be called once.
+ *
+ * @param rate the changes per second
+ * @param expire the seconds a result is answered again
+ */
+void magma_operation_cache_configure(guint rate, guint expire)
+{
+	guint64 capacity = (guint64) MAX(rate, 1) * MAGMA_OPERATION_CACHE_SPAN;
+	magma_operation_cache_slots = (capacity + MAGMA_OPERATION_CACHE_SHARDS - 1) / MAGMA_OPERATION_CACHE_SHARDS;
+	magma_operation_cache_expire = (gint64) expire * G_USEC_PER_SEC;
+
+	int i = 0;
+	for (; i < MAGMA_OPERATION_CACHE_SHARDS; i++) {
+		g_mutex_init(&magma_operation_shards[i].lock);
+		g_cond_init(&magma_operation_shards[i].done);
+		magma_operation_shards[i].index = g_hash_table_new(magma_operation_key_hash, magma_operation_key_equal);
+		magma_operation_shards[i].ring = g_new0(magma_operation_entry, magma_operation_cache_slots);
+		magma_operation_shards[i].slots = magma_operation_cache_slots;
+		magma_operation_shards[i].next = 0;
+	}
+
+	dbg(LOG_INFO, DEBUG_FLARE, "Operation cache holds %u results in %d shards",
+		magma_operation_cache_slots * MAGMA_OPERATION_CACHE_SHARDS, MAGMA_OPERATION_CACHE_SHARDS);
+}
+
+void magma_init_operation_cache()
+{
+	guint rate = magma_environment.operation_rate > 0 ? magma_environment.operation_rate : MAGMA_OPERATION_CACHE_RATE;
+	magma_operation_cache_configure(rate, MAGMA_OPERATION_CACHE_EXPIRE);
+}
+
+/**
+ * Double the ring of a shard whose slots are all running. The
+ * entries are moved oldest first and next points to the first
+ * new slot. Must be called with the shard lock held.
+ */
+static void magma_operation_cache_grow(magma_operation_shard *shard)
+{
+	guint slots = shard->slots * 2;
+	magma_operation_entry *ring = g_new0(magma_operation_entry, slots);
+
+	g_hash_table_remove_all(shard->index);
+
+	guint i = 0;
+	for (; i < shard->slots; i++) {
+		ring[i] = shard->ring[(shard->next + i) % shard->slots];
+		if (ring[i].saved) g_hash_table_insert(shard->index, &ring[i].key, &ring[i]);
+	}
+
+	dbg(LOG_INFO, DEBUG_FLARE, "Operation cache shard grown to %u slots", slots);
+
+	g_free(shard->ring);
+	shard->ring = ring;
+	shard->next = shard->slots;
+	shard->slots = slots;
+}
+
+/**
+ * Take the oldest slot of a shard for a key, dropping what it held.
+ * Running operations are never dropped: their slots are skipped
+ * and the ring grows if no other slot is left.
+ * Must be called with the shard lock held.
+ */
+static magma_operation_entry *magma_operation_cache_take_slot(magma_operation_shard *shard, magma_operation_key *key)
+{
+	/* a key stored again drops its former slot */
+	magma_operation_entry *entry = g_hash_table_lookup(shard->index, key);
+	if (entry) {
+		g_hash_table_remove(shard->index, &entry->key);
+		entry->saved = 0;
+		entry->running = FALSE;
+	}
+
+	guint skipped = 0;
+	while (shard->ring[shard->next].running) {
+		shard->next = (shard->next + 1) % shard->slots;
+		if (++skipped is shard->slots) {
+			magma_operation_cache_grow(shard);
+			break;
+		}
+	}
+
+	entry = &shard->ring[shard->next];
+	if (entry->saved) g_hash_table_remove(shard->index, &entry->key);
+	shard->next = (shard->next + 1) % shard->slots;
+
+	entry->key = *key;
+	entry->saved = g_get_monotonic_time();
+	g_hash_table_insert(shard->index, &entry->key, entry);
+
+	return (entry);
+}
+
+/**
+ * Build the key to store the result of an operation. UDP peers are
+ * told by address and port, local peers by a digest of their socket
+ * name.
+ *
+ * @param peer the remote peer sending the request
+ * @param tid the transaction id
+ * @param key the key to be filled
+ */
+void magma_operation_cache_make_key(GSocketAddress *peer, magma_transaction_id tid, magma_operation_key *key)
+{
+	memset(key, 0, sizeof(magma_operation_key));
+	key->tid = tid;
+	key->family = g_socket_address_get_family(peer);
+
+	if (key->family is G_SOCKET_FAMILY_UNIX) {
+		gchar *name = magma_get_peer_name(peer);
+		unsigned char *digest = magma_sha1_data(name, strlen(name));
+		memcpy(key->address, digest, sizeof(key->address));
+		g_free(digest);
+		g_free(name);
+		return;
+	}
+
+	GInetAddress *address = g_inet_socket_address_get_address(G_INET_SOCKET_ADDRESS(peer));
+	memcpy(key->address, g_inet_address_to_bytes(address),
+		MIN(g_inet_address_get_native_size(address), sizeof(key->address)));
+	key->port = g_inet_socket_address_get_port(G_INET_SOCKET_ADDRESS(peer));
+}
+
+/**
+ * Look up the result of an operation already served
+ *
+ * @param key the operation key
+ * @param result filled with the cached result, if any
+ * @return result if cached, NULL otherwise
+ */
+magma_operation_result *magma_operation_cache_lookup(magma_operation_key *key, magma_operation_result *result)
+{
+	magma_operation_shard *shard = &magma_operation_shards[magma_operation_key_hash(key) % MAGMA_OPERATION_CACHE_SHARDS];
+	gint64 now = g_get_monotonic_time();
+	gboolean found = FALSE;
+
+	g_mutex_lock(&shard->lock);
+	magma_operation_entry *entry = g_hash_table_lookup(shard->index, key);
+	if (entry && !entry->running && now - entry->saved <= magma_operation_cache_expire) {
+		*result = entry->result;
+		found = TRUE;
+	}
+	g_mutex_unlock(&shard->lock);
+
+	return (found ? result : NULL);
+}
+
+/**
+ * Claim an operation before executing it. If its result is cached,
+ * it's returned. If the operation is running, the result is waited
+ * for. Otherwise the operation is marked as running and NULL is
+ * returned: the caller executes it and must save its result with
+ * magma_operation_cache_save_result().
+ *
+ * @param key the operation key
+ * @param result filled with the cached result, if any
+ * @return result if cached, NULL if the caller must execute the operation
+ */
+magma_operation_result *magma_operation_cache_claim(magma_operation_key *key, magma_operation_result *result)
+{
+	magma_operation_shard *shard = &magma_operation_shards[magma_operation_key_hash(key) % MAGMA_OPERATION_CACHE_SHARDS];
+	gboolean found = FALSE;
+
+	g_mutex_lock(&shard->lock);
+
+	magma_operation_entry *entry;
+	while ((entry = g_hash_table_lookup(shard->index, key)) && entry->running) {
+		g_cond_wait(&shard->done, &shard->lock);
+	}
+
+	if (entry && g_get_monotonic_time() - entry->saved <= magma_operation_cache_expire) {
+		*result = entry->result;
+		found = TRUE;
+	} else {
+		magma_operation_cache_take_slot(shard, key)->running = TRUE;
+	}
+
+	g_mutex_unlock(&shard->lock);
+
+	return (found ? result : NULL);
+}
+
+/**
+ * Saves an operation result in the cache, in the slot of its
+ * running marker or in place of the oldest result of its shard,
+ * and wakes up the retransmissions waiting for it
+ *
+ * @param key a key filled by magma_operation_cache_make_key()
+ * @param res the result to be cached
+ * @param err_no the error value to be cached
+ */
+void magma_operation_cache_save_result(magma_operation_key *key, gint32 res, guint16 err_no)
+{
+	magma_operation_shard *shard = &magma_operation_shards[magma_operation_key_hash(key) % MAGMA_OPERATION_CACHE_SHARDS];
+
+	g_mutex_lock(&shard->lock);
+
+	magma_operation_entry *entry = g_hash_table_lookup(shard->index, key);
+	if (entry && entry->running) {
+		entry->saved = g_get_monotonic_time();
+	} else {
+		entry = magma_operation_cache_take_slot(shard, key);
+	}
+
+	entry->result.res = res;
+	entry->result.err_no = err_no;
+	entry->running = FALSE;
+
+	g_cond_broadcast(&shard->done);
+	g_mutex_unlock(&shard->lock);
+}
+
+// vim:ts=4:nocindent:autoindent
@@ -24,12 +24,6 @@
 // #define INCLUDE_FLARE_INTERNALS
 #include "../magma.h"
 
-/*
- * if TRUE a GThreadPool is used to queue the replication
- * operations
- */
-#define MAGMA_DUPLICATION_THREAD_POOL FALSE
-
 /*
  * if TRUE the MAGMA_OP_TYPE_TRANSMIT_KEY operation is used to
  * replicate every operation
@@ -39,91 +33,213 @@
  */
 #define MAGMA_REPLICA_ON_PNODE TRUE
 
-GHashTable *magma_operation_cache;
+/**
+ * A WRITE_LARGE being reassembled
+ */
+typedef struct {
+	gchar *buffer;			/** NULL once handed to the write */
+	guint32 size;
+	guint16 fragment_size;
+	guint32 received[MAGMA_LARGE_IO_BITMAP_WORDS];
+	guint missing;
+	gint64 last_seen;
+} magma_large_write;
 
-#if MAGMA_DUPLICATION_THREAD_POOL
-GThreadPool *magma_duplication_thread_pool;
-#else
-GAsyncQueue *magma_duplication_queue;
-GThread *magma_duplication_thread;
-#endif
+/**
+ * WRITE_LARGE requests being reassembled, keyed like the operation
+ * cache. A running write is kept until done, so fragments
+ * retransmitted meanwhile don't start it again; then the operation
+ * cache answers for it. magma_large_writes_held counts the bytes
+ * of the buffers allocated, including those of running writes.
+ */
+GHashTable *magma_large_writes;
+GMutex magma_large_writes_mutex;
+static guint64 magma_large_writes_held = 0;
+
+static void magma_large_write_free(magma_large_write *write)
+{
+	if (write->buffer) magma_large_writes_held -= write->size;
+	g_free(write->buffer);
+	g_free(write);
+}
+
+/**
+ * Incomplete writes whose fragments stopped coming are dropped;
+ * running ones have no buffer here and are never expired.
+ */
+static gboolean magma_large_write_expired(magma_operation_key *key, magma_large_write *write, gint64 *now)
+{
+	(void) key;
+	if (!write->buffer) return (FALSE);
+	return ((*now - write->last_seen > MAGMA_LARGE_IO_EXPIRE * G_USEC_PER_SEC) ? TRUE : FALSE);
+}
+
+/**
+ * Drop the expired WRITE_LARGE every MAGMA_LARGE_IO_EXPIRE
+ * seconds, so an abandoned transfer doesn't hold its buffer
+ * until the next WRITE_LARGE comes.
+ */
+static gpointer magma_large_writes_reaper(gpointer data)
+{
+	(void) data;
+
+	while (1) {
+		g_usleep(MAGMA_LARGE_IO_EXPIRE * G_USEC_PER_SEC);
+
+		gint64 now = g_get_monotonic_time();
+		g_mutex_lock(&magma_large_writes_mutex);
+		guint expired = g_hash_table_foreach_remove(magma_large_writes, (GHRFunc) magma_large_write_expired, &now);
+		g_mutex_unlock(&magma_large_writes_mutex);
+
+		if (expired) dbg(LOG_INFO, DEBUG_PFUSE, "%u incomplete WRITE_LARGE expired", expired);
+	}
+
+	return (NULL);
+}
 
 /**
  * Stores a duplication operation
  */
-typedef void (*magma_replica_function)(magma_flare_request *, magma_volcano *);
 typedef struct {
 	magma_flare_request *request;
 	magma_volcano *node;
 	magma_replica_function replica_function;
 } magma_replica_ops;
 
-#if MAGMA_DUPLICATION_THREAD_POOL
+/**
+ * A replication lane: the operations waiting to be sent to
+ * a node, served in order by their own worker thread
+ */
+typedef struct {
+	GMutex lock;
+	GCond filled;			/** an operation has been queued */
+	GCond drained;			/** an operation has been taken */
+	GQueue ops;
+	GThread *worker;
+} magma_replica_lane;
+
+/**
+ * The lanes of a destination node. The operations on a key always
+ * take the same lane, so each key is replicated in the order it was
+ * changed, while different keys and different nodes go on in parallel
+ * and a slow node only holds back its own lanes.
+ */
+typedef struct {
+	gchar node_name[MAX_HOSTNAME_LENGTH];
+	guint lanes_count;
+	magma_replica_lane *lanes;
+} magma_replica_destination;
 
-void magma_replica_pool_kernel(magma_replica_ops *op, gpointer data)
-{
-	(void) data;
+/** destinations by node name, created on first use */
+static GHashTable *magma_replica_destinations;
+static GMutex magma_replica_destinations_mutex;
 
-	/*
-	 * execute it
-	 */
-	op->replica_function(op->request, op->node);
+/** lanes opened for each destination */
+static guint magma_replica_workers = MAGMA_REPLICA_WORKERS;
 
-	/*
-	 * free the request resources
-	 */
-	if (MAGMA_OP_TYPE_WRITE == op->request->header.type) g_free(op->request->body.write.buffer);
+static void magma_replica_ops_free(magma_replica_ops *op)
+{
+	if (op->request->header.type is MAGMA_OP_TYPE_WRITE) g_free(op->request->body.write.buffer);
 	g_free(op->request);
 	g_free(op->node);
 	g_free(op);
 }
 
-#else
-
 gpointer magma_replica_kernel(gpointer data)
 {
-	(void) data;
+	magma_replica_lane *lane = (magma_replica_lane *) data;
 
 	while (1) {
 		/*
-		 * pop a replica request from the queue
+		 * pop a replica request from the lane
 		 */
-		magma_replica_ops *op = g_async_queue_pop(magma_duplication_queue);
+		g_mutex_lock(&lane->lock);
+		while (g_queue_is_empty(&lane->ops)) g_cond_wait(&lane->filled, &lane->lock);
+		magma_replica_ops *op = g_queue_pop_head(&lane->ops);
+		g_cond_signal(&lane->drained);
+		g_mutex_unlock(&lane->lock);
 
 		/*
-		 * execute it
+		 * execute it, then free the request resources
 		 */
 		op->replica_function(op->request, op->node);
-
-		/*
-		 * free the request resources
-		 */
-		if (op->request->header.type is MAGMA_OP_TYPE_WRITE) g_free(op->request->body.write.buffer);
-		g_free(op->request);
-		g_free(op->node);
-		g_free(op);
+		magma_replica_ops_free(op);
 	}
 
 	return (NULL);
 }
 
-#endif
-
-void magma_init_server_flare()
+/**
+ * Return the lanes of a node, opening them on first use
+ *
+ * @param node the destination volcano
+ * @return the destination
+ */
+static magma_replica_destination *magma_replica_get_destination(magma_volcano *node)
 {
-	magma_operation_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	g_mutex_lock(&magma_replica_destinations_mutex);
+
+	magma_replica_destination *destination = g_hash_table_lookup(magma_replica_destinations, node->node_name);
+	if (!destination) {
+		destination = g_new0(magma_replica_destination, 1);
+		g_strlcpy(destination->node_name, node->node_name, MAX_HOSTNAME_LENGTH);
+		destination->lanes_count = magma_replica_workers;
+		destination->lanes = g_new0(magma_replica_lane, destination->lanes_count);
+
+		guint i = 0;
+		for (; i < destination->lanes_count; i++) {
+			magma_replica_lane *lane = &destination->lanes[i];
+			g_mutex_init(&lane->lock);
+			g_cond_init(&lane->filled);
+			g_cond_init(&lane->drained);
+			g_queue_init(&lane->ops);
+
+			gchar *name = g_strdup_printf("Replica %s/%u", destination->node_name, i);
+			lane->worker = g_thread_new(name, magma_replica_kernel, lane);
+			g_free(name);
+		}
 
-#if MAGMA_DUPLICATION_THREAD_POOL
+		g_hash_table_insert(magma_replica_destinations, destination->node_name, destination);
+		dbg(LOG_INFO, DEBUG_PFUSE, "Opened %u replication lanes to %s", destination->lanes_count, destination->node_name);
+	}
 
-	GError *error = NULL;
-	magma_duplication_thread_pool = g_thread_pool_new((GFunc) magma_replica_pool_kernel, NULL, -1, FALSE, &error);
+	g_mutex_unlock(&magma_replica_destinations_mutex);
+	return (destination);
+}
 
-#else
+/**
+ * Return the key a replica operation works on, which
+ * chooses its lane
+ *
+ * @param request the replicated request
+ * @return the path of the flare changed by the request
+ */
+static const gchar *magma_replica_key(magma_flare_request *request)
+{
+	magma_optype type = request->header.type;
+
+	if (type is MAGMA_OP_TYPE_MKNOD)	return (request->body.mknod.path);
+	if (type is MAGMA_OP_TYPE_MKDIR)	return (request->body.mkdir.path);
+	if (type is MAGMA_OP_TYPE_UNLINK)	return (request->body.unlink.path);
+	if (type is MAGMA_OP_TYPE_RMDIR)	return (request->body.rmdir.path);
+	if (type is MAGMA_OP_TYPE_SYMLINK)	return (request->body.symlink.to);
+	if (type is MAGMA_OP_TYPE_CHMOD)	return (request->body.chmod.path);
+	if (type is MAGMA_OP_TYPE_CHOWN)	return (request->body.chown.path);
+	if (type is MAGMA_OP_TYPE_TRUNCATE)	return (request->body.truncate.path);
+	if (type is MAGMA_OP_TYPE_UTIME)	return (request->body.utime.path);
+	if (type is MAGMA_OP_TYPE_WRITE)	return (request->body.write.path);
+
+	return ("");
+}
 
-	magma_duplication_queue = g_async_queue_new();
-	magma_duplication_thread = g_thread_new("Replica ops", magma_replica_kernel, NULL);
+void magma_init_server_flare()
+{
+	magma_init_operation_cache();
+	magma_large_writes = g_hash_table_new_full(magma_operation_key_hash, magma_operation_key_equal, g_free, (GDestroyNotify) magma_large_write_free);
+	g_thread_unref(g_thread_new("Large writes", magma_large_writes_reaper, NULL));
 
-#endif
+	if (magma_environment.replica_workers > 0) magma_replica_workers = magma_environment.replica_workers;
+	magma_replica_destinations = g_hash_table_new(g_str_hash, g_str_equal);
 }
 
 /**
@@ -144,73 +260,6 @@ gboolean magma_misplaced_query(const gchar *path)
 	return (TRUE);
 }
 
-/**
- * Build the key to store the result of an operation
- *
- * @param peer the remote peer sending the request
- * @param tid the transaction id
- * @return the string to be used as key
- */
-gchar *magma_operation_cache_make_key(GSocketAddress *peer, magma_transaction_id tid)
-{
-	GInetAddress *addr = g_inet_socket_address_get_address(G_INET_SOCKET_ADDRESS(peer));
-	gchar *addr_string = g_inet_address_to_string(addr);
-	gchar *key = g_strdup_printf("%s:%d:%d",
-		addr_string,
-		g_inet_socket_address_get_port(G_INET_SOCKET_ADDRESS(peer)),
-		tid);
-	g_free(addr_string);
-	return (key);
-}
-
-/**
- * Stores the result of writing operations
- */
-typedef struct {
-	guint32 res;
-	guint16 err_no;
-} magma_operation_result;
-
-/**
- * Saves an operation result in the cache
- *
- * @param key a key obtained magma_operation_cache_make_key()
- * @param res the result to be cached
- * @err_no the error value to be cached
- */
-void magma_operation_cache_save_result(gchar *key, guint32 res, guint16 err_no)
-{
-	magma_operation_result *result = g_new0(magma_operation_result, 1);
-	result->res = res;
-	result->err_no = err_no;
-
-	g_hash_table_insert(magma_operation_cache, key, result);
-}
-
-#if 0
-/**
- * Compares two replica operations by destination IP address and
- * transaction id to order the queue
- */
-gint magma_queue_sorter(const magma_replica_ops *op1, const magma_replica_ops *op2, gpointer data)
-{
-	(void) data;
-
-	/*
-	 * first compare by IP address
-	 */
-	int strings = g_strcmp0(op1->node->ip_addr, op2->node->ip_addr);
-	if (0 != strings) return (strings);
-
-	/*
-	 * then compare by transaction id
-	 */
-	if (op1->request->header.transaction_id < op2->request->header.transaction_id) return (-1);
-	if (op1->request->header.transaction_id > op2->request->header.transaction_id) return (1);
-	return (0);
-}
-#endif
-
 /**
  * Enqueues a replica operation
  *
@@ -279,19 +328,29 @@ gboolean magma_queue_replica(magma_replica_function replica_function, magma_flar
 	op->request = r;
 
 	/*
-	 * finally, push the request into the queue
+	 * finally, push the request into the lane of its key. If the
+	 * node doesn't keep up and the lane is full, the caller waits
+	 * for the worker to make room: no operation is ever dropped,
+	 * so the node never silently diverges. Each replica request
+	 * gives up after MAGMA_RETRY_LIMIT retransmissions, so even a
+	 * dead node drains its lanes.
 	 */
-#if MAGMA_DUPLICATION_THREAD_POOL
-	GError *error = NULL;
-	g_thread_pool_push(magma_duplication_thread_pool, op, &error);
-	if (error) {
-		dbg(LOG_ERR, DEBUG_PFUSE, "Error pushing request to replication pool: %s", error->message);
-		g_error_free(error);
+	magma_replica_destination *destination = magma_replica_get_destination(node);
+	magma_replica_lane *lane = &destination->lanes[g_str_hash(magma_replica_key(r)) % destination->lanes_count];
+
+	g_mutex_lock(&lane->lock);
+	if (g_queue_get_length(&lane->ops) >= MAGMA_REPLICA_QUEUE_LENGTH) {
+		dbg(LOG_INFO, DEBUG_PFUSE, "Replication lane to %s is full: waiting to queue %s on %s",
+			node->node_name, magma_explain_optype(r->header.type), magma_replica_key(r));
+
+		while (g_queue_get_length(&lane->ops) >= MAGMA_REPLICA_QUEUE_LENGTH) {
+			g_cond_wait(&lane->drained, &lane->lock);
+		}
 	}
-#else
-	// g_async_queue_push_sorted(magma_duplication_queue, op, (GCompareDataFunc) magma_queue_sorter, NULL);
-	g_async_queue_push(magma_duplication_queue, op);
-#endif // MAGMA_DUPLICATION_THREAD_POOL
+
+	g_queue_push_tail(&lane->ops, op);
+	g_cond_signal(&lane->filled);
+	g_mutex_unlock(&lane->lock);
 
 	return (TRUE);
 #endif // MAGMA_REPLICA_ON_PNODE
@@ -472,6 +531,39 @@ int magma_server_manage_readdir(GSocket *socket, GSocketAddress *peer, gchar *bu
 /**************************************************************
  * READDIR (extended version with entries struct stat)        *
  **************************************************************/
+
+/**
+ * Fill the attributes of a directory entry for READDIR_EXTENDED
+ * and READDIR_COMPACT
+ *
+ * @param request the READDIR request
+ * @param de the entry name
+ * @param dst the attributes
+ */
+static void magma_server_readdir_stat(magma_flare_request *request, const gchar *de, magma_stat_struct *dst)
+{
+	gchar *entry_path = g_strdup_printf("%s/%s", request->body.readdir_extended.path, de);
+
+	struct stat src;
+	magma_stat(request->header.uid, request->header.gid, entry_path, &src);
+
+	dst->dev		= src.st_dev;
+	dst->ino		= src.st_ino;
+	dst->size		= src.st_size;
+	dst->blocks		= src.st_blocks;
+	dst->atime		= src.st_atime;
+	dst->ctime		= src.st_ctime;
+	dst->mtime		= src.st_mtime;
+	dst->mode		= src.st_mode;
+	dst->nlink		= src.st_nlink;
+	dst->uid		= src.st_uid;
+	dst->gid		= src.st_gid;
+	dst->rdev		= src.st_rdev;
+	dst->blksize	= src.st_blksize;
+
+	g_free(entry_path);
+}
+
 int magma_server_manage_readdir_extended(GSocket *socket, GSocketAddress *peer, gchar *buffer, magma_flare_request *request)
 {
 	off_t offset = 0;
@@ -555,28 +647,7 @@ int magma_server_manage_readdir_extended(GSocket *socket, GSocketAddress *peer,
 		/*
 		 * add the struct stat section
 		 */
-		gchar *entry_path = g_strdup_printf("%s/%s", request->body.readdir_extended.path, de);
-
-		struct stat src;
-		magma_stat(request->header.uid, request->header.gid, entry_path, &src);
-		magma_stat_struct *dst = &(response.body.readdir_extended.entries[e].st);
-
-		dst->dev		= src.st_dev;
-		dst->ino		= src.st_ino;
-		dst->size		= src.st_size;
-		dst->blocks		= src.st_blocks;
-		dst->atime		= src.st_atime;
-		dst->ctime		= src.st_ctime;
-		dst->mtime		= src.st_mtime;
-		dst->mode		= src.st_mode;
-		dst->nlink		= src.st_nlink;
-		dst->uid		= src.st_uid;
-		dst->gid		= src.st_gid;
-		dst->rdev		= src.st_rdev;
-		dst->blksize	= src.st_blksize;
-
-		// magma_encode_stat_struct(&st, &(response.body.readdir_extended.entries[e].st));
-		g_free(entry_path);
+		magma_server_readdir_stat(request, de, &(response.body.readdir_extended.entries[e].st));
 	}
 
 	/*
@@ -593,10 +664,95 @@ int magma_server_manage_readdir_extended(GSocket *socket, GSocketAddress *peer,
 	return 0;
 }
 
+/**************************************************************
+ * READDIR_COMPACT (as many packed entries as fit a datagram) *
+ **************************************************************/
+int magma_server_manage_readdir_compact(GSocket *socket, GSocketAddress *peer, gchar *buffer, magma_flare_request *request)
+{
+	MAGMA_IO_BUFFER(entries);
+
+	magma_flare_response response;
+	memset(&response, 0, sizeof(magma_flare_response));
+	response.body.readdir_compact.entries = entries;
+
+	/* the request is the same of READDIR_EXTENDED */
+	magma_pktqr_readdir_extended(buffer, request);
+
+	magma_flags flags = 0;
+	if (magma_misplaced_query(request->body.readdir_extended.path)) {
+		magma_raise_flag(flags, MAGMA_FLAG_REFRESH_TOPOLOGY);
+	}
+
+	/*
+	 * ACL
+	 */
+	if (!magma_validate_connection(socket, peer, request->body.readdir_extended.path, 'r')) {
+		response.header.res = MAGMA_DIR_IS_CLOSE;
+		magma_pktas_readdir_compact(socket, peer, &response, request->header.transaction_id, flags);
+		dbg(LOG_INFO, DEBUG_PFUSE, "READDIR denied");
+		return (-1);
+	}
+
+	dbg(LOG_INFO, DEBUG_PFUSE, "READDIR compact #%05d on %s by %d.%d",
+		request->header.transaction_id,
+		request->body.readdir_extended.path,
+		request->header.uid,
+		request->header.gid);
+
+	magma_DIR_t *dirp = magma_opendir(
+		request->header.uid,
+		request->header.gid,
+		request->body.readdir_extended.path);
+
+	if (!dirp) {
+		response.header.res = MAGMA_DIR_IS_CLOSE;
+		magma_pktas_readdir_compact(socket, peer, &response, request->header.transaction_id, flags);
+		dbg(LOG_ERR, DEBUG_ERR, "READDIR#%d: %s", request->header.transaction_id, strerror(errno));
+		return (-1);
+	}
+
+	magma_seekdir(dirp, request->body.readdir_extended.offset);
+
+	/*
+	 * pack entries while the longest one still fits
+	 */
+	response.header.res = MAGMA_DIR_IS_OPEN;
+	gchar *ptr = entries;
+
+	while (ptr - entries + MAGMA_COMPACT_READDIR_ENTRY_MAX_SIZE <= MAGMA_COMPACT_READDIR_PAYLOAD &&
+		response.body.readdir_compact.entry_number < G_MAXUINT16) {
+
+		char *de = magma_readdir(dirp);
+		if (!de) {
+			dbg(LOG_INFO, DEBUG_PFUSE, "READDIR: last entry read");
+			response.header.res = MAGMA_DIR_IS_CLOSE;
+			break;
+		}
+
+		magma_stat_struct st;
+		magma_server_readdir_stat(request, de, &st);
+
+		ptr = magma_encode_compact_readdir_entry(ptr, de, &st);
+		response.body.readdir_compact.entry_number++;
+	}
+
+	response.body.readdir_compact.length = ptr - entries;
+	response.body.readdir_compact.offset = magma_telldir(dirp);
+	magma_pktas_readdir_compact(socket, peer, &response, request->header.transaction_id, flags);
+
+	dbg(LOG_INFO, DEBUG_PFUSE, "READDIR#%d: sent %u entries in %lu bytes",
+		request->header.transaction_id,
+		response.body.readdir_compact.entry_number,
+		response.body.readdir_compact.length);
+
+	magma_closedir(dirp);
+	return 0;
+}
+
 #endif
 
 /**************************************************************
- * OPEN (for file creation see MKNOD)                         *
+ * OPEN (for file creation see MKNOD) and OPEN_HANDLE         *
  **************************************************************/
 int magma_server_manage_open(GSocket *socket, GSocketAddress *peer, gchar *buffer, magma_flare_request *request)
 {
@@ -635,7 +791,10 @@ int magma_server_manage_open(GSocket *socket, GSocketAddress *peer, gchar *buffe
 		flare = magma_search_or_create(request->body.open.path);
 	}
 
-	magma_pktas_open(socket, peer, res, server_errno, flare, request->header.transaction_id, flags);
+	if (request->header.type is MAGMA_OP_TYPE_OPEN_HANDLE)
+		magma_pktas_open_handle(socket, peer, res, server_errno, flare, request->header.transaction_id, flags);
+	else
+		magma_pktas_open(socket, peer, res, server_errno, flare, request->header.transaction_id, flags);
 
 	dbg(LOG_INFO, DEBUG_PFUSE, "open #%05d (%s) answered res: %d, errno: %d",
 		request->header.transaction_id,
@@ -675,7 +834,7 @@ int magma_server_manage_read(GSocket *socket, GSocketAddress *peer, gchar *buffe
 		res = magma_read(
 			request->header.uid, request->header.gid,
 			request->body.read.path,
-			request->body.read.size,
+			MIN(request->body.read.size, MAGMA_READ_WRITE_BUFFER_SIZE),
 			request->body.read.offset,
 			read_buffer);
 
@@ -691,6 +850,159 @@ int magma_server_manage_read(GSocket *socket, GSocketAddress *peer, gchar *buffe
     return (res);
 }
 
+/**************************************************************
+ * READ_HANDLE and WRITE_HANDLE                               *
+ **************************************************************/
+/**
+ * Find the flare a file handle names. Only the owner of the flare
+ * serves a handle, or its redundant owner for a read: anyone else
+ * could hold an outdated copy, so it answers ESTALE like for a
+ * flare which left the cache, and asks the client to refresh the
+ * topology.
+ *
+ * @param handle the file handle
+ * @param write TRUE if the flare is going to be written
+ * @param flags the answer flags
+ * @return the flare, NULL with errno set to ESTALE
+ */
+static magma_flare_t *magma_server_resolve_handle(magma_flare_handle *handle, gboolean write, magma_flags *flags)
+{
+	magma_flare_t *flare = magma_search_by_handle(handle->binhash, handle->generation);
+	if (!flare) {
+		errno = ESTALE;
+		return (NULL);
+	}
+
+	magma_volcano *owner = magma_route_flare(flare);
+	if (magma_compare_nodes(owner, &myself)) return (flare);
+	if (!write && magma_compare_nodes(magma_get_next_node(owner), &myself)) return (flare);
+
+	magma_raise_flag(*flags, MAGMA_FLAG_REFRESH_TOPOLOGY);
+	magma_dispose_flare(flare);
+	errno = ESTALE;
+	return (NULL);
+}
+
+int magma_server_manage_read_handle(GSocket *socket, GSocketAddress *peer, gchar *buffer, magma_flare_request *request)
+{
+	int server_errno = 0, res = -1;
+	gchar read_buffer[MAGMA_READ_WRITE_BUFFER_SIZE];
+
+	magma_pktqr_read_handle(buffer, request);
+
+	magma_flags flags = 0;
+	magma_flare_t *flare = magma_server_resolve_handle(&request->body.read_handle.handle, FALSE, &flags);
+
+	if (!flare) {
+		server_errno = errno;
+		dbg(LOG_INFO, DEBUG_PFUSE, "READ_HANDLE #%05d: stale handle", request->header.transaction_id);
+	} else if (!magma_validate_connection(socket, peer, flare->path, 'r')) {
+		errno = server_errno = ECONNREFUSED;
+		dbg(LOG_INFO, DEBUG_PFUSE, "READ_HANDLE denied");
+	} else {
+		dbg(LOG_INFO, DEBUG_PFUSE, "READ_HANDLE #%05d on %s by %d.%d",
+			request->header.transaction_id,
+			flare->path,
+			request->header.uid,
+			request->header.gid);
+
+		res = magma_read_flare(
+			request->header.uid, request->header.gid,
+			flare,
+			MIN(request->body.read_handle.size, MAGMA_READ_WRITE_BUFFER_SIZE),
+			request->body.read_handle.offset,
+			read_buffer);
+
+		server_errno = errno;
+	}
+
+	magma_pktas_read(socket, peer, res, server_errno, read_buffer, request->header.transaction_id, flags);
+	dbg(LOG_INFO, DEBUG_PFUSE, "read_handle #%05d answered res: %d, errno: %d",
+			request->header.transaction_id, res, server_errno);
+
+	magma_dispose_flare(flare);
+	return (res);
+}
+
+/**************************************************************
+ * READ_LARGE                                                 *
+ **************************************************************/
+int magma_server_manage_read_large(GSocket *socket, GSocketAddress *peer, gchar *buffer, magma_flare_request *request)
+{
+	int server_errno = 0, res = 0;
+	gchar *read_buffer = NULL;
+
+	magma_pktqr_read_large(buffer, request);
+
+	magma_flags flags = 0;
+	if (magma_misplaced_query(request->body.read_large.path)) {
+		magma_raise_flag(flags, MAGMA_FLAG_REFRESH_TOPOLOGY);
+	}
+
+	guint16 fragment_size = request->body.read_large.fragment_size;
+
+	if (!magma_validate_connection(socket, peer, request->body.read_large.path, 'r')) {
+		res = -1;
+		errno = server_errno = ECONNREFUSED;
+		dbg(LOG_INFO, DEBUG_PFUSE, "READ_LARGE denied");
+	} else if (!fragment_size || fragment_size > MAGMA_LARGE_IO_FRAGMENT_SIZE) {
+		res = -1;
+		errno = server_errno = EINVAL;
+		dbg(LOG_INFO, DEBUG_PFUSE, "READ_LARGE with fragments of %u bytes refused", fragment_size);
+	} else {
+		dbg(LOG_INFO, DEBUG_PFUSE, "READ_LARGE #%05d on %s by %d.%d",
+			request->header.transaction_id,
+			request->body.read_large.path,
+			request->header.uid,
+			request->header.gid);
+
+		/*
+		 * only the span from the first to the last wanted fragment
+		 * is read, into its place in a buffer as large as the range;
+		 * the pages outside the span are never touched
+		 */
+		guint32 size = MIN(request->body.read_large.size, MAGMA_LARGE_IO_MAX_FRAGMENTS * (guint32) fragment_size);
+		guint fragments = magma_large_io_fragments(size, fragment_size), first = fragments, last = 0, i;
+		for (i = 0; i < fragments; i++) {
+			if (!magma_large_io_bit_is_set(request->body.read_large.wanted, i)) continue;
+			if (first is fragments) first = i;
+			last = i;
+		}
+
+		/* a request wanting nothing has nothing to answer */
+		if (first is fragments) return (0);
+
+		guint32 start = first * fragment_size;
+		guint32 span = MIN((last + 1) * fragment_size, size) - start;
+		read_buffer = g_malloc(size);
+
+		res = magma_read(
+			request->header.uid, request->header.gid,
+			request->body.read_large.path,
+			span,
+			request->body.read_large.offset + start,
+			read_buffer + start);
+
+		server_errno = errno;
+
+		/*
+		 * res tells the client the bytes in the range: a short
+		 * read found the end of file, a full one leaves the
+		 * fragments after the span to the next windows
+		 */
+		if (res isNot -1) res = ((guint32) res < span) ? (gint32) (start + res) : (gint32) size;
+	}
+
+	magma_pktas_read_large(socket, peer, res, server_errno, read_buffer, fragment_size, request->body.read_large.wanted, request->header.transaction_id, flags);
+	dbg(LOG_INFO, DEBUG_PFUSE, "read_large #%05d (%s) answered res: %d, errno: %d",
+			request->header.transaction_id,
+			request->body.read_large.path,
+			res, server_errno);
+
+	g_free(read_buffer);
+	return (res);
+}
+
 /**************************************************************
  * STATFS                                                     *
  **************************************************************/
@@ -766,7 +1078,7 @@ void magma_redundant_mknod(magma_flare_request *request, magma_volcano *node)
 int magma_server_manage_mknod(GSocket *socket, GSocketAddress *peer, gchar *buffer, magma_flare_request *request)
 {
 	int res = 0, server_errno = 0;
-	magma_operation_result *result = NULL;
+	magma_operation_result cached, *result = NULL;
 
 	magma_pktqr_mknod(buffer, request);
 
@@ -786,12 +1098,12 @@ int magma_server_manage_mknod(GSocket *socket, GSocketAddress *peer, gchar *buff
 			request->header.uid,
 			request->header.gid);
 
-		gchar *key = magma_operation_cache_make_key(peer, request->header.transaction_id);
-		result = g_hash_table_lookup(magma_operation_cache, key);
+		magma_operation_key key;
+		magma_operation_cache_make_key(peer, request->header.transaction_id, &key);
+		result = magma_operation_cache_claim(&key, &cached);
 
 		if (result) {
 
-			g_free(key);
 			res = result->res;
 			server_errno = result->err_no;
 
@@ -806,7 +1118,7 @@ int magma_server_manage_mknod(GSocket *socket, GSocketAddress *peer, gchar *buff
 				request->body.mknod.rdev);
 
 			server_errno = errno;
-			magma_operation_cache_save_result(key, res, server_errno);
+			magma_operation_cache_save_result(&key, res, server_errno);
 		}
 	}
 
@@ -868,7 +1180,7 @@ void magma_redundant_mkdir(magma_flare_request *request, magma_volcano *node)
 int magma_server_manage_mkdir(GSocket *socket, GSocketAddress *peer, gchar *buffer, magma_flare_request *request)
 {
 	int server_errno = 0, res = 0;
-	magma_operation_result *result = NULL;
+	magma_operation_result cached, *result = NULL;
 
 	magma_pktqr_mkdir(buffer, request);
 
@@ -888,11 +1200,11 @@ int magma_server_manage_mkdir(GSocket *socket, GSocketAddress *peer, gchar *buff
 			request->header.uid,
 			request->header.gid);
 
-		gchar *key = magma_operation_cache_make_key(peer, request->header.transaction_id);
-		result = g_hash_table_lookup(magma_operation_cache, key);
+		magma_operation_key key;
+		magma_operation_cache_make_key(peer, request->header.transaction_id, &key);
+		result = magma_operation_cache_claim(&key, &cached);
 		if (result) {
 
-			g_free(key);
 			res = result->res;
 			server_errno = result->err_no;
 
@@ -906,7 +1218,7 @@ int magma_server_manage_mkdir(GSocket *socket, GSocketAddress *peer, gchar *buff
 				request->body.mkdir.mode);
 
 			server_errno = errno;
-			magma_operation_cache_save_result(key, res, server_errno);
+			magma_operation_cache_save_result(&key, res, server_errno);
 
 		}
 	}
@@ -965,7 +1277,7 @@ void magma_redundant_unlink(magma_flare_request *request, magma_volcano *node)
 int magma_server_manage_unlink(GSocket *socket, GSocketAddress *peer, gchar *buffer, magma_flare_request *request)
 {
 	int server_errno = 0, res = 0;
-	magma_operation_result *result = NULL;
+	magma_operation_result cached, *result = NULL;
 
 	magma_pktqr_unlink(buffer, request);
 
@@ -985,12 +1297,12 @@ int magma_server_manage_unlink(GSocket *socket, GSocketAddress *peer, gchar *buf
 			request->header.uid,
 			request->header.gid);
 
-		gchar *key = magma_operation_cache_make_key(peer, request->header.transaction_id);
-		result = g_hash_table_lookup(magma_operation_cache, key);
+		magma_operation_key key;
+		magma_operation_cache_make_key(peer, request->header.transaction_id, &key);
+		result = magma_operation_cache_claim(&key, &cached);
 
 		if (result) {
 
-			g_free(key);
 			res = result->res;
 			server_errno = result->err_no;
 
@@ -1003,7 +1315,7 @@ int magma_server_manage_unlink(GSocket *socket, GSocketAddress *peer, gchar *buf
 				request->body.unlink.path);
 
 			server_errno = errno;
-			magma_operation_cache_save_result(key, res, server_errno);
+			magma_operation_cache_save_result(&key, res, server_errno);
 
 		}
 	}
@@ -1063,7 +1375,7 @@ void magma_redundant_rmdir(magma_flare_request *request, magma_volcano *node)
 int magma_server_manage_rmdir(GSocket *socket, GSocketAddress *peer, gchar *buffer, magma_flare_request *request)
 {
 	int server_errno = 0, res = 0;
-	magma_operation_result *result = NULL;
+	magma_operation_result cached, *result = NULL;
 
 	magma_pktqr_rmdir(buffer, request);
 
@@ -1083,11 +1395,11 @@ int magma_server_manage_rmdir(GSocket *socket, GSocketAddress *peer, gchar *buff
 			request->header.uid,
 			request->header.gid);
 
-		gchar *key = magma_operation_cache_make_key(peer, request->header.transaction_id);
-		result = g_hash_table_lookup(magma_operation_cache, key);
+		magma_operation_key key;
+		magma_operation_cache_make_key(peer, request->header.transaction_id, &key);
+		result = magma_operation_cache_claim(&key, &cached);
 		if (result) {
 
-			g_free(key);
 			res = result->res;
 			server_errno = result->err_no;
 
@@ -1100,7 +1412,7 @@ int magma_server_manage_rmdir(GSocket *socket, GSocketAddress *peer, gchar *buff
 				request->body.rmdir.path);
 
 			server_errno = errno;
-			magma_operation_cache_save_result(key, res, server_errno);
+			magma_operation_cache_save_result(&key, res, server_errno);
 
 		}
 	}
@@ -1161,7 +1473,7 @@ void magma_redundant_symlink(magma_flare_request *request, magma_volcano *node)
 int magma_server_manage_symlink(GSocket *socket, GSocketAddress *peer, gchar *buffer, magma_flare_request *request)
 {
 	int server_errno = 0, res = 0;
-	magma_operation_result *result = NULL;
+	magma_operation_result cached, *result = NULL;
 
 	magma_pktqr_symlink(buffer, request);
 
@@ -1182,11 +1494,11 @@ int magma_server_manage_symlink(GSocket *socket, GSocketAddress *peer, gchar *bu
 			request->header.uid,
 			request->header.gid);
 
-		gchar *key = magma_operation_cache_make_key(peer, request->header.transaction_id);
-		result = g_hash_table_lookup(magma_operation_cache, key);
+		magma_operation_key key;
+		magma_operation_cache_make_key(peer, request->header.transaction_id, &key);
+		result = magma_operation_cache_claim(&key, &cached);
 		if (result) {
 
-			g_free(key);
 			res = result->res;
 			server_errno = result->err_no;
 
@@ -1200,7 +1512,7 @@ int magma_server_manage_symlink(GSocket *socket, GSocketAddress *peer, gchar *bu
 				request->body.symlink.to);
 
 			server_errno = errno;
-			magma_operation_cache_save_result(key, res, server_errno);
+			magma_operation_cache_save_result(&key, res, server_errno);
 		}
 	}
 
@@ -1348,7 +1660,7 @@ int magma_server_manage_chmod(
 	magma_flare_request *request)
 {
 	int server_errno = 0, res = 0;
-	magma_operation_result *result = NULL;
+	magma_operation_result cached, *result = NULL;
 
 	magma_pktqr_chmod(buffer, request);
 
@@ -1368,11 +1680,11 @@ int magma_server_manage_chmod(
 			request->header.uid,
 			request->header.gid);
 
-		gchar *key = magma_operation_cache_make_key(peer, request->header.transaction_id);
-		result = g_hash_table_lookup(magma_operation_cache, key);
+		magma_operation_key key;
+		magma_operation_cache_make_key(peer, request->header.transaction_id, &key);
+		result = magma_operation_cache_claim(&key, &cached);
 		if (result) {
 
-			g_free(key);
 			res = result->res;
 			server_errno = result->err_no;
 
@@ -1386,7 +1698,7 @@ int magma_server_manage_chmod(
 				request->body.chmod.mode);
 
 			server_errno = errno;
-			magma_operation_cache_save_result(key, res, server_errno);
+			magma_operation_cache_save_result(&key, res, server_errno);
 
 		}
 	}
@@ -1448,7 +1760,7 @@ void magma_redundant_chown(magma_flare_request *request, magma_volcano *node)
 int magma_server_manage_chown(GSocket *socket, GSocketAddress *peer, gchar *buffer, magma_flare_request *request)
 {
 	int server_errno = 0, res = 0;
-	magma_operation_result *result = NULL;
+	magma_operation_result cached, *result = NULL;
 
 	magma_pktqr_chown(buffer, request);
 
@@ -1468,11 +1780,11 @@ int magma_server_manage_chown(GSocket *socket, GSocketAddress *peer, gchar *buff
 			request->header.uid,
 			request->header.gid);
 
-		gchar *key = magma_operation_cache_make_key(peer, request->header.transaction_id);
-		result = g_hash_table_lookup(magma_operation_cache, key);
+		magma_operation_key key;
+		magma_operation_cache_make_key(peer, request->header.transaction_id, &key);
+		result = magma_operation_cache_claim(&key, &cached);
 		if (result) {
 
-			g_free(key);
 			res = result->res;
 			server_errno = result->err_no;
 
@@ -1487,7 +1799,7 @@ int magma_server_manage_chown(GSocket *socket, GSocketAddress *peer, gchar *buff
 				request->body.chown.new_gid);
 
 			server_errno = errno;
-			magma_operation_cache_save_result(key, res, server_errno);
+			magma_operation_cache_save_result(&key, res, server_errno);
 
 		}
 	}
@@ -1547,7 +1859,7 @@ void magma_redundant_truncate(magma_flare_request *request, magma_volcano *node)
 int magma_server_manage_truncate(GSocket *socket, GSocketAddress *peer, gchar *buffer, magma_flare_request *request)
 {
 	int res = 0, server_errno = 0;
-	magma_operation_result *result = NULL;
+	magma_operation_result cached, *result = NULL;
 
 	magma_pktqr_truncate(buffer, request);
 
@@ -1567,12 +1879,12 @@ int magma_server_manage_truncate(GSocket *socket, GSocketAddress *peer, gchar *b
 			request->header.uid,
 			request->header.gid);
 
-		gchar *key = magma_operation_cache_make_key(peer, request->header.transaction_id);
-		result = g_hash_table_lookup(magma_operation_cache, key);
+		magma_operation_key key;
+		magma_operation_cache_make_key(peer, request->header.transaction_id, &key);
+		result = magma_operation_cache_claim(&key, &cached);
 
 		if (result) {
 
-			g_free(key);
 			res = result->res;
 			server_errno = result->err_no;
 
@@ -1586,7 +1898,7 @@ int magma_server_manage_truncate(GSocket *socket, GSocketAddress *peer, gchar *b
 				request->body.truncate.offset);
 
 			server_errno = errno;
-			magma_operation_cache_save_result(key, res, server_errno);
+			magma_operation_cache_save_result(&key, res, server_errno);
 
 		}
 	}
@@ -1647,7 +1959,7 @@ void magma_redundant_utime(magma_flare_request *request, magma_volcano *node)
 int magma_server_manage_utime(GSocket *socket, GSocketAddress *peer, gchar *buffer, magma_flare_request *request)
 {
 	int server_errno = 0, res = 0;
-	magma_operation_result *result = NULL;
+	magma_operation_result cached, *result = NULL;
 
 	magma_pktqr_utime(buffer, request);
 
@@ -1667,11 +1979,11 @@ int magma_server_manage_utime(GSocket *socket, GSocketAddress *peer, gchar *buff
 			request->header.uid,
 			request->header.gid);
 
-		gchar *key = magma_operation_cache_make_key(peer, request->header.transaction_id);
-		result = g_hash_table_lookup(magma_operation_cache, key);
+		magma_operation_key key;
+		magma_operation_cache_make_key(peer, request->header.transaction_id, &key);
+		result = magma_operation_cache_claim(&key, &cached);
 		if (result) {
 
-			g_free(key);
 			res = result->res;
 			server_errno = result->err_no;
 
@@ -1686,7 +1998,7 @@ int magma_server_manage_utime(GSocket *socket, GSocketAddress *peer, gchar *buff
 				request->body.utime.mtime);
 
 			server_errno = errno;
-			magma_operation_cache_save_result(key, res, server_errno);
+			magma_operation_cache_save_result(&key, res, server_errno);
 
 		}
 	}
@@ -1739,25 +2051,39 @@ void magma_redundant_write(magma_flare_request *request, magma_volcano *node)
 		return;
 	}
 
+	/*
+	 * a write reassembled from a WRITE_LARGE is mirrored in chunks
+	 */
 	socket = magma_open_client_connection(node->ip_addr, MAGMA_NODE_PORT, &peer);
-	magma_pktqs_transmit_key(socket, peer,
-		request->body.write.offset,
-		request->body.write.size,
-		request->body.write.buffer,
-		flare, &response);
+	guint32 done = 0;
+	do {
+		guint32 chunk = MIN(request->body.write.size - done, MAGMA_READ_WRITE_BUFFER_SIZE);
+		magma_pktqs_transmit_key(socket, peer,
+			request->body.write.offset + done,
+			chunk,
+			request->body.write.buffer + done,
+			flare, &response);
+		done += chunk;
+	} while (done < request->body.write.size);
 	magma_close_client_connection(socket, peer);
 	magma_dispose_flare(flare);
 }
 
-int magma_server_manage_write(GSocket *socket, GSocketAddress *peer, gchar *buffer, magma_flare_request *request)
+/**
+ * Perform a write, answer it and mirror it. Serves WRITE, the
+ * WRITE_LARGE requests once reassembled and WRITE_HANDLE, which
+ * comes with the flare already resolved and its path copied in
+ * the request for the replicas.
+ *
+ * @param flare the flare of a WRITE_HANDLE, NULL otherwise
+ */
+static int magma_server_serve_write(GSocket *socket, GSocketAddress *peer, magma_flare_request *request, magma_flare_t *flare)
 {
 	int server_errno = 0, res = 0;
-	magma_operation_result *result = NULL;
-
-	magma_pktqr_write(buffer, request);
+	magma_operation_result cached, *result = NULL;
 
 	magma_flags flags = 0;
-	if (magma_misplaced_query(request->body.write.path)) {
+	if (!flare && magma_misplaced_query(request->body.write.path)) {
 		magma_raise_flag(flags, MAGMA_FLAG_REFRESH_TOPOLOGY);
 	}
 
@@ -1773,15 +2099,28 @@ int magma_server_manage_write(GSocket *socket, GSocketAddress *peer, gchar *buff
 			request->header.uid,
 			request->header.gid);
 
-		gchar *key = magma_operation_cache_make_key(peer, request->header.transaction_id);
-		result = g_hash_table_lookup(magma_operation_cache, key);
+		magma_operation_key key;
+		magma_operation_cache_make_key(peer, request->header.transaction_id, &key);
+		result = magma_operation_cache_claim(&key, &cached);
 
 		if (result) {
 
-			g_free(key);
 			res = result->res;
 			server_errno = result->err_no;
 
+		} else if (flare) {
+
+			res = magma_write_flare(
+				request->header.uid,
+				request->header.gid,
+				flare,
+				request->body.write.size,
+				request->body.write.offset,
+				request->body.write.buffer);
+
+			server_errno = errno;
+			magma_operation_cache_save_result(&key, res, server_errno);
+
 		} else {
 
 			res = magma_write(
@@ -1794,7 +2133,7 @@ int magma_server_manage_write(GSocket *socket, GSocketAddress *peer, gchar *buff
 				request->body.write.buffer);
 
 			server_errno = errno;
-			magma_operation_cache_save_result(key, res, server_errno);
+			magma_operation_cache_save_result(&key, res, server_errno);
 
 		}
 	}
@@ -1811,7 +2150,7 @@ int magma_server_manage_write(GSocket *socket, GSocketAddress *peer, gchar *buff
 	if (res isNot -1) {
 		/* mirror on redundant node */
 		if (request->header.ttl > MAGMA_TERMINAL_TTL) {
-			magma_volcano *owner = magma_route_path(request->body.write.path);
+			magma_volcano *owner = flare ? magma_route_flare(flare) : magma_route_path(request->body.write.path);
 			magma_volcano *red_owner = magma_get_next_node(owner);
 
 			if (!magma_compare_nodes(red_owner, &myself)) magma_queue_replica(magma_redundant_write, request, red_owner);
@@ -1830,12 +2169,240 @@ int magma_server_manage_write(GSocket *socket, GSocketAddress *peer, gchar *buff
     return (res);
 }
 
+int magma_server_manage_write(GSocket *socket, GSocketAddress *peer, gchar *buffer, magma_flare_request *request)
+{
+	magma_pktqr_write(buffer, request);
+	return (magma_server_serve_write(socket, peer, request, NULL));
+}
+
+int magma_server_manage_write_handle(GSocket *socket, GSocketAddress *peer, gchar *buffer, magma_flare_request *request)
+{
+	magma_pktqr_write_handle(buffer, request);
+
+	magma_flags flags = 0;
+	magma_flare_t *flare = magma_server_resolve_handle(&request->body.write_handle.handle, TRUE, &flags);
+	if (!flare) {
+		dbg(LOG_INFO, DEBUG_PFUSE, "WRITE_HANDLE #%05d: stale handle", request->header.transaction_id);
+		magma_pktas_write(socket, peer, -1, ESTALE, request->header.transaction_id, flags);
+		return (-1);
+	}
+
+	/*
+	 * turn the request into a plain WRITE, so the operation
+	 * cache and the replicas treat it the same way
+	 */
+	magma_request_write_handle_body handle = request->body.write_handle;
+	request->header.type = MAGMA_OP_TYPE_WRITE;
+	request->body.write.offset = handle.offset;
+	request->body.write.size = handle.size;
+	g_strlcpy(request->body.write.path, flare->path, MAGMA_TERMINATED_PATH_LENGTH);
+	request->body.write.buffer = handle.buffer;
+
+	int res = magma_server_serve_write(socket, peer, request, flare);
+
+	magma_dispose_flare(flare);
+	return (res);
+}
+
+/**************************************************************
+ * WRITE_LARGE                                                *
+ **************************************************************/
+int magma_server_manage_write_large(GSocket *socket, GSocketAddress *peer, gchar *buffer, magma_flare_request *request)
+{
+	magma_pktqr_write_large(buffer, request);
+
+	if (!magma_validate_connection(socket, peer, request->body.write_large.path, 'w')) {
+		dbg(LOG_INFO, DEBUG_PFUSE, "WRITE_LARGE denied");
+		magma_pktas_write(socket, peer, -1, ECONNREFUSED, request->header.transaction_id, 0);
+		return (-1);
+	}
+
+	magma_operation_key key;
+	magma_operation_cache_make_key(peer, request->header.transaction_id, &key);
+
+	/*
+	 * the write is over and its answer got lost
+	 */
+	magma_operation_result cached;
+	if (magma_operation_cache_lookup(&key, &cached)) {
+		magma_pktas_write(socket, peer, cached.res, cached.err_no, request->header.transaction_id, 0);
+		return (cached.res);
+	}
+
+	guint16 fragment_size = request->body.write_large.fragment_size;
+	if (!fragment_size || fragment_size > MAGMA_LARGE_IO_FRAGMENT_SIZE) {
+		dbg(LOG_INFO, DEBUG_PFUSE, "WRITE_LARGE with fragments of %u bytes refused", fragment_size);
+		magma_pktas_write(socket, peer, -1, EINVAL, request->header.transaction_id, 0);
+		return (-1);
+	}
+
+	guint32 size = MIN(request->body.write_large.size, MAGMA_LARGE_IO_MAX_FRAGMENTS * (guint32) fragment_size);
+	guint16 fragment = request->body.write_large.fragment;
+	guint32 received[MAGMA_LARGE_IO_BITMAP_WORDS];
+	gchar *write_buffer = NULL;
+
+	g_mutex_lock(&magma_large_writes_mutex);
+
+	magma_large_write *write = g_hash_table_lookup(magma_large_writes, &key);
+	if (!write) {
+		/*
+		 * too many writes or bytes being reassembled: the client
+		 * is told to try again later, on its probe only
+		 */
+		if (g_hash_table_size(magma_large_writes) >= MAGMA_LARGE_IO_MAX_WRITES ||
+			magma_large_writes_held + size > MAGMA_LARGE_IO_MAX_PENDING) {
+			g_mutex_unlock(&magma_large_writes_mutex);
+
+			if (fragment is MAGMA_LARGE_IO_PROBE) {
+				dbg(LOG_WARNING, DEBUG_PFUSE, "WRITE_LARGE #%05d refused: %u writes holding %lu bytes",
+					request->header.transaction_id, g_hash_table_size(magma_large_writes), magma_large_writes_held);
+				magma_pktas_write(socket, peer, -1, EAGAIN, request->header.transaction_id, 0);
+			}
+			return (-1);
+		}
+
+		write = g_new0(magma_large_write, 1);
+		write->buffer = g_malloc(size ? size : 1);
+		magma_large_writes_held += size;
+		write->size = size;
+		write->fragment_size = fragment_size;
+		write->missing = magma_large_io_fragments(size, fragment_size);
+		g_hash_table_insert(magma_large_writes, g_memdup(&key, sizeof(magma_operation_key)), write);
+	}
+	write->last_seen = g_get_monotonic_time();
+
+	if (fragment isNot MAGMA_LARGE_IO_PROBE && write->buffer &&
+		fragment_size is write->fragment_size &&
+		fragment < magma_large_io_fragments(write->size, fragment_size) &&
+		!magma_large_io_bit_is_set(write->received, fragment)) {
+
+		memcpy(write->buffer + fragment * fragment_size, request->body.write_large.buffer,
+			MIN(fragment_size, write->size - fragment * fragment_size));
+		magma_large_io_set_bit(write->received, fragment);
+		write->missing--;
+	}
+
+	/* the last fragment arrived: this thread does the write */
+	if (!write->missing && write->buffer) {
+		write_buffer = write->buffer;
+		write->buffer = NULL;
+	}
+
+	memcpy(received, write->received, sizeof(received));
+	g_mutex_unlock(&magma_large_writes_mutex);
+
+	if (!write_buffer) {
+		if (fragment is MAGMA_LARGE_IO_PROBE)
+			magma_pktas_write_large(socket, peer, received, request->header.transaction_id, 0);
+		return (0);
+	}
+
+	/*
+	 * turn the request into a plain WRITE, so the operation
+	 * cache and the replicas treat it the same way
+	 */
+	magma_request_write_large_body large = request->body.write_large;
+	request->header.type = MAGMA_OP_TYPE_WRITE;
+	request->body.write.offset = large.offset;
+	request->body.write.size = size;
+	g_strlcpy(request->body.write.path, large.path, MAGMA_TERMINATED_PATH_LENGTH);
+	request->body.write.buffer = write_buffer;
+
+	int res = magma_server_serve_write(socket, peer, request, NULL);
+
+	/* from now on the operation cache answers for this write */
+	g_mutex_lock(&magma_large_writes_mutex);
+	g_hash_table_remove(magma_large_writes, &key);
+	magma_large_writes_held -= size;
+	g_mutex_unlock(&magma_large_writes_mutex);
+
+	g_free(write_buffer);
+	return (res);
+}
+
+/**************************************************************
+ * COMPOUND                                                   *
+ **************************************************************/
+/**
+ * Serve the requests of a COMPOUND in order, each one through the
+ * usual callback with its reply captured instead of sent, and send
+ * back all the replies together. The chain stops on the first
+ * failure, on a request which can't be batched and on a reply
+ * which doesn't fit; the client sends again what is left.
+ */
+int magma_server_manage_compound(GSocket *socket, GSocketAddress *peer, gchar *buffer, magma_flare_request *request)
+{
+	magma_pktqr_compound(buffer, request);
+
+	MAGMA_IO_BUFFER(operation);
+	MAGMA_IO_BUFFER(replies);
+
+	gchar *ptr = request->body.compound.operations;
+	gchar *rptr = replies;
+	gsize consumed = 0;
+	int served = 0;
+	guint i = 0;
+
+	for (; i < request->body.compound.count && i < MAGMA_COMPOUND_MAX_OPERATIONS; i++) {
+		guint16 length = 0;
+		ptr = magma_deserialize_16(ptr, &length);
+
+		consumed += sizeof(guint16) + length;
+		if (!length || consumed > MAGMA_COMPOUND_MAX_PAYLOAD) {
+			dbg(LOG_WARNING, DEBUG_ERR, "COMPOUND #%05d: malformed request %u", request->header.transaction_id, i);
+			break;
+		}
+
+		if (!magma_compound_allowed((magma_optype) ptr[0])) {
+			dbg(LOG_WARNING, DEBUG_ERR, "COMPOUND #%05d: operation %u can't be batched", request->header.transaction_id, ptr[0]);
+			break;
+		}
+
+		memcpy(operation, ptr, length);
+		operation[length] = '\0';
+		ptr += length;
+
+		gsize room = MAGMA_COMPOUND_MAX_PAYLOAD - (rptr - replies) - sizeof(guint16);
+
+		magma_capture_begin(socket, rptr + sizeof(guint16), room);
+		magma_manage_udp_flare_protocol(socket, peer, operation);
+		gssize reply = magma_capture_end();
+
+		/*
+		 * a request served without a reply or with one too long
+		 * for the room left ends the chain: the client will send it
+		 * again and the operation cache will answer
+		 */
+		if (reply <= 0 || (gsize) reply > room) break;
+
+		magma_serialize_16(rptr, reply);
+		rptr += sizeof(guint16) + reply;
+		served++;
+
+		if (magma_peek_response_result(rptr - reply, reply) is -1) break;
+	}
+
+	magma_pktas_compound(socket, peer, served, replies, rptr - replies, request->header.transaction_id, 0);
+	return (served);
+}
+
 /**************************************************************
  *                                                            *
  *             FLARE-SYSTEM INTERNAL OPERATIONS               *
  *                                                            *
  **************************************************************/
 
+/**
+ * Tell the peer which protocol version this server speaks
+ */
+int magma_server_manage_negotiate(GSocket *socket, GSocketAddress *peer, gchar *buffer, magma_flare_request *request)
+{
+	magma_pktqr_negotiate(buffer, request);
+	magma_pktas_negotiate(socket, peer, request->body.negotiate.version, request->header.transaction_id,
+		magma_environment.stream ? MAGMA_FLAG_STREAM_TRANSPORT : 0);
+	return (0);
+}
+
 int magma_server_manage_f_opendir(GSocket *socket, GSocketAddress *peer, magma_flare_request *request)
 {
 	int res = 0, server_errno = 0;
@@ -1930,6 +2497,7 @@ void magma_init_flare_callbacks()
 	magma_register_callback(MAGMA_OP_TYPE_READDIR,			magma_server_manage_readdir			);
 #else
 	magma_register_callback(MAGMA_OP_TYPE_READDIR_EXTENDED,	magma_server_manage_readdir_extended);
+	magma_register_callback(MAGMA_OP_TYPE_READDIR_COMPACT,	magma_server_manage_readdir_compact	);
 #endif
 	magma_register_callback(MAGMA_OP_TYPE_MKNOD,			magma_server_manage_mknod			);
 	magma_register_callback(MAGMA_OP_TYPE_MKDIR,			magma_server_manage_mkdir			);
@@ -1945,9 +2513,18 @@ void magma_init_flare_callbacks()
 	magma_register_callback(MAGMA_OP_TYPE_OPEN,				magma_server_manage_open			);
 	magma_register_callback(MAGMA_OP_TYPE_READ,				magma_server_manage_read			);
 	magma_register_callback(MAGMA_OP_TYPE_WRITE,			magma_server_manage_write			);
+	magma_register_callback(MAGMA_OP_TYPE_READ_LARGE,		magma_server_manage_read_large		);
+	magma_register_callback(MAGMA_OP_TYPE_WRITE_LARGE,		magma_server_manage_write_large		);
+	magma_register_callback(MAGMA_OP_TYPE_READ_PMTU,		magma_server_manage_read_large		);
+	magma_register_callback(MAGMA_OP_TYPE_WRITE_PMTU,		magma_server_manage_write_large		);
+	magma_register_callback(MAGMA_OP_TYPE_OPEN_HANDLE,		magma_server_manage_open			);
+	magma_register_callback(MAGMA_OP_TYPE_READ_HANDLE,		magma_server_manage_read_handle		);
+	magma_register_callback(MAGMA_OP_TYPE_WRITE_HANDLE,		magma_server_manage_write_handle	);
 	magma_register_callback(MAGMA_OP_TYPE_STATFS,			magma_server_manage_statfs			);
 
 	magma_register_callback(MAGMA_OP_TYPE_F_OPENDIR,		magma_server_manage_f_opendir		);
+	magma_register_callback(MAGMA_OP_TYPE_NEGOTIATE,		magma_server_manage_negotiate		);
+	magma_register_callback(MAGMA_OP_TYPE_COMPOUND,			magma_server_manage_compound		);
 }
 
 /**
@@ -1962,10 +2539,9 @@ void magma_manage_udp_flare_protocol_pool(magma_incoming_request *incoming, gpoi
 	magma_manage_udp_flare_protocol(incoming->socket, incoming->peer, incoming->buffer);
 
 	/*
-	 * unref GLib objects to allow their disposal
+	 * unref GLib objects and return the request to its free list
 	 */
-	g_object_unref(incoming->peer);
-	g_free(incoming);
+	magma_dispose_incoming_request(incoming);
 }
 
 /**
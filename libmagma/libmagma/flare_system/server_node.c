@@ -45,49 +45,27 @@ void magma_update_myself_from_lava(magma_lava *lava) {
 }
 
 /**
- * Send a whole key (all its content) to a remote node described by peer.
+ * Send the content of a flare to a remote node described by peer.
  *
  * @param socket the socket to transmit the data
  * @param peer the remote node
- * @param key_path the path of the flare
+ * @param path the path of the flare
  */
-void magma_node_transmit_key(GSocket *socket, GSocketAddress *peer, const gchar *flare_key)
+void magma_node_transmit_flare(GSocket *socket, GSocketAddress *peer, const gchar *path)
 {
-	/*
-	 * Retrieve flare data from SQL
-	 */
-	gchar *query = g_strdup_printf("select path from flare_%s where hash = '%s'",
-		myself.node_name, flare_key);
-
-	dbi_result result = magma_sql_query(query);
-	g_free(query);
-
-	gchar *path = NULL;
-	if (result && dbi_result_next_row(result)) {
-		path = magma_sql_fetch_string(result, 1);
-	}
-
-	if (!path) {
-		dbg(LOG_ERR, DEBUG_PNODE, "Unable to fetch path while transmitting key %s", flare_key);
-		return;
-	}
-
-	dbg(LOG_INFO, DEBUG_PNODE, "Sending key %s (%s)", flare_key, path);
+	dbg(LOG_INFO, DEBUG_PNODE, "Sending flare %s", path);
 
 	/*
 	 * build the flare object
 	 */
 	magma_flare_t *flare = magma_search_or_create(path);
 	if (!flare) {
-		dbg(LOG_ERR, DEBUG_PNODE, "Unable to fetch flare while transmitting key %s (%s)", flare_key, path);
-		free(path);
+		dbg(LOG_ERR, DEBUG_PNODE, "Unable to fetch flare while transmitting %s", path);
 		return;
 	}
 
-	free(path);
-
 	int fd = open(flare->contents, O_RDONLY);
-	if (!fd) {
+	if (fd is -1) {
 		dbg(LOG_ERR, DEBUG_PNODE, "Unable to open %s: %s", flare->contents, strerror(errno));
 		magma_dispose_flare(flare);
 		return;
@@ -108,12 +86,24 @@ void magma_node_transmit_key(GSocket *socket, GSocketAddress *peer, const gchar
 			magma_node_response response;
 			response.header.res = -1;
 
-			while (response.header.res is -1) {
+			/*
+			 * each attempt waits for room in the congestion window
+			 * of the node; a chunk still refused after MAGMA_RETRY_LIMIT
+			 * attempts ends the transmission of this flare instead of
+			 * being sent again forever
+			 */
+			int attempts = 0;
+			while (response.header.res is -1 && attempts++ < MAGMA_RETRY_LIMIT) {
 				dbg(LOG_INFO, DEBUG_PNODE, "Sending key %s @%lu:%ld", flare->path, offset, size);
 				magma_pktqs_transmit_key(socket, peer, offset, size, buffer, flare, &response);
 				dbg(LOG_INFO, DEBUG_PNODE, "Key %s offset moved to %lu",
 					flare->path, response.body.send_key.offset);
 			}
+
+			if (response.header.res is -1) {
+				dbg(LOG_ERR, DEBUG_PNODE, "Giving up sending key %s @%lu", flare->path, offset);
+				break;
+			}
 		}
 	}
 	magma_flare_read_unlock(flare);
@@ -123,41 +113,172 @@ void magma_node_transmit_key(GSocket *socket, GSocketAddress *peer, const gchar
 }
 
 /**
- * Transmit this node entire key-space to a remote node.
- * This is usually done after a new node joins the DHT and
- * needs all the keys of its peer to become its redundant
- * node.
+ * Send a whole key (all its content) to a remote node described by peer.
  *
- * @param socket an network socket
- * @param peer the remote peer
+ * @param socket the socket to transmit the data
+ * @param peer the remote node
+ * @param key_path the path of the flare
  */
-void magma_node_transmit_keyspace_to_node(magma_volcano *node) {
+void magma_node_transmit_key(GSocket *socket, GSocketAddress *peer, const gchar *flare_key)
+{
 	/*
-	 * duplicate all the keys to the joining node to let
-	 * it act as redundant node of this node
+	 * Retrieve flare data from SQL
 	 */
-	GError *error = NULL;
-	GDir *dir = g_dir_open(magma_environment.hashpath, 0, &error);
+	gchar *query = g_strdup_printf("select path from flare_%s where hash = '%s'",
+		myself.node_name, flare_key);
+
+	dbi_result result = magma_sql_query(query);
+	g_free(query);
+
+	gchar *path = NULL;
+	if (result && dbi_result_next_row(result)) {
+		path = magma_sql_fetch_string(result, 1);
+	}
 
-	if (!dir) {
-		dbg(LOG_ERR, DEBUG_ERR, "Error opening %s dir", magma_environment.hashpath);
+	if (!path) {
+		dbg(LOG_ERR, DEBUG_PNODE, "Unable to fetch path while transmitting key %s", flare_key);
 		return;
 	}
 
+	dbg(LOG_INFO, DEBUG_PNODE, "Sending key %s (%s)", flare_key, path);
+
+	magma_node_transmit_flare(socket, peer, path);
+	free(path);
+}
+
+/**
+ * Transmit a page of flare records to a remote node.
+ *
+ * @param socket the socket to transmit the data
+ * @param peer the remote node
+ * @param rows the flare records
+ * @param count the number of records
+ * @return TRUE if all the records have been saved by the remote node
+ */
+static gboolean magma_node_transmit_metadata(GSocket *socket, GSocketAddress *peer, magma_flare_metadata *rows, guint16 count)
+{
+	guint16 sent = 0;
+	while (sent < count) {
+		magma_node_response response;
+		magma_pktqs_transmit_metadata(socket, peer, rows + sent, count - sent, &response);
+
+		if (response.header.status isNot G_IO_STATUS_NORMAL || response.header.res is -1 || !response.body.transmit_metadata.count) {
+			dbg(LOG_ERR, DEBUG_PNODE, "Remote node refused %u flare records", count - sent);
+			return (FALSE);
+		}
+
+		sent += response.body.transmit_metadata.count;
+	}
+
+	return (TRUE);
+}
+
+/**
+ * Transmit this node entire key-space to a remote node.
+ * This is usually done after a new node joins the DHT and
+ * needs all the keys of its peer to become its redundant
+ * node.
+ *
+ * The flare table is paged by hash. For each page, the flare
+ * records are streamed first, many per packet, and saved by
+ * the remote node in bulk. Then the contents of each flare
+ * of the page follow.
+ *
+ * @param node the remote node
+ */
+void magma_node_transmit_keyspace_to_node(magma_volcano *node) {
 	GSocketAddress *peer = NULL;
 	GSocket *socket = magma_open_client_connection(node->ip_addr, MAGMA_NODE_PORT, &peer);
 
+	magma_flare_metadata *rows = g_new0(magma_flare_metadata, MAGMA_METADATA_PAGE_SIZE);
+	gchar last_hash[SHA_READABLE_DIGEST_LENGTH] = "";
+	guint64 total = 0;
+
 	while (1) {
+		guint16 count = magma_flare_sql_load_page(last_hash, rows, MAGMA_METADATA_PAGE_SIZE);
+		if (!count) break;
+
+		/*
+		 * the contents file mode is not saved in SQL
+		 */
+		guint16 i = 0;
+		for (; i < count; i++) {
+			struct stat st;
+			gchar *contents = magma_xlate_path(rows[i].path);
+			rows[i].mode = (lstat(contents, &st) is 0) ? st.st_mode : 0;
+			g_free(contents);
+		}
+
+		/*
+		 * if the remote node fails to save the records, it
+		 * will still create the flares when their contents
+		 * are received, one by one
+		 */
+		magma_node_transmit_metadata(socket, peer, rows, count);
+
+		for (i = 0; i < count; i++) {
+			magma_node_transmit_flare(socket, peer, rows[i].path);
+		}
+
+		total += count;
+		g_strlcpy(last_hash, rows[count - 1].hash, SHA_READABLE_DIGEST_LENGTH);
+		if (count < MAGMA_METADATA_PAGE_SIZE) break;
+	}
+
+	dbg(LOG_INFO, DEBUG_PNODE, "%lu keys transmitted to %s", total, node->node_name);
+
+	g_free(rows);
+	magma_close_client_connection(socket, peer);
+}
+
+/**
+ * Receive a batch of flare records from its owner. Records are
+ * saved with one SQL statement and contents files are created
+ * empty, to be filled by the following TRANSMIT_KEY requests.
+ *
+ * @param socket the receiving socket
+ * @param peer the transmitting node
+ * @param buffer a buffer for the packet coming from the wire
+ * @param request the incoming request described
+ */
+void magma_node_receive_metadata(GSocket *socket, GSocketAddress *peer, gchar *buffer, magma_node_request *request)
+{
+	magma_pktqr_transmit_metadata(buffer, request);
+
+	guint16 count = request->body.transmit_metadata.count;
+	dbg(LOG_INFO, DEBUG_PNODE, "Receiving %u flare records", count);
+
+	magma_flare_metadata *rows = g_new0(magma_flare_metadata, count ? count : 1);
+	gchar *ptr = request->body.transmit_metadata.rows;
+
+	guint16 i = 0;
+	for (; i < count; i++) {
+		ptr = magma_deserialize_flare_metadata(ptr, &rows[i]);
+
 		/*
-		 * read another key entry from local storage directory
+		 * create the contents file, if missing
 		 */
-		const gchar *key = g_dir_read_name(dir);
-		if (!key) break;
-		if (strcmp(key, "store.sql") is 0) continue;
-		magma_node_transmit_key(socket, peer, key);
+		gchar *contents = magma_xlate_path(rows[i].path);
+		if (access(contents, F_OK) isNot 0) {
+			if (rows[i].type is MAGMA_FLARE_TYPE_BLOCK || rows[i].type is MAGMA_FLARE_TYPE_CHAR || rows[i].type is MAGMA_FLARE_TYPE_FIFO) {
+				mknod(contents, rows[i].mode, 0);
+			} else {
+				int fd = open(contents, O_WRONLY|O_CREAT, S_IRUSR|S_IWUSR);
+				if (fd isNot -1) close(fd);
+				chmod(contents, rows[i].mode & ~S_IFMT);
+			}
+		}
+		g_free(contents);
 	}
 
-	g_dir_close(dir);
+	if (magma_flare_sql_save_batch(rows, count)) {
+		magma_pktas_transmit_metadata(socket, peer, 0, count, request->header.transaction_id, 0);
+	} else {
+		dbg(LOG_ERR, DEBUG_PNODE, "Error saving %u flare records", count);
+		magma_pktas_transmit_metadata(socket, peer, -1, 0, request->header.transaction_id, 0);
+	}
+
+	g_free(rows);
 }
 
 /**
@@ -190,6 +311,13 @@ int magma_node_receive_key(GSocket *socket, GSocketAddress *peer, gchar *buffer,
 
 	magma_flare_write_lock(flare);
 
+	/* a flare already described by a TRANSMIT_METADATA batch is on disk and in SQL */
+	gboolean known = magma_check_flare(flare) && flare->commit_time;
+	gboolean changed =
+		flare->st.st_mode isNot request->body.send_key.mode ||
+		flare->st.st_uid  isNot request->body.send_key.uid  ||
+		flare->st.st_gid  isNot request->body.send_key.gid;
+
 	flare->st.st_mode = request->body.send_key.mode;
 	flare->st.st_uid  = request->body.send_key.uid;
 	flare->st.st_gid  = request->body.send_key.gid;
@@ -223,8 +351,16 @@ int magma_node_receive_key(GSocket *socket, GSocketAddress *peer, gchar *buffer,
 #endif
 	}
 
-	magma_save_flare(flare, request->body.send_key.offset ? FALSE : TRUE);
-	magma_load_flare(flare);
+	/*
+	 * the received mode, uid and gid are always recorded, since
+	 * chmod, chown and journal replays travel this way; a flare
+	 * already described by a TRANSMIT_METADATA batch is only
+	 * saved again if they differ from what is stored
+	 */
+	if (!known || changed) {
+		magma_save_flare(flare, (changed || !request->body.send_key.offset) ? TRUE : FALSE);
+		magma_load_flare(flare);
+	}
 
 	/*
 	 * Saving flare contents
@@ -701,6 +837,17 @@ void magma_node_manage_heartbeat(GSocket *socket, GSocketAddress *peer, gchar *b
 	return;
 }
 
+/**
+ * manage a protocol version negotiation
+ */
+void magma_node_manage_negotiate(GSocket *socket, GSocketAddress *peer, gchar *buffer, magma_node_request *request)
+{
+	magma_flare_request negotiate;
+	magma_pktqr_negotiate(buffer, &negotiate);
+	magma_pktas_negotiate(socket, peer, negotiate.body.negotiate.version, request->header.transaction_id,
+		magma_environment.stream ? MAGMA_FLAG_STREAM_TRANSPORT : 0);
+}
+
 /**
  * manage a shutdown request
  */
@@ -748,6 +895,281 @@ void magma_node_manage_network_built(GSocket *socket, GSocketAddress *peer, gcha
 	return;
 }
 
+/**
+ * The state of a journal replay toward a redundant node
+ */
+typedef struct {
+	magma_volcano *node;	/* the node receiving the replay (a clone) */
+	guint64 since;			/* last sequence already owned by the node */
+	guint64 until;			/* last sequence to be replayed */
+	guint64 applied;		/* last sequence acknowledged by the node */
+	guint64 reported;		/* last sequence sent as a JOURNAL_CHECKPOINT */
+	GSocket *socket;		/* node protocol socket */
+	GSocketAddress *peer;	/* node protocol address */
+} magma_journal_replay_state;
+
+/**
+ * Send the content of a written range of a flare
+ *
+ * @param state the replay state
+ * @param flare the flare
+ * @param offset where the write started
+ * @param size how many bytes were written
+ * @return TRUE if the node acknowledged every chunk, FALSE otherwise
+ */
+static gboolean magma_node_replay_write(magma_journal_replay_state *state, magma_flare_t *flare, off_t offset, size_t size)
+{
+	int fd = open(flare->contents, O_RDONLY);
+	if (fd is -1) {
+		dbg(LOG_ERR, DEBUG_PNODE, "Unable to open %s: %s", flare->contents, strerror(errno));
+		return (FALSE);
+	}
+
+	gboolean applied = TRUE;
+
+	magma_flare_read_lock(flare);
+	magma_flare_update_stat(flare);
+
+	off_t stop = offset + size;
+	if (stop > flare->st.st_size) stop = flare->st.st_size;
+
+	while (offset < stop) {
+		gchar buffer[32 * 1024];
+		size_t chunk = (stop - offset > 32 * 1024) ? 32 * 1024 : stop - offset;
+
+		ssize_t got = pread(fd, buffer, chunk, offset);
+		if (got <= 0) break;
+
+		magma_node_response response;
+		magma_pktqs_transmit_key(state->socket, state->peer, offset, got, buffer, flare, &response);
+		if (response.header.status isNot G_IO_STATUS_NORMAL || response.header.res is -1) {
+			applied = FALSE;
+			break;
+		}
+		offset += got;
+	}
+
+	magma_flare_read_unlock(flare);
+	close(fd);
+	return (applied);
+}
+
+/**
+ * Tell the node receiving the replay the last sequence it
+ * acknowledged, so it restarts from there on the next catch up
+ *
+ * @param state the replay state
+ */
+static void magma_node_replay_checkpoint(magma_journal_replay_state *state)
+{
+	if (state->applied <= state->reported) return;
+
+	magma_node_response response;
+	magma_pktqs_journal_checkpoint(state->socket, state->peer, myself.node_name, state->applied, &response);
+
+	if (response.header.status is G_IO_STATUS_NORMAL && response.header.res isNot -1) {
+		state->reported = state->applied;
+	}
+}
+
+/**
+ * Replay a single journal entry to a redundant node.
+ * Removals and truncations are replayed with the flare protocol
+ * and a terminal TTL, everything else is replayed by sending the
+ * current state of the flare with TRANSMIT_KEY. Since the current
+ * state is sent, replaying an entry already received is harmless.
+ * Every MAGMA_JOURNAL_BATCH_SIZE entries the node is told how far
+ * the replay has been applied.
+ *
+ * @param entry the journal entry
+ * @param user_data the magma_journal_replay_state
+ * @return TRUE if the node acknowledged the entry, FALSE to stop the replay
+ */
+static gboolean magma_node_replay_journal_entry(magma_journal_entry *entry, gpointer user_data)
+{
+	magma_journal_replay_state *state = (magma_journal_replay_state *) user_data;
+	magma_flare_response flare_response;
+	gboolean applied = TRUE;
+
+	dbg(LOG_INFO, DEBUG_PNODE, "Replaying %s(%s) #%lu to %s",
+		magma_explain_optype(entry->optype), entry->path, entry->sequence, state->node->node_name);
+
+	if (entry->optype is MAGMA_OP_TYPE_UNLINK || entry->optype is MAGMA_OP_TYPE_RMDIR || entry->optype is MAGMA_OP_TYPE_TRUNCATE) {
+		GSocketAddress *peer;
+		GSocket *socket = magma_open_client_connection(state->node->ip_addr, state->node->port, &peer);
+
+		if (entry->optype is MAGMA_OP_TYPE_UNLINK) {
+			magma_pktqs_unlink(socket, peer, MAGMA_TERMINAL_TTL, 0, 0, entry->path, &flare_response);
+		} else if (entry->optype is MAGMA_OP_TYPE_RMDIR) {
+			magma_pktqs_rmdir(socket, peer, MAGMA_TERMINAL_TTL, 0, 0, entry->path, &flare_response);
+		} else {
+			magma_pktqs_truncate(socket, peer, MAGMA_TERMINAL_TTL, 0, 0, entry->path, entry->write_offset, &flare_response);
+		}
+
+		magma_close_client_connection(socket, peer);
+
+		/* a removal answered with an error has been applied already */
+		applied = (flare_response.header.status is G_IO_STATUS_NORMAL);
+	} else {
+		magma_flare_t *flare = magma_search_or_create(entry->path);
+		if (!flare) {
+			dbg(LOG_ERR, DEBUG_PNODE, "Unable to replay %s: flare not found", entry->path);
+			return (FALSE);
+		}
+
+		/* the flare has been removed later on, a following entry will replay that */
+		if (flare->type) {
+			magma_node_response response;
+
+			if (entry->optype is MAGMA_OP_TYPE_SYMLINK && entry->to_path) {
+				magma_pktqs_transmit_key(state->socket, state->peer, 0, strlen(entry->to_path), entry->to_path, flare, &response);
+				applied = (response.header.status is G_IO_STATUS_NORMAL && response.header.res isNot -1);
+			} else if (entry->optype is MAGMA_OP_TYPE_WRITE) {
+				applied = magma_node_replay_write(state, flare, entry->write_offset, entry->write_size);
+			} else {
+				magma_pktqs_transmit_key(state->socket, state->peer, 0, 0, NULL, flare, &response);
+				applied = (response.header.status is G_IO_STATUS_NORMAL && response.header.res isNot -1);
+			}
+		}
+
+		magma_dispose_flare(flare);
+	}
+
+	if (!applied) {
+		dbg(LOG_ERR, DEBUG_PNODE, "%s did not acknowledge #%lu, replay stopped", state->node->node_name, entry->sequence);
+		return (FALSE);
+	}
+
+	state->applied = entry->sequence;
+	if (state->applied - state->reported >= MAGMA_JOURNAL_BATCH_SIZE) magma_node_replay_checkpoint(state);
+
+	return (TRUE);
+}
+
+/**
+ * Thread body replaying the journal to a redundant node.
+ * If the journal no longer holds the entries the node is missing,
+ * the whole key-space is transmitted instead. Key-space transfers
+ * are not acknowledged, so no checkpoint is sent for them and the
+ * node will ask again on its next catch up.
+ *
+ * @param data the magma_journal_replay_state
+ */
+static gpointer magma_node_replay_journal_to_node(gpointer data)
+{
+	magma_journal_replay_state *state = (magma_journal_replay_state *) data;
+
+	if (state->since + 1 < magma_journal_first_sequence()) {
+		dbg(LOG_INFO, DEBUG_PNODE, "Journal trimmed past #%lu: sending whole key-space to %s",
+			state->since, state->node->node_name);
+		magma_node_transmit_keyspace_to_node(state->node);
+	} else {
+		state->socket = magma_open_client_connection(state->node->ip_addr, MAGMA_NODE_PORT, &state->peer);
+		state->applied = state->reported = state->since;
+		guint64 last = magma_journal_replay(state->since, state->until, magma_node_replay_journal_entry, state);
+		magma_node_replay_checkpoint(state);
+		magma_close_client_connection(state->socket, state->peer);
+
+		dbg(LOG_INFO, DEBUG_PNODE, "Journal replayed to %s up to #%lu", state->node->node_name, last);
+	}
+
+	g_free(state->node);
+	g_free(state);
+	return (NULL);
+}
+
+/**
+ * manage a replay journal request coming from the redundant node
+ */
+void magma_node_manage_replay_journal(GSocket *socket, GSocketAddress *peer, gchar *buffer, magma_node_request *request)
+{
+	magma_pktqr_replay_journal(buffer, request);
+
+	/* look for the requesting node inside the lava ring */
+	magma_volcano *node = lava ? lava->first_node : NULL;
+	while (node && strcmp(node->node_name, request->body.replay_journal.node_name) isNot 0) {
+		node = node->next;
+		if (!node || node is lava->first_node) {
+			node = NULL;
+			break;
+		}
+	}
+
+	if (!node) {
+		dbg(LOG_ERR, DEBUG_PNODE, "Replay journal requested by unknown node %s", request->body.replay_journal.node_name);
+		magma_pktas_replay_journal(socket, peer, -1, 0, request->header.transaction_id, 0);
+		return;
+	}
+
+	guint64 until = magma_journal_flush();
+	magma_pktas_replay_journal(socket, peer, 0, until, request->header.transaction_id, 0);
+
+	if (until <= request->body.replay_journal.since) {
+		dbg(LOG_INFO, DEBUG_PNODE, "Node %s is already up to date", node->node_name);
+		return;
+	}
+
+	magma_journal_replay_state *state = g_new0(magma_journal_replay_state, 1);
+	state->node = magma_volcano_clone(node);
+	state->since = request->body.replay_journal.since;
+	state->until = until;
+
+	GThread *thread = g_thread_new("Journal replay", magma_node_replay_journal_to_node, state);
+	g_thread_unref(thread);
+}
+
+/**
+ * Ask the node this node is redundant for to replay the operations
+ * recorded in its journal since the last checkpoint. Called after
+ * a restart to catch up with the changes missed while down.
+ */
+void magma_journal_catch_up()
+{
+	magma_volcano *me = magma_get_myself_from_lava(lava);
+	if (!me) return;
+
+	magma_volcano *owner = magma_get_previous_node(me);
+	if (!owner || magma_compare_nodes(owner, &myself)) return;
+
+	guint64 since = magma_journal_load_checkpoint(owner->node_name);
+
+	dbg(LOG_INFO, DEBUG_PNODE, "Asking %s to replay its journal since #%lu", owner->node_name, since);
+
+	magma_node_response response;
+	GSocketAddress *peer;
+	GSocket *socket = magma_open_client_connection(owner->ip_addr, MAGMA_NODE_PORT, &peer);
+	magma_pktqs_replay_journal(socket, peer, myself.node_name, since, &response);
+	magma_close_client_connection(socket, peer);
+
+	if (response.header.status isNot G_IO_STATUS_NORMAL || response.header.res is -1) {
+		dbg(LOG_ERR, DEBUG_PNODE, "Node %s refused to replay its journal", owner->node_name);
+		return;
+	}
+
+	/* the checkpoint advances with the JOURNAL_CHECKPOINT requests sent by the owner */
+	dbg(LOG_INFO, DEBUG_PNODE, "Node %s will replay its journal up to #%lu",
+		owner->node_name, response.body.replay_journal.sequence);
+}
+
+/**
+ * manage a journal checkpoint coming from the node replaying its
+ * journal: the entries up to the checkpoint have been applied here
+ */
+void magma_node_manage_journal_checkpoint(GSocket *socket, GSocketAddress *peer, gchar *buffer, magma_node_request *request)
+{
+	magma_pktqr_journal_checkpoint(buffer, request);
+
+	const gchar *node_name = request->body.journal_checkpoint.node_name;
+	guint64 sequence = request->body.journal_checkpoint.sequence;
+
+	if (sequence > magma_journal_load_checkpoint(node_name)) {
+		magma_journal_save_checkpoint(node_name, sequence);
+		dbg(LOG_INFO, DEBUG_PNODE, "Journal of %s applied up to #%lu", node_name, sequence);
+	}
+
+	magma_pktas_journal_checkpoint(socket, peer, 0, request->header.transaction_id, 0);
+}
+
 /*
  * The prototype of the node callback used to answer
  * to node requests
@@ -782,9 +1204,13 @@ void magma_init_node_callbacks()
 	magma_register_callback(MAGMA_OP_TYPE_TRANSMIT_TOPOLOGY,		magma_node_transmit_topology   				);
 	magma_register_callback(MAGMA_OP_TYPE_NETWORK_BUILT,			magma_node_manage_network_built 			);
 	magma_register_callback(MAGMA_OP_TYPE_HEARTBEAT,				magma_node_manage_heartbeat					);
+	magma_register_callback(MAGMA_OP_TYPE_NEGOTIATE,				magma_node_manage_negotiate					);
 	magma_register_callback(MAGMA_OP_TYPE_ADD_FLARE_TO_PARENT,		magma_node_manage_add_flare_to_parent		);
 	magma_register_callback(MAGMA_OP_TYPE_REMOVE_FLARE_FROM_PARENT,	magma_node_manage_remove_flare_from_parent	);
 	magma_register_callback(MAGMA_OP_TYPE_SHUTDOWN,					magma_node_manage_shutdown					);
+	magma_register_callback(MAGMA_OP_TYPE_REPLAY_JOURNAL,			magma_node_manage_replay_journal			);
+	magma_register_callback(MAGMA_OP_TYPE_TRANSMIT_METADATA,		magma_node_receive_metadata					);
+	magma_register_callback(MAGMA_OP_TYPE_JOURNAL_CHECKPOINT,		magma_node_manage_journal_checkpoint		);
 }
 
 /**
@@ -844,10 +1270,9 @@ void magma_manage_udp_node_protocol_pool(magma_incoming_request *incoming, gpoin
 	magma_manage_udp_node_protocol(incoming->socket, incoming->peer, incoming->buffer);
 
 	/*
-	 * unref GLib objects to allow their disposal
+	 * unref GLib objects and return the request to its free list
 	 */
-	g_object_unref(incoming->peer);
-	g_free(incoming);
+	magma_dispose_incoming_request(incoming);
 }
 
 // vim:ts=4:nocindent:autoindent
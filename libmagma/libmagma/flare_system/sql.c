@@ -76,9 +76,99 @@ dbi_result magma_sql_query_on_connection(gchar *query, dbi_conn dbi, GMutex *mut
 }
 #endif
 
+/**
+ * SQL statistics, one slot for each kind of statement.
+ * Updated and read while holding magma_sql_mutex.
+ */
+static magma_sql_stats magma_sql_statistics[MAGMA_SQL_KINDS];
+
+/** statements lasting longer than this (in microseconds) are logged, 0 disables */
+gint64 magma_sql_slow_threshold = MAGMA_SQL_SLOW_THRESHOLD;
+
+static const gchar *magma_sql_kind_names[MAGMA_SQL_KINDS] = {
+	"select", "insert", "update", "delete", "other"
+};
+
+const gchar *magma_sql_kind_name(magma_sql_kind kind)
+{
+	return (kind < MAGMA_SQL_KINDS) ? magma_sql_kind_names[kind] : "unknown";
+}
+
+/**
+ * Guess the kind of a statement from its first word
+ */
+static magma_sql_kind magma_sql_classify(const gchar *query)
+{
+	while (*query && g_ascii_isspace(*query)) query++;
+
+	if (g_ascii_strncasecmp(query, "select", 6) is 0) return (MAGMA_SQL_SELECT);
+	if (g_ascii_strncasecmp(query, "insert", 6) is 0) return (MAGMA_SQL_INSERT);
+	if (g_ascii_strncasecmp(query, "update", 6) is 0) return (MAGMA_SQL_UPDATE);
+	if (g_ascii_strncasecmp(query, "delete", 6) is 0) return (MAGMA_SQL_DELETE);
+	return (MAGMA_SQL_OTHER);
+}
+
+/**
+ * Account a statement in the SQL statistics and log it
+ * if slow. Must be called holding magma_sql_mutex.
+ *
+ * @param query the statement
+ * @param wait microseconds spent waiting for magma_sql_mutex
+ * @param exec microseconds spent executing the statement
+ * @param failed TRUE if the statement failed
+ */
+static void magma_sql_account(const gchar *query, gint64 wait, gint64 exec, gboolean failed)
+{
+	magma_sql_stats *stats = &magma_sql_statistics[magma_sql_classify(query)];
+
+	stats->count++;
+	if (failed) stats->errors++;
+
+	stats->wait_time += wait;
+	stats->exec_time += exec;
+	if (wait > stats->max_wait) stats->max_wait = wait;
+	if (exec > stats->max_exec) stats->max_exec = exec;
+
+	/* bucket N counts statements executed in [2^N, 2^(N+1)) microseconds */
+	int bucket = 0;
+	while (exec > 1 && bucket < MAGMA_SQL_HISTOGRAM_BUCKETS - 1) {
+		exec >>= 1;
+		bucket++;
+	}
+	stats->histogram[bucket]++;
+
+	if (magma_sql_slow_threshold && wait + exec >= magma_sql_slow_threshold) {
+		dbg(LOG_WARNING, DEBUG_ERR, "Slow SQL statement (%ldus waiting, %ldus executing): %s", wait, exec, query);
+	}
+}
+
+/**
+ * Copy the SQL statistics
+ *
+ * @param stats an array of MAGMA_SQL_KINDS structs to be filled
+ */
+void magma_sql_get_stats(magma_sql_stats *stats)
+{
+	g_mutex_lock(&magma_sql_mutex);
+	memcpy(stats, magma_sql_statistics, sizeof(magma_sql_statistics));
+	g_mutex_unlock(&magma_sql_mutex);
+}
+
+/**
+ * Reset the SQL statistics
+ */
+void magma_sql_reset_stats()
+{
+	g_mutex_lock(&magma_sql_mutex);
+	memset(magma_sql_statistics, 0, sizeof(magma_sql_statistics));
+	g_mutex_unlock(&magma_sql_mutex);
+}
+
 dbi_result magma_sql_query(gchar *query)
 {
+	gint64 requested = g_get_monotonic_time();
 	g_mutex_lock(&magma_sql_mutex);
+	gint64 acquired = g_get_monotonic_time();
 	const char *error_message;
 
 	if (!dbi_conn_ping(dbi) && dbi_conn_connect(dbi) < 0) {
@@ -90,20 +180,48 @@ dbi_result magma_sql_query(gchar *query)
 	dbg(LOG_INFO, DEBUG_SQL, "SQL statement: %s", query);
 
 	dbi_result result = dbi_conn_query(dbi, query);
+	gint64 executed = g_get_monotonic_time();
 
     if (!result) {
     	dbi_conn_error(dbi, &error_message);
     	dbg(LOG_ERR, DEBUG_SQL, "Error running query: %s", error_message);
     }
 
+    magma_sql_account(query, acquired - requested, executed - acquired, result ? FALSE : TRUE);
+
     g_mutex_unlock(&magma_sql_mutex);
     return (result);
 }
 
+/**
+ * Quote a string to be used as a literal in an SQL statement
+ *
+ * @param string the string to be quoted
+ * @return the quoted string, surrounding quotes included, to be freed with g_free()
+ */
+gchar *magma_sql_quote(const gchar *string)
+{
+	char *quoted = NULL;
+
+	g_mutex_lock(&magma_sql_mutex);
+	size_t length = dbi_conn_quote_string_copy(dbi, string ? string : "", &quoted);
+	g_mutex_unlock(&magma_sql_mutex);
+
+	if (!length || !quoted) {
+		free(quoted);
+		return (NULL);
+	}
+
+	gchar *copy = g_strdup(quoted);
+	free(quoted);
+	return (copy);
+}
+
 void magma_init_sql()
 {
     dbi = magma_sql_connect();
     gchar *stmt;
+    dbi_result result;
 
     /*
      * create lava table
@@ -122,7 +240,9 @@ void magma_init_sql()
     	")",
     	magma_environment.nickname);
 
-    if (!magma_sql_query(stmt)) exit (1);
+    result = magma_sql_query(stmt);
+    if (!result) exit (1);
+    dbi_result_free(result);
     g_free(stmt);
 
     /*
@@ -140,7 +260,22 @@ void magma_init_sql()
     	")",
     	magma_environment.nickname);
 
-    if (!magma_sql_query(stmt)) exit (1);
+    result = magma_sql_query(stmt);
+    if (!result) exit (1);
+    dbi_result_free(result);
+    g_free(stmt);
+
+    /*
+     * index the flare table by hash, to page through
+     * it when the key-space is transmitted to another node
+     */
+    stmt = g_strdup_printf(
+    	"create index if not exists flare_%s_hash on flare_%s (hash)",
+    	magma_environment.nickname, magma_environment.nickname);
+
+    result = magma_sql_query(stmt);
+    if (!result) exit (1);
+    dbi_result_free(result);
     g_free(stmt);
 
     /*
@@ -163,7 +298,9 @@ void magma_init_sql()
     	")",
     	magma_environment.nickname);
 
-    if (!magma_sql_query(stmt)) exit (1);
+    result = magma_sql_query(stmt);
+    if (!result) exit (1);
+    dbi_result_free(result);
     g_free(stmt);
 
     dbg(LOG_INFO, DEBUG_SQL, "SQL layer initialized");
@@ -218,6 +355,32 @@ guint32 magma_sql_fetch_integer(dbi_result result, int index)
     return (i);
 }
 
+/**
+ * Like magma_sql_fetch_integer() but returns the full 64 bits
+ * of the field, as needed by sequence numbers and offsets
+ */
+guint64 magma_sql_fetch_integer64(dbi_result result, int index)
+{
+	guint64 i = 0;
+
+    unsigned int type = dbi_result_get_field_type_idx(result, index);
+
+    if (type == DBI_TYPE_INTEGER) {
+        unsigned int size = dbi_result_get_field_attribs_idx(result, index) & DBI_INTEGER_SIZEMASK;
+
+        if (size == DBI_INTEGER_SIZE8) {
+            i = dbi_result_get_ulonglong_idx(result, index);
+        } else {
+            i = magma_sql_fetch_integer(result, index);
+        }
+    } else if (type == DBI_TYPE_STRING) {
+        const gchar *int_string = dbi_result_get_string_idx(result, index);
+        if (int_string) i = g_ascii_strtoull(int_string, NULL, 10);
+    }
+
+    return (i);
+}
+
 gchar *magma_sql_fetch_string(dbi_result result, int index)
 {
     gchar *result_string = dbi_result_get_string_copy_idx(result, index);
@@ -309,6 +472,123 @@ void magma_flare_sql_load(magma_flare_t *flare)
 	g_free(query);
 }
 
+/**
+ * Load a page of flare records, ordered by hash
+ *
+ * @param after_hash only records with hash greater than this are loaded ("" to start)
+ * @param rows an array of at least max_rows records to be filled
+ * @param max_rows the page size
+ * @return the number of records loaded
+ */
+guint16 magma_flare_sql_load_page(const gchar *after_hash, magma_flare_metadata *rows, guint16 max_rows)
+{
+	gchar *after = magma_sql_quote(after_hash);
+	if (!after) return (0);
+
+	gchar *query = g_strdup_printf(
+		"select hash, type, path, uid, gid, commit_path, commit_time from flare_%s "
+			"where hash > %s order by hash limit %u",
+		magma_environment.nickname, after, max_rows);
+
+	dbi_result result = magma_sql_query(query);
+	g_free(query);
+	g_free(after);
+
+	guint16 count = 0;
+	while (result && count < max_rows && dbi_result_next_row(result)) {
+		magma_flare_metadata *row = &rows[count];
+		memset(row, 0, sizeof(magma_flare_metadata));
+
+		gchar *hash = magma_sql_fetch_string(result, 1);
+		gchar *type = magma_sql_fetch_string(result, 2);
+		gchar *path = magma_sql_fetch_string(result, 3);
+		gchar *commit_path = magma_sql_fetch_string(result, 6);
+		gchar *commit_time = magma_sql_fetch_string(result, 7);
+
+		if (hash) g_strlcpy(row->hash, hash, SHA_READABLE_DIGEST_LENGTH);
+		if (type) row->type = type[0];
+		if (path) g_strlcpy(row->path, path, sizeof(row->path));
+		if (commit_path) g_strlcpy(row->commit_path, commit_path, sizeof(row->commit_path));
+		if (commit_time) g_strlcpy(row->commit_time, commit_time, sizeof(row->commit_time));
+		row->uid = magma_sql_fetch_integer(result, 4);
+		row->gid = magma_sql_fetch_integer(result, 5);
+
+		free(hash);
+		free(type);
+		free(path);
+		free(commit_path);
+		free(commit_time);
+
+		count++;
+	}
+
+	if (result) dbi_result_free(result);
+	return (count);
+}
+
+/**
+ * Save a batch of flare records with one single statement,
+ * which sqlite runs inside one implicit transaction.
+ * Existing records with the same path are replaced.
+ *
+ * @param rows the records
+ * @param count how many records are in rows
+ * @return TRUE on success, FALSE otherwise
+ */
+gboolean magma_flare_sql_save_batch(magma_flare_metadata *rows, guint16 count)
+{
+	if (!count) return (TRUE);
+
+	GString *query = g_string_new(NULL);
+	g_string_printf(query,
+		"insert or replace into flare_%s (hash, type, path, uid, gid, commit_path, commit_time) values ",
+		magma_environment.nickname);
+
+	guint16 i = 0;
+	for (; i < count; i++) {
+		gchar type[2] = { rows[i].type, '\0' };
+
+		gchar *hash = magma_sql_quote(rows[i].hash);
+		gchar *flare_type = magma_sql_quote(type);
+		gchar *path = magma_sql_quote(rows[i].path);
+		gchar *commit_path = magma_sql_quote(rows[i].commit_path);
+		gchar *commit_time = magma_sql_quote(rows[i].commit_time);
+
+		gboolean quoted = (hash && flare_type && path && commit_path && commit_time) ? TRUE : FALSE;
+		if (quoted) {
+			g_string_append_printf(query, "%s(%s, %s, %s, %u, %u, %s, %s)",
+				i ? ", " : "",
+				hash,
+				flare_type,
+				path,
+				rows[i].uid,
+				rows[i].gid,
+				commit_path,
+				commit_time);
+		}
+
+		g_free(hash);
+		g_free(flare_type);
+		g_free(path);
+		g_free(commit_path);
+		g_free(commit_time);
+
+		if (!quoted) {
+			dbg(LOG_ERR, DEBUG_SQL, "Error quoting flare record %s", rows[i].path);
+			g_string_free(query, TRUE);
+			return (FALSE);
+		}
+	}
+
+	dbi_result result = magma_sql_query(query->str);
+	g_string_free(query, TRUE);
+
+	if (!result) return (FALSE);
+
+	dbi_result_free(result);
+	return (TRUE);
+}
+
 /**
  * Rename a flare into the flare table
  *
@@ -91,6 +91,11 @@ typedef struct {
 	char *bootserver;	/** Remote boot server address used if bootstrap is false */
 	int bootport;		/** Remote boot server port used if bootstrap is false */
 	char *secretkey;	/** Secret key used to join a network */
+	int receivers;		/** Number of receiving sockets per UDP service (SO_REUSEPORT) */
+	int stream;			/** If true, bulk operations are also served over TCP */
+	int replica_workers;	/** Replication lanes per redundant node */
+	int operation_rate;		/** Changes per second the duplicate request cache remembers */
+	int metadata_xattr;		/** If true, flare metadata are also kept in extended attributes */
 
 	/*
 	 * mount.magma section
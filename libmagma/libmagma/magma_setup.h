@@ -62,6 +62,8 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <ifaddrs.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include <sys/stat.h>
@@ -76,6 +78,7 @@
 #include <ctype.h>
 #include <sys/mman.h>
 #include <netinet/tcp.h>
+#include <netinet/udp.h>
 #include <syslog.h>
 #include <pwd.h>
 #include <grp.h>
@@ -93,6 +96,11 @@
 
 #include <dbi/dbi.h>
 
-#ifdef HAVE_SETXATTR
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sched.h>
+#endif
+
+#if defined(HAVE_SETXATTR) || defined(HAVE_LSETXATTR)
 #include <sys/xattr.h>
 #endif
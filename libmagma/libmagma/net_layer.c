@@ -26,12 +26,72 @@
 
 #if MAGMA_CACHE_SOCKETS
 GHashTable *magma_socket_cache;
+GMutex magma_socket_cache_mutex;
 
+/**
+ * The congestion state of a peer host, shared by all the cached
+ * sockets to that host. Never freed.
+ */
+typedef struct {
+	gchar *host;
+	GMutex lock;
+	GCond cond;				/** signalled when datagrams leave the window */
+	gdouble cwnd;			/** datagrams allowed in flight */
+	gdouble ssthresh;		/** slow start threshold */
+	guint inflight;			/** datagrams sent and not yet acknowledged or lost */
+	gint64 recovery;		/** losses before this monotonic time don't shrink the window again */
+} magma_congestion;
+
+/** host -> magma_congestion, guarded by magma_socket_cache_mutex */
+static GHashTable *magma_congestion_table;
+
+/**
+ * A cached client socket. Many threads can share it: the receive
+ * side is owned by the demultiplexer, which hands each reply to the
+ * thread waiting for its transaction ID.
+ */
 typedef struct {
 	GSocket *socket;
 	GSocketAddress *peer;
+
+	GMutex lock;
+	GCond cond;
+	gboolean receiving;		/** a waiting thread is reading the socket on behalf of all */
+	GHashTable *pending;	/** wire transaction ID -> magma_demux_waiter */
+	gboolean wide_tids;		/** the peer speaks protocol version 2 */
+	guint version;			/** the protocol version negotiated with the peer */
+	guint32 probe_tid;		/** wire ID of the NEGOTIATE request, 0 once answered */
+	gint64 probe_sent;		/** monotonic time the NEGOTIATE request was last sent */
+	guint probe_tries;		/** NEGOTIATE requests sent so far */
+	gboolean stream_capable;	/** the peer accepts stream connections for bulk operations */
+	GQueue streams;			/** idle stream connections to the peer */
+	gboolean gro;			/** UDP_GRO is on: a read may return several coalesced datagrams */
+	guint mtu;				/** the path MTU to the peer, 0 if unknown */
+
+	gint64 srtt;			/** smoothed round trip time, 0 until the first sample */
+	gint64 rttvar;			/** round trip time variation */
+	gint64 rto;				/** current retransmission timeout, backoff included */
+	magma_congestion *congestion;	/** the congestion window of the peer host */
 } magma_socket_cacher;
 
+/**
+ * A thread waiting for a reply on a cached socket, or an
+ * asynchronous request if deliver is set
+ */
+typedef struct {
+	magma_socket_cacher *sc;
+	guint32 tid;
+	gchar *buffer;
+	gsize max_size;
+	gssize length;			/** -1 until the reply arrives */
+	GQueue early;			/** GBytes replies arrived while the waiter was not receiving */
+	magma_demux_deliver_func deliver;
+	gpointer data;
+} magma_demux_waiter;
+
+/** the waiter registered by the calling thread, if any */
+static GPrivate magma_demux_current;
+
 gboolean magma_compare_cached_sockets(gchar *key1, gchar *key2)
 {
 	return ((g_strcmp0(key1, key2) == 0) ? TRUE : FALSE);
@@ -39,11 +99,882 @@ gboolean magma_compare_cached_sockets(gchar *key1, gchar *key2)
 
 void magma_destroy_cached_sockets(magma_socket_cacher *sc)
 {
+	GSocket *stream;
+	while ((stream = g_queue_pop_head(&sc->streams))) {
+		g_socket_close(stream, NULL);
+		g_object_unref(stream);
+	}
+
 	g_object_unref(sc->peer);
 	g_object_unref(sc->socket);
+	g_hash_table_destroy(sc->pending);
+	g_mutex_clear(&sc->lock);
+	g_cond_clear(&sc->cond);
 	g_free(sc);
 }
+
+#define magma_demux_lookup(socket) ((magma_socket_cacher *) g_object_get_data(G_OBJECT(socket), "magma-demux"))
+
+/**
+ * Tell if requests on this socket can carry 32 bit transaction IDs
+ *
+ * @param socket a GSocket returned by magma_open_client_connection()
+ * @return TRUE if the peer negotiated protocol version 2
+ */
+gboolean magma_demux_wide_tids(GSocket *socket)
+{
+	magma_socket_cacher *sc = magma_demux_lookup(socket);
+	if (!sc) return (FALSE);
+
+	g_mutex_lock(&sc->lock);
+	gboolean wide = sc->wide_tids;
+	g_mutex_unlock(&sc->lock);
+
+	return (wide);
+}
+
+/**
+ * Tell the protocol version negotiated with the peer of a socket
+ *
+ * @param socket a GSocket returned by magma_open_client_connection()
+ * @return the version, 1 until the peer has answered NEGOTIATE
+ */
+guint magma_demux_peer_version(GSocket *socket)
+{
+	magma_socket_cacher *sc = magma_demux_lookup(socket);
+	if (!sc) return (1);
+
+	g_mutex_lock(&sc->lock);
+	guint version = sc->version;
+	g_mutex_unlock(&sc->lock);
+
+	return (version);
+}
+
+/**
+ * Ask the kernel the MTU of the route to a peer. A throwaway UDP
+ * socket connected to the peer gets the route, including the path
+ * MTU learnt from ICMP "fragmentation needed" messages, which the
+ * kernel receives because datagrams fitting the path go out with DF.
+ *
+ * @param peer the peer address
+ * @return the MTU, 0 if unknown
+ */
+static guint magma_path_mtu_probe(GSocketAddress *peer)
+{
+#ifdef IP_MTU
+	if (g_socket_address_get_family(peer) isNot G_SOCKET_FAMILY_IPV4) return (0);
+
+	struct sockaddr_in address;
+	if (!g_socket_address_to_native(peer, &address, sizeof(struct sockaddr_in), NULL)) return (0);
+
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd is -1) return (0);
+
+	int mtu = 0;
+	socklen_t length = sizeof(int);
+	if (connect(fd, (struct sockaddr *) &address, sizeof(struct sockaddr_in)) is -1 ||
+		getsockopt(fd, IPPROTO_IP, IP_MTU, &mtu, &length) is -1) mtu = 0;
+
+	close(fd);
+	return ((mtu > 0) ? (guint) mtu : 0);
+#else
+	(void) peer;
+	return (0);
+#endif
+}
+
+/**
+ * Tell the path MTU to the peer of a socket
+ *
+ * @param socket a GSocket returned by magma_open_client_connection()
+ * @return the MTU, 0 if unknown or if the socket is local
+ */
+guint magma_path_mtu(GSocket *socket)
+{
+	magma_socket_cacher *sc = magma_demux_lookup(socket);
+	if (!sc) return (0);
+
+	g_mutex_lock(&sc->lock);
+	guint mtu = sc->mtu;
+	g_mutex_unlock(&sc->lock);
+
+	return (mtu);
+}
+
+/**
+ * Ask the kernel again the path MTU to the peer of a socket,
+ * after losses which may come from a shrunk route
+ *
+ * @param socket a GSocket returned by magma_open_client_connection()
+ */
+void magma_path_mtu_refresh(GSocket *socket)
+{
+	magma_socket_cacher *sc = magma_demux_lookup(socket);
+	if (!sc || magma_socket_is_local(socket)) return;
+
+	guint mtu = magma_path_mtu_probe(sc->peer);
+
+	g_mutex_lock(&sc->lock);
+	if (mtu isNot sc->mtu) dbg(LOG_INFO, DEBUG_NET, "Path MTU changed from %u to %u", sc->mtu, mtu);
+	sc->mtu = mtu;
+	g_mutex_unlock(&sc->lock);
+}
+
+/**
+ * Declare that the calling thread is waiting for the reply
+ * to transaction tid on socket. Must be paired with
+ * magma_demux_forget().
+ *
+ * @param socket the socket the request has been sent on
+ * @param tid the transaction ID as sent on the wire
+ */
+void magma_demux_expect(GSocket *socket, guint32 tid)
+{
+	magma_socket_cacher *sc = magma_demux_lookup(socket);
+	if (!sc) return;
+
+	magma_demux_waiter *waiter = g_new0(magma_demux_waiter, 1);
+	waiter->sc = sc;
+	waiter->tid = tid;
+	waiter->length = -1;
+
+	g_mutex_lock(&sc->lock);
+	g_hash_table_insert(sc->pending, GUINT_TO_POINTER(tid), waiter);
+	g_mutex_unlock(&sc->lock);
+
+	g_private_set(&magma_demux_current, waiter);
+}
+
+/**
+ * Stop waiting for the reply declared with magma_demux_expect()
+ *
+ * @param socket the socket the request has been sent on
+ */
+void magma_demux_forget(GSocket *socket)
+{
+	magma_demux_waiter *waiter = g_private_get(&magma_demux_current);
+	if (!waiter || waiter->sc isNot magma_demux_lookup(socket)) return;
+
+	g_mutex_lock(&waiter->sc->lock);
+	g_hash_table_remove(waiter->sc->pending, GUINT_TO_POINTER(waiter->tid));
+	g_mutex_unlock(&waiter->sc->lock);
+
+	g_private_set(&magma_demux_current, NULL);
+	GBytes *early;
+	while ((early = g_queue_pop_head(&waiter->early))) g_bytes_unref(early);
+	g_free(waiter);
+}
+
+/**
+ * Tell if the retransmission timeout of socket follows its peer
+ *
+ * @param socket a GSocket object
+ * @return TRUE for sockets returned by magma_open_client_connection()
+ */
+gboolean magma_rtt_adaptive(GSocket *socket)
+{
+	return (magma_demux_lookup(socket) ? TRUE : FALSE);
+}
+
+/**
+ * Return how long to wait for a reply before sending a request again
+ *
+ * @param socket a GSocket object
+ * @return the timeout in microseconds
+ */
+gint64 magma_rtt_timeout(GSocket *socket)
+{
+	magma_socket_cacher *sc = magma_demux_lookup(socket);
+	if (!sc) return ((gint64) (MAGMA_WAIT_CYCLE_UNIT) * (MAGMA_MAX_WAIT_CYCLE_ITERATIONS - 1) * MAGMA_MAX_WAIT_CYCLE_ITERATIONS / 2);
+
+	g_mutex_lock(&sc->lock);
+	gint64 rto = sc->rto;
+	g_mutex_unlock(&sc->lock);
+
+	return (rto);
+}
+
+/**
+ * Update the round trip time estimate of the peer (Jacobson).
+ * Following Karn, only replies to requests which have not been
+ * retransmitted must be sampled, since the reply to a retransmitted
+ * request can't be told from the reply to the original one.
+ *
+ * @param socket a GSocket object
+ * @param rtt the measured round trip time in microseconds
+ */
+void magma_rtt_sample(GSocket *socket, gint64 rtt)
+{
+	magma_socket_cacher *sc = magma_demux_lookup(socket);
+	if (!sc) return;
+
+	g_mutex_lock(&sc->lock);
+
+	if (!sc->srtt) {
+		sc->srtt = rtt;
+		sc->rttvar = rtt / 2;
+	} else {
+		gint64 delta = sc->srtt - rtt;
+		sc->rttvar = (3 * sc->rttvar + ABS(delta)) / 4;
+		sc->srtt = (7 * sc->srtt + rtt) / 8;
+	}
+
+	/* a fresh sample also clears any backoff */
+	sc->rto = CLAMP(sc->srtt + 4 * sc->rttvar, MAGMA_RTO_MIN, MAGMA_RTO_MAX);
+
+	g_mutex_unlock(&sc->lock);
+}
+
+/**
+ * Double the retransmission timeout of the peer after a request
+ * went unanswered. It stays backed off until the next sample.
+ *
+ * @param socket a GSocket object
+ */
+void magma_rtt_backoff(GSocket *socket)
+{
+	magma_socket_cacher *sc = magma_demux_lookup(socket);
+	if (!sc) return;
+
+	g_mutex_lock(&sc->lock);
+	sc->rto = MIN(sc->rto * 2, MAGMA_RTO_MAX);
+	g_mutex_unlock(&sc->lock);
+}
+
+/**
+ * Return the congestion state of a host, creating it if missing.
+ * Called with magma_socket_cache_mutex held.
+ *
+ * @param host the peer host
+ * @return the congestion state
+ */
+static magma_congestion *magma_congestion_lookup(const gchar *host)
+{
+	magma_congestion *cc = g_hash_table_lookup(magma_congestion_table, host);
+	if (cc) return (cc);
+
+	cc = g_new0(magma_congestion, 1);
+	cc->host = g_strdup(host);
+	g_mutex_init(&cc->lock);
+	g_cond_init(&cc->cond);
+	cc->cwnd = MAGMA_CWND_INITIAL;
+	cc->ssthresh = MAGMA_CWND_MAX;
+	g_hash_table_insert(magma_congestion_table, cc->host, cc);
+
+	return (cc);
+}
+
+/**
+ * Take room in the congestion window of the peer of socket before
+ * sending datagrams. If wait is TRUE and the window is full, wait
+ * until some room is given back; a window which stays full for a
+ * whole retransmission timeout lets one datagram through anyway,
+ * so a stalled sender can't stop the others. If wait is FALSE all
+ * the datagrams are counted at once, as asynchronous senders must
+ * not block.
+ *
+ * Every granted datagram must be given back with magma_cwnd_release().
+ *
+ * @param socket a GSocket object
+ * @param wanted the datagrams to be sent
+ * @return the datagrams which can be sent now, at least one if wanted isn't 0
+ */
+guint magma_cwnd_acquire(GSocket *socket, guint wanted, gboolean wait)
+{
+	magma_socket_cacher *sc = magma_demux_lookup(socket);
+	if (!sc || !wanted) return (wanted);
+
+	magma_congestion *cc = sc->congestion;
+	gint64 deadline = g_get_monotonic_time() + magma_rtt_timeout(socket);
+
+	g_mutex_lock(&cc->lock);
+
+	if (wait) {
+		while (cc->inflight >= (guint) cc->cwnd) {
+			if (!g_cond_wait_until(&cc->cond, &cc->lock, deadline)) break;
+		}
+	}
+
+	guint room = (cc->inflight < (guint) cc->cwnd) ? (guint) cc->cwnd - cc->inflight : 1;
+	guint granted = wait ? MIN(wanted, room) : wanted;
+	cc->inflight += granted;
+
+	g_mutex_unlock(&cc->lock);
+
+	return (granted);
+}
+
+/**
+ * Give back the room taken by magma_cwnd_acquire(), growing the
+ * window by the datagrams acknowledged: by one each below the slow
+ * start threshold, by one per window above it (additive increase).
+ *
+ * @param socket a GSocket object
+ * @param granted the datagrams granted by magma_cwnd_acquire()
+ * @param acked how many of them have been acknowledged
+ */
+void magma_cwnd_release(GSocket *socket, guint granted, guint acked)
+{
+	magma_socket_cacher *sc = magma_demux_lookup(socket);
+	if (!sc || !granted) return;
+
+	magma_congestion *cc = sc->congestion;
+
+	g_mutex_lock(&cc->lock);
+
+	cc->inflight -= MIN(granted, cc->inflight);
+
+	guint i;
+	for (i = 0; i < MIN(acked, granted); i++) {
+		cc->cwnd += (cc->cwnd < cc->ssthresh) ? 1 : 1 / cc->cwnd;
+	}
+	cc->cwnd = MIN(cc->cwnd, MAGMA_CWND_MAX);
+
+	g_cond_broadcast(&cc->cond);
+	g_mutex_unlock(&cc->lock);
+}
+
+/**
+ * Halve the congestion window of the peer of socket after a request
+ * or a fragment went unanswered (multiplicative decrease). The losses
+ * of one round trip are taken as one, so a burst lost together halves
+ * the window once.
+ *
+ * @param socket a GSocket object
+ */
+void magma_cwnd_loss(GSocket *socket)
+{
+	magma_socket_cacher *sc = magma_demux_lookup(socket);
+	if (!sc) return;
+
+	g_mutex_lock(&sc->lock);
+	gint64 srtt = sc->srtt ? sc->srtt : MAGMA_RTO_INITIAL;
+	g_mutex_unlock(&sc->lock);
+
+	magma_congestion *cc = sc->congestion;
+	gint64 now = g_get_monotonic_time();
+
+	g_mutex_lock(&cc->lock);
+	if (now >= cc->recovery) {
+		cc->ssthresh = MAX(cc->cwnd / 2, MAGMA_CWND_MIN);
+		cc->cwnd = cc->ssthresh;
+		cc->recovery = now + srtt;
+		dbg(LOG_INFO, DEBUG_NET, "Congestion window of %s down to %u", cc->host, (guint) cc->cwnd);
+	}
+	g_mutex_unlock(&cc->lock);
+}
+
+/**
+ * Register an asynchronous request on a cached socket. When its
+ * reply is read, deliver is called once with the datagram, while
+ * the socket lock is held: it must not block.
+ *
+ * @param socket a GSocket returned by magma_open_client_connection()
+ * @param tid the transaction ID as sent on the wire
+ * @param deliver the function receiving the reply
+ * @param data passed to deliver
+ * @return TRUE if registered, FALSE if socket is not a cached one
+ */
+gboolean magma_demux_submit(GSocket *socket, guint32 tid, magma_demux_deliver_func deliver, gpointer data)
+{
+	magma_socket_cacher *sc = magma_demux_lookup(socket);
+	if (!sc) return (FALSE);
+
+	magma_demux_waiter *waiter = g_new0(magma_demux_waiter, 1);
+	waiter->sc = sc;
+	waiter->tid = tid;
+	waiter->length = -1;
+	waiter->deliver = deliver;
+	waiter->data = data;
+
+	g_mutex_lock(&sc->lock);
+	g_hash_table_insert(sc->pending, GUINT_TO_POINTER(tid), waiter);
+	g_mutex_unlock(&sc->lock);
+
+	return (TRUE);
+}
+
+/**
+ * Withdraw an asynchronous request
+ *
+ * @param socket the socket the request has been sent on
+ * @param tid the transaction ID as sent on the wire
+ * @return TRUE if withdrawn, FALSE if its reply has already been delivered
+ */
+gboolean magma_demux_cancel(GSocket *socket, guint32 tid)
+{
+	magma_socket_cacher *sc = magma_demux_lookup(socket);
+	if (!sc) return (FALSE);
+
+	g_mutex_lock(&sc->lock);
+	magma_demux_waiter *waiter = g_hash_table_lookup(sc->pending, GUINT_TO_POINTER(tid));
+	if (waiter && waiter->deliver) {
+		g_hash_table_remove(sc->pending, GUINT_TO_POINTER(tid));
+		g_free(waiter);
+	} else {
+		waiter = NULL;
+	}
+	g_mutex_unlock(&sc->lock);
+
+	return (waiter ? TRUE : FALSE);
+}
+
+/**
+ * Hand a datagram read by the receiving thread to its waiter.
+ * Called with sc->lock held.
+ *
+ * @param sc the cached socket
+ * @param self the waiter of the receiving thread, NULL if reading on behalf of others only
+ * @param datagram the datagram
+ * @param length the datagram length
+ */
+static void magma_demux_route(magma_socket_cacher *sc, magma_demux_waiter *self, gchar *datagram, gssize length)
+{
+	guint32 tid = magma_peek_response_tid(datagram, length);
+
+	/*
+	 * the answer to the NEGOTIATE request tells the peer version
+	 */
+	if (sc->probe_tid && tid is sc->probe_tid) {
+		sc->probe_tid = 0;
+		sc->version = CLAMP(magma_peek_response_result(datagram, length), 1, MAGMA_PROTOCOL_VERSION);
+		sc->wide_tids = (sc->version >= 2) ? TRUE : FALSE;
+		sc->stream_capable = (magma_peek_response_flags(datagram, length) & MAGMA_FLAG_STREAM_TRANSPORT) ? TRUE : FALSE;
+		dbg(LOG_INFO, DEBUG_NET, "Peer speaks protocol version %u%s",
+			sc->version, sc->stream_capable ? " and accepts streams" : "");
+		return;
+	}
+
+	if (self && tid is self->tid && self->length is -1) {
+		if (datagram isNot self->buffer) {
+			length = MIN((gsize) length, self->max_size);
+			memmove(self->buffer, datagram, length);
+			if ((gsize) length < self->max_size) self->buffer[length] = '\0';
+		}
+		self->length = length;
+		return;
+	}
+
+	magma_demux_waiter *waiter = g_hash_table_lookup(sc->pending, GUINT_TO_POINTER(tid));
+
+	/*
+	 * asynchronous requests are served once and forgotten
+	 */
+	if (waiter && waiter->deliver) {
+		g_hash_table_remove(sc->pending, GUINT_TO_POINTER(tid));
+		waiter->deliver(waiter->data, datagram, length);
+		g_free(waiter);
+		return;
+	}
+
+	/*
+	 * the waiter has sent its request but is not receiving yet, or
+	 * has already got a reply from the same read: keep the reply
+	 * until it asks again. More than one can pile up while the
+	 * fragments of a READ_LARGE are coming.
+	 */
+	if (waiter && (!waiter->buffer || waiter->length isNot -1) && waiter->early.length < MAGMA_DEMUX_EARLY_LIMIT) {
+		g_queue_push_tail(&waiter->early, g_bytes_new(datagram, length));
+		return;
+	}
+
+	/*
+	 * replies nobody is waiting for any more, or duplicates of a
+	 * reply already taken, are dropped: they must never be handed
+	 * to the waiter of another transaction
+	 */
+	if (!waiter || waiter->length isNot -1 || !waiter->buffer) {
+		dbg(LOG_INFO, DEBUG_NET, "Dropping %s reply #%05u", waiter ? "late" : "unknown", tid);
+		return;
+	}
+
+	if (datagram isNot waiter->buffer) {
+		length = MIN((gsize) length, waiter->max_size);
+		memmove(waiter->buffer, datagram, length);
+	}
+
+	waiter->length = length;
+	g_cond_broadcast(&sc->cond);
+}
+
+/**
+ * Read what is waiting on a cached socket and route it. With UDP_GRO
+ * on, one read may return a burst of datagrams coalesced by the
+ * kernel: each segment is routed on its own.
+ *
+ * @param sc the cached socket
+ * @param self the waiter of the receiving thread, NULL if reading on behalf of others only
+ * @param buffer the buffer to read into
+ * @param max_size the size of buffer
+ * @return the bytes read, -1 if nothing was waiting
+ */
+static gssize magma_demux_read(magma_socket_cacher *sc, magma_demux_waiter *self, gchar *buffer, gsize max_size)
+{
+	gssize received = -1;
+	gsize segment = 0;
+
+#ifdef UDP_GRO
+	if (sc->gro) {
+		union {
+			gchar buffer[CMSG_SPACE(sizeof(int))];
+			struct cmsghdr align;
+		} control;
+
+		struct iovec iov = { buffer, max_size };
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(struct msghdr));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.buffer;
+		msg.msg_controllen = sizeof(control.buffer);
+
+		received = recvmsg(g_socket_get_fd(sc->socket), &msg, MSG_DONTWAIT);
+		if (received > 0) segment = magma_udp_gro_segment_size(&msg, received);
+	} else
 #endif
+	{
+		received = g_socket_receive_from(sc->socket, NULL, buffer, max_size, NULL, NULL);
+		segment = received;
+	}
+
+	if (received <= 0) return (received);
+
+	g_mutex_lock(&sc->lock);
+
+	if ((gsize) received is segment) {
+		if ((gsize) received < max_size) buffer[received] = '\0';
+		magma_demux_route(sc, self, buffer, received);
+	} else {
+		gsize offset = 0;
+		for (; offset < (gsize) received; offset += segment) {
+			magma_demux_route(sc, self, buffer + offset, MIN(segment, (gsize) received - offset));
+		}
+	}
+
+	g_mutex_unlock(&sc->lock);
+
+	return (received);
+}
+
+/**
+ * Send a NEGOTIATE request to the peer of a cached socket. The
+ * transaction ID is recorded before sending, so the answer can't
+ * arrive before the demultiplexer knows it.
+ *
+ * @param sc the cached socket
+ */
+static void magma_demux_negotiate(magma_socket_cacher *sc)
+{
+	magma_transaction_id tid = magma_new_transaction_id();
+
+	g_mutex_lock(&sc->lock);
+	sc->probe_tid = tid & 0xffff;
+	sc->probe_sent = g_get_monotonic_time();
+	sc->probe_tries++;
+	g_mutex_unlock(&sc->lock);
+
+	magma_pktqs_negotiate(sc->socket, sc->peer, tid);
+}
+
+/**
+ * Send NEGOTIATE again if the peer didn't answer within the
+ * retransmission timeout, doubled on every try. After
+ * MAGMA_RETRY_LIMIT tries the peer is taken for a version 1 one.
+ *
+ * @param sc the cached socket
+ */
+static void magma_demux_negotiate_again(magma_socket_cacher *sc)
+{
+	g_mutex_lock(&sc->lock);
+
+	gboolean again = FALSE;
+	if (sc->probe_tid) {
+		gint64 timeout = MIN(sc->rto << (sc->probe_tries - 1), MAGMA_RTO_MAX);
+		if (g_get_monotonic_time() - sc->probe_sent >= timeout) {
+			if (sc->probe_tries < MAGMA_RETRY_LIMIT) {
+				again = TRUE;
+			} else {
+				dbg(LOG_INFO, DEBUG_NET, "Peer doesn't answer NEGOTIATE, using protocol version 1");
+				sc->probe_tid = 0;
+			}
+		}
+	}
+
+	g_mutex_unlock(&sc->lock);
+
+	if (again) magma_demux_negotiate(sc);
+}
+
+/**
+ * Wait for a reply on a cached socket. One waiting thread at time
+ * reads the socket and routes each datagram to the thread waiting
+ * for its transaction ID; the others sleep on the condition. The
+ * calling thread must have declared its transaction ID with
+ * magma_demux_expect().
+ *
+ * @param sc the cached socket
+ * @param buffer where the reply must be copied
+ * @param max_size the size of buffer
+ * @param length if not NULL, returns the reply length
+ * @return G_IO_STATUS_NORMAL or G_IO_STATUS_AGAIN on timeout
+ */
+static GIOStatus magma_demux_receive(magma_socket_cacher *sc, gchar *buffer, gsize max_size, gssize *length)
+{
+	magma_demux_waiter *waiter = g_private_get(&magma_demux_current);
+	if (!waiter || waiter->sc isNot sc) {
+		dbg(LOG_ERR, DEBUG_NET, "Receiving on a shared socket without an expected transaction");
+		return (G_IO_STATUS_AGAIN);
+	}
+
+	g_mutex_lock(&sc->lock);
+
+	/* wait for the peer retransmission timeout */
+	gint64 deadline = g_get_monotonic_time() + sc->rto;
+
+	waiter->buffer = buffer;
+	waiter->max_size = max_size;
+	waiter->length = -1;
+
+	GBytes *early = g_queue_pop_head(&waiter->early);
+	if (early) {
+		gsize early_length = 0;
+		gconstpointer data = g_bytes_get_data(early, &early_length);
+		waiter->length = MIN(early_length, max_size);
+		memcpy(buffer, data, waiter->length);
+		g_bytes_unref(early);
+	}
+
+	while (waiter->length is -1) {
+		gint64 now = g_get_monotonic_time();
+		if (now >= deadline) break;
+
+		if (sc->receiving) {
+			g_cond_wait_until(&sc->cond, &sc->lock, deadline);
+			continue;
+		}
+
+		/*
+		 * become the receiving thread
+		 */
+		sc->receiving = TRUE;
+		g_mutex_unlock(&sc->lock);
+
+		if (g_socket_condition_timed_wait(sc->socket, G_IO_IN, MIN(deadline - now, MAGMA_WAIT_CYCLE_UNIT), NULL, NULL)) {
+			magma_demux_read(sc, waiter, buffer, max_size);
+		}
+
+		magma_demux_negotiate_again(sc);
+
+		g_mutex_lock(&sc->lock);
+		sc->receiving = FALSE;
+
+		/* let another waiter take over the socket */
+		g_cond_broadcast(&sc->cond);
+	}
+
+	GIOStatus status = (waiter->length is -1) ? G_IO_STATUS_AGAIN : G_IO_STATUS_NORMAL;
+	if (length) *length = waiter->length;
+	waiter->buffer = NULL;
+
+	g_mutex_unlock(&sc->lock);
+
+	return (status);
+}
+
+/**
+ * Get a stream connection to the peer of a cached socket, reusing
+ * an idle one if available. Must be returned with magma_stream_checkin().
+ *
+ * @param socket a GSocket returned by magma_open_client_connection()
+ * @return a connected stream or NULL if the peer doesn't accept streams
+ */
+GSocket *magma_stream_checkout(GSocket *socket)
+{
+	magma_socket_cacher *sc = magma_demux_lookup(socket);
+	if (!sc || magma_socket_is_local(socket)) return (NULL);
+
+	g_mutex_lock(&sc->lock);
+	if (!sc->stream_capable) {
+		g_mutex_unlock(&sc->lock);
+		return (NULL);
+	}
+	GSocket *stream = g_queue_pop_head(&sc->streams);
+	g_mutex_unlock(&sc->lock);
+
+	if (stream) return (stream);
+
+	GError *error = NULL;
+	stream = g_socket_new(G_SOCKET_FAMILY_IPV4, G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_TCP, &error);
+	if (!stream) {
+		dbg(LOG_ERR, DEBUG_NET, "Error creating stream socket: %s", error->message);
+		g_error_free(error);
+		return (NULL);
+	}
+
+	magma_stream_setup(stream, MAGMA_STREAM_TIMEOUT);
+
+	if (!g_socket_connect(stream, sc->peer, NULL, &error)) {
+		dbg(LOG_ERR, DEBUG_NET, "Error opening stream, using datagrams only: %s", error->message);
+		g_error_free(error);
+		g_object_unref(stream);
+
+		/* don't try again on every request */
+		g_mutex_lock(&sc->lock);
+		sc->stream_capable = FALSE;
+		g_mutex_unlock(&sc->lock);
+		return (NULL);
+	}
+
+	return (stream);
+}
+
+/**
+ * Return a stream connection taken with magma_stream_checkout()
+ *
+ * @param socket the socket passed to magma_stream_checkout()
+ * @param stream the stream connection
+ * @param reusable FALSE if the stream is broken or out of sync, and must be closed
+ */
+void magma_stream_checkin(GSocket *socket, GSocket *stream, gboolean reusable)
+{
+	magma_socket_cacher *sc = magma_demux_lookup(socket);
+
+	if (sc && reusable) {
+		g_mutex_lock(&sc->lock);
+		if (g_queue_get_length(&sc->streams) < MAGMA_STREAMS_PER_PEER) {
+			g_queue_push_head(&sc->streams, stream);
+			g_mutex_unlock(&sc->lock);
+			return;
+		}
+		g_mutex_unlock(&sc->lock);
+	}
+
+	g_socket_close(stream, NULL);
+	g_object_unref(stream);
+}
+
+/**
+ * Read and route all the datagrams waiting on a cached socket,
+ * without blocking. Used by the asynchronous I/O thread. If a
+ * waiting thread is already reading the socket, it will route
+ * the replies itself.
+ *
+ * @param socket a GSocket returned by magma_open_client_connection()
+ */
+void magma_demux_poll(GSocket *socket)
+{
+	magma_socket_cacher *sc = magma_demux_lookup(socket);
+	if (!sc) return;
+
+	g_mutex_lock(&sc->lock);
+	if (sc->receiving) {
+		g_mutex_unlock(&sc->lock);
+		return;
+	}
+	sc->receiving = TRUE;
+	g_mutex_unlock(&sc->lock);
+
+	MAGMA_IO_BUFFER(buffer);
+
+	while (magma_demux_read(sc, NULL, buffer, MAGMA_MAX_BUFFER_SIZE) > 0);
+
+	magma_demux_negotiate_again(sc);
+
+	g_mutex_lock(&sc->lock);
+	sc->receiving = FALSE;
+	g_cond_broadcast(&sc->cond);
+	g_mutex_unlock(&sc->lock);
+}
+
+#else
+
+gboolean magma_demux_submit(GSocket *socket, guint32 tid, magma_demux_deliver_func deliver, gpointer data) { (void) socket; (void) tid; (void) deliver; (void) data; return (FALSE); }
+gboolean magma_demux_cancel(GSocket *socket, guint32 tid) { (void) socket; (void) tid; return (FALSE); }
+gboolean magma_rtt_adaptive(GSocket *socket) { (void) socket; return (FALSE); }
+gint64 magma_rtt_timeout(GSocket *socket) { (void) socket; return ((gint64) (MAGMA_WAIT_CYCLE_UNIT) * (MAGMA_MAX_WAIT_CYCLE_ITERATIONS - 1) * MAGMA_MAX_WAIT_CYCLE_ITERATIONS / 2); }
+void magma_rtt_sample(GSocket *socket, gint64 rtt) { (void) socket; (void) rtt; }
+void magma_rtt_backoff(GSocket *socket) { (void) socket; }
+guint magma_cwnd_acquire(GSocket *socket, guint wanted, gboolean wait) { (void) socket; (void) wait; return (wanted); }
+void magma_cwnd_release(GSocket *socket, guint granted, guint acked) { (void) socket; (void) granted; (void) acked; }
+void magma_cwnd_loss(GSocket *socket) { (void) socket; }
+void magma_demux_poll(GSocket *socket) { (void) socket; }
+GSocket *magma_stream_checkout(GSocket *socket) { (void) socket; return (NULL); }
+void magma_stream_checkin(GSocket *socket, GSocket *stream, gboolean reusable) { (void) socket; (void) reusable; g_socket_close(stream, NULL); g_object_unref(stream); }
+gboolean magma_demux_wide_tids(GSocket *socket) { (void) socket; return (FALSE); }
+guint magma_demux_peer_version(GSocket *socket) { (void) socket; return (1); }
+guint magma_path_mtu(GSocket *socket) { (void) socket; return (0); }
+void magma_path_mtu_refresh(GSocket *socket) { (void) socket; }
+void magma_demux_expect(GSocket *socket, guint32 tid) { (void) socket; (void) tid; }
+void magma_demux_forget(GSocket *socket) { (void) socket; }
+
+#endif
+
+/**
+ * the per-thread stack of free I/O buffers
+ */
+typedef struct {
+	guint count;
+	gchar *buffers[MAGMA_IO_BUFFERS_PER_THREAD];
+} magma_io_buffer_cache;
+
+static void magma_io_buffer_cache_free(gpointer data)
+{
+	magma_io_buffer_cache *cache = (magma_io_buffer_cache *) data;
+	while (cache->count) g_free(cache->buffers[--cache->count]);
+	g_free(cache);
+}
+
+static GPrivate magma_io_buffer_cache_key = G_PRIVATE_INIT(magma_io_buffer_cache_free);
+
+/**
+ * Get a MAGMA_MAX_BUFFER_SIZE buffer from the thread free list,
+ * allocating a new one if the list is empty. No locking is
+ * involved since each thread owns its list. The buffer content
+ * is whatever the previous user left in it.
+ *
+ * @return the buffer
+ */
+gchar *magma_io_buffer_get()
+{
+	magma_io_buffer_cache *cache = g_private_get(&magma_io_buffer_cache_key);
+	if (cache && cache->count) return (cache->buffers[--cache->count]);
+
+	return (g_malloc(MAGMA_MAX_BUFFER_SIZE));
+}
+
+/**
+ * Return a buffer to the free list of the calling thread,
+ * or free it if the list is already full
+ *
+ * @param buffer the buffer, as returned by magma_io_buffer_get()
+ */
+void magma_io_buffer_release(gchar *buffer)
+{
+	if (!buffer) return;
+
+	magma_io_buffer_cache *cache = g_private_get(&magma_io_buffer_cache_key);
+	if (!cache) {
+		cache = g_new0(magma_io_buffer_cache, 1);
+		g_private_set(&magma_io_buffer_cache_key, cache);
+	}
+
+	if (cache->count < MAGMA_IO_BUFFERS_PER_THREAD) {
+		cache->buffers[cache->count++] = buffer;
+	} else {
+		g_free(buffer);
+	}
+}
+
+/**
+ * cleanup handler used by MAGMA_IO_BUFFER()
+ *
+ * @param buffer a pointer to the buffer variable
+ */
+void magma_io_buffer_cleanup(gchar **buffer)
+{
+	magma_io_buffer_release(*buffer);
+}
 
 void magma_init_net_layer()
 {
@@ -53,9 +984,128 @@ void magma_init_net_layer()
 		(GEqualFunc) magma_compare_cached_sockets,
 		g_free,
 		(GDestroyNotify) magma_destroy_cached_sockets);
+
+	magma_congestion_table = g_hash_table_new(g_str_hash, g_str_equal);
 #endif
 }
 
+/**
+ * Build the address of a socket in the abstract namespace
+ *
+ * @param name the socket name, without the leading nul byte
+ * @return a new GSocketAddress
+ */
+static GSocketAddress *magma_local_address(const gchar *name)
+{
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(struct sockaddr_un));
+	address.sun_family = AF_UNIX;
+	g_strlcpy(address.sun_path + 1, name, sizeof(address.sun_path) - 1);
+
+	gsize length = G_STRUCT_OFFSET(struct sockaddr_un, sun_path) + 1 + strlen(address.sun_path + 1);
+	return (g_socket_address_new_from_native(&address, length));
+}
+
+/**
+ * Get the address of the local socket of the server on a port
+ *
+ * @param port the UDP port of the service
+ * @return a new GSocketAddress
+ */
+GSocketAddress *magma_local_service_address(guint16 port)
+{
+	gchar *name = g_strdup_printf(MAGMA_LOCAL_SOCKET_FORMAT, port);
+	GSocketAddress *address = magma_local_address(name);
+	g_free(name);
+	return (address);
+}
+
+/**
+ * Tell if a socket is a local (unix domain) socket
+ *
+ * @param socket a GSocket
+ * @return TRUE for local sockets
+ */
+gboolean magma_socket_is_local(GSocket *socket)
+{
+	return ((g_socket_get_family(socket) is G_SOCKET_FAMILY_UNIX) ? TRUE : FALSE);
+}
+
+/**
+ * Tell if an address belongs to this host
+ *
+ * @param host an IPv4 or IPv6 address as a string
+ * @return TRUE if host is a loopback address or is assigned to a local interface
+ */
+gboolean magma_address_is_local(const gchar *host)
+{
+	GInetAddress *address = g_inet_address_new_from_string(host);
+	if (!address) return (FALSE);
+
+	gboolean local = g_inet_address_get_is_loopback(address);
+
+	struct ifaddrs *interfaces = NULL, *i;
+	if (!local && getifaddrs(&interfaces) isNot -1) {
+		for (i = interfaces; i && !local; i = i->ifa_next) {
+			if (!i->ifa_addr || i->ifa_addr->sa_family isNot AF_INET) continue;
+
+			GInetAddress *assigned = g_inet_address_new_from_bytes(
+				(guint8 *) &((struct sockaddr_in *) i->ifa_addr)->sin_addr, G_SOCKET_FAMILY_IPV4);
+			local = g_inet_address_equal(address, assigned);
+			g_object_unref(assigned);
+		}
+		freeifaddrs(interfaces);
+	}
+
+	g_object_unref(address);
+	return (local);
+}
+
+/**
+ * Open a local socket to the server listening on port of this host.
+ * The socket is bound to a name of its own, where replies come back.
+ * It is not connected, so it keeps working when the server restarts;
+ * a throwaway socket checks that the server is there.
+ *
+ * @param port the UDP port of the server
+ * @param peer where the server address is returned
+ * @return the socket or NULL if the server has no local socket
+ */
+static GSocket *magma_open_local_connection(guint16 port, GSocketAddress **peer)
+{
+	static gint serial = 0;
+
+	GError *error = NULL;
+	GSocket *socket = g_socket_new(G_SOCKET_FAMILY_UNIX, G_SOCKET_TYPE_DATAGRAM, G_SOCKET_PROTOCOL_DEFAULT, &error);
+	if (!socket) {
+		dbg(LOG_ERR, DEBUG_NET, "Error creating local socket: %s", error->message);
+		g_error_free(error);
+		return (NULL);
+	}
+
+	gchar *name = g_strdup_printf(MAGMA_LOCAL_CLIENT_FORMAT, getpid(), g_atomic_int_add(&serial, 1));
+	GSocketAddress *self = magma_local_address(name);
+	g_free(name);
+
+	GSocketAddress *server = magma_local_service_address(port);
+
+	GSocket *probe = g_socket_new(G_SOCKET_FAMILY_UNIX, G_SOCKET_TYPE_DATAGRAM, G_SOCKET_PROTOCOL_DEFAULT, NULL);
+	gboolean ready = probe && g_socket_connect(probe, server, NULL, &error) && g_socket_bind(socket, self, FALSE, &error);
+	if (probe) g_object_unref(probe);
+	g_object_unref(self);
+
+	if (!ready) {
+		dbg(LOG_INFO, DEBUG_NET, "No local socket for port %u, using UDP: %s", port, error ? error->message : "unknown reason");
+		if (error) g_error_free(error);
+		g_object_unref(server);
+		g_object_unref(socket);
+		return (NULL);
+	}
+
+	*peer = server;
+	return (socket);
+}
+
 /**
  * Open a connection to a magma server
  *
@@ -71,60 +1121,108 @@ GSocket *magma_open_client_connection(const gchar *host, const uint16_t port, GS
 	 * lookup the socket in the cache
 	 */
 	gchar *key = g_strdup_printf("%s:%d", host, port);
+	g_mutex_lock(&magma_socket_cache_mutex);
 	magma_socket_cacher *sc = g_hash_table_lookup(magma_socket_cache, key);
+	g_mutex_unlock(&magma_socket_cache_mutex);
 	if (sc) {
 		g_free(key);
 		*peer = sc->peer;
-		return (sc->socket);
-	}
-#endif
-
-	/*
-	 * Create the socket
-	 */
-	GError *error = NULL;
-	GSocket *socket = g_socket_new(
-		G_SOCKET_FAMILY_IPV4,
-		G_SOCKET_TYPE_DATAGRAM,
-		G_SOCKET_PROTOCOL_UDP,
-		&error);
-
-	if (error) {
-		fprintf(stderr, "Error on socket creation: %s\n", error->message);
-		g_error_free(error);
-		return (NULL);
+		return (sc->socket);
 	}
+#endif
 
 	/*
-	 * Avoid blocking on incoming data
+	 * A server on this host is reached through its local socket,
+	 * if it has one; otherwise over UDP
 	 */
-	g_socket_set_blocking(socket, FALSE);
+	GSocket *socket = magma_address_is_local(host) ? magma_open_local_connection(port, peer) : NULL;
+
+	if (!socket) {
+		/*
+		 * Create the socket
+		 */
+		GError *error = NULL;
+		socket = g_socket_new(
+			G_SOCKET_FAMILY_IPV4,
+			G_SOCKET_TYPE_DATAGRAM,
+			G_SOCKET_PROTOCOL_UDP,
+			&error);
+
+		if (error) {
+			fprintf(stderr, "Error on socket creation: %s\n", error->message);
+			g_error_free(error);
+			return (NULL);
+		}
 
+		/*
+		 * Create a GSocketAddress to represent the destination
+		 */
+		GInetAddress *address = g_inet_address_new_from_string(host);
+		*peer = g_inet_socket_address_new(address, port);
+		if (!*peer) {
+			fprintf(stderr, "Error creating GSocketAddress\n");
+			g_object_unref(socket);
+			socket = NULL;
+		}
+
+		g_object_unref(address);
+	}
+
+	if (socket) {
+		/*
+		 * Avoid blocking on incoming data
+		 */
+		g_socket_set_blocking(socket, FALSE);
+
+		/*
+		 * Make room for the fragments of a READ_LARGE answer arriving
+		 * in a burst; the kernel caps it to its own limit
+		 */
+		g_socket_set_option(socket, SOL_SOCKET, SO_RCVBUF, MAGMA_LARGE_IO_RECEIVE_BUFFER, NULL);
+	}
+
+#if MAGMA_CACHE_SOCKETS
 	/*
-	 * Create a GSocketAddress to represent the destination
+	 * save the socket in the cache. If another thread got there
+	 * first, use its socket and drop this one.
 	 */
-	GInetAddress *address = g_inet_address_new_from_string(host);
-	*peer = g_inet_socket_address_new(address, port);
-	if (!*peer) {
-		fprintf(stderr, "Error creating GSocketAddress\n");
+	if (!socket) {
+		g_free(key);
+		return (NULL);
+	}
+
+	g_mutex_lock(&magma_socket_cache_mutex);
+	sc = g_hash_table_lookup(magma_socket_cache, key);
+	if (sc) {
+		g_mutex_unlock(&magma_socket_cache_mutex);
 		g_object_unref(socket);
-		socket = NULL;
+		g_object_unref(*peer);
+		g_free(key);
+		*peer = sc->peer;
+		return (sc->socket);
 	}
 
-	g_object_unref(address);
+	sc = g_new0(magma_socket_cacher, 1);
+	sc->peer = *peer;
+	sc->socket = socket;
+	g_mutex_init(&sc->lock);
+	g_cond_init(&sc->cond);
+	g_queue_init(&sc->streams);
+	sc->rto = MAGMA_RTO_INITIAL;
+	sc->version = 1;
+	sc->pending = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, NULL);
+	sc->gro = magma_udp_enable_gro(socket);
+	sc->mtu = magma_socket_is_local(socket) ? 0 : magma_path_mtu_probe(*peer);
+	sc->congestion = magma_congestion_lookup(host);
+	g_object_set_data(G_OBJECT(socket), "magma-demux", sc);
+	g_hash_table_insert(magma_socket_cache, key, sc);
+	g_mutex_unlock(&magma_socket_cache_mutex);
 
-#if MAGMA_CACHE_SOCKETS
 	/*
-	 * save the socket in the cache
+	 * ask the peer its protocol version; the answer is picked up
+	 * by the demultiplexer, until then requests use version 1
 	 */
-	if (!g_hash_table_contains(magma_socket_cache, key)) {
-		magma_socket_cacher *sc = g_new0(magma_socket_cacher, 1);
-		if (sc) {
-			sc->peer = *peer;
-			sc->socket = socket;
-			g_hash_table_insert(magma_socket_cache, key, sc);
-		}
-	}
+	magma_demux_negotiate(sc);
 #endif
 
 	return (socket);
@@ -155,6 +1253,112 @@ void magma_close_client_connection(GSocket *socket, GSocketAddress *peer)
 #endif
 }
 
+/**
+ * Replies diverted into a buffer instead of being sent, or a reply
+ * handed to the next receive instead of being read from the wire.
+ * Both are per thread and bound to one socket, so other traffic of
+ * the thread goes on as usual.
+ */
+typedef struct {
+	GSocket *socket;
+	gchar *buffer;
+	gsize max_size;
+	gssize length;
+} magma_divert;
+
+static GPrivate magma_capture_current = G_PRIVATE_INIT(g_free);
+static GPrivate magma_replay_current = G_PRIVATE_INIT(g_free);
+
+static magma_divert *magma_divert_get(GPrivate *key)
+{
+	magma_divert *divert = g_private_get(key);
+	if (!divert) {
+		divert = g_new0(magma_divert, 1);
+		g_private_set(key, divert);
+	}
+	return (divert);
+}
+
+/**
+ * Start capturing what the calling thread sends on socket: the last
+ * packet sent is copied into buffer instead of going on the wire.
+ *
+ * @param socket the socket whose packets are captured
+ * @param buffer where the packet is copied
+ * @param max_size the size of buffer
+ */
+void magma_capture_begin(GSocket *socket, gchar *buffer, gsize max_size)
+{
+	magma_divert *capture = magma_divert_get(&magma_capture_current);
+	capture->socket = socket;
+	capture->buffer = buffer;
+	capture->max_size = max_size;
+	capture->length = -1;
+}
+
+/**
+ * Stop capturing started with magma_capture_begin()
+ *
+ * @return the length of the packet captured, -1 if nothing was sent;
+ *         more than max_size if the packet was truncated
+ */
+gssize magma_capture_end()
+{
+	magma_divert *capture = magma_divert_get(&magma_capture_current);
+	capture->socket = NULL;
+	return (capture->length);
+}
+
+/**
+ * Copy a packet into the capture buffer if the calling thread
+ * is capturing on socket
+ *
+ * @return TRUE if captured
+ */
+static gboolean magma_capture_vectors(GSocket *socket, GOutputVector *vectors, gint num_vectors)
+{
+	magma_divert *capture = g_private_get(&magma_capture_current);
+	if (!capture || !capture->socket || capture->socket isNot socket) return (FALSE);
+
+	gsize length = 0, copied = 0;
+	gint i = 0;
+	for (; i < num_vectors; i++) {
+		gsize size = MIN(vectors[i].size, capture->max_size - copied);
+		memcpy(capture->buffer + copied, vectors[i].buffer, size);
+		copied += size;
+		length += vectors[i].size;
+	}
+
+	capture->length = length;
+	return (TRUE);
+}
+
+/**
+ * Make the next receive of the calling thread on socket return
+ * buffer instead of reading the wire. Receives after the first
+ * one time out.
+ *
+ * @param socket the socket
+ * @param buffer the packet to be received
+ * @param length the packet length
+ */
+void magma_replay_begin(GSocket *socket, gchar *buffer, gsize length)
+{
+	magma_divert *replay = magma_divert_get(&magma_replay_current);
+	replay->socket = socket;
+	replay->buffer = buffer;
+	replay->length = length;
+}
+
+/**
+ * Stop replaying started with magma_replay_begin()
+ */
+void magma_replay_end()
+{
+	magma_divert *replay = magma_divert_get(&magma_replay_current);
+	replay->socket = NULL;
+}
+
 /*
  * Send a request/response buffer over the wire. First the buffer
  * length is sent as a guint16 type. Then the buffer itself gets streamed.
@@ -168,6 +1372,11 @@ GIOStatus magma_send_buffer(GSocket *socket, GSocketAddress *peer, const gchar *
 	/* null size? then return */
 	if (!size) return (G_IO_STATUS_NORMAL);
 
+	GOutputVector vector = { buffer, size };
+	if (magma_capture_vectors(socket, &vector, 1)) return (G_IO_STATUS_NORMAL);
+
+	if (magma_socket_is_stream(socket)) return (magma_send_vectors(socket, peer, &vector, 1));
+
 	GError *error = NULL;
 	int sent = g_socket_send_to(socket, peer, buffer, size, NULL, &error);
 
@@ -180,16 +1389,445 @@ GIOStatus magma_send_buffer(GSocket *socket, GSocketAddress *peer, const gchar *
 	return (G_IO_STATUS_NORMAL);
 }
 
+/**
+ * Tell if a socket is a stream connection rather than a datagram socket
+ *
+ * @param socket a GSocket
+ * @return TRUE for TCP connections
+ */
+gboolean magma_socket_is_stream(GSocket *socket)
+{
+	return ((g_socket_get_socket_type(socket) is G_SOCKET_TYPE_STREAM) ? TRUE : FALSE);
+}
+
+static void magma_stream_free_lock(gpointer lock)
+{
+	g_mutex_clear(lock);
+	g_free(lock);
+}
+
+/**
+ * Prepare a stream connection to carry magma packets. A lock is
+ * attached to serialize the frames written by different threads.
+ *
+ * @param stream the stream socket
+ * @param timeout seconds a read or write may block, 0 for ever
+ */
+void magma_stream_setup(GSocket *stream, guint timeout)
+{
+	GMutex *lock = g_new0(GMutex, 1);
+	g_mutex_init(lock);
+	g_object_set_data_full(G_OBJECT(stream), "magma-stream-lock", lock, magma_stream_free_lock);
+
+	g_socket_set_blocking(stream, TRUE);
+	g_socket_set_timeout(stream, timeout);
+	g_socket_set_option(stream, IPPROTO_TCP, TCP_NODELAY, 1, NULL);
+}
+
+/**
+ * Write a packet on a stream connection, preceded by its length
+ *
+ * @param stream the stream socket
+ * @param vectors the pieces of the packet
+ * @param num_vectors the number of elements in vectors
+ */
+static GIOStatus magma_stream_send(GSocket *stream, GOutputVector *vectors, gint num_vectors)
+{
+	GOutputVector *frame = g_newa(GOutputVector, num_vectors + 1);
+
+	guint32 length = 0;
+	gint i = 0;
+	for (; i < num_vectors; i++) {
+		frame[i + 1] = vectors[i];
+		length += vectors[i].size;
+	}
+
+	guint32 wire_length = htonl(length);
+	frame[0].buffer = &wire_length;
+	frame[0].size = MAGMA_STREAM_FRAME_HEADER;
+
+	GIOStatus status = G_IO_STATUS_NORMAL;
+	GMutex *lock = g_object_get_data(G_OBJECT(stream), "magma-stream-lock");
+	if (lock) g_mutex_lock(lock);
+
+	/*
+	 * a stream may take less than the whole frame at once
+	 */
+	gint first = 0, count = num_vectors + 1;
+	while (first < count) {
+		GError *error = NULL;
+		gssize sent = g_socket_send_message(stream, NULL, frame + first, count - first, NULL, 0, 0, NULL, &error);
+		if (-1 == sent) {
+			dbg(LOG_ERR, DEBUG_NET, "Error sending on stream: %s", error ? error->message : "unknown reason");
+			if (error) g_error_free(error);
+			status = G_IO_STATUS_ERROR;
+			break;
+		}
+
+		while (first < count && (gsize) sent >= frame[first].size) {
+			sent -= frame[first].size;
+			first++;
+		}
+
+		if (first < count) {
+			frame[first].buffer = (const gchar *) frame[first].buffer + sent;
+			frame[first].size -= sent;
+		}
+	}
+
+	if (lock) g_mutex_unlock(lock);
+	return (status);
+}
+
+/**
+ * Read exactly size bytes from a stream
+ */
+static gboolean magma_stream_read_all(GSocket *stream, gchar *buffer, gsize size)
+{
+	while (size) {
+		GError *error = NULL;
+		gssize received = g_socket_receive(stream, buffer, size, NULL, &error);
+		if (received <= 0) {
+			if (error) {
+				dbg(LOG_ERR, DEBUG_NET, "Error receiving from stream: %s", error->message);
+				g_error_free(error);
+			}
+			return (FALSE);
+		}
+		buffer += received;
+		size -= received;
+	}
+
+	return (TRUE);
+}
+
+/**
+ * Read the next packet from a stream connection
+ *
+ * @param stream the stream socket
+ * @param buffer the buffer to read into
+ * @param max_size the buffer size
+ * @param length if not NULL, returns the packet length
+ * @return G_IO_STATUS_NORMAL, G_IO_STATUS_EOF if the peer closed the connection
+ * or G_IO_STATUS_ERROR; after an error the stream is out of sync and must be closed
+ */
+GIOStatus magma_stream_receive(GSocket *stream, gchar *buffer, gsize max_size, gssize *length)
+{
+	guint32 wire_length = 0;
+	if (!magma_stream_read_all(stream, (gchar *) &wire_length, MAGMA_STREAM_FRAME_HEADER)) return (G_IO_STATUS_EOF);
+
+	gsize size = ntohl(wire_length);
+	if (size > max_size) {
+		dbg(LOG_ERR, DEBUG_NET, "Stream frame of %lu bytes exceeds %lu", (unsigned long) size, (unsigned long) max_size);
+		return (G_IO_STATUS_ERROR);
+	}
+
+	if (!magma_stream_read_all(stream, buffer, size)) return (G_IO_STATUS_ERROR);
+
+	/* buffers are recycled, so terminate what has been received */
+	if (size < max_size) buffer[size] = '\0';
+	if (length) *length = size;
+
+	return (G_IO_STATUS_NORMAL);
+}
+
 /*
- * Receive a request/response buffer over the wire. First the buffer
- * length is received as a guint16 type. Then the buffer itself gets read.
+ * Send a request/response gathered from several buffers as a
+ * single datagram, letting the kernel collect the pieces instead
+ * of copying them into a contiguous buffer first.
  *
- * @param connection an open connection
- * @param request the buffer to be sent over the wire
- * @param size the buffer size
+ * @param socket the GSocket to send on
+ * @param peer the remote end point
+ * @param vectors the pieces of the datagram
+ * @param num_vectors the number of elements in vectors
  */
-GIOStatus magma_receive_buffer(GSocket *socket, GSocketAddress *peer, gchar *buffer, gsize max_size)
+GIOStatus magma_send_vectors(GSocket *socket, GSocketAddress *peer, GOutputVector *vectors, gint num_vectors)
+{
+	if (magma_capture_vectors(socket, vectors, num_vectors)) return (G_IO_STATUS_NORMAL);
+
+	if (magma_socket_is_stream(socket)) return (magma_stream_send(socket, vectors, num_vectors));
+
+	GError *error = NULL;
+	gssize sent = g_socket_send_message(socket, peer, vectors, num_vectors, NULL, 0, 0, NULL, &error);
+
+	if (-1 == sent) {
+		dbg(LOG_ERR, DEBUG_NET, "Error sending UDP datagram: %s", error ? error->message : "unknown reason");
+		if (error) g_error_free(error);
+		return (G_IO_STATUS_ERROR);
+	}
+
+	return (G_IO_STATUS_NORMAL);
+}
+
+static gint magma_udp_gso = FALSE;
+static gint magma_udp_gro = FALSE;
+static GOnce magma_udp_offload_once = G_ONCE_INIT;
+
+/**
+ * Check once if the kernel knows UDP_SEGMENT and UDP_GRO
+ */
+static gpointer magma_udp_offload_probe(gpointer data)
+{
+	(void) data;
+
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd is -1) return (NULL);
+
+#ifdef UDP_SEGMENT
+	int segment = MAGMA_UDP_GSO_MAX_SEGMENT_SIZE;
+	if (setsockopt(fd, IPPROTO_UDP, UDP_SEGMENT, &segment, sizeof(int)) is 0) g_atomic_int_set(&magma_udp_gso, TRUE);
+#endif
+
+#ifdef UDP_GRO
+	int on = 1;
+	if (setsockopt(fd, IPPROTO_UDP, UDP_GRO, &on, sizeof(int)) is 0) g_atomic_int_set(&magma_udp_gro, TRUE);
+#endif
+
+	close(fd);
+
+	dbg(LOG_INFO, DEBUG_NET, "UDP segmentation offload %s, UDP receive offload %s",
+		g_atomic_int_get(&magma_udp_gso) ? "on" : "off",
+		g_atomic_int_get(&magma_udp_gro) ? "on" : "off");
+
+	return (NULL);
+}
+
+/**
+ * Tell if bursts of datagrams can be sent with UDP_SEGMENT
+ *
+ * @return TRUE if the running kernel supports it
+ */
+gboolean magma_udp_gso_supported()
+{
+	g_once(&magma_udp_offload_once, magma_udp_offload_probe, NULL);
+	return (g_atomic_int_get(&magma_udp_gso) ? TRUE : FALSE);
+}
+
+/**
+ * Tell if coalesced datagrams can be received with UDP_GRO
+ *
+ * @return TRUE if the running kernel supports it
+ */
+gboolean magma_udp_gro_supported()
+{
+	g_once(&magma_udp_offload_once, magma_udp_offload_probe, NULL);
+	return (g_atomic_int_get(&magma_udp_gro) ? TRUE : FALSE);
+}
+
+/**
+ * Turn UDP_GRO on for a datagram socket. Whoever reads the socket
+ * must then split what it reads with magma_udp_gro_segment_size().
+ *
+ * @param socket a UDP GSocket
+ * @return TRUE if UDP_GRO is on
+ */
+gboolean magma_udp_enable_gro(GSocket *socket)
+{
+#ifdef UDP_GRO
+	if (!magma_udp_gro_supported()) return (FALSE);
+	return (g_socket_set_option(socket, IPPROTO_UDP, UDP_GRO, 1, NULL));
+#else
+	(void) socket;
+	return (FALSE);
+#endif
+}
+
+/**
+ * Get the size of the datagrams coalesced in a buffer read with
+ * recvmsg() from a socket with UDP_GRO on. Every datagram but the
+ * last one is that long.
+ *
+ * @param msg the message header passed to recvmsg(), with room for control messages
+ * @param length the bytes read
+ * @return the segment size, length if the buffer holds one datagram
+ */
+gsize magma_udp_gro_segment_size(struct msghdr *msg, gsize length)
+{
+#ifdef UDP_GRO
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+	for (; cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level is IPPROTO_UDP && cmsg->cmsg_type is UDP_GRO) {
+			int segment = 0;
+			memcpy(&segment, CMSG_DATA(cmsg), sizeof(int));
+			if (segment > 0 && (gsize) segment < length) return (segment);
+		}
+	}
+#else
+	(void) msg;
+#endif
+	return (length);
+}
+
+/**
+ * Tell if a burst can go out as one UDP_SEGMENT send: more than one
+ * datagram, all of the same size but the last one, which may be
+ * shorter, each fitting an ethernet frame and all together fitting
+ * the largest UDP payload.
+ *
+ * @return the segment size, 0 if the burst can't be segmented
+ */
+static gsize magma_udp_gso_segment(GOutputMessage *messages, guint num_messages)
+{
+	if (num_messages < 2 || num_messages > MAGMA_UDP_GSO_MAX_SEGMENTS) return (0);
+	if (!magma_udp_gso_supported()) return (0);
+
+	gsize segment = 0, total = 0;
+	guint i, j;
+	for (i = 0; i < num_messages; i++) {
+		gsize size = 0;
+		for (j = 0; j < messages[i].num_vectors; j++) size += messages[i].vectors[j].size;
+
+		if (!i) segment = size;
+		if (!size || size > segment || (size < segment && i < num_messages - 1)) return (0);
+		total += size;
+	}
+
+	if (segment > MAGMA_UDP_GSO_MAX_SEGMENT_SIZE || total > MAGMA_MAX_BUFFER_SIZE) return (0);
+
+	return (segment);
+}
+
+/**
+ * Send a burst as one buffer the kernel cuts into segment long
+ * datagrams. If the route can't do it, segmentation is turned off.
+ *
+ * @return TRUE if sent
+ */
+static gboolean magma_udp_send_segmented(GSocket *socket, GSocketAddress *peer, GOutputMessage *messages, guint num_messages, gsize segment)
+{
+#ifdef UDP_SEGMENT
+	struct sockaddr_storage address;
+	if (!g_socket_address_to_native(peer, &address, sizeof(struct sockaddr_storage), NULL)) return (FALSE);
+
+	guint count = 0, i, j;
+	for (i = 0; i < num_messages; i++) count += messages[i].num_vectors;
+
+	struct iovec *iov = g_newa(struct iovec, count);
+	for (count = 0, i = 0; i < num_messages; i++) {
+		for (j = 0; j < messages[i].num_vectors; j++, count++) {
+			iov[count].iov_base = (gpointer) messages[i].vectors[j].buffer;
+			iov[count].iov_len = messages[i].vectors[j].size;
+		}
+	}
+
+	union {
+		gchar buffer[CMSG_SPACE(sizeof(guint16))];
+		struct cmsghdr align;
+	} control;
+	memset(&control, 0, sizeof(control));
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(struct msghdr));
+	msg.msg_name = &address;
+	msg.msg_namelen = g_socket_address_get_native_size(peer);
+	msg.msg_iov = iov;
+	msg.msg_iovlen = count;
+	msg.msg_control = control.buffer;
+	msg.msg_controllen = sizeof(control.buffer);
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = IPPROTO_UDP;
+	cmsg->cmsg_type = UDP_SEGMENT;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(guint16));
+	guint16 segment_size = segment;
+	memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(guint16));
+
+	if (sendmsg(g_socket_get_fd(socket), &msg, 0) isNot -1) return (TRUE);
+
+	if (errno is EIO || errno is EINVAL || errno is EOPNOTSUPP) {
+		dbg(LOG_ERR, DEBUG_NET, "UDP segmentation offload failed, turning it off: %s", strerror(errno));
+		g_atomic_int_set(&magma_udp_gso, FALSE);
+	}
+#else
+	(void) socket; (void) peer; (void) messages; (void) num_messages; (void) segment;
+#endif
+	return (FALSE);
+}
+
+/**
+ * Send a burst of datagrams to the same peer with as few system calls
+ * as possible: one UDP_SEGMENT send if the kernel supports it and the
+ * datagrams fit (see magma_udp_gso_segment()), sendmmsg() otherwise.
+ * On a stream connection, each datagram becomes a frame.
+ *
+ * @param socket the GSocket to send on
+ * @param peer the remote end point
+ * @param messages the datagrams; address and bytes_sent are set here
+ * @param num_messages the number of elements in messages
+ */
+GIOStatus magma_send_datagrams(GSocket *socket, GSocketAddress *peer, GOutputMessage *messages, guint num_messages)
+{
+	guint i;
+
+	if (magma_socket_is_stream(socket)) {
+		for (i = 0; i < num_messages; i++) {
+			GIOStatus status = magma_stream_send(socket, messages[i].vectors, messages[i].num_vectors);
+			if (status isNot G_IO_STATUS_NORMAL) return (status);
+		}
+		return (G_IO_STATUS_NORMAL);
+	}
+
+	/* local sockets ignore UDP_SEGMENT and would send the burst as one datagram */
+	gsize segment = magma_socket_is_local(socket) ? 0 : magma_udp_gso_segment(messages, num_messages);
+	if (segment && magma_udp_send_segmented(socket, peer, messages, num_messages, segment)) return (G_IO_STATUS_NORMAL);
+
+	for (i = 0; i < num_messages; i++) {
+		messages[i].address = peer;
+		messages[i].bytes_sent = 0;
+		messages[i].control_messages = NULL;
+		messages[i].num_control_messages = 0;
+	}
+
+	guint sent = 0;
+	while (sent < num_messages) {
+		GError *error = NULL;
+		gint count = g_socket_send_messages(socket, messages + sent, num_messages - sent, 0, NULL, &error);
+		if (count <= 0) {
+			dbg(LOG_ERR, DEBUG_NET, "Error sending UDP datagrams: %s", error ? error->message : "unknown reason");
+			if (error) g_error_free(error);
+			return (G_IO_STATUS_ERROR);
+		}
+		sent += count;
+	}
+
+	return (G_IO_STATUS_NORMAL);
+}
+
+/*
+ * Receive a request/response datagram, or the next packet of a
+ * stream connection.
+ *
+ * @param socket the GSocket to receive from
+ * @param peer the remote end point
+ * @param buffer the buffer to read into
+ * @param max_size the buffer size
+ * @param length if not NULL, returns the bytes received
+ * @return G_IO_STATUS_NORMAL, G_IO_STATUS_AGAIN on timeout or G_IO_STATUS_ERROR
+ */
+GIOStatus magma_receive_datagram(GSocket *socket, GSocketAddress *peer, gchar *buffer, gsize max_size, gssize *length)
 {
+	magma_divert *replay = g_private_get(&magma_replay_current);
+	if (replay && replay->socket && replay->socket is socket) {
+		if (replay->length <= 0) return (G_IO_STATUS_AGAIN);
+
+		gsize replayed = MIN((gsize) replay->length, max_size);
+		memcpy(buffer, replay->buffer, replayed);
+		if (replayed < max_size) buffer[replayed] = '\0';
+		replay->length = 0;
+		if (length) *length = replayed;
+		return (G_IO_STATUS_NORMAL);
+	}
+
+	if (magma_socket_is_stream(socket)) return (magma_stream_receive(socket, buffer, max_size, length));
+
+#if MAGMA_CACHE_SOCKETS
+	/*
+	 * cached sockets are shared, so replies go through the demultiplexer
+	 */
+	magma_socket_cacher *sc = magma_demux_lookup(socket);
+	if (sc) return (magma_demux_receive(sc, buffer, max_size, length));
+#endif
+
 	int read = FALSE;
 
 	do {
@@ -211,6 +1849,10 @@ GIOStatus magma_receive_buffer(GSocket *socket, GSocketAddress *peer, gchar *buf
 			return (G_IO_STATUS_ERROR);
 		} else {
 			read = TRUE;
+			if (length) *length = received;
+
+			/* buffers are recycled, so terminate what has been received */
+			if ((gsize) received < max_size) buffer[received] = '\0';
 		}
 
 		if (error) g_error_free(error);
@@ -219,6 +1861,19 @@ GIOStatus magma_receive_buffer(GSocket *socket, GSocketAddress *peer, gchar *buf
 	return (G_IO_STATUS_NORMAL);
 }
 
+/*
+ * Receive a request/response buffer over the wire.
+ *
+ * @param socket the GSocket to receive from
+ * @param peer the remote end point
+ * @param buffer the buffer to read into
+ * @param max_size the buffer size
+ */
+GIOStatus magma_receive_buffer(GSocket *socket, GSocketAddress *peer, gchar *buffer, gsize max_size)
+{
+	return (magma_receive_datagram(socket, peer, buffer, max_size, NULL));
+}
+
 #if 0
 
 static gchar __G_IO_STATUS_ERROR[]  = "G_IO_STATUS_ERROR";
@@ -36,6 +36,26 @@
  */
 #define MAGMA_WAIT_CYCLE_UNIT 20 * 1000
 
+/**
+ * Retransmission timeout bounds for cached sockets, in microseconds.
+ * The timeout starts at MAGMA_RTO_INITIAL and follows the measured
+ * round trip time of the peer.
+ */
+#define MAGMA_RTO_INITIAL (320 * 1000)
+#define MAGMA_RTO_MIN (2 * 1000)
+#define MAGMA_RTO_MAX (3 * 1000 * 1000)
+
+/**
+ * Congestion window bounds, in datagrams. The requests and large I/O
+ * fragments this process sends to a host share one window, whatever
+ * the port and the thread sending them: it grows by one datagram per
+ * acknowledgment up to the slow start threshold, by one per window
+ * past it, and halves when a request goes unanswered.
+ */
+#define MAGMA_CWND_INITIAL MAGMA_LARGE_IO_WINDOW
+#define MAGMA_CWND_MIN 2
+#define MAGMA_CWND_MAX (2 * MAGMA_LARGE_IO_MAX_FRAGMENTS)
+
 /**
  * if set to TRUE, when a connection is closed, a MAGMA_OPTYPE_CLOSE_CONNECTION
  * message is sent.
@@ -81,10 +101,111 @@ extern void close_connection(magma_connection *connection);
 #define MAGMA_MAX_BUFFER_SIZE 65507
 #define MAGMA_READ_WRITE_BUFFER_SIZE 32768
 
+/** free MAGMA_MAX_BUFFER_SIZE buffers kept by each thread for reuse */
+#define MAGMA_IO_BUFFERS_PER_THREAD 4
+
+extern gchar *magma_io_buffer_get();
+extern void magma_io_buffer_release(gchar *buffer);
+extern void magma_io_buffer_cleanup(gchar **buffer);
+
+/**
+ * Declare a MAGMA_MAX_BUFFER_SIZE buffer taken from the thread
+ * free list. The buffer is not zeroed and goes back to the free
+ * list by itself when the declaring block ends.
+ */
+#define MAGMA_IO_BUFFER(name) gchar *name __attribute__((cleanup(magma_io_buffer_cleanup))) = magma_io_buffer_get()
+
 extern GIOStatus magma_perfect_send(magma_connection *connection, const gchar *buffer, guint16 size, gboolean flush, const gchar *caption);
 extern GIOStatus magma_send_buffer(GSocket *socket, GSocketAddress *peer, const gchar *buffer, guint16 size);
+/** replies kept for a waiter which is not receiving */
+#define MAGMA_DEMUX_EARLY_LIMIT (2 * MAGMA_LARGE_IO_MAX_FRAGMENTS)
+
+/** receives the reply to an asynchronous request */
+typedef void (*magma_demux_deliver_func)(gpointer data, gchar *datagram, gssize length);
+
+extern gboolean magma_demux_wide_tids(GSocket *socket);
+extern guint magma_demux_peer_version(GSocket *socket);
+extern guint magma_path_mtu(GSocket *socket);
+extern void magma_path_mtu_refresh(GSocket *socket);
+extern gboolean magma_demux_submit(GSocket *socket, guint32 tid, magma_demux_deliver_func deliver, gpointer data);
+extern gboolean magma_demux_cancel(GSocket *socket, guint32 tid);
+extern void magma_demux_poll(GSocket *socket);
+extern void magma_demux_expect(GSocket *socket, guint32 tid);
+extern void magma_demux_forget(GSocket *socket);
+
+extern gboolean magma_rtt_adaptive(GSocket *socket);
+extern gint64 magma_rtt_timeout(GSocket *socket);
+extern void magma_rtt_sample(GSocket *socket, gint64 rtt);
+extern void magma_rtt_backoff(GSocket *socket);
+
+extern guint magma_cwnd_acquire(GSocket *socket, guint wanted, gboolean wait);
+extern void magma_cwnd_release(GSocket *socket, guint granted, guint acked);
+extern void magma_cwnd_loss(GSocket *socket);
+
+extern GIOStatus magma_send_vectors(GSocket *socket, GSocketAddress *peer, GOutputVector *vectors, gint num_vectors);
+
+/**
+ * UDP segmentation offload. A burst of equally sized datagrams goes
+ * to the kernel as one buffer cut by the kernel or the NIC (UDP_SEGMENT);
+ * on receive, UDP_GRO hands such bursts back coalesced. Both are
+ * detected at run time.
+ */
+#define MAGMA_UDP_GSO_MAX_SEGMENTS 64
+
+/** the largest segment: an ethernet MTU minus IPv4 and UDP headers */
+#define MAGMA_UDP_GSO_MAX_SEGMENT_SIZE 1472
+
+/** datagrams handed to magma_send_datagrams() at once by the large I/O paths */
+#define MAGMA_UDP_SEND_BATCH MAGMA_LARGE_IO_WINDOW
+
+extern gboolean magma_udp_gso_supported();
+extern gboolean magma_udp_gro_supported();
+extern gboolean magma_udp_enable_gro(GSocket *socket);
+extern gsize magma_udp_gro_segment_size(struct msghdr *msg, gsize length);
+extern GIOStatus magma_send_datagrams(GSocket *socket, GSocketAddress *peer, GOutputMessage *messages, guint num_messages);
+
+/**
+ * Stream (TCP) connections carry the same packets as UDP, each
+ * one preceded by its length as a 32 bit network order integer
+ */
+#define MAGMA_STREAM_FRAME_HEADER 4
+
+/** idle stream connections kept open to each peer */
+#define MAGMA_STREAMS_PER_PEER 4
+
+/** seconds a client waits for a stream reply before giving up on the connection */
+#define MAGMA_STREAM_TIMEOUT 30
+
+/** stream connections a service keeps open, more are closed at once */
+#define MAGMA_STREAM_MAX_CONNECTIONS 64
+
+extern gboolean magma_socket_is_stream(GSocket *socket);
+extern void magma_stream_setup(GSocket *stream, guint timeout);
+extern GIOStatus magma_stream_receive(GSocket *stream, gchar *buffer, gsize max_size, gssize *length);
+extern GSocket *magma_stream_checkout(GSocket *socket);
+extern void magma_stream_checkin(GSocket *socket, GSocket *stream, gboolean reusable);
+
+/**
+ * A server also listens on a unix datagram socket in the abstract
+ * namespace, named after its UDP port. Clients on the same host
+ * reach it there, skipping the UDP/IP stack.
+ */
+#define MAGMA_LOCAL_SOCKET_FORMAT "magma-%u"
+
+/** the name a local client binds to, to receive its replies */
+#define MAGMA_LOCAL_CLIENT_FORMAT "magma-client-%d-%d"
+
+extern GSocketAddress *magma_local_service_address(guint16 port);
+extern gboolean magma_socket_is_local(GSocket *socket);
+extern gboolean magma_address_is_local(const gchar *host);
+
+extern void magma_capture_begin(GSocket *socket, gchar *buffer, gsize max_size);
+extern gssize magma_capture_end();
+extern void magma_replay_begin(GSocket *socket, gchar *buffer, gsize length);
+extern void magma_replay_end();
 
 extern GIOStatus perfect_receive(magma_connection *connection, gchar *buffer, guint16 size, const gchar *caption);
 extern GIOStatus magma_receive_buffer(GSocket *socket, GSocketAddress *peer, gchar *buffer, gsize max_size);
+extern GIOStatus magma_receive_datagram(GSocket *socket, GSocketAddress *peer, gchar *buffer, gsize max_size, gssize *length);
 
 #endif /* _MAGMA_NET_LAYER_H */
@@ -834,6 +834,94 @@ void magma_console_cache_load(magma_session_environment *env, char *buffer, regm
 	magma_console_xsendline(env, "Cache contains %d flares.\n", g_tree_nnodes(magma_cache_gtree));
 }
 
+/** console command that prints SQL statistics */
+void magma_console_sql_stats(magma_session_environment *env, char *buffer, regmatch_t *matchptr)
+{
+	(void) buffer;
+	(void) matchptr;
+
+	magma_sql_stats stats[MAGMA_SQL_KINDS];
+	magma_sql_get_stats(stats);
+
+	magma_console_xsendline(env, "Slow statement threshold: %ldus\n\n", magma_sql_slow_threshold);
+	magma_console_sendline(env, "  kind       count   errors   avg wait   max wait   avg exec   max exec\n");
+
+	magma_sql_kind kind = 0;
+	for (; kind < MAGMA_SQL_KINDS; kind++) {
+		if (!stats[kind].count) continue;
+
+		magma_console_xsendline(env, "  %-6s %9lu %8lu %8luus %8luus %8luus %8luus\n",
+			magma_sql_kind_name(kind),
+			stats[kind].count,
+			stats[kind].errors,
+			stats[kind].wait_time / stats[kind].count,
+			stats[kind].max_wait,
+			stats[kind].exec_time / stats[kind].count,
+			stats[kind].max_exec);
+	}
+
+	for (kind = 0; kind < MAGMA_SQL_KINDS; kind++) {
+		if (!stats[kind].count) continue;
+
+		magma_console_xsendline(env, "\n  %s execution time:\n", magma_sql_kind_name(kind));
+
+		int bucket = 0;
+		for (; bucket < MAGMA_SQL_HISTOGRAM_BUCKETS; bucket++) {
+			if (!stats[kind].histogram[bucket]) continue;
+
+			if (bucket is MAGMA_SQL_HISTOGRAM_BUCKETS - 1) {
+				magma_console_xsendline(env, "    >= %8luus: %lu\n", 1UL << bucket, stats[kind].histogram[bucket]);
+			} else {
+				magma_console_xsendline(env, "    < %9luus: %lu\n", 1UL << (bucket + 1), stats[kind].histogram[bucket]);
+			}
+		}
+	}
+}
+
+/** console command that prints worker pool statistics */
+void magma_console_pool_stats(magma_session_environment *env, char *buffer, regmatch_t *matchptr)
+{
+	(void) buffer;
+	(void) matchptr;
+
+	magma_console_sendline(env, "  class      workers   queue  priority    admitted    rejected\n");
+
+	magma_request_class class = 0;
+	for (; class < MAGMA_SCHEDULER_CLASSES; class++) {
+		magma_scheduler_class *sc = magma_scheduler_get_class(class);
+		magma_console_xsendline(env, "  %-9s %8d %7u %9u %11d %11d\n",
+			sc->name,
+			sc->workers,
+			sc->queue_limit,
+			sc->priority,
+			g_atomic_int_get(&sc->admitted),
+			g_atomic_int_get(&sc->rejected));
+	}
+}
+
+/** console command that resets SQL statistics */
+void magma_console_sql_reset(magma_session_environment *env, char *buffer, regmatch_t *matchptr)
+{
+	(void) buffer;
+	(void) matchptr;
+
+	magma_sql_reset_stats();
+	magma_console_sendline(env, "SQL statistics cleared.\n");
+}
+
+/** console command that sets the slow SQL statement threshold */
+void magma_console_sql_slow(magma_session_environment *env, char *buffer, regmatch_t *matchptr)
+{
+	gchar *threshold = buffer + matchptr[1].rm_so;
+	magma_sql_slow_threshold = g_ascii_strtoll(threshold, NULL, 10) * 1000;
+
+	if (magma_sql_slow_threshold) {
+		magma_console_xsendline(env, "Logging SQL statements lasting more than %ldms.\n", magma_sql_slow_threshold / 1000);
+	} else {
+		magma_console_sendline(env, "Slow SQL statements log disabled.\n");
+	}
+}
+
 /** close current connection */
 void magma_console_quit(magma_session_environment *env, char *buffer, regmatch_t *matchptr)
 {
@@ -871,6 +959,10 @@ void magma_init_console()
 	magma_console_add_hook("pwd",			magma_console_pwd,				"           pwd: print working directory");
 	magma_console_add_hook("quit",			magma_console_quit,				"          quit: close current session");
 	magma_console_add_hook("shutdown",		magma_console_server_shutdown,	"      shutdown: shutdown magma server");
+	magma_console_add_hook("pool stats",	magma_console_pool_stats,		"    pool stats: print worker pool sizes and admission counters");
+	magma_console_add_hook("sql reset",		magma_console_sql_reset,		"     sql reset: clear SQL statistics");
+	magma_console_add_hook("sql slow ([0-9]+)",magma_console_sql_slow,		"  sql slow <N>: log SQL statements lasting more than N ms (0 disables)");
+	magma_console_add_hook("sql stats",		magma_console_sql_stats,		"     sql stats: print SQL statement counters and latencies");
 }
 
 /**
@@ -32,8 +32,7 @@ magma_pktqs_chmod(
 	mode_t mode,
 	magma_flare_response *response)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	magma_transaction_id tid = 0;
 	gchar *ptr = magma_format_request_header(buffer, MAGMA_OP_TYPE_CHMOD, uid, gid, &tid, ttl);
@@ -60,8 +59,7 @@ void magma_pktas_chmod(
 	magma_transaction_id tid,
 	magma_flags flags)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	gchar *ptr = magma_format_response_header(buffer, res, error, tid, flags);
 
@@ -70,8 +68,7 @@ void magma_pktas_chmod(
 
 GIOStatus magma_pktar_chmod(GSocket *socket, GSocketAddress *peer, magma_flare_response *response)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	gchar *ptr = magma_pktar(socket, peer, buffer, (magma_response *) response);
 
@@ -33,8 +33,7 @@ magma_pktqs_chown(
 	gid_t new_gid,
 	magma_flare_response *response)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	magma_transaction_id tid = 0;
 	gchar *ptr = magma_format_request_header(buffer, MAGMA_OP_TYPE_CHOWN, uid, gid, &tid, ttl);
@@ -64,8 +63,7 @@ void magma_pktas_chown(
 	magma_transaction_id tid,
 	magma_flags flags)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	gchar *ptr = magma_format_response_header(buffer, res, error, tid, flags);
 
@@ -74,8 +72,7 @@ void magma_pktas_chown(
 
 GIOStatus magma_pktar_chown(GSocket *socket, GSocketAddress *peer, magma_flare_response *response)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	gchar *ptr = magma_pktar(socket, peer, buffer, (magma_response *) response);
 
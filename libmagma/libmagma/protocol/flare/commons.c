@@ -30,8 +30,6 @@
  */
 gchar *magma_pktqr(GSocket *socket, GSocketAddress *peer, gchar *buffer, magma_request *request)
 {
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
-
 	if (G_IO_STATUS_NORMAL != magma_receive_buffer(socket, peer, buffer, MAGMA_MAX_BUFFER_SIZE))
 		return (NULL);
 
@@ -48,16 +46,19 @@ gchar *magma_pktqr(GSocket *socket, GSocketAddress *peer, gchar *buffer, magma_r
  * magma_response (see its union body) without wasting network
  * bandwidth and cpu time.
  *
+ * The bytes received are saved in the length field of the response
+ * header, so variable length fields can be bounded by the datagram.
+ *
  * @param socket the GSocket used to receive
  * @param response the magma_response buffer to write in (must be allocated)
  * @return TRUE in case of success, FALSE otherwise
  */
 gchar *magma_pktar(GSocket *socket, GSocketAddress *peer, gchar *buffer, magma_response *response)
 {
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
-
 	/* get the packet from the wire */
-	response->generic_response.header.status = magma_receive_buffer(socket, peer, buffer, MAGMA_MAX_BUFFER_SIZE);
+	response->generic_response.header.length = 0;
+	response->generic_response.header.status = magma_receive_datagram(
+		socket, peer, buffer, MAGMA_MAX_BUFFER_SIZE, &response->generic_response.header.length);
 
 	/* if the GIOStatus is not normal, return NULL */
 	if (response->generic_response.header.status isNot G_IO_STATUS_NORMAL) {
@@ -72,6 +73,27 @@ gchar *magma_pktar(GSocket *socket, GSocketAddress *peer, gchar *buffer, magma_r
 	return (ptr);
 }
 
+/**
+ * Choose the fragment size of a READ_LARGE or WRITE_LARGE so that each
+ * datagram fits the path MTU to the peer of socket. Peers too old for
+ * READ_PMTU and WRITE_PMTU, local sockets and paths whose MTU holds a
+ * whole MAGMA_LARGE_IO_FRAGMENT_SIZE get MAGMA_LARGE_IO_FRAGMENT_SIZE.
+ *
+ * @param socket a GSocket returned by magma_open_client_connection()
+ * @param overhead the bytes each datagram carries besides the data
+ * @return the fragment size
+ */
+guint16 magma_pmtu_fragment_size(GSocket *socket, gsize overhead)
+{
+	if (magma_demux_peer_version(socket) < MAGMA_PMTU_IO_VERSION) return (MAGMA_LARGE_IO_FRAGMENT_SIZE);
+
+	guint mtu = magma_path_mtu(socket);
+	if (mtu < MAGMA_PMTU_IP_OVERHEAD + overhead + MAGMA_PMTU_MIN_FRAGMENT_SIZE) return (MAGMA_LARGE_IO_FRAGMENT_SIZE);
+
+	gsize fragment_size = mtu - MAGMA_PMTU_IP_OVERHEAD - overhead;
+	return ((fragment_size < MAGMA_LARGE_IO_FRAGMENT_SIZE) ? fragment_size : MAGMA_LARGE_IO_FRAGMENT_SIZE);
+}
+
 magma_transaction_id
 magma_pktqs_f_opendir(
 	GSocket *socket,
@@ -82,8 +104,7 @@ magma_pktqs_f_opendir(
 	magma_offset offset,
 	magma_flare_response *response)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	magma_transaction_id tid = 0;
 	gchar *ptr = magma_format_request_header(buffer, MAGMA_OP_TYPE_F_OPENDIR, uid, gid, &tid, MAGMA_TERMINAL_TTL);
@@ -109,8 +130,7 @@ void magma_pktas_f_opendir(
 	gchar *payload, magma_offset offset, magma_size buffer_size,
 	magma_size size, magma_transaction_id tid, magma_flags flags)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	gchar *ptr = magma_format_response_header(buffer, res, error, tid, flags);
 
@@ -128,8 +148,7 @@ void magma_pktas_f_opendir(
 
 GIOStatus magma_pktar_f_opendir(GSocket *socket, GSocketAddress *peer, magma_flare_response *response)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	gchar *ptr = magma_pktar(socket, peer, buffer, (magma_response *) response);
 
@@ -161,8 +180,7 @@ magma_pktqs_add_flare_to_parent(
 	const gchar *path,
 	magma_flare_response *response)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	magma_transaction_id tid = 0;
 	gchar *ptr = magma_format_request_header(buffer, MAGMA_OP_TYPE_ADD_FLARE_TO_PARENT, uid, gid, &tid, ttl);
@@ -183,8 +201,7 @@ void magma_pktqr_add_flare_to_parent(gchar *buffer, magma_flare_request *request
 
 void magma_pktas_add_flare_to_parent(GSocket *socket, GSocketAddress *peer, int res, int error, magma_transaction_id tid)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	gchar *ptr = magma_format_response_header(buffer, res, error, tid);
 
@@ -193,8 +210,7 @@ void magma_pktas_add_flare_to_parent(GSocket *socket, GSocketAddress *peer, int
 
 GIOStatus magma_pktar_add_flare_to_parent(GSocket *socket, GSocketAddress *peer, magma_flare_response *response)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	gchar *ptr = magma_pktar(socket, peer, buffer, (magma_response *) response);
 
@@ -215,8 +231,7 @@ magma_pktqs_remove_flare_from_parent(
 	const gchar *path,
 	magma_flare_response *response)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	magma_transaction_id tid = 0;
 	gchar *ptr = magma_format_request_header(buffer, MAGMA_OP_TYPE_REMOVE_FLARE_FROM_PARENT, uid, gid, &tid, ttl);
@@ -237,8 +252,7 @@ void magma_pktqr_remove_flare_from_parent(gchar *buffer, magma_flare_request *re
 
 void magma_pktas_remove_flare_from_parent(GSocket *socket, GSocketAddress *peer, int res, int error, magma_transaction_id tid)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	gchar *ptr = magma_format_response_header(buffer, res, error, tid);
 
@@ -249,8 +263,7 @@ void magma_pktas_remove_flare_from_parent(GSocket *socket, GSocketAddress *peer,
 
 GIOStatus magma_pktar_remove_flare_from_parent(GSocket *socket, GSocketAddress *peer, magma_flare_response *response)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	gchar *ptr = magma_pktar(socket, peer, buffer, (magma_response *) response);
 
@@ -258,3 +271,51 @@ GIOStatus magma_pktar_remove_flare_from_parent(GSocket *socket, GSocketAddress *
 }
 
 #endif
+
+/************************************************\
+ * NEGOTIATE                                    *
+\************************************************/
+
+/**
+ * Ask a peer which protocol version it speaks. The request is sent
+ * in version 1 format and the answer is not waited for: it will be
+ * picked up by the socket demultiplexer, which must know the
+ * transaction ID before the request leaves.
+ *
+ * @param socket the GSocket to send on
+ * @param peer the remote end point
+ * @param tid the transaction ID of the request
+ * @return the transaction ID of the request
+ */
+magma_transaction_id magma_pktqs_negotiate(GSocket *socket, GSocketAddress *peer, magma_transaction_id tid)
+{
+	MAGMA_IO_BUFFER(buffer);
+
+	gchar *ptr = magma_format_request_header(buffer, MAGMA_OP_TYPE_NEGOTIATE, 0, 0, &tid, MAGMA_TERMINAL_TTL);
+	ptr = magma_serialize_8(ptr, MAGMA_PROTOCOL_VERSION);
+
+	magma_log_transaction(MAGMA_OP_TYPE_NEGOTIATE, tid, peer);
+	magma_send_request(socket, peer, buffer, ptr - buffer);
+
+	return (tid);
+}
+
+void magma_pktqr_negotiate(gchar *buffer, magma_flare_request *request)
+{
+	gchar *ptr = buffer;
+	ptr = magma_deserialize_8(ptr, &request->body.negotiate.version);
+}
+
+/**
+ * Answer a NEGOTIATE request with the highest version
+ * both ends speak, carried in the result field, and the
+ * transports offered, carried in the flags
+ */
+void magma_pktas_negotiate(GSocket *socket, GSocketAddress *peer, guint8 version, magma_transaction_id tid, magma_flags flags)
+{
+	MAGMA_IO_BUFFER(buffer);
+
+	gchar *ptr = magma_format_response_header(buffer, MIN(version, MAGMA_PROTOCOL_VERSION), 0, tid, flags);
+
+	magma_send_buffer(socket, peer, buffer, ptr - buffer);
+}
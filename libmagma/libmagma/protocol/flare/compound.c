@@ -0,0 +1,321 @@
+/*
+   MAGMA -- protocol_flare/compound.c
+   Copyright (C) 2006-2013 Tx0 <tx0@strumentiresistenti.org>
+
+   COMPOUND: several requests to the same server in one datagram.
+   Between magma_compound_begin() and magma_compound_end() the requests
+   a thread sends on a socket are recorded instead of being sent; they
+   go on the wire together when the compound is full or ends, and each
+   reply is handed to the receiver of its request as if it had been
+   read from the socket.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include "../../magma.h"
+
+/**
+ * The requests recorded by a thread
+ */
+typedef struct {
+	GSocket *socket;
+	GSocketAddress *peer;
+	gboolean flushing;		/** the recorded requests are on their way */
+	guint count;
+	gsize length;			/** bytes used in buffer */
+	gchar *buffer;			/** the requests, each one preceded by its 16 bit length */
+	gsize offsets[MAGMA_COMPOUND_MAX_OPERATIONS];
+	guint16 lengths[MAGMA_COMPOUND_MAX_OPERATIONS];
+	magma_receiver_func receivers[MAGMA_COMPOUND_MAX_OPERATIONS];
+	magma_response *responses[MAGMA_COMPOUND_MAX_OPERATIONS];
+} magma_compound;
+
+static GPrivate magma_compound_current;
+
+/**
+ * Tell if an operation can travel inside a COMPOUND. Only
+ * metadata operations with a short reply are allowed: bulk
+ * data and directory listings have their own transports.
+ *
+ * @param type the operation
+ * @return TRUE if allowed
+ */
+gboolean magma_compound_allowed(magma_optype type)
+{
+	if (
+		type is MAGMA_OP_TYPE_GETATTR ||
+		type is MAGMA_OP_TYPE_READLINK ||
+		type is MAGMA_OP_TYPE_MKNOD ||
+		type is MAGMA_OP_TYPE_MKDIR ||
+		type is MAGMA_OP_TYPE_UNLINK ||
+		type is MAGMA_OP_TYPE_RMDIR ||
+		type is MAGMA_OP_TYPE_SYMLINK ||
+		type is MAGMA_OP_TYPE_RENAME ||
+		type is MAGMA_OP_TYPE_LINK ||
+		type is MAGMA_OP_TYPE_CHMOD ||
+		type is MAGMA_OP_TYPE_CHOWN ||
+		type is MAGMA_OP_TYPE_TRUNCATE ||
+		type is MAGMA_OP_TYPE_UTIME ||
+		type is MAGMA_OP_TYPE_OPEN ||
+		type is MAGMA_OP_TYPE_OPEN_HANDLE ||
+		type is MAGMA_OP_TYPE_STATFS) return (TRUE);
+
+	return (FALSE);
+}
+
+/**
+ * Start recording the requests the calling thread sends on socket.
+ * Their responses are filled only after magma_compound_end(), so
+ * callers must not look at them before.
+ *
+ * @param socket the socket the requests are sent on
+ * @param peer the server
+ * @return TRUE if recording, FALSE if the requests will be sent one by
+ *         one (old peer, stream socket, compound already running); call
+ *         magma_compound_end() only if TRUE was returned
+ */
+gboolean magma_compound_begin(GSocket *socket, GSocketAddress *peer)
+{
+	if (g_private_get(&magma_compound_current)) return (FALSE);
+	if (magma_socket_is_stream(socket)) return (FALSE);
+	if (magma_demux_peer_version(socket) < MAGMA_COMPOUND_VERSION) return (FALSE);
+
+	magma_compound *compound = g_new0(magma_compound, 1);
+	compound->socket = socket;
+	compound->peer = peer;
+	compound->buffer = g_new0(gchar, MAGMA_COMPOUND_MAX_PAYLOAD);
+
+	g_private_set(&magma_compound_current, compound);
+	return (TRUE);
+}
+
+/**
+ * Send the recorded requests and hand each reply to its receiver.
+ * A single request is sent as usual. The requests the server didn't
+ * serve because the chain stopped on a failure are answered with
+ * ECANCELED; those left out for lack of room are sent one by one.
+ */
+static void magma_compound_flush(magma_compound *compound)
+{
+	if (!compound->count) return;
+	compound->flushing = TRUE;
+
+	guint i = 0;
+	if (compound->count > 1) {
+		MAGMA_IO_BUFFER(request);
+		MAGMA_IO_BUFFER(replies);
+
+		magma_transaction_id tid = 0;
+		gchar *ptr = magma_format_request_header(request, MAGMA_OP_TYPE_COMPOUND, 0, 0, &tid, MAGMA_TERMINAL_TTL);
+		ptr = magma_serialize_16(ptr, compound->count);
+		memcpy(ptr, compound->buffer, compound->length);
+		ptr += compound->length;
+
+		magma_flare_response response;
+		memset(&response, 0, sizeof(magma_flare_response));
+		response.body.compound.replies = replies;
+
+		magma_log_transaction(MAGMA_OP_TYPE_COMPOUND, tid, compound->peer);
+		magma_send_and_receive(compound->socket, compound->peer, request, ptr - request, magma_pktar_compound, &response);
+
+		if (response.header.status isNot G_IO_STATUS_NORMAL || response.header.res < 0) {
+			for (; i < compound->count; i++) {
+				compound->responses[i]->generic_response.header.status = G_IO_STATUS_ERROR;
+				compound->responses[i]->generic_response.header.res = -1;
+				compound->responses[i]->generic_response.header.err_no = EIO;
+			}
+		} else {
+			guint served = MIN((guint) response.header.res, compound->count);
+			magma_result last = 0;
+
+			gchar *rptr = replies;
+			for (; i < served; i++) {
+				guint16 length = 0;
+				rptr = magma_deserialize_16(rptr, &length);
+
+				magma_replay_begin(compound->socket, rptr, length);
+				compound->receivers[i](compound->socket, compound->peer, compound->responses[i]);
+				magma_replay_end();
+
+				if (compound->responses[i]->generic_response.header.status isNot G_IO_STATUS_NORMAL) {
+					compound->responses[i]->generic_response.header.status = G_IO_STATUS_ERROR;
+					compound->responses[i]->generic_response.header.res = -1;
+					compound->responses[i]->generic_response.header.err_no = EIO;
+				}
+
+				last = magma_peek_response_result(rptr, length);
+				rptr += length;
+			}
+
+			/* the chain stopped on a failure: what follows was not executed */
+			if (served && last is -1) {
+				for (; i < compound->count; i++) {
+					compound->responses[i]->generic_response.header.status = G_IO_STATUS_NORMAL;
+					compound->responses[i]->generic_response.header.res = -1;
+					compound->responses[i]->generic_response.header.err_no = ECANCELED;
+				}
+			}
+		}
+	}
+
+	/*
+	 * what is left goes one by one; the server operation cache
+	 * answers again what it already served under the same ID
+	 */
+	for (; i < compound->count; i++) {
+		magma_send_and_receive(compound->socket, compound->peer,
+			compound->buffer + compound->offsets[i], compound->lengths[i],
+			compound->receivers[i], compound->responses[i]);
+	}
+
+	compound->count = 0;
+	compound->length = 0;
+	compound->flushing = FALSE;
+}
+
+/**
+ * Record a request inside the compound of the calling thread.
+ * Called by magma_send_vectors_and_receive_base() once the request
+ * header has been fitted to the peer.
+ *
+ * @return TRUE if recorded, FALSE if the request must be sent now
+ */
+gboolean magma_compound_record(
+	GSocket *socket,
+	GOutputVector *vectors,
+	gint num_vectors,
+	magma_receiver_func receiver,
+	magma_response *response)
+{
+	magma_compound *compound = g_private_get(&magma_compound_current);
+	if (!compound || compound->flushing || compound->socket isNot socket) return (FALSE);
+
+	/* a request which can't be batched must follow those recorded before it */
+	if (!magma_compound_allowed(((guint8 *) vectors[0].buffer)[0])) {
+		magma_compound_flush(compound);
+		return (FALSE);
+	}
+
+	gsize length = 0;
+	gint i = 0;
+	for (; i < num_vectors; i++) length += vectors[i].size;
+	if (length + sizeof(guint16) > MAGMA_COMPOUND_MAX_PAYLOAD) {
+		magma_compound_flush(compound);
+		return (FALSE);
+	}
+
+	if (compound->count is MAGMA_COMPOUND_MAX_OPERATIONS ||
+		compound->length + sizeof(guint16) + length > MAGMA_COMPOUND_MAX_PAYLOAD) magma_compound_flush(compound);
+
+	gchar *ptr = magma_serialize_16(compound->buffer + compound->length, length);
+	compound->offsets[compound->count] = ptr - compound->buffer;
+	compound->lengths[compound->count] = length;
+	compound->receivers[compound->count] = receiver;
+	compound->responses[compound->count] = response;
+
+	for (i = 0; i < num_vectors; i++) {
+		memcpy(ptr, vectors[i].buffer, vectors[i].size);
+		ptr += vectors[i].size;
+	}
+
+	compound->length = ptr - compound->buffer;
+	compound->count++;
+
+	response->generic_response.header.status = G_IO_STATUS_AGAIN;
+	response->generic_response.header.res = -1;
+	response->generic_response.header.err_no = EINPROGRESS;
+
+	return (TRUE);
+}
+
+/**
+ * Send what the calling thread recorded since magma_compound_begin()
+ * and stop recording. On return all the responses are filled.
+ */
+void magma_compound_end()
+{
+	magma_compound *compound = g_private_get(&magma_compound_current);
+	if (!compound) return;
+
+	magma_compound_flush(compound);
+
+	g_private_set(&magma_compound_current, NULL);
+	g_free(compound->buffer);
+	g_free(compound);
+}
+
+void magma_pktqr_compound(gchar *buffer, magma_flare_request *request)
+{
+	gchar *ptr = buffer;
+	ptr = magma_deserialize_16(ptr, &request->body.compound.count);
+	request->body.compound.operations = ptr;
+}
+
+void magma_pktas_compound(
+	GSocket *socket,
+	GSocketAddress *peer,
+	int count,
+	gchar *replies,
+	gsize length,
+	magma_transaction_id tid,
+	magma_flags flags)
+{
+	MAGMA_IO_BUFFER(buffer);
+
+	gchar *ptr = magma_format_response_header(buffer, count, 0, tid, flags);
+
+	GOutputVector vectors[2] = {
+		{ buffer, ptr - buffer },
+		{ replies, length },
+	};
+
+	magma_send_vectors(socket, peer, vectors, 2);
+}
+
+GIOStatus magma_pktar_compound(GSocket *socket, GSocketAddress *peer, magma_flare_response *response)
+{
+	MAGMA_IO_BUFFER(buffer);
+
+	gchar *ptr = magma_pktar(socket, peer, buffer, (magma_response *) response);
+
+	if (!ptr) return (G_IO_STATUS_AGAIN);
+	if (response->header.res <= 0) {
+		response->body.compound.length = 0;
+		return (G_IO_STATUS_NORMAL);
+	}
+
+	/*
+	 * walk the replies to learn how many bytes they take, dropping
+	 * those cut by a malformed datagram
+	 */
+	gchar *start = ptr;
+	gchar *end = buffer + MAGMA_MAX_BUFFER_SIZE;
+	int served = 0;
+	for (; served < response->header.res; served++) {
+		guint16 length = 0;
+		if (ptr + sizeof(guint16) > end) break;
+		magma_deserialize_16(ptr, &length);
+		if (ptr + sizeof(guint16) + length > end) break;
+		ptr += sizeof(guint16) + length;
+	}
+
+	response->header.res = served;
+	response->body.compound.length = ptr - start;
+	memcpy(response->body.compound.replies, start, ptr - start);
+
+	return (G_IO_STATUS_NORMAL);
+}
+
+// vim:ts=4:nocindent:autoindent
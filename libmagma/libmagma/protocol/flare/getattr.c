@@ -30,7 +30,7 @@ magma_pktqs_getattr(
 	const gchar *path,
 	magma_flare_response *response)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
+	MAGMA_IO_BUFFER(buffer);
 
 	magma_transaction_id tid = 0;
 	gchar *ptr = magma_format_request_header(buffer, MAGMA_OP_TYPE_GETATTR, uid, gid, &tid, MAGMA_TERMINAL_TTL);
@@ -140,7 +140,7 @@ void magma_pktas_getattr(
 	magma_transaction_id tid,
 	magma_flags flags)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
+	MAGMA_IO_BUFFER(buffer);
 
 	gchar *ptr = magma_format_response_header(buffer, res, error, tid, flags);
 
@@ -153,7 +153,7 @@ void magma_pktas_getattr(
 
 GIOStatus magma_pktar_getattr(GSocket *socket, GSocketAddress *peer, magma_flare_response *response)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
+	MAGMA_IO_BUFFER(buffer);
 
 	gchar *ptr = magma_pktar(socket, peer, buffer, (magma_response *) response);
 
@@ -0,0 +1,207 @@
+/*
+   MAGMA -- protocol_flare/handle.c
+   Copyright (C) 2006-2013 Tx0 <tx0@strumentiresistenti.org>
+
+   OPEN_HANDLE, READ_HANDLE and WRITE_HANDLE: READ and WRITE naming
+   the flare by the file handle OPEN_HANDLE answered instead of by
+   its path. A handle is the binary hash of the path plus the flare
+   generation, so a request carries 24 bytes in place of up to
+   MAGMA_TERMINATED_PATH_LENGTH and the owner looks its cache up
+   directly.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include "../../magma.h"
+
+gchar *magma_serialize_handle(gchar *buffer, const magma_flare_handle *handle)
+{
+	memcpy(buffer, handle->binhash, SHA_DIGEST_LENGTH);
+	return (magma_serialize_32(buffer + SHA_DIGEST_LENGTH, handle->generation));
+}
+
+gchar *magma_deserialize_handle(gchar *buffer, magma_flare_handle *handle)
+{
+	memcpy(handle->binhash, buffer, SHA_DIGEST_LENGTH);
+	return (magma_deserialize_32(buffer + SHA_DIGEST_LENGTH, &handle->generation));
+}
+
+/*
+ * OPEN_HANDLE: the request is that of OPEN
+ */
+magma_transaction_id
+magma_pktqs_open_handle(
+	GSocket *socket,
+	GSocketAddress *peer,
+	uid_t uid,
+	gid_t gid,
+	guint32 flags,
+	const gchar *path,
+	magma_flare_response *response)
+{
+	MAGMA_IO_BUFFER(buffer);
+
+	magma_transaction_id tid = 0;
+	gchar *ptr = magma_format_request_header(buffer, MAGMA_OP_TYPE_OPEN_HANDLE, uid, gid, &tid, MAGMA_TERMINAL_TTL);
+
+	ptr = magma_serialize_32(ptr, flags);
+	ptr = magma_serialize_string(ptr, path);
+
+	magma_log_transaction(MAGMA_OP_TYPE_OPEN_HANDLE, tid, peer);
+	magma_send_and_receive(socket, peer, buffer, ptr - buffer, magma_pktar_open_handle, response);
+
+	return (tid);
+}
+
+void magma_pktas_open_handle(
+	GSocket *socket,
+	GSocketAddress *peer,
+	int res,
+	int error,
+	magma_flare_t *flare,
+	magma_transaction_id tid,
+	magma_flags flags)
+{
+	MAGMA_IO_BUFFER(buffer);
+
+	gchar *ptr = magma_format_response_header(buffer, res, error, tid, flags);
+
+	if (res isNot -1) {
+		magma_flare_handle handle;
+		memcpy(handle.binhash, flare->binhash, SHA_DIGEST_LENGTH);
+		handle.generation = flare->generation;
+
+		ptr = magma_serialize_string(ptr, flare->commit_url);
+		ptr = magma_serialize_handle(ptr, &handle);
+	}
+
+	magma_send_buffer(socket, peer, buffer, ptr - buffer);
+}
+
+GIOStatus magma_pktar_open_handle(GSocket *socket, GSocketAddress *peer, magma_flare_response *response)
+{
+	MAGMA_IO_BUFFER(buffer);
+
+	gchar *ptr = magma_pktar(socket, peer, buffer, (magma_response *) response);
+
+	if (ptr && response->header.res isNot -1) {
+		ptr = magma_deserialize_string(ptr, response->body.open.commit_url);
+		ptr = magma_deserialize_handle(ptr, &response->body.open.handle);
+	}
+
+	return (!ptr ? G_IO_STATUS_AGAIN : G_IO_STATUS_NORMAL);
+}
+
+/*
+ * READ_HANDLE: answered by magma_pktas_read()
+ */
+magma_transaction_id
+magma_pktqs_read_handle(
+	GSocket *socket,
+	GSocketAddress *peer,
+	uid_t uid,
+	gid_t gid,
+	guint32 size,
+	guint64 offset,
+	const magma_flare_handle *handle,
+	magma_flare_response *response)
+{
+	MAGMA_IO_BUFFER(buffer);
+
+	magma_transaction_id tid = 0;
+	gchar *ptr = magma_format_request_header(buffer, MAGMA_OP_TYPE_READ_HANDLE, uid, gid, &tid, MAGMA_TERMINAL_TTL);
+	ptr = magma_serialize_32(ptr, size);
+	ptr = magma_serialize_64(ptr, offset);
+	ptr = magma_serialize_handle(ptr, handle);
+
+	magma_log_transaction(MAGMA_OP_TYPE_READ_HANDLE, tid, peer);
+	magma_send_and_receive(socket, peer, buffer, ptr - buffer, magma_pktar_read_handle, response);
+
+	return (tid);
+}
+
+void magma_pktqr_read_handle(gchar *buffer, magma_flare_request *request)
+{
+	gchar *ptr = buffer;
+	ptr = magma_deserialize_32(ptr, &request->body.read_handle.size);
+	ptr = magma_deserialize_64(ptr, &request->body.read_handle.offset);
+	ptr = magma_deserialize_handle(ptr, &request->body.read_handle.handle);
+}
+
+/**
+ * Unlike magma_pktar_read(), an error answer is final: a stale
+ * handle must reach the caller at once to fall back to the path.
+ */
+GIOStatus magma_pktar_read_handle(GSocket *socket, GSocketAddress *peer, magma_flare_response *response)
+{
+	MAGMA_IO_BUFFER(buffer);
+
+	gchar *ptr = magma_pktar(socket, peer, buffer, (magma_response *) response);
+
+	if (G_IO_STATUS_NORMAL != response->header.status || !ptr) return (G_IO_STATUS_AGAIN);
+
+	if (response->header.res > 0)
+		memcpy(response->body.read.buffer, ptr, MIN(response->header.res, MAGMA_READ_WRITE_BUFFER_SIZE));
+
+	return (G_IO_STATUS_NORMAL);
+}
+
+/*
+ * WRITE_HANDLE: answered by magma_pktas_write()
+ */
+magma_transaction_id
+magma_pktqs_write_handle(
+	GSocket *socket,
+	GSocketAddress *peer,
+	magma_ttl ttl,
+	uid_t uid,
+	gid_t gid,
+	guint32 size,
+	guint64 offset,
+	const magma_flare_handle *handle,
+	const gchar *write_buffer,
+	magma_flare_response *response)
+{
+	gchar header[MAGMA_VECTOR_HEADER_SIZE];
+
+	magma_transaction_id tid = 0;
+	gchar *ptr = magma_format_request_header(header, MAGMA_OP_TYPE_WRITE_HANDLE, uid, gid, &tid, ttl);
+
+	ptr = magma_serialize_32(ptr, size);
+	ptr = magma_serialize_64(ptr, offset);
+	ptr = magma_serialize_handle(ptr, handle);
+
+	GOutputVector vectors[2] = {
+		{ header, ptr - header },
+		{ write_buffer, size },
+	};
+
+	magma_log_transaction(MAGMA_OP_TYPE_WRITE_HANDLE, tid, peer);
+	magma_send_vectors_and_receive(socket, peer, vectors, 2, magma_pktar_write, response);
+
+	return (tid);
+}
+
+void magma_pktqr_write_handle(gchar *buffer, magma_flare_request *request)
+{
+	gchar *ptr = buffer;
+	ptr = magma_deserialize_32(ptr, &request->body.write_handle.size);
+	ptr = magma_deserialize_64(ptr, &request->body.write_handle.offset);
+	ptr = magma_deserialize_handle(ptr, &request->body.write_handle.handle);
+
+	request->body.write_handle.buffer = ptr;
+}
+
+// vim:ts=4:nocindent:autoindent
@@ -32,8 +32,7 @@ magma_pktqs_mkdir(
 	const gchar *path,
 	magma_flare_response *response)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	magma_transaction_id tid = 0;
 	gchar *ptr = magma_format_request_header(buffer, MAGMA_OP_TYPE_MKDIR, uid, gid, &tid, ttl);
@@ -63,8 +62,7 @@ void magma_pktas_mkdir(
 	magma_transaction_id tid,
 	magma_flags flags)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	gchar *ptr = magma_format_response_header(buffer, res, error, tid, flags);
 
@@ -73,8 +71,7 @@ void magma_pktas_mkdir(
 
 GIOStatus magma_pktar_mkdir(GSocket *socket, GSocketAddress *peer, magma_flare_response *response)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	gchar *ptr = magma_pktar(socket, peer, buffer, (magma_response *) response);
 
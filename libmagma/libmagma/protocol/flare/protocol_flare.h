@@ -27,6 +27,12 @@
 /** magma flags used by Flare and Node protocol */
 #define MAGMA_FLAG_REFRESH_TOPOLOGY 1
 
+/** in a NEGOTIATE response: bulk operations can be sent over a stream connection */
+#define MAGMA_FLAG_STREAM_TRANSPORT 2
+
+/** in a WRITE_LARGE response: not all the fragments arrived, a bitmap of the received ones follows */
+#define MAGMA_FLAG_LARGE_IO_PARTIAL 4
+
 /**
  * raises a flag in a bitmask
  */
@@ -149,6 +155,27 @@ typedef struct MAGMA_PROTOCOL_ALIGNMENT {
 	magma_extended_readdir_entry entries[MAGMA_MAX_READDIR_ENTRIES];
 } magma_response_readdir_extended_body;
 
+/**
+ * READDIR_COMPACT is READDIR_EXTENDED with the entries packed: each
+ * name is preceded by its length and each stat field is written as
+ * a varint, so an answer carries as many entries as fit a datagram
+ * instead of MAGMA_MAX_READDIR_ENTRIES. The request is the same.
+ */
+#define MAGMA_COMPACT_READDIR_VERSION 6
+
+/** room for the entries, leaving space for the response header, offset and count */
+#define MAGMA_COMPACT_READDIR_PAYLOAD (MAGMA_MAX_BUFFER_SIZE - 64)
+
+/** the longest entry: the name, its length and 13 stat fields */
+#define MAGMA_COMPACT_READDIR_ENTRY_MAX_SIZE (MAGMA_TERMINATED_DIRENTRY_LENGTH + 14 * MAGMA_VARINT_MAX_SIZE)
+
+typedef struct MAGMA_PROTOCOL_ALIGNMENT {
+	magma_readdir_entry entry_number;
+	magma_offset offset;
+	gchar *entries;			/** entry_number packed entries; set by the caller, MAGMA_COMPACT_READDIR_PAYLOAD bytes */
+	gsize length;
+} magma_response_readdir_compact_body;
+
 /**
  * READDIR offset request body
  */
@@ -292,8 +319,25 @@ typedef struct MAGMA_PROTOCOL_ALIGNMENT {
 	gchar path[MAGMA_TERMINATED_PATH_LENGTH];
 } magma_request_open_body;
 
+/**
+ * A file handle names a flare by the binary hash of its path and
+ * by the generation the flare got entering the cache of its owner.
+ * OPEN_HANDLE answers it after the commit URL; READ_HANDLE and
+ * WRITE_HANDLE carry it instead of the path, so the owner finds
+ * the flare in its cache without hashing anything. A handle whose
+ * flare left the cache, or whose receiver doesn't hold the flare,
+ * is answered ESTALE and the client goes back to the path.
+ */
+#define MAGMA_HANDLE_VERSION 7
+
+typedef struct MAGMA_PROTOCOL_ALIGNMENT {
+	unsigned char binhash[SHA_DIGEST_LENGTH];
+	guint32 generation;
+} magma_flare_handle;
+
 typedef struct MAGMA_PROTOCOL_ALIGNMENT {
 	gchar commit_url[2 * MAGMA_TERMINATED_PATH_LENGTH];
+	magma_flare_handle handle;	/** OPEN_HANDLE only */
 } magma_response_open_body;
 
 /**
@@ -324,6 +368,109 @@ typedef struct MAGMA_PROTOCOL_ALIGNMENT {
 	// empty
 } magma_response_write_body;
 
+/**
+ * READ_HANDLE and WRITE_HANDLE: READ and WRITE by file handle.
+ * The answers are those of READ and WRITE.
+ */
+typedef struct MAGMA_PROTOCOL_ALIGNMENT {
+	magma_offset offset;
+	magma_size32 size;
+	magma_flare_handle handle;
+} magma_request_read_handle_body;
+
+typedef struct MAGMA_PROTOCOL_ALIGNMENT {
+	magma_offset offset;
+	magma_size32 size;
+	magma_flare_handle handle;
+	gchar *buffer;
+} magma_request_write_handle_body;
+
+/**
+ * READ_LARGE and WRITE_LARGE move up to MAGMA_LARGE_IO_MAX_SIZE bytes
+ * in one transaction, split in numbered fragments of one READ or WRITE
+ * each. Only missing fragments are sent again: READ_LARGE requests
+ * carry the bitmap of the wanted fragments, WRITE_LARGE answers the
+ * bitmap of the received ones.
+ */
+#define MAGMA_LARGE_IO_VERSION 3
+#define MAGMA_LARGE_IO_FRAGMENT_SIZE MAGMA_READ_WRITE_BUFFER_SIZE
+#define MAGMA_LARGE_IO_MAX_FRAGMENTS 128
+#define MAGMA_LARGE_IO_BITMAP_WORDS (MAGMA_LARGE_IO_MAX_FRAGMENTS / 32)
+#define MAGMA_LARGE_IO_MAX_SIZE (MAGMA_LARGE_IO_FRAGMENT_SIZE * MAGMA_LARGE_IO_MAX_FRAGMENTS)
+
+/** fragments of MAGMA_LARGE_IO_FRAGMENT_SIZE sent before waiting for an acknowledgement */
+#define MAGMA_LARGE_IO_WINDOW 16
+
+/**
+ * READ_PMTU and WRITE_PMTU are READ_LARGE and WRITE_LARGE whose
+ * request carries the fragment size, chosen by the client so that
+ * each datagram fits the path MTU and no IP fragmentation happens.
+ * Smaller fragments travel in proportionally larger windows.
+ */
+#define MAGMA_PMTU_IO_VERSION 5
+
+/** below this, fragments cost more in headers than IP fragmentation does */
+#define MAGMA_PMTU_MIN_FRAGMENT_SIZE 512
+
+/** the IPv4 and UDP headers */
+#define MAGMA_PMTU_IP_OVERHEAD 28
+
+/** a READ_PMTU answer: the widest response header and the fragment index */
+#define MAGMA_PMTU_READ_OVERHEAD 16
+
+/** a WRITE_PMTU request: header, size, offset, path, fragment size and index */
+#define magma_pmtu_write_overhead(path) (32 + strlen(path))
+
+#define magma_large_io_window(fragment_size) \
+	MIN(MAGMA_LARGE_IO_MAX_FRAGMENTS, MAGMA_LARGE_IO_WINDOW * MAGMA_LARGE_IO_FRAGMENT_SIZE / (fragment_size))
+
+/** client receive buffer, room for two windows */
+#define MAGMA_LARGE_IO_RECEIVE_BUFFER (2 * MAGMA_LARGE_IO_WINDOW * MAGMA_LARGE_IO_FRAGMENT_SIZE)
+
+/** WRITE_LARGE fragment index asking which fragments arrived */
+#define MAGMA_LARGE_IO_PROBE 0xffff
+
+/** seconds an incomplete WRITE_LARGE is kept by the server */
+#define MAGMA_LARGE_IO_EXPIRE 30
+
+/** WRITE_LARGE reassembled at once by the server, more are refused with EAGAIN */
+#define MAGMA_LARGE_IO_MAX_WRITES 256
+
+/** bytes the WRITE_LARGE being reassembled may hold, more are refused with EAGAIN */
+#define MAGMA_LARGE_IO_MAX_PENDING (64 * 1024 * 1024)
+
+#define magma_large_io_fragments(size, fragment_size) (((size) + (fragment_size) - 1) / (fragment_size))
+#define magma_large_io_bit_is_set(bitmap, i) ((bitmap)[(i) / 32] & (1U << ((i) % 32)))
+#define magma_large_io_set_bit(bitmap, i) ((bitmap)[(i) / 32] |= (1U << ((i) % 32)))
+#define magma_large_io_clear_bit(bitmap, i) ((bitmap)[(i) / 32] &= ~(1U << ((i) % 32)))
+
+/**
+ * READ_LARGE
+ */
+typedef struct MAGMA_PROTOCOL_ALIGNMENT {
+	magma_offset offset;
+	magma_size32 size;
+	gchar path[MAGMA_TERMINATED_PATH_LENGTH];
+	guint16 fragment_size;	/** carried by READ_PMTU, MAGMA_LARGE_IO_FRAGMENT_SIZE for READ_LARGE */
+	guint32 wanted[MAGMA_LARGE_IO_BITMAP_WORDS];
+} magma_request_read_large_body;
+
+/**
+ * WRITE_LARGE
+ */
+typedef struct MAGMA_PROTOCOL_ALIGNMENT {
+	magma_offset offset;
+	magma_size32 size;
+	gchar path[MAGMA_TERMINATED_PATH_LENGTH];
+	guint16 fragment_size;	/** carried by WRITE_PMTU, MAGMA_LARGE_IO_FRAGMENT_SIZE for WRITE_LARGE */
+	guint16 fragment;
+	gchar *buffer;
+} magma_request_write_large_body;
+
+typedef struct MAGMA_PROTOCOL_ALIGNMENT {
+	guint32 received[MAGMA_LARGE_IO_BITMAP_WORDS];
+} magma_response_write_large_body;
+
 /**
  * STATFS
  */
@@ -377,6 +524,36 @@ typedef struct MAGMA_PROTOCOL_ALIGNMENT {
 	// empty
 } magma_response_remove_flare_from_parent_body;
 
+/**
+ * NEGOTIATE
+ */
+typedef struct MAGMA_PROTOCOL_ALIGNMENT {
+	guint8 version;
+} magma_request_negotiate_body;
+
+/**
+ * COMPOUND carries several requests to the same server in one
+ * datagram, each one with its own header and transaction ID, and
+ * is answered with all their replies. The requests are served in
+ * order and the first failure stops the chain; so does a reply
+ * which doesn't fit, and the client sends what is left one by one.
+ */
+#define MAGMA_COMPOUND_VERSION 4
+#define MAGMA_COMPOUND_MAX_OPERATIONS 16
+
+/** room for the requests or the replies, leaving space for the compound header */
+#define MAGMA_COMPOUND_MAX_PAYLOAD (MAGMA_MAX_BUFFER_SIZE - 64)
+
+typedef struct MAGMA_PROTOCOL_ALIGNMENT {
+	guint16 count;
+	gchar *operations;		/** count requests, each one preceded by its 16 bit length */
+} magma_request_compound_body;
+
+typedef struct MAGMA_PROTOCOL_ALIGNMENT {
+	gchar *replies;			/** res replies, each one preceded by its 16 bit length; set by the caller */
+	gsize length;
+} magma_response_compound_body;
+
 /**
  * FLARE REQUEST packet
  */
@@ -401,12 +578,19 @@ typedef struct MAGMA_PROTOCOL_ALIGNMENT {
 		magma_request_open_body open;
 		magma_request_read_body read;
 		magma_request_write_body write;
+		magma_request_read_handle_body read_handle;
+		magma_request_write_handle_body write_handle;
+		magma_request_read_large_body read_large;
+		magma_request_write_large_body write_large;
 		magma_request_statfs_body statfs;
 
 		magma_request_f_opendir_body f_opendir;
 
 		magma_request_add_flare_to_parent_body add_flare_to_parent;
 		magma_request_remove_flare_from_parent_body remove_flare_from_parent;
+
+		magma_request_negotiate_body negotiate;
+		magma_request_compound_body compound;
 	} body;
 } magma_flare_request;
 
@@ -420,6 +604,7 @@ typedef struct MAGMA_PROTOCOL_ALIGNMENT {
 		magma_response_readlink_body readlink;
 		magma_response_readdir_body readdir;
 		magma_response_readdir_extended_body readdir_extended;
+		magma_response_readdir_compact_body readdir_compact;
 		magma_response_readdir_offset_body readdir_offset;
 		magma_response_mknod_body mknod;
 		magma_response_mkdir_body mkdir;
@@ -434,12 +619,15 @@ typedef struct MAGMA_PROTOCOL_ALIGNMENT {
 		magma_response_open_body open;
 		magma_response_read_body read;
 		magma_response_write_body write;
+		magma_response_write_large_body write_large;
 		magma_response_statfs_body statfs;
 
 		magma_response_f_opendir_body f_opendir;
 
 		magma_response_add_flare_to_parent_body add_flare_to_parent;
 		magma_response_remove_flare_from_parent_body remove_flare_from_parent;
+
+		magma_response_compound_body compound;
 	} body;
 } magma_flare_response;
 
@@ -548,12 +736,45 @@ extern void magma_pktqr_write(gchar *buffer, magma_flare_request *request);
 extern void magma_pktas_write(GSocket *socket, GSocketAddress *peer, int res, int error, magma_transaction_id tid, magma_flags flags);
 extern GIOStatus magma_pktar_write(GSocket *socket, GSocketAddress *peer, magma_flare_response *response);
 
+/* OPEN_HANDLE, READ_HANDLE, WRITE_HANDLE */
+extern gchar *magma_serialize_handle(gchar *buffer, const magma_flare_handle *handle);
+extern gchar *magma_deserialize_handle(gchar *buffer, magma_flare_handle *handle);
+extern magma_transaction_id magma_pktqs_open_handle(GSocket *socket, GSocketAddress *peer, uid_t uid, gid_t gid, guint32 flags, const gchar *path, magma_flare_response *response);
+extern void magma_pktas_open_handle(GSocket *socket, GSocketAddress *peer, int res, int error, magma_flare_t *flare, magma_transaction_id tid, magma_flags flags);
+extern GIOStatus magma_pktar_open_handle(GSocket *socket, GSocketAddress *peer, magma_flare_response *response);
+extern magma_transaction_id magma_pktqs_read_handle(GSocket *socket, GSocketAddress *peer, uid_t uid, gid_t gid, guint32 size, guint64 offset, const magma_flare_handle *handle, magma_flare_response *response);
+extern void magma_pktqr_read_handle(gchar *buffer, magma_flare_request *request);
+extern GIOStatus magma_pktar_read_handle(GSocket *socket, GSocketAddress *peer, magma_flare_response *response);
+extern magma_transaction_id magma_pktqs_write_handle(GSocket *socket, GSocketAddress *peer, magma_ttl ttl, uid_t uid, gid_t gid, guint32 size, guint64 offset, const magma_flare_handle *handle, const gchar *write_buffer, magma_flare_response *response);
+extern void magma_pktqr_write_handle(gchar *buffer, magma_flare_request *request);
+
+/* READ_LARGE */
+extern guint16 magma_pmtu_fragment_size(GSocket *socket, gsize overhead);
+extern magma_transaction_id magma_pktqs_read_large(GSocket *socket, GSocketAddress *peer, uid_t uid, gid_t gid, guint32 size, guint64 offset, const gchar *path, guint16 fragment_size, gchar *read_buffer, magma_flare_response *response);
+extern void magma_pktqr_read_large(gchar *buffer, magma_flare_request *request);
+extern void magma_pktas_read_large(GSocket *socket, GSocketAddress *peer, int res, int error, gchar *read_buffer, guint16 fragment_size, guint32 *wanted, magma_transaction_id tid, magma_flags flags);
+extern int magma_pktqs_read_chunked(GSocket *socket, GSocketAddress *peer, uid_t uid, gid_t gid, guint32 size, guint64 offset, const gchar *path, gchar *read_buffer, magma_flare_response *response);
+
+/* WRITE_LARGE */
+extern magma_transaction_id magma_pktqs_write_large(GSocket *socket, GSocketAddress *peer, magma_ttl ttl, uid_t uid, gid_t gid, guint32 size, guint64 offset, const gchar *path, guint16 fragment_size, const gchar *write_buffer, magma_flare_response *response);
+extern void magma_pktqr_write_large(gchar *buffer, magma_flare_request *request);
+extern void magma_pktas_write_large(GSocket *socket, GSocketAddress *peer, guint32 *received, magma_transaction_id tid, magma_flags flags);
+extern int magma_pktqs_write_chunked(GSocket *socket, GSocketAddress *peer, magma_ttl ttl, uid_t uid, gid_t gid, guint32 size, guint64 offset, const gchar *path, const gchar *write_buffer, magma_flare_response *response);
+
 /* STATFS OK */
 extern magma_transaction_id magma_pktqs_statfs(GSocket *socket, GSocketAddress *peer,  uid_t uid, gid_t gid, const gchar *path, magma_flare_response *response);
 extern void magma_pktqr_statfs(gchar *buffer, magma_flare_request *request);
 extern void magma_pktas_statfs(GSocket *socket, GSocketAddress *peer, int res, struct statfs *statbuf, int error, magma_transaction_id tid, magma_flags flags);
 extern GIOStatus magma_pktar_statfs(GSocket *socket, GSocketAddress *peer, magma_flare_response *response);
 
+/* COMPOUND */
+extern gboolean magma_compound_allowed(magma_optype type);
+extern gboolean magma_compound_begin(GSocket *socket, GSocketAddress *peer);
+extern void magma_compound_end();
+extern void magma_pktqr_compound(gchar *buffer, magma_flare_request *request);
+extern void magma_pktas_compound(GSocket *socket, GSocketAddress *peer, int count, gchar *replies, gsize length, magma_transaction_id tid, magma_flags flags);
+extern GIOStatus magma_pktar_compound(GSocket *socket, GSocketAddress *peer, magma_flare_response *response);
+
 /* F_OPENDIR OK */
 extern magma_transaction_id magma_pktqs_f_opendir(GSocket *socket, GSocketAddress *peer, uid_t uid, gid_t gid, const gchar *path, magma_offset offset, magma_flare_response *response);
 extern void magma_pktqr_f_opendir(gchar *buffer, magma_flare_request *request);
@@ -567,6 +788,10 @@ extern void magma_pktqr_add_flare_to_parent(gchar *buffer, magma_flare_request *
 extern void magma_pktas_add_flare_to_parent(GSocket *socket, GSocketAddress *peer, int res, int error, magma_transaction_id tid);
 extern GIOStatus magma_pktar_add_flare_to_parent(GSocket *socket, GSocketAddress *peer, magma_flare_response *response);
 
+extern magma_transaction_id magma_pktqs_negotiate(GSocket *socket, GSocketAddress *peer, magma_transaction_id tid);
+extern void magma_pktqr_negotiate(gchar *buffer, magma_flare_request *request);
+extern void magma_pktas_negotiate(GSocket *socket, GSocketAddress *peer, guint8 version, magma_transaction_id tid, magma_flags flags);
+
 /* REMOVE_FLARE_FROM_PARENT OK */
 extern magma_transaction_id magma_pktqs_remove_flare_from_parent(GSocket *socket, GSocketAddress *peer, magma_ttl ttl, uid_t uid, gid_t gid, const gchar *path, magma_flare_response *response);
 extern void magma_pktqr_remove_flare_from_parent(gchar *buffer, magma_flare_request *request);
@@ -593,3 +818,10 @@ extern void magma_pktqr_readdir_extended(gchar *buffer, magma_flare_request *req
 extern void magma_pktas_readdir_extended(GSocket *socket, GSocketAddress *peer, magma_flare_response *response, magma_transaction_id tid, magma_flags flags);
 extern GIOStatus magma_pktar_readdir_extended(GSocket *socket, GSocketAddress *peer, magma_flare_response *response);
 
+/* READDIR compact */
+extern magma_transaction_id magma_pktqs_readdir_compact(GSocket *socket, GSocketAddress *peer, uid_t uid, gid_t gid, const gchar *path, off_t offset, magma_flare_response *response);
+extern void magma_pktas_readdir_compact(GSocket *socket, GSocketAddress *peer, magma_flare_response *response, magma_transaction_id tid, magma_flags flags);
+extern GIOStatus magma_pktar_readdir_compact(GSocket *socket, GSocketAddress *peer, magma_flare_response *response);
+extern gchar *magma_encode_compact_readdir_entry(gchar *buffer, const gchar *name, magma_stat_struct *st);
+extern gchar *magma_decode_compact_readdir_entry(gchar *buffer, gchar *end, magma_extended_readdir_entry *entry);
+
@@ -32,8 +32,7 @@ magma_pktqs_read(
 	const gchar *path,
 	magma_flare_response *response)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	magma_transaction_id tid = 0;
 	gchar *ptr = magma_format_request_header(buffer, MAGMA_OP_TYPE_READ, uid, gid, &tid, MAGMA_TERMINAL_TTL);
@@ -64,20 +63,24 @@ void magma_pktas_read(
 	magma_transaction_id tid,
 	magma_flags flags)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	gchar header[MAGMA_VECTOR_HEADER_SIZE];
 
-	gchar *ptr = magma_format_response_header(buffer, res, error, tid, flags);
-	memcpy(ptr, read_buffer, res);
-	ptr += res;
+	gchar *ptr = magma_format_response_header(header, res, error, tid, flags);
 
-	magma_send_buffer(socket, peer, buffer, ptr - buffer);
+	/*
+	 * the data read are sent straight from read_buffer
+	 */
+	GOutputVector vectors[2] = {
+		{ header, ptr - header },
+		{ read_buffer, res > 0 ? res : 0 },
+	};
+
+	magma_send_vectors(socket, peer, vectors, res > 0 ? 2 : 1);
 }
 
 GIOStatus magma_pktar_read(GSocket *socket, GSocketAddress *peer, magma_flare_response *response)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	gchar *ptr = magma_pktar(socket, peer, buffer, (magma_response *) response);
 
@@ -0,0 +1,337 @@
+/*
+   MAGMA -- protocol_flare/read_large.c
+   Copyright (C) 2006-2013 Tx0 <tx0@strumentiresistenti.org>
+
+   READ_LARGE: a READ of up to MAGMA_LARGE_IO_MAX_SIZE bytes answered
+   with one datagram per fragment. The request carries the bitmap of
+   the fragments the client still wants, so a lost fragment costs a
+   new request for that fragment only. READ_PMTU is the same with
+   fragments sized by the client to fit the path MTU.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include "../../magma.h"
+
+/**
+ * Send a READ_LARGE request and collect the fragments of its answer
+ * into read_buffer. At most magma_large_io_window() fragments are asked
+ * at once, fewer if the congestion window of the peer is short; a
+ * window which doesn't fully arrive within the peer retransmission
+ * timeout is asked again for its missing fragments.
+ *
+ * Must be called only if the peer speaks MAGMA_LARGE_IO_VERSION, and
+ * MAGMA_PMTU_IO_VERSION for fragments other than MAGMA_LARGE_IO_FRAGMENT_SIZE.
+ *
+ * @param fragment_size the fragment size, from magma_pmtu_fragment_size()
+ * @param read_buffer at least size bytes
+ * @return the transaction ID; response->header.res holds the bytes read
+ */
+magma_transaction_id
+magma_pktqs_read_large(
+	GSocket *socket,
+	GSocketAddress *peer,
+	uid_t uid,
+	gid_t gid,
+	guint32 size,
+	guint64 offset,
+	const gchar *path,
+	guint16 fragment_size,
+	gchar *read_buffer,
+	magma_flare_response *response)
+{
+	MAGMA_IO_BUFFER(buffer);
+	MAGMA_IO_BUFFER(reply);
+
+	gboolean pmtu = (fragment_size isNot MAGMA_LARGE_IO_FRAGMENT_SIZE) ? TRUE : FALSE;
+	magma_optype type = pmtu ? MAGMA_OP_TYPE_READ_PMTU : MAGMA_OP_TYPE_READ_LARGE;
+	size = MIN(size, MAGMA_LARGE_IO_MAX_FRAGMENTS * (guint32) fragment_size);
+
+	/*
+	 * the bitmap is serialized last, so it can be rewritten
+	 * in place for every window once the header has been fitted
+	 */
+	magma_transaction_id tid = 0;
+	gchar *ptr = magma_format_request_header(buffer, type, uid, gid, &tid, MAGMA_TERMINAL_TTL);
+	ptr = magma_serialize_32(ptr, size);
+	ptr = magma_serialize_64(ptr, offset);
+	ptr = magma_serialize_string(ptr, path);
+	if (pmtu) ptr = magma_serialize_16(ptr, fragment_size);
+	ptr += MAGMA_LARGE_IO_BITMAP_WORDS * sizeof(guint32);
+
+	magma_transaction_id wire_tid = 0;
+	gsize length = magma_fit_request_header(buffer, ptr - buffer, magma_demux_wide_tids(socket), &wire_tid);
+	gchar *bitmap = buffer + length - MAGMA_LARGE_IO_BITMAP_WORDS * sizeof(guint32);
+
+	/* the fragments still missing; trimmed once the file size is known */
+	guint32 missing[MAGMA_LARGE_IO_BITMAP_WORDS] = { 0 };
+	guint fragments = magma_large_io_fragments(size, fragment_size), i;
+	for (i = 0; i < fragments; i++) magma_large_io_set_bit(missing, i);
+
+	guint window = magma_large_io_window(fragment_size);
+
+	response->header.res = 0;
+	response->header.err_no = 0;
+
+	magma_log_transaction(MAGMA_OP_TYPE_READ_LARGE, tid, peer);
+	magma_demux_expect(socket, wire_tid);
+
+	guint left = fragments, idle_rounds = 0;
+	while (left && idle_rounds < MAGMA_RETRY_LIMIT) {
+		/*
+		 * ask the next window of missing fragments, as many as
+		 * the congestion window of the peer has room for
+		 */
+		guint granted = magma_cwnd_acquire(socket, MIN(window, left), TRUE);
+
+		guint32 wanted[MAGMA_LARGE_IO_BITMAP_WORDS] = { 0 };
+		guint asked = 0;
+		for (i = 0; i < fragments && asked < granted; i++) {
+			if (magma_large_io_bit_is_set(missing, i)) {
+				magma_large_io_set_bit(wanted, i);
+				asked++;
+			}
+		}
+
+		gchar *wptr = bitmap;
+		for (i = 0; i < MAGMA_LARGE_IO_BITMAP_WORDS; i++) wptr = magma_serialize_32(wptr, wanted[i]);
+
+		magma_send_buffer(socket, peer, buffer, length);
+
+		/*
+		 * collect the window until complete or timed out
+		 */
+		guint got = 0;
+		gboolean timed_out = FALSE;
+		while (asked) {
+			ptr = magma_pktar(socket, peer, reply, (magma_response *) response);
+			if (!ptr) {
+				timed_out = TRUE;
+				break;
+			}
+
+			/* an error or the end of file: nothing more will come */
+			if (response->header.res <= 0) {
+				left = 0;
+				break;
+			}
+
+			/* forget the fragments beyond the end of file */
+			guint available = magma_large_io_fragments((guint32) response->header.res, fragment_size);
+			for (i = available; i < fragments; i++) {
+				if (magma_large_io_bit_is_set(missing, i)) {
+					magma_large_io_clear_bit(missing, i);
+					left--;
+				}
+				if (magma_large_io_bit_is_set(wanted, i)) {
+					magma_large_io_clear_bit(wanted, i);
+					asked--;
+				}
+			}
+			fragments = MIN(fragments, available);
+
+			guint16 fragment = 0;
+			ptr = magma_deserialize_16(ptr, &fragment);
+
+			if (fragment < fragments && magma_large_io_bit_is_set(missing, fragment)) {
+				guint32 received = MIN(fragment_size, (guint32) response->header.res - fragment * fragment_size);
+				memcpy(read_buffer + fragment * fragment_size, ptr, received);
+
+				magma_large_io_clear_bit(missing, fragment);
+				left--;
+				got++;
+
+				if (magma_large_io_bit_is_set(wanted, fragment)) {
+					magma_large_io_clear_bit(wanted, fragment);
+					asked--;
+				}
+			}
+
+			if (!left) break;
+		}
+
+		magma_cwnd_release(socket, granted, got);
+		if (timed_out) magma_cwnd_loss(socket);
+
+		if (got) {
+			idle_rounds = 0;
+		} else {
+			/* the route may have shrunk: the next transfer will know */
+			idle_rounds++;
+			magma_rtt_backoff(socket);
+			if (pmtu) magma_path_mtu_refresh(socket);
+		}
+	}
+
+	magma_demux_forget(socket);
+
+	if (left) {
+		dbg(LOG_ERR, DEBUG_NET, "READ_LARGE #%05u: %u fragments never arrived", tid, left);
+		response->header.status = G_IO_STATUS_ERROR;
+		response->header.res = -1;
+		response->header.err_no = EIO;
+	}
+
+	return (tid);
+}
+
+/**
+ * Read size bytes into read_buffer, whatever the size: with READ_LARGE
+ * if the peer speaks MAGMA_LARGE_IO_VERSION, in path MTU fragments if
+ * it speaks MAGMA_PMTU_IO_VERSION and the path needs them, with
+ * consecutive READs otherwise. Stops at the end of file.
+ *
+ * @param read_buffer at least size bytes
+ * @param response holds the outcome of the last request sent
+ * @return the bytes read, -1 on error with errno set
+ */
+int magma_pktqs_read_chunked(
+	GSocket *socket,
+	GSocketAddress *peer,
+	uid_t uid,
+	gid_t gid,
+	guint32 size,
+	guint64 offset,
+	const gchar *path,
+	gchar *read_buffer,
+	magma_flare_response *response)
+{
+	gboolean large = (magma_demux_peer_version(socket) >= MAGMA_LARGE_IO_VERSION) ? TRUE : FALSE;
+	guint16 fragment_size = magma_pmtu_fragment_size(socket, MAGMA_PMTU_READ_OVERHEAD);
+	guint32 done = 0;
+
+	while (done < size) {
+		guint32 chunk = MIN(size - done, large ? MAGMA_LARGE_IO_MAX_FRAGMENTS * (guint32) fragment_size : MAGMA_READ_WRITE_BUFFER_SIZE);
+
+		if (large) {
+			magma_pktqs_read_large(socket, peer, uid, gid, chunk, offset + done, path, fragment_size, read_buffer + done, response);
+		} else {
+			magma_pktqs_read(socket, peer, uid, gid, chunk, offset + done, path, response);
+			if (response->header.res > 0) memcpy(read_buffer + done, response->body.read.buffer, response->header.res);
+		}
+
+		if (response->header.res is -1) {
+			if (done) break;
+			errno = response->header.err_no;
+			return (-1);
+		}
+
+		done += response->header.res;
+		if ((guint32) response->header.res < chunk) break;
+	}
+
+	return (done);
+}
+
+void magma_pktqr_read_large(gchar *buffer, magma_flare_request *request)
+{
+	gchar *ptr = buffer;
+	ptr = magma_deserialize_32(ptr, &request->body.read_large.size);
+	ptr = magma_deserialize_64(ptr, &request->body.read_large.offset);
+	ptr = magma_deserialize_string(ptr, request->body.read_large.path);
+
+	request->body.read_large.fragment_size = MAGMA_LARGE_IO_FRAGMENT_SIZE;
+	if (request->header.type is MAGMA_OP_TYPE_READ_PMTU)
+		ptr = magma_deserialize_16(ptr, &request->body.read_large.fragment_size);
+
+	int i;
+	for (i = 0; i < MAGMA_LARGE_IO_BITMAP_WORDS; i++)
+		ptr = magma_deserialize_32(ptr, &request->body.read_large.wanted[i]);
+}
+
+/**
+ * Answer a READ_LARGE request by sending each wanted fragment in its
+ * own datagram, a burst at time with magma_send_datagrams(). Every
+ * datagram carries the total bytes read in res, followed by the
+ * fragment index and the fragment data. Errors and the end of file
+ * are answered with the header only. If all the wanted fragments
+ * are past res, one datagram with the MAGMA_LARGE_IO_PROBE index
+ * and no data tells the client where the file ends.
+ *
+ * @param read_buffer the data read, fragment i at i * fragment_size
+ * @param fragment_size the fragment size asked by the client
+ * @param wanted the bitmap of the fragments to be sent
+ */
+void magma_pktas_read_large(
+	GSocket *socket,
+	GSocketAddress *peer,
+	gint32 res,
+	int error,
+	gchar *read_buffer,
+	guint16 fragment_size,
+	guint32 *wanted,
+	magma_transaction_id tid,
+	magma_flags flags)
+{
+	gchar header[MAGMA_VECTOR_HEADER_SIZE];
+
+	gchar *ptr = magma_format_response_header(header, res, error, tid, flags);
+
+	if (res <= 0) {
+		magma_send_buffer(socket, peer, header, ptr - header);
+		return;
+	}
+
+	/*
+	 * the fragments go out in bursts, sharing the header and sent
+	 * straight from read_buffer; only the index is per fragment
+	 */
+	gchar indexes[MAGMA_UDP_SEND_BATCH][sizeof(guint16)];
+	GOutputVector vectors[MAGMA_UDP_SEND_BATCH][3];
+	GOutputMessage messages[MAGMA_UDP_SEND_BATCH];
+	guint batched = 0, sent = 0;
+
+	guint fragments = MIN(magma_large_io_fragments((guint32) res, fragment_size), MAGMA_LARGE_IO_MAX_FRAGMENTS), i;
+	for (i = 0; i < fragments; i++) {
+		if (!magma_large_io_bit_is_set(wanted, i)) continue;
+		sent++;
+
+		magma_serialize_16(indexes[batched], i);
+
+		vectors[batched][0].buffer = header;
+		vectors[batched][0].size = ptr - header;
+		vectors[batched][1].buffer = indexes[batched];
+		vectors[batched][1].size = sizeof(guint16);
+		vectors[batched][2].buffer = read_buffer + i * fragment_size;
+		vectors[batched][2].size = MIN(fragment_size, (guint32) res - i * fragment_size);
+
+		messages[batched].vectors = vectors[batched];
+		messages[batched].num_vectors = 3;
+
+		if (++batched is MAGMA_UDP_SEND_BATCH) {
+			magma_send_datagrams(socket, peer, messages, batched);
+			batched = 0;
+		}
+	}
+
+	if (batched) magma_send_datagrams(socket, peer, messages, batched);
+
+	/*
+	 * every wanted fragment is past the end of file: the client
+	 * learns it from res, the index of a probe carries no data
+	 */
+	if (!sent) {
+		magma_serialize_16(indexes[0], MAGMA_LARGE_IO_PROBE);
+		vectors[0][0].buffer = header;
+		vectors[0][0].size = ptr - header;
+		vectors[0][1].buffer = indexes[0];
+		vectors[0][1].size = sizeof(guint16);
+		messages[0].vectors = vectors[0];
+		messages[0].num_vectors = 2;
+		magma_send_datagrams(socket, peer, messages, 1);
+	}
+}
+
+// vim:ts=4:nocindent:autoindent
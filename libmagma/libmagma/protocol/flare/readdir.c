@@ -32,8 +32,7 @@ magma_pktqs_readdir(
 	const gchar *path,
 	magma_flare_response *response)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	magma_transaction_id tid = 0;
 	gchar *ptr = magma_format_request_header(buffer, MAGMA_OP_TYPE_READDIR, uid, gid, &tid, MAGMA_TERMINAL_TTL);
@@ -53,8 +52,7 @@ void magma_pktqr_readdir(gchar *buffer, magma_flare_request *request)
 
 void magma_pktas_readdir(GSocket *socket, GSocketAddress *peer, int res, int error, magma_transaction_id tid)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	gchar *ptr = magma_format_response_header(buffer, res, error, tid);
 
@@ -63,8 +61,7 @@ void magma_pktas_readdir(GSocket *socket, GSocketAddress *peer, int res, int err
 
 GIOStatus magma_pktar_readdir(GSocket *socket, GSocketAddress *peer, magma_flare_response *response)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	gchar *ptr = magma_pktar(socket, peer, buffer, (magma_response *) response);
 
@@ -79,20 +76,18 @@ void magma_pkt_send_readdir_offset(
 	off_t offset,
 	magma_transaction_id tid)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	magma_transaction_id in_tid = tid;
 	gchar *ptr = magma_format_request_header(buffer, MAGMA_OP_TYPE_READDIR_OFFSET, uid, gid, &in_tid, MAGMA_TERMINAL_TTL);
 	ptr = magma_serialize_64(ptr, offset);
 
-	magma_send_buffer(socket, peer, buffer, ptr - buffer);
+	magma_send_request(socket, peer, buffer, ptr - buffer);
 }
 
 GIOStatus magma_pkt_recv_readdir_offset(GSocket *socket, GSocketAddress *peer, magma_flare_request *request)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	gchar *ptr = magma_pktqr(socket, peer, buffer, (magma_request *) request);
 	if (!ptr) return (G_IO_STATUS_AGAIN);
@@ -104,8 +99,7 @@ GIOStatus magma_pkt_recv_readdir_offset(GSocket *socket, GSocketAddress *peer, m
 
 void magma_pkt_send_readdir_entry(GSocket *socket, GSocketAddress *peer, gchar *dirent, magma_transaction_id tid)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	gchar *ptr;
 
@@ -122,8 +116,7 @@ void magma_pkt_send_readdir_entry(GSocket *socket, GSocketAddress *peer, gchar *
 GIOStatus
 magma_pkt_recv_readdir_entry(GSocket *socket, GSocketAddress *peer, magma_flare_response *response)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	gchar *ptr = magma_pktar(socket, peer, buffer, (magma_response *) response);
 
@@ -146,8 +139,7 @@ magma_pktqs_readdir_extended(
 	off_t offset,
 	magma_flare_response *response)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	magma_transaction_id tid = 0;
 	gchar *ptr = magma_format_request_header(buffer, MAGMA_OP_TYPE_READDIR_EXTENDED, uid, gid, &tid, MAGMA_TERMINAL_TTL);
@@ -174,8 +166,7 @@ void magma_pktas_readdir_extended(
 	magma_transaction_id tid,
 	magma_flags flags)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	gchar *ptr = magma_format_response_header(buffer, response->header.res, response->header.err_no, tid, flags);
 	ptr = magma_serialize_64(ptr, response->body.readdir_extended.offset);
@@ -196,7 +187,7 @@ void magma_pktas_readdir_extended(
 GIOStatus
 magma_pktar_readdir_extended(GSocket *socket, GSocketAddress *peer, magma_flare_response *response)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
+	MAGMA_IO_BUFFER(buffer);
 
 	gchar *ptr = magma_pktar(socket, peer, buffer, (magma_response *) response);
 
@@ -214,4 +205,166 @@ magma_pktar_readdir_extended(GSocket *socket, GSocketAddress *peer, magma_flare_
 	return (G_IO_STATUS_NORMAL);
 }
 
+/**
+ * Pack a directory entry for READDIR_COMPACT
+ *
+ * @param buffer at least MAGMA_COMPACT_READDIR_ENTRY_MAX_SIZE bytes
+ * @param name the entry name
+ * @param st the entry attributes
+ * @return a pointer inside buffer to the next available location for insertion
+ */
+gchar *magma_encode_compact_readdir_entry(gchar *buffer, const gchar *name, magma_stat_struct *st)
+{
+	gsize length = MIN(strlen(name), MAGMA_TERMINATED_DIRENTRY_LENGTH - 1);
+
+	gchar *ptr = magma_serialize_varint(buffer, length);
+	ptr = magma_append_to_buffer(ptr, name, length);
+
+	ptr = magma_serialize_varint(ptr, st->dev);
+	ptr = magma_serialize_varint(ptr, st->ino);
+	ptr = magma_serialize_varint(ptr, st->size);
+	ptr = magma_serialize_varint(ptr, st->blocks);
+	ptr = magma_serialize_varint(ptr, st->atime);
+	ptr = magma_serialize_varint(ptr, st->ctime);
+	ptr = magma_serialize_varint(ptr, st->mtime);
+	ptr = magma_serialize_varint(ptr, st->mode);
+	ptr = magma_serialize_varint(ptr, st->nlink);
+	ptr = magma_serialize_varint(ptr, st->uid);
+	ptr = magma_serialize_varint(ptr, st->gid);
+	ptr = magma_serialize_varint(ptr, st->rdev);
+	ptr = magma_serialize_varint(ptr, st->blksize);
+
+	return (ptr);
+}
+
+/**
+ * Unpack a directory entry of a READDIR_COMPACT answer
+ *
+ * @param buffer the packed entry
+ * @param end the first byte past the packed entries
+ * @param entry the unpacked entry
+ * @return a pointer to the next entry, NULL if this one is malformed
+ */
+gchar *magma_decode_compact_readdir_entry(gchar *buffer, gchar *end, magma_extended_readdir_entry *entry)
+{
+	guint64 length = 0;
+	gchar *ptr = magma_deserialize_varint(buffer, end, &length);
+	if (!ptr || length >= MAGMA_TERMINATED_DIRENTRY_LENGTH || length > (guint64) (end - ptr)) return (NULL);
+
+	memcpy(entry->path, ptr, length);
+	entry->path[length] = '\0';
+	ptr += length;
+
+	guint64 fields[13];
+	int i = 0;
+	for (; i < 13; i++) {
+		ptr = magma_deserialize_varint(ptr, end, &fields[i]);
+		if (!ptr) return (NULL);
+	}
+
+	entry->st.dev		= fields[0];
+	entry->st.ino		= fields[1];
+	entry->st.size		= fields[2];
+	entry->st.blocks	= fields[3];
+	entry->st.atime		= fields[4];
+	entry->st.ctime		= fields[5];
+	entry->st.mtime		= fields[6];
+	entry->st.mode		= fields[7];
+	entry->st.nlink		= fields[8];
+	entry->st.uid		= fields[9];
+	entry->st.gid		= fields[10];
+	entry->st.rdev		= fields[11];
+	entry->st.blksize	= fields[12];
+
+	return (ptr);
+}
+
+/**
+ * Ask a chunk of directory entries in the READDIR_COMPACT format.
+ * Must be called only if the peer speaks MAGMA_COMPACT_READDIR_VERSION.
+ *
+ * @param response response->body.readdir_compact.entries must point to
+ *        MAGMA_COMPACT_READDIR_PAYLOAD bytes, to be read back with
+ *        magma_decode_compact_readdir_entry()
+ */
+magma_transaction_id
+magma_pktqs_readdir_compact(
+	GSocket *socket,
+	GSocketAddress *peer,
+	uid_t uid,
+	gid_t gid,
+	const gchar *path,
+	off_t offset,
+	magma_flare_response *response)
+{
+	MAGMA_IO_BUFFER(buffer);
+
+	magma_transaction_id tid = 0;
+	gchar *ptr = magma_format_request_header(buffer, MAGMA_OP_TYPE_READDIR_COMPACT, uid, gid, &tid, MAGMA_TERMINAL_TTL);
+	ptr = magma_serialize_64(ptr, offset);
+	ptr = magma_serialize_string(ptr, path);
+
+	magma_log_transaction(MAGMA_OP_TYPE_READDIR_COMPACT, tid, peer);
+	magma_send_and_receive(socket, peer, buffer, ptr - buffer, magma_pktar_readdir_compact, response);
+
+	return (tid);
+}
+
+void magma_pktas_readdir_compact(
+	GSocket *socket,
+	GSocketAddress *peer,
+	magma_flare_response *response,
+	magma_transaction_id tid,
+	magma_flags flags)
+{
+	MAGMA_IO_BUFFER(buffer);
+
+	gchar *ptr = magma_format_response_header(buffer, response->header.res, response->header.err_no, tid, flags);
+	ptr = magma_serialize_64(ptr, response->body.readdir_compact.offset);
+	ptr = magma_serialize_16(ptr, response->body.readdir_compact.entry_number);
+
+	/*
+	 * the entries are sent straight from the buffer they were packed in
+	 */
+	GOutputVector vectors[2] = {
+		{ buffer, ptr - buffer },
+		{ response->body.readdir_compact.entries, response->body.readdir_compact.length },
+	};
+
+	magma_send_vectors(socket, peer, vectors, 2);
+}
+
+GIOStatus
+magma_pktar_readdir_compact(GSocket *socket, GSocketAddress *peer, magma_flare_response *response)
+{
+	MAGMA_IO_BUFFER(buffer);
+
+	gchar *ptr = magma_pktar(socket, peer, buffer, (magma_response *) response);
+
+	if (G_IO_STATUS_NORMAL != response->header.status || -1 == response->header.res || !ptr) return (response->header.status);
+
+	ptr = magma_deserialize_64(ptr, &response->body.readdir_compact.offset);
+	ptr = magma_deserialize_16(ptr, &response->body.readdir_compact.entry_number);
+
+	/*
+	 * walk the entries to learn how many bytes they take,
+	 * dropping those cut by a malformed datagram
+	 */
+	gchar *start = ptr;
+	gchar *end = buffer + MIN((gsize) MAX(response->header.length, 0), MAGMA_MAX_BUFFER_SIZE);
+	magma_readdir_entry decoded = 0;
+	for (; decoded < response->body.readdir_compact.entry_number; decoded++) {
+		magma_extended_readdir_entry entry;
+		gchar *next = magma_decode_compact_readdir_entry(ptr, end, &entry);
+		if (!next) break;
+		ptr = next;
+	}
+
+	response->body.readdir_compact.entry_number = decoded;
+	response->body.readdir_compact.length = MIN(ptr - start, MAGMA_COMPACT_READDIR_PAYLOAD);
+	memcpy(response->body.readdir_compact.entries, start, response->body.readdir_compact.length);
+
+	return (G_IO_STATUS_NORMAL);
+}
+
 #endif
@@ -34,21 +34,25 @@ magma_pktqs_write(
 	const gchar *write_buffer,
 	magma_flare_response *response)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	gchar header[MAGMA_VECTOR_HEADER_SIZE];
 
 	magma_transaction_id tid = 0;
-	gchar *ptr = magma_format_request_header(buffer, MAGMA_OP_TYPE_WRITE, uid, gid, &tid, ttl);
+	gchar *ptr = magma_format_request_header(header, MAGMA_OP_TYPE_WRITE, uid, gid, &tid, ttl);
 
 	ptr = magma_serialize_32(ptr, size);
 	ptr = magma_serialize_64(ptr, offset);
 	ptr = magma_serialize_string(ptr, path);
 
-	memcpy(ptr, write_buffer, size);
-	ptr += size;
+	/*
+	 * the payload is sent straight from the caller buffer
+	 */
+	GOutputVector vectors[2] = {
+		{ header, ptr - header },
+		{ write_buffer, size },
+	};
 
 	magma_log_transaction(MAGMA_OP_TYPE_WRITE, tid, peer);
-	magma_send_and_receive(socket, peer, buffer, ptr - buffer, magma_pktar_write, response);
+	magma_send_vectors_and_receive(socket, peer, vectors, 2, magma_pktar_write, response);
 
 	return (tid);
 }
@@ -71,8 +75,7 @@ void magma_pktas_write(
 	magma_transaction_id tid,
 	magma_flags flags)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	gchar *ptr = magma_format_response_header(buffer, res, error, tid, flags);
 
@@ -81,8 +84,7 @@ void magma_pktas_write(
 
 GIOStatus magma_pktar_write(GSocket *socket, GSocketAddress *peer, magma_flare_response *response)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	gchar *ptr = magma_pktar(socket, peer, buffer, (magma_response *) response);
 
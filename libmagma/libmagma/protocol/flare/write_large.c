@@ -0,0 +1,288 @@
+/*
+   MAGMA -- protocol_flare/write_large.c
+   Copyright (C) 2006-2013 Tx0 <tx0@strumentiresistenti.org>
+
+   WRITE_LARGE: a WRITE of up to MAGMA_LARGE_IO_MAX_SIZE bytes sent as
+   one datagram per fragment, all sharing the same transaction ID. The
+   server reassembles them, answers a probe with the bitmap of the
+   fragments received so far and performs the write once complete.
+   WRITE_PMTU is the same with fragments sized by the client to fit
+   the path MTU.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include "../../magma.h"
+
+/**
+ * Send a WRITE_LARGE request. Each round sends a window of the
+ * fragments not yet acknowledged, as large as the congestion window
+ * of the peer allows, followed by a probe; the answer
+ * to the probe is either the bitmap of the received fragments or
+ * the result of the write. Once every fragment has arrived the
+ * server is writing: the client waits for the result, probing
+ * again only when it doesn't come within the timeout, and a probe
+ * answered meanwhile doesn't count as an idle round.
+ *
+ * Must be called only if the peer speaks MAGMA_LARGE_IO_VERSION, and
+ * MAGMA_PMTU_IO_VERSION for fragments other than MAGMA_LARGE_IO_FRAGMENT_SIZE.
+ *
+ * @param fragment_size the fragment size, from magma_pmtu_fragment_size()
+ * @return the transaction ID; response->header.res holds the bytes written
+ */
+magma_transaction_id
+magma_pktqs_write_large(
+	GSocket *socket,
+	GSocketAddress *peer,
+	magma_ttl ttl,
+	uid_t uid,
+	gid_t gid,
+	guint32 size,
+	guint64 offset,
+	const gchar *path,
+	guint16 fragment_size,
+	const gchar *write_buffer,
+	magma_flare_response *response)
+{
+	gchar header[MAGMA_VECTOR_HEADER_SIZE];
+	MAGMA_IO_BUFFER(reply);
+
+	gboolean pmtu = (fragment_size isNot MAGMA_LARGE_IO_FRAGMENT_SIZE) ? TRUE : FALSE;
+	magma_optype type = pmtu ? MAGMA_OP_TYPE_WRITE_PMTU : MAGMA_OP_TYPE_WRITE_LARGE;
+	size = MIN(size, MAGMA_LARGE_IO_MAX_FRAGMENTS * (guint32) fragment_size);
+
+	/*
+	 * the fragment index is serialized last, so it can be
+	 * rewritten in place once the header has been fitted
+	 */
+	magma_transaction_id tid = 0;
+	gchar *ptr = magma_format_request_header(header, type, uid, gid, &tid, ttl);
+	ptr = magma_serialize_32(ptr, size);
+	ptr = magma_serialize_64(ptr, offset);
+	ptr = magma_serialize_string(ptr, path);
+	if (pmtu) ptr = magma_serialize_16(ptr, fragment_size);
+	ptr += sizeof(guint16);
+
+	magma_transaction_id wire_tid = 0;
+	gsize length = magma_fit_request_header(header, ptr - header, magma_demux_wide_tids(socket), &wire_tid);
+	gchar *index = header + length - sizeof(guint16);
+
+	guint32 missing[MAGMA_LARGE_IO_BITMAP_WORDS] = { 0 };
+	guint fragments = magma_large_io_fragments(size, fragment_size), i;
+	for (i = 0; i < fragments; i++) magma_large_io_set_bit(missing, i);
+
+	guint window = magma_large_io_window(fragment_size);
+
+	response->header.status = G_IO_STATUS_AGAIN;
+	response->header.res = -1;
+	response->header.err_no = EIO;
+
+	magma_log_transaction(MAGMA_OP_TYPE_WRITE_LARGE, tid, peer);
+	magma_demux_expect(socket, wire_tid);
+
+	guint left = fragments, idle_rounds = 0;
+	gboolean writing = FALSE;
+	while (idle_rounds < MAGMA_RETRY_LIMIT) {
+		/*
+		 * send the next window of missing fragments in bursts,
+		 * straight from the caller buffer, then ask what arrived;
+		 * the window is cut to the room in the congestion window.
+		 * While the server is writing, just wait for its answer.
+		 */
+		guint granted = writing ? 0 : magma_cwnd_acquire(socket, MIN(window, left), TRUE);
+
+		gchar indexes[MAGMA_UDP_SEND_BATCH][sizeof(guint16)];
+		GOutputVector vectors[MAGMA_UDP_SEND_BATCH][3];
+		GOutputMessage messages[MAGMA_UDP_SEND_BATCH];
+		guint sent = 0, batched = 0;
+		for (i = 0; i < fragments && sent < granted; i++) {
+			if (!magma_large_io_bit_is_set(missing, i)) continue;
+
+			magma_serialize_16(indexes[batched], i);
+
+			vectors[batched][0].buffer = header;
+			vectors[batched][0].size = length - sizeof(guint16);
+			vectors[batched][1].buffer = indexes[batched];
+			vectors[batched][1].size = sizeof(guint16);
+			vectors[batched][2].buffer = write_buffer + i * fragment_size;
+			vectors[batched][2].size = MIN(fragment_size, size - i * fragment_size);
+
+			messages[batched].vectors = vectors[batched];
+			messages[batched].num_vectors = 3;
+			sent++;
+
+			if (++batched is MAGMA_UDP_SEND_BATCH) {
+				magma_send_datagrams(socket, peer, messages, batched);
+				batched = 0;
+			}
+		}
+
+		if (batched) magma_send_datagrams(socket, peer, messages, batched);
+
+		if (!writing) {
+			magma_serialize_16(index, MAGMA_LARGE_IO_PROBE);
+			magma_send_buffer(socket, peer, header, length);
+		}
+
+		ptr = magma_pktar(socket, peer, reply, (magma_response *) response);
+		if (!ptr) {
+			idle_rounds++;
+
+			/* no result in time: probe again, the server may be gone */
+			if (writing) {
+				writing = FALSE;
+				continue;
+			}
+
+			magma_cwnd_release(socket, granted, 0);
+			magma_cwnd_loss(socket);
+			magma_rtt_backoff(socket);
+			if (pmtu) magma_path_mtu_refresh(socket);
+			continue;
+		}
+
+		/* the write has been done */
+		if (!(response->header.flags & MAGMA_FLAG_LARGE_IO_PARTIAL)) {
+			magma_cwnd_release(socket, granted, sent);
+			break;
+		}
+
+		for (i = 0; i < MAGMA_LARGE_IO_BITMAP_WORDS; i++) {
+			ptr = magma_deserialize_32(ptr, &response->body.write_large.received[i]);
+			missing[i] &= ~response->body.write_large.received[i];
+		}
+
+		guint still_missing = 0;
+		for (i = 0; i < fragments; i++) if (magma_large_io_bit_is_set(missing, i)) still_missing++;
+
+		/* fragments of the window the server didn't get were lost */
+		guint acked = left - still_missing;
+		if (!writing) {
+			magma_cwnd_release(socket, granted, acked);
+			if (acked < sent) magma_cwnd_loss(socket);
+		}
+
+		/* all arrived: the server is alive and writing */
+		if (!still_missing) {
+			writing = TRUE;
+			idle_rounds = 0;
+		} else if (still_missing < left) {
+			idle_rounds = 0;
+		} else {
+			idle_rounds++;
+			magma_rtt_backoff(socket);
+		}
+		left = still_missing;
+	}
+
+	magma_demux_forget(socket);
+
+	if (response->header.status isNot G_IO_STATUS_NORMAL || (response->header.flags & MAGMA_FLAG_LARGE_IO_PARTIAL)) {
+		dbg(LOG_ERR, DEBUG_NET, "WRITE_LARGE #%05u: %u fragments never acknowledged", tid, left);
+		response->header.status = G_IO_STATUS_ERROR;
+		response->header.res = -1;
+		response->header.err_no = EIO;
+	}
+
+	return (tid);
+}
+
+/**
+ * Write size bytes from write_buffer, whatever the size: with
+ * WRITE_LARGE if the peer speaks MAGMA_LARGE_IO_VERSION, in path MTU
+ * fragments if it speaks MAGMA_PMTU_IO_VERSION and the path needs
+ * them, with consecutive WRITEs otherwise. Stops at the first short write.
+ *
+ * @param response holds the outcome of the last request sent
+ * @return the bytes written, -1 on error with errno set
+ */
+int magma_pktqs_write_chunked(
+	GSocket *socket,
+	GSocketAddress *peer,
+	magma_ttl ttl,
+	uid_t uid,
+	gid_t gid,
+	guint32 size,
+	guint64 offset,
+	const gchar *path,
+	const gchar *write_buffer,
+	magma_flare_response *response)
+{
+	gboolean large = (magma_demux_peer_version(socket) >= MAGMA_LARGE_IO_VERSION) ? TRUE : FALSE;
+	guint16 fragment_size = magma_pmtu_fragment_size(socket, magma_pmtu_write_overhead(path));
+	guint32 done = 0;
+
+	do {
+		guint32 chunk = MIN(size - done, large ? MAGMA_LARGE_IO_MAX_FRAGMENTS * (guint32) fragment_size : MAGMA_READ_WRITE_BUFFER_SIZE);
+
+		if (large) {
+			magma_pktqs_write_large(socket, peer, ttl, uid, gid, chunk, offset + done, path, fragment_size, write_buffer + done, response);
+		} else {
+			magma_pktqs_write(socket, peer, ttl, uid, gid, chunk, offset + done, path, write_buffer + done, response);
+		}
+
+		if (response->header.res is -1) {
+			if (done) break;
+			errno = response->header.err_no;
+			return (-1);
+		}
+
+		done += response->header.res;
+		if ((guint32) response->header.res < chunk) break;
+	} while (done < size);
+
+	return (done);
+}
+
+void magma_pktqr_write_large(gchar *buffer, magma_flare_request *request)
+{
+	gchar *ptr = buffer;
+	ptr = magma_deserialize_32(ptr, &request->body.write_large.size);
+	ptr = magma_deserialize_64(ptr, &request->body.write_large.offset);
+	ptr = magma_deserialize_string(ptr, request->body.write_large.path);
+
+	request->body.write_large.fragment_size = MAGMA_LARGE_IO_FRAGMENT_SIZE;
+	if (request->header.type is MAGMA_OP_TYPE_WRITE_PMTU)
+		ptr = magma_deserialize_16(ptr, &request->body.write_large.fragment_size);
+
+	ptr = magma_deserialize_16(ptr, &request->body.write_large.fragment);
+
+	request->body.write_large.buffer = ptr;
+}
+
+/**
+ * Answer a WRITE_LARGE probe while some fragments are still missing.
+ * Once the write is done, it's answered by magma_pktas_write().
+ *
+ * @param received the bitmap of the fragments received so far
+ */
+void magma_pktas_write_large(
+	GSocket *socket,
+	GSocketAddress *peer,
+	guint32 *received,
+	magma_transaction_id tid,
+	magma_flags flags)
+{
+	MAGMA_IO_BUFFER(buffer);
+
+	gchar *ptr = magma_format_response_header(buffer, 0, 0, tid, flags | MAGMA_FLAG_LARGE_IO_PARTIAL);
+
+	int i;
+	for (i = 0; i < MAGMA_LARGE_IO_BITMAP_WORDS; i++) ptr = magma_serialize_32(ptr, received[i]);
+
+	magma_send_buffer(socket, peer, buffer, ptr - buffer);
+}
+
+// vim:ts=4:nocindent:autoindent
@@ -72,8 +72,7 @@ magma_pktqs_join_network(
 	magma_volcano *node,
 	magma_node_response *response)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	magma_transaction_id tid = 0;
 	gchar *ptr = magma_format_request_header(buffer, MAGMA_OP_TYPE_JOIN, 0, 0, &tid, MAGMA_TERMINAL_TTL);
@@ -110,8 +109,7 @@ void magma_pktas_join_network(
 	magma_transaction_id tid,
 	magma_flags flags)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	gchar *ptr = magma_format_response_header(buffer, res, 0, tid, flags);
 
@@ -126,7 +124,7 @@ void magma_pktas_join_network(
 }
 
 void magma_pktar_join_network(GSocket *socket, GSocketAddress *peer, magma_node_response *response) {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
+	MAGMA_IO_BUFFER(buffer);
 
 	gchar *ptr = magma_pktar(socket, peer, buffer, (magma_response *) response);
 
@@ -148,8 +146,7 @@ magma_pktqs_finish_join_network(
 	guint32 number_of_nodes,
 	magma_node_response *response)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	magma_transaction_id tid = 0;
 	gchar *ptr = magma_format_request_header(buffer, MAGMA_OP_TYPE_FINISH_JOIN, 0, 0, &tid, MAGMA_TERMINAL_TTL);
@@ -206,8 +203,7 @@ void magma_pktas_finish_join_network(
 	magma_transaction_id tid,
 	magma_flags flags)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	gchar *ptr = magma_format_response_header(buffer, res, 0, tid, flags);
 
@@ -218,7 +214,7 @@ void magma_pktas_finish_join_network(
 
 void magma_pktar_finish_join_network(GSocket *socket, GSocketAddress *peer, magma_node_response *response)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
+	MAGMA_IO_BUFFER(buffer);
 
 	gchar *ptr = magma_pktar(socket, peer, buffer, (magma_response *) response);
 
@@ -231,9 +227,8 @@ void magma_pktar_finish_join_network(GSocket *socket, GSocketAddress *peer, magm
  * DHT exchange
  */
 magma_transaction_id
-magma_pktqs_transmit_node(GSocket *socket, GSocketAddress *peer, gchar *start_key, int direction) {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+magma_pktqs_transmit_node(GSocket *socket, GSocketAddress *peer, gchar *start_key, int direction, magma_node_response *response) {
+	MAGMA_IO_BUFFER(buffer);
 
 	magma_transaction_id tid = 0;
 	gchar *ptr = magma_format_request_header(buffer, MAGMA_OP_TYPE_TRANSMIT_NODE, 0, 0, &tid, MAGMA_TERMINAL_TTL);
@@ -242,7 +237,7 @@ magma_pktqs_transmit_node(GSocket *socket, GSocketAddress *peer, gchar *start_ke
 
 	// dbg(LOG_INFO, DEBUG_PNODE, "Asking for node sibling of %s, direction %d", start_key, direction);
 
-	magma_send_buffer(socket, peer, buffer, ptr - buffer);
+	magma_send_and_receive(socket, peer, buffer, ptr - buffer, magma_pktar_transmit_node, response);
 
 	return (tid);
 }
@@ -269,8 +264,7 @@ void magma_pktas_transmit_node(
 {
 	if (!node) return;
 
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	gchar *ptr = magma_format_response_header(buffer, 0, 0, tid, flags);
 
@@ -293,8 +287,7 @@ void magma_pktas_transmit_node(
 }
 
 void magma_pktar_transmit_node(GSocket *socket, GSocketAddress *peer, magma_node_response *response) {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	gchar *ptr = magma_pktar(socket, peer, buffer, (magma_response *) response);
 
@@ -326,8 +319,7 @@ magma_pktqs_transmit_topology(
 	guint16 offset,
 	magma_node_response *response)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	magma_transaction_id tid = 0;
 	gchar *ptr = magma_format_request_header(buffer, MAGMA_OP_TYPE_TRANSMIT_TOPOLOGY, 0, 0, &tid, MAGMA_TERMINAL_TTL);
@@ -355,8 +347,7 @@ void magma_pktas_transmit_topology(
 {
 	if (!lava) return;
 
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	/*
 	 * encode the whole topology
@@ -439,8 +430,7 @@ void magma_pktas_transmit_topology(
 }
 
 void magma_pktar_transmit_topology(GSocket *socket, GSocketAddress *peer, magma_node_response *response) {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	gchar *ptr = magma_pktar(socket, peer, buffer, (magma_response *) response);
 
@@ -483,8 +473,7 @@ magma_pktqs_transmit_key(
 	magma_flare_t *flare,
 	magma_node_response *response)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	magma_transaction_id tid = 0;
 	gchar *ptr = magma_format_request_header(buffer, MAGMA_OP_TYPE_TRANSMIT_KEY, 0, 0, &tid, MAGMA_TERMINAL_TTL);
@@ -523,8 +512,7 @@ void magma_pktas_transmit_key(
 	magma_transaction_id tid,
 	magma_flags flags)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	gchar *ptr = magma_format_response_header(buffer, res, 0, tid, flags);
 
@@ -534,8 +522,7 @@ void magma_pktas_transmit_key(
 }
 
 void magma_pktar_transmit_key(GSocket *socket, GSocketAddress *peer, magma_node_response *response) {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	gchar *ptr = magma_pktar(socket, peer, buffer, (magma_response *) response);
 
@@ -544,6 +531,120 @@ void magma_pktar_transmit_key(GSocket *socket, GSocketAddress *peer, magma_node_
 	ptr = magma_deserialize_64(ptr, &response->body.send_key.offset);
 }
 
+/**
+ * Serialize a flare record
+ */
+static gchar *magma_serialize_flare_metadata(gchar *buffer, magma_flare_metadata *row)
+{
+	gchar *ptr = buffer;
+
+	ptr = magma_serialize_string(ptr, row->hash);
+	ptr = magma_serialize_8(ptr, row->type);
+	ptr = magma_serialize_string(ptr, row->path);
+	ptr = magma_serialize_32(ptr, row->uid);
+	ptr = magma_serialize_32(ptr, row->gid);
+	ptr = magma_serialize_32(ptr, row->mode);
+	ptr = magma_serialize_string(ptr, row->commit_path);
+	ptr = magma_serialize_string(ptr, row->commit_time);
+
+	return (ptr);
+}
+
+/**
+ * Deserialize a flare record
+ */
+gchar *magma_deserialize_flare_metadata(gchar *buffer, magma_flare_metadata *row)
+{
+	gchar *ptr = buffer;
+
+	ptr = magma_deserialize_string(ptr, row->hash);
+	ptr = magma_deserialize_8(ptr, (guint8 *) &row->type);
+	ptr = magma_deserialize_string(ptr, row->path);
+	ptr = magma_deserialize_32(ptr, &row->uid);
+	ptr = magma_deserialize_32(ptr, &row->gid);
+	ptr = magma_deserialize_32(ptr, &row->mode);
+	ptr = magma_deserialize_string(ptr, row->commit_path);
+	ptr = magma_deserialize_string(ptr, row->commit_time);
+
+	return (ptr);
+}
+
+/**
+ * Transmit a batch of flare records. As many records as fit
+ * in one packet are sent; the receiver answers with the number
+ * of records saved, which the caller uses to advance.
+ */
+magma_transaction_id
+magma_pktqs_transmit_metadata(
+	GSocket *socket,
+	GSocketAddress *peer,
+	magma_flare_metadata *rows,
+	guint16 count,
+	magma_node_response *response)
+{
+	MAGMA_IO_BUFFER(buffer);
+
+	magma_transaction_id tid = 0;
+	gchar *ptr = magma_format_request_header(buffer, MAGMA_OP_TYPE_TRANSMIT_METADATA, 0, 0, &tid, MAGMA_TERMINAL_TTL);
+
+	gchar *count_ptr = ptr;
+	ptr = magma_serialize_16(ptr, 0);
+
+	guint16 packed = 0;
+	for (; packed < count; packed++) {
+		magma_flare_metadata *row = &rows[packed];
+
+		/* 5 strings carry a 16 bit length each */
+		gsize row_size = 5 * 2 + 1 + 3 * 4 +
+			strlen(row->hash) + strlen(row->path) + strlen(row->commit_path) + strlen(row->commit_time);
+
+		if ((ptr - buffer) + row_size > MAGMA_MAX_BUFFER_SIZE) break;
+
+		ptr = magma_serialize_flare_metadata(ptr, row);
+	}
+
+	magma_serialize_16(count_ptr, packed);
+
+	magma_log_transaction(MAGMA_OP_TYPE_TRANSMIT_METADATA, tid, peer);
+	magma_send_and_receive(socket, peer, buffer, ptr - buffer, magma_pktar_transmit_metadata, response);
+
+	return (tid);
+}
+
+void magma_pktqr_transmit_metadata(gchar *buffer, magma_node_request *request) {
+	gchar *ptr = buffer;
+
+	ptr = magma_deserialize_16(ptr, &request->body.transmit_metadata.count);	/* how many records */
+	request->body.transmit_metadata.rows = ptr;									/* the records, see magma_deserialize_flare_metadata() */
+}
+
+void magma_pktas_transmit_metadata(
+	GSocket *socket,
+	GSocketAddress *peer,
+	int res,
+	guint16 count,
+	magma_transaction_id tid,
+	magma_flags flags)
+{
+	MAGMA_IO_BUFFER(buffer);
+
+	gchar *ptr = magma_format_response_header(buffer, res, 0, tid, flags);
+
+	ptr = magma_serialize_16(ptr, count);
+
+	magma_send_buffer(socket, peer, buffer, ptr - buffer);
+}
+
+void magma_pktar_transmit_metadata(GSocket *socket, GSocketAddress *peer, magma_node_response *response) {
+	MAGMA_IO_BUFFER(buffer);
+
+	gchar *ptr = magma_pktar(socket, peer, buffer, (magma_response *) response);
+
+	if (response->header.status isNot G_IO_STATUS_NORMAL || response->header.res is -1) return;
+
+	ptr = magma_deserialize_16(ptr, &response->body.transmit_metadata.count);
+}
+
 /**
  * Add a flare to its parent
  */
@@ -554,8 +655,7 @@ magma_pktqs_add_flare_to_parent(
 	const gchar *path,
 	magma_node_response *response)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	magma_transaction_id tid = 0;
 	gchar *ptr = magma_format_request_header(buffer, MAGMA_OP_TYPE_ADD_FLARE_TO_PARENT, 0, 0, &tid, MAGMA_TERMINAL_TTL);
@@ -581,8 +681,7 @@ void magma_pktas_add_flare_to_parent(
 	magma_transaction_id tid,
 	magma_flags flags)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	gchar *ptr = magma_format_response_header(buffer, res, 0, tid, flags);
 
@@ -590,8 +689,7 @@ void magma_pktas_add_flare_to_parent(
 }
 
 void magma_pktar_add_flare_to_parent(GSocket *socket, GSocketAddress *peer, magma_node_response *response) {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	gchar *ptr = magma_pktar(socket, peer, buffer, (magma_response *) response);
 
@@ -609,8 +707,7 @@ magma_pktqs_remove_flare_from_parent(
 	const gchar *path,
 	magma_node_response *response)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	magma_transaction_id tid = 0;
 	gchar *ptr = magma_format_request_header(buffer, MAGMA_OP_TYPE_REMOVE_FLARE_FROM_PARENT, 0, 0, &tid, MAGMA_TERMINAL_TTL);
@@ -637,8 +734,7 @@ void magma_pktas_remove_flare_from_parent(
 	magma_transaction_id tid,
 	magma_flags flags)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	gchar *ptr = magma_format_response_header(buffer, res, 0, tid, flags);
 
@@ -646,8 +742,7 @@ void magma_pktas_remove_flare_from_parent(
 }
 
 void magma_pktar_remove_flare_from_parent(GSocket *socket, GSocketAddress *peer, magma_node_response *response) {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	gchar *ptr = magma_pktar(socket, peer, buffer, (magma_response *) response);
 
@@ -655,13 +750,134 @@ void magma_pktar_remove_flare_from_parent(GSocket *socket, GSocketAddress *peer,
 	// if (response->header.status isNot G_IO_STATUS_NORMAL || response->header.res is -1) return;
 }
 
+/**
+ * Replay journal
+ *
+ * the requesting node declares the last journal sequence
+ * it received from the remote node. The remote node answers
+ * with the last sequence it will replay and then sends the
+ * journaled operations in the background.
+ */
+magma_transaction_id
+magma_pktqs_replay_journal(
+	GSocket *socket,
+	GSocketAddress *peer,
+	const gchar *node_name,
+	guint64 since,
+	magma_node_response *response)
+{
+	MAGMA_IO_BUFFER(buffer);
+
+	magma_transaction_id tid = 0;
+	gchar *ptr = magma_format_request_header(buffer, MAGMA_OP_TYPE_REPLAY_JOURNAL, 0, 0, &tid, MAGMA_TERMINAL_TTL);
+
+	ptr = magma_serialize_64(ptr, since);
+	ptr = magma_serialize_string(ptr, node_name);
+
+	magma_log_transaction(MAGMA_OP_TYPE_REPLAY_JOURNAL, tid, peer);
+	magma_send_and_receive(socket, peer, buffer, ptr - buffer, magma_pktar_replay_journal, response);
+
+	return (tid);
+}
+
+void magma_pktqr_replay_journal(gchar *buffer, magma_node_request *request) {
+	gchar *ptr = buffer;
+
+	ptr = magma_deserialize_64(ptr, &request->body.replay_journal.since);
+	ptr = magma_deserialize_string(ptr, request->body.replay_journal.node_name);
+}
+
+void magma_pktas_replay_journal(
+	GSocket *socket,
+	GSocketAddress *peer,
+	int res,
+	guint64 sequence,
+	magma_transaction_id tid,
+	magma_flags flags)
+{
+	MAGMA_IO_BUFFER(buffer);
+
+	gchar *ptr = magma_format_response_header(buffer, res, 0, tid, flags);
+
+	ptr = magma_serialize_64(ptr, sequence);
+
+	magma_send_buffer(socket, peer, buffer, ptr - buffer);
+}
+
+void magma_pktar_replay_journal(GSocket *socket, GSocketAddress *peer, magma_node_response *response) {
+	MAGMA_IO_BUFFER(buffer);
+
+	gchar *ptr = magma_pktar(socket, peer, buffer, (magma_response *) response);
+
+	if (response->header.status isNot G_IO_STATUS_NORMAL || response->header.res is -1) return;
+
+	ptr = magma_deserialize_64(ptr, &response->body.replay_journal.sequence);
+}
+
+/**
+ * Journal checkpoint
+ *
+ * the node replaying its journal declares the last sequence
+ * the receiver acknowledged as applied. The receiver saves it
+ * as the point to restart from on the next catch up.
+ */
+magma_transaction_id
+magma_pktqs_journal_checkpoint(
+	GSocket *socket,
+	GSocketAddress *peer,
+	const gchar *node_name,
+	guint64 sequence,
+	magma_node_response *response)
+{
+	MAGMA_IO_BUFFER(buffer);
+
+	magma_transaction_id tid = 0;
+	gchar *ptr = magma_format_request_header(buffer, MAGMA_OP_TYPE_JOURNAL_CHECKPOINT, 0, 0, &tid, MAGMA_TERMINAL_TTL);
+
+	ptr = magma_serialize_64(ptr, sequence);
+	ptr = magma_serialize_string(ptr, node_name);
+
+	magma_log_transaction(MAGMA_OP_TYPE_JOURNAL_CHECKPOINT, tid, peer);
+	magma_send_and_receive(socket, peer, buffer, ptr - buffer, magma_pktar_journal_checkpoint, response);
+
+	return (tid);
+}
+
+void magma_pktqr_journal_checkpoint(gchar *buffer, magma_node_request *request) {
+	gchar *ptr = buffer;
+
+	ptr = magma_deserialize_64(ptr, &request->body.journal_checkpoint.sequence);
+	ptr = magma_deserialize_string(ptr, request->body.journal_checkpoint.node_name);
+}
+
+void magma_pktas_journal_checkpoint(
+	GSocket *socket,
+	GSocketAddress *peer,
+	int res,
+	magma_transaction_id tid,
+	magma_flags flags)
+{
+	MAGMA_IO_BUFFER(buffer);
+
+	gchar *ptr = magma_format_response_header(buffer, res, 0, tid, flags);
+
+	magma_send_buffer(socket, peer, buffer, ptr - buffer);
+}
+
+void magma_pktar_journal_checkpoint(GSocket *socket, GSocketAddress *peer, magma_node_response *response) {
+	MAGMA_IO_BUFFER(buffer);
+
+	gchar *ptr = magma_pktar(socket, peer, buffer, (magma_response *) response);
+
+	(void) ptr;
+}
+
 /**
  * Ping
  */
 void magma_pktqs_heartbeat(GSocket *socket, GSocketAddress *peer, magma_node_response *response)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	magma_transaction_id tid = 0;
 	gchar *ptr = magma_format_request_header(buffer, MAGMA_OP_TYPE_HEARTBEAT, 0, 0, &tid, MAGMA_TERMINAL_TTL);
@@ -682,8 +898,7 @@ void magma_pktas_heartbeat(
 	magma_transaction_id tid,
 	magma_flags flags)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	gchar *ptr = magma_format_response_header(buffer, 0, 0, tid, flags);
 
@@ -705,8 +920,7 @@ void magma_pktas_heartbeat(
 
 void magma_pktar_heartbeat(GSocket *socket, GSocketAddress *peer, magma_node_response *response)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	gchar *ptr = magma_pktar(socket, peer, buffer, (magma_response *) response);
 
@@ -732,8 +946,7 @@ void magma_pktar_heartbeat(GSocket *socket, GSocketAddress *peer, magma_node_res
  */
 void magma_pktqs_network_built(GSocket *socket, GSocketAddress *peer, magma_network_status status, magma_node_response *response)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	magma_transaction_id tid = 0;
 	gchar *ptr = magma_format_request_header(buffer, MAGMA_OP_TYPE_NETWORK_BUILT, 0, 0, &tid, MAGMA_TERMINAL_TTL);
@@ -755,8 +968,7 @@ void magma_pktas_network_built(
 	magma_transaction_id tid,
 	magma_flags flags)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	gchar *ptr = magma_format_response_header(buffer, 0, 0, tid, flags);
 	magma_send_buffer(socket, peer, buffer, ptr - buffer);
@@ -764,8 +976,7 @@ void magma_pktas_network_built(
 
 void magma_pktar_network_built(GSocket *socket, GSocketAddress *peer, magma_node_response *response)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	gchar *ptr = magma_pktar(socket, peer, buffer, (magma_response *) response);
 	(void) ptr;
@@ -776,8 +987,7 @@ void magma_pktar_network_built(GSocket *socket, GSocketAddress *peer, magma_node
  */
 void magma_pktqs_shutdown(GSocket *socket, GSocketAddress *peer, magma_node_response *response)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	magma_transaction_id tid = 0;
 	gchar *ptr = magma_format_request_header(buffer, MAGMA_OP_TYPE_SHUTDOWN, 0, 0, &tid, MAGMA_TERMINAL_TTL);
@@ -797,8 +1007,7 @@ void magma_pktas_shutdown(
 	magma_transaction_id tid,
 	magma_flags flags)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	gchar *ptr = magma_format_response_header(buffer, 0, 0, tid, flags);
 	magma_send_buffer(socket, peer, buffer, ptr - buffer);
@@ -806,8 +1015,7 @@ void magma_pktas_shutdown(
 
 void magma_pktar_shutdown(GSocket *socket, GSocketAddress *peer, magma_node_response *response)
 {
-	gchar buffer[MAGMA_MAX_BUFFER_SIZE];
-	memset(buffer, 0, MAGMA_MAX_BUFFER_SIZE);
+	MAGMA_IO_BUFFER(buffer);
 
 	gchar *ptr = magma_pktar(socket, peer, buffer, (magma_response *) response);
 	(void) ptr;
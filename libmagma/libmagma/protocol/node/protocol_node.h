@@ -140,6 +140,18 @@ typedef struct MAGMA_PROTOCOL_ALIGNMENT {
 	guint64 offset;
 } magma_node_response_send_key;
 
+/**
+ * Stream flare records in bulk, as many as fit in a packet
+ */
+typedef struct MAGMA_PROTOCOL_ALIGNMENT {
+	guint16 count;
+	gchar *rows;		/* serialized magma_flare_metadata records */
+} magma_node_request_transmit_metadata;
+
+typedef struct MAGMA_PROTOCOL_ALIGNMENT {
+	guint16 count;		/* records saved by the receiver */
+} magma_node_response_transmit_metadata;
+
 /**
  * Node heartbeat
  */
@@ -180,6 +192,29 @@ typedef struct MAGMA_PROTOCOL_ALIGNMENT {
 typedef struct MAGMA_PROTOCOL_ALIGNMENT {
 } magma_node_response_remove_flare_from_parent;
 
+/**
+ * Replay journal
+ */
+typedef struct MAGMA_PROTOCOL_ALIGNMENT {
+	gchar node_name[MAX_HOSTNAME_LENGTH];	/* the node asking for the replay */
+	guint64 since;							/* last sequence already received */
+} magma_node_request_replay_journal;
+
+typedef struct MAGMA_PROTOCOL_ALIGNMENT {
+	guint64 sequence;						/* last sequence that will be replayed */
+} magma_node_response_replay_journal;
+
+/**
+ * Journal checkpoint
+ */
+typedef struct MAGMA_PROTOCOL_ALIGNMENT {
+	gchar node_name[MAX_HOSTNAME_LENGTH];	/* the node which replayed its journal */
+	guint64 sequence;						/* last sequence applied by the receiver */
+} magma_node_request_journal_checkpoint;
+
+typedef struct MAGMA_PROTOCOL_ALIGNMENT {
+} magma_node_response_journal_checkpoint;
+
 /**
  * Node protocol request header
  */
@@ -204,6 +239,9 @@ typedef struct MAGMA_PROTOCOL_ALIGNMENT {
 		magma_node_request_network_built network_built;
 		magma_node_request_add_flare_to_parent add_flare_to_parent;
 		magma_node_request_add_flare_to_parent remove_flare_from_parent;
+		magma_node_request_replay_journal replay_journal;
+		magma_node_request_transmit_metadata transmit_metadata;
+		magma_node_request_journal_checkpoint journal_checkpoint;
 	} body;
 } magma_node_request;
 
@@ -232,6 +270,9 @@ typedef struct MAGMA_PROTOCOL_ALIGNMENT {
 		magma_node_response_network_built network_built;
 		magma_node_response_add_flare_to_parent add_flare_to_parent;
 		magma_node_response_add_flare_to_parent remove_flare_from_parent;
+		magma_node_response_replay_journal replay_journal;
+		magma_node_response_transmit_metadata transmit_metadata;
+		magma_node_response_journal_checkpoint journal_checkpoint;
 	} body;
 } magma_node_response;
 
@@ -262,6 +303,13 @@ extern void magma_pktqr_transmit_key(gchar *buffer, magma_node_request *request)
 extern void magma_pktas_transmit_key(GSocket *socket, GSocketAddress *peer, int res, off_t offset, magma_transaction_id tid, magma_flags flags);
 extern void magma_pktar_transmit_key(GSocket *socket, GSocketAddress *peer, magma_node_response *response);
 
+/** Transmit a batch of flare records */
+extern magma_transaction_id magma_pktqs_transmit_metadata(GSocket *socket, GSocketAddress *peer, magma_flare_metadata *rows, guint16 count, magma_node_response *response);
+extern void magma_pktqr_transmit_metadata(gchar *buffer, magma_node_request *request);
+extern void magma_pktas_transmit_metadata(GSocket *socket, GSocketAddress *peer, int res, guint16 count, magma_transaction_id tid, magma_flags flags);
+extern void magma_pktar_transmit_metadata(GSocket *socket, GSocketAddress *peer, magma_node_response *response);
+extern gchar *magma_deserialize_flare_metadata(gchar *buffer, magma_flare_metadata *row);
+
 /** Add a flare to its parent directory */
 extern magma_transaction_id magma_pktqs_add_flare_to_parent(GSocket *socket, GSocketAddress *peer, const gchar *path, magma_node_response *response);
 extern void magma_pktqr_add_flare_to_parent(gchar *buffer, magma_node_request *request);
@@ -274,6 +322,18 @@ extern void magma_pktqr_remove_flare_from_parent(gchar *buffer, magma_node_reque
 extern void magma_pktas_remove_flare_from_parent(GSocket *socket, GSocketAddress *peer, int res, magma_transaction_id tid, magma_flags flags);
 extern void magma_pktar_remove_flare_from_parent(GSocket *socket, GSocketAddress *peer, magma_node_response *response);
 
+/** Replay the journal to a redundant node */
+extern magma_transaction_id magma_pktqs_replay_journal(GSocket *socket, GSocketAddress *peer, const gchar *node_name, guint64 since, magma_node_response *response);
+extern void magma_pktqr_replay_journal(gchar *buffer, magma_node_request *request);
+extern void magma_pktas_replay_journal(GSocket *socket, GSocketAddress *peer, int res, guint64 sequence, magma_transaction_id tid, magma_flags flags);
+extern void magma_pktar_replay_journal(GSocket *socket, GSocketAddress *peer, magma_node_response *response);
+
+/** Tell a redundant node how far the journal replay has been applied */
+extern magma_transaction_id magma_pktqs_journal_checkpoint(GSocket *socket, GSocketAddress *peer, const gchar *node_name, guint64 sequence, magma_node_response *response);
+extern void magma_pktqr_journal_checkpoint(gchar *buffer, magma_node_request *request);
+extern void magma_pktas_journal_checkpoint(GSocket *socket, GSocketAddress *peer, int res, magma_transaction_id tid, magma_flags flags);
+extern void magma_pktar_journal_checkpoint(GSocket *socket, GSocketAddress *peer, magma_node_response *response);
+
 /**
  * Node profile exchange
  * Both transmit_node and transmit_topology request are answered
@@ -283,7 +343,7 @@ extern void magma_pktar_remove_flare_from_parent(GSocket *socket, GSocketAddress
  * struct.
  * 
  */
-extern magma_transaction_id magma_pktqs_transmit_node(GSocket *socket, GSocketAddress *peer, gchar *start_key, int direction);
+extern magma_transaction_id magma_pktqs_transmit_node(GSocket *socket, GSocketAddress *peer, gchar *start_key, int direction, magma_node_response *response);
 extern void magma_pktqr_transmit_node(gchar *buffer, magma_node_request *request);
 
 extern magma_transaction_id magma_pktqs_transmit_topology(GSocket *socket, GSocketAddress *peer, guint16 offset, magma_node_response *response);
@@ -75,6 +75,15 @@ const magma_optype MAGMA_OP_TYPE_INIT		= 30;	/**< Operation type INIT optional *
 const magma_optype MAGMA_OP_TYPE_DESTROY	= 31;	/**< Operation type DESTROY optional */
 const magma_optype MAGMA_OP_TYPE_READDIR_EXTENDED = 32;
 const magma_optype MAGMA_OP_TYPE_READDIR_OFFSET = 33;
+const magma_optype MAGMA_OP_TYPE_READ_LARGE	= 34;	/**< Operation type READ_LARGE (fragmented READ, protocol version 3) */
+const magma_optype MAGMA_OP_TYPE_WRITE_LARGE	= 35;	/**< Operation type WRITE_LARGE (fragmented WRITE, protocol version 3) */
+const magma_optype MAGMA_OP_TYPE_COMPOUND	= 36;	/**< Operation type COMPOUND (several operations in one datagram, protocol version 4) */
+const magma_optype MAGMA_OP_TYPE_READ_PMTU	= 37;	/**< Operation type READ_PMTU (READ_LARGE in path MTU fragments, protocol version 5) */
+const magma_optype MAGMA_OP_TYPE_WRITE_PMTU	= 38;	/**< Operation type WRITE_PMTU (WRITE_LARGE in path MTU fragments, protocol version 5) */
+const magma_optype MAGMA_OP_TYPE_READDIR_COMPACT = 39;	/**< Operation type READDIR_COMPACT (READDIR_EXTENDED with varint entries, protocol version 6) */
+const magma_optype MAGMA_OP_TYPE_OPEN_HANDLE	= 40;	/**< Operation type OPEN_HANDLE (OPEN answering a file handle, protocol version 7) */
+const magma_optype MAGMA_OP_TYPE_READ_HANDLE	= 41;	/**< Operation type READ_HANDLE (READ by file handle, protocol version 7) */
+const magma_optype MAGMA_OP_TYPE_WRITE_HANDLE	= 42;	/**< Operation type WRITE_HANDLE (WRITE by file handle, protocol version 7) */
 
 const magma_optype MAGMA_OP_TYPE_ADD_FLARE_TO_PARENT = 50;		/**< Operation type ADD_FLARE_TO_PARENT implemented */
 const magma_optype MAGMA_OP_TYPE_REMOVE_FLARE_FROM_PARENT = 51;	/**< Operation type REMOVE_FLARE_FROM_PARENT implemented */
@@ -103,10 +112,14 @@ const magma_optype MAGMA_OP_TYPE_PUT_KEY			= 114;	/**< Operation type PUT_KEY (t
 const magma_optype MAGMA_OP_TYPE_DROP_KEY			= 115;	/**< Operation type DROP_KEY (I've received this key, forget it) */
 const magma_optype MAGMA_OP_TYPE_GET_KEY_CONTENT	= 116;	/**< Operation type GET_KEY_CONTENT (Send me flare contents of this key) */
 const magma_optype MAGMA_OP_TYPE_NETWORK_BUILT		= 117;	/**< Operation type NETWORK_BUILT (Lava network loaded from disk and ready to operate) */
+const magma_optype MAGMA_OP_TYPE_REPLAY_JOURNAL		= 118;	/**< Operation type REPLAY_JOURNAL (Send me the operations journaled after this sequence) */
+const magma_optype MAGMA_OP_TYPE_TRANSMIT_METADATA	= 119;	/**< Operation type TRANSMIT_METADATA (Receive a batch of flare records) */
+const magma_optype MAGMA_OP_TYPE_JOURNAL_CHECKPOINT	= 120;	/**< Operation type JOURNAL_CHECKPOINT (My journal has been applied on you up to this sequence) */
 
 /* 
  * generic utilities
 */
+const magma_optype MAGMA_OP_TYPE_NEGOTIATE			= 251;	/**< Operation type NEGOTIATE (agree on the protocol version) */
 const magma_optype MAGMA_OP_TYPE_CLOSECONNECTION 	= 252;	/**< Operation type CLOSECONNECTION (close connection to MAGMA server) */
 const magma_optype MAGMA_OP_TYPE_SHUTDOWN			= 253;	/**< Operation type SHUTDOWN (shutdown the lava network) */
 const magma_optype MAGMA_OP_TYPE_HEARTBEAT			= 254;	/**< Operation type HEARTBEAT (see if server is still available) */
@@ -150,6 +163,15 @@ gchar *magma_explain_optype(magma_optype optype)
 		explanation[MAGMA_OP_TYPE_FSYNCDIR] = g_strdup("MAGMA_OP_TYPE_FSYNCDIR");
 		explanation[MAGMA_OP_TYPE_INIT] = g_strdup("MAGMA_OP_TYPE_INIT");
 		explanation[MAGMA_OP_TYPE_DESTROY] = g_strdup("MAGMA_OP_TYPE_DESTROY");
+		explanation[MAGMA_OP_TYPE_READ_LARGE] = g_strdup("MAGMA_OP_TYPE_READ_LARGE");
+		explanation[MAGMA_OP_TYPE_WRITE_LARGE] = g_strdup("MAGMA_OP_TYPE_WRITE_LARGE");
+		explanation[MAGMA_OP_TYPE_COMPOUND] = g_strdup("MAGMA_OP_TYPE_COMPOUND");
+		explanation[MAGMA_OP_TYPE_READ_PMTU] = g_strdup("MAGMA_OP_TYPE_READ_PMTU");
+		explanation[MAGMA_OP_TYPE_WRITE_PMTU] = g_strdup("MAGMA_OP_TYPE_WRITE_PMTU");
+		explanation[MAGMA_OP_TYPE_READDIR_COMPACT] = g_strdup("MAGMA_OP_TYPE_READDIR_COMPACT");
+		explanation[MAGMA_OP_TYPE_OPEN_HANDLE] = g_strdup("MAGMA_OP_TYPE_OPEN_HANDLE");
+		explanation[MAGMA_OP_TYPE_READ_HANDLE] = g_strdup("MAGMA_OP_TYPE_READ_HANDLE");
+		explanation[MAGMA_OP_TYPE_WRITE_HANDLE] = g_strdup("MAGMA_OP_TYPE_WRITE_HANDLE");
 		explanation[MAGMA_OP_TYPE_ADD_FLARE_TO_PARENT] = g_strdup("MAGMA_OP_TYPE_ADD_FLARE_TO_PARENT");
 		explanation[MAGMA_OP_TYPE_REMOVE_FLARE_FROM_PARENT] = g_strdup("MAGMA_OP_TYPE_REMOVE_FLARE_FROM_PARENT");
 		explanation[MAGMA_OP_TYPE_F_OPENDIR] = g_strdup("MAGMA_OP_TYPE_F_OPENDIR");
@@ -166,6 +188,10 @@ gchar *magma_explain_optype(magma_optype optype)
 		explanation[MAGMA_OP_TYPE_PUT_KEY] = g_strdup("MAGMA_OP_TYPE_PUT_KEY");
 		explanation[MAGMA_OP_TYPE_DROP_KEY] = g_strdup("MAGMA_OP_TYPE_DROP_KEY");
 		explanation[MAGMA_OP_TYPE_GET_KEY_CONTENT] = g_strdup("MAGMA_OP_TYPE_GET_KEY_CONTENT");
+		explanation[MAGMA_OP_TYPE_REPLAY_JOURNAL] = g_strdup("MAGMA_OP_TYPE_REPLAY_JOURNAL");
+		explanation[MAGMA_OP_TYPE_TRANSMIT_METADATA] = g_strdup("MAGMA_OP_TYPE_TRANSMIT_METADATA");
+		explanation[MAGMA_OP_TYPE_JOURNAL_CHECKPOINT] = g_strdup("MAGMA_OP_TYPE_JOURNAL_CHECKPOINT");
+		explanation[MAGMA_OP_TYPE_NEGOTIATE] = g_strdup("MAGMA_OP_TYPE_NEGOTIATE");
 		explanation[MAGMA_OP_TYPE_CLOSECONNECTION] = g_strdup("MAGMA_OP_TYPE_CLOSECONNECTION");
 		explanation[MAGMA_OP_TYPE_HEARTBEAT] = g_strdup("MAGMA_OP_TYPE_HEARTBEAT");
 
@@ -175,29 +201,262 @@ gchar *magma_explain_optype(magma_optype optype)
 	return explanation[optype];
 }
 
+/**
+ * Get an incoming request to receive a datagram into. Requests are
+ * taken from the service free list; if the free list is empty a new
+ * one is allocated and will be freed once served. Buffers are not
+ * zeroed: only the received length is meaningful.
+ *
+ * @param context the UDP service context
+ * @return an incoming request
+ */
+static magma_incoming_request *magma_get_incoming_request(magma_udp_service_context *context)
+{
+	magma_incoming_request *incoming = g_async_queue_try_pop(context->free_list);
+	if (!incoming) {
+		incoming = g_new(magma_incoming_request, 1);
+		incoming->free_list = NULL;
+	}
+
+	g_strlcpy(incoming->ip_addr, context->ip_addr, MAX_IP_LENGTH);
+	incoming->port = context->port;
+	incoming->socket = context->socket;
+	incoming->peer = NULL;
+	incoming->stream = NULL;
+	incoming->length = 0;
+
+	return (incoming);
+}
+
+/**
+ * Release an incoming request once served, returning it
+ * to its free list.
+ *
+ * @param incoming the request
+ */
+void magma_dispose_incoming_request(magma_incoming_request *incoming)
+{
+	if (incoming->peer) {
+		g_object_unref(incoming->peer);
+		incoming->peer = NULL;
+	}
+
+	if (incoming->stream) {
+		g_object_unref(incoming->stream);
+		incoming->stream = NULL;
+	}
+
+	if (incoming->free_list) {
+		g_async_queue_push(incoming->free_list, incoming);
+	} else {
+		g_free(incoming);
+	}
+}
+
+/**
+ * Hand a received datagram to the thread pool or, if the
+ * service has no pool, serve it directly.
+ *
+ * @param context the UDP service context
+ * @param incoming the received request
+ */
+static void magma_dispatch_incoming_request(magma_udp_service_context *context, magma_incoming_request *incoming)
+{
+	dbg(LOG_INFO, DEBUG_NET, "Datagram received");
+	if (context->pool_callback) {
+		/* pass the request to the pool of its class */
+		if (!magma_scheduler_admit(context, incoming)) {
+			magma_dispose_incoming_request(incoming);
+		} else {
+			dbg(LOG_INFO, DEBUG_NET, "New request pushed into thread pool");
+		}
+	} else {
+		/* directly call the callback to manage the request */
+		context->callback(context->socket, incoming->peer, incoming->buffer);
+		magma_dispose_incoming_request(incoming);
+	}
+}
+
+#if MAGMA_UDP_RECVMMSG_ENABLED
+
+/**
+ * Dispatch a buffer read with UDP_GRO on, which may hold several
+ * datagrams from the same peer coalesced by the kernel. Each one
+ * after the first is copied into a request of its own.
+ *
+ * @param context the UDP service context
+ * @param incoming the received buffer
+ * @param segment the size of each coalesced datagram
+ */
+static void magma_split_coalesced_request(magma_udp_service_context *context, magma_incoming_request *incoming, gsize segment)
+{
+	magma_incoming_request *segments[MAGMA_UDP_GSO_MAX_SEGMENTS];
+	guint count = 0, i;
+
+	gsize offset = segment;
+	for (; offset < (gsize) incoming->length && count < MAGMA_UDP_GSO_MAX_SEGMENTS; offset += segment) {
+		magma_incoming_request *next = magma_get_incoming_request(context);
+		next->length = MIN(segment, (gsize) incoming->length - offset);
+		memcpy(next->buffer, incoming->buffer + offset, next->length);
+		next->peer = g_object_ref(incoming->peer);
+		segments[count++] = next;
+	}
+
+	incoming->length = MIN(segment, (gsize) incoming->length);
+
+	/* keep the order they were sent in */
+	magma_dispatch_incoming_request(context, incoming);
+	for (i = 0; i < count; i++) magma_dispatch_incoming_request(context, segments[i]);
+}
+
 /**
  * Cycles to receive new packets from the wire and call the proper
  * callack to service them.
  *
+ * The thread sleeps in epoll_wait() until the socket is readable,
+ * then drains it with recvmmsg(), reading up to MAGMA_UDP_RECEIVE_BATCH
+ * datagrams per system call into preallocated requests. If the kernel
+ * supports UDP_GRO, bursts of datagrams arrive coalesced and are split
+ * here into one request each.
+ *
  * @param context the context the thread is running in
  */
 gpointer magma_manage_udp_service(magma_udp_service_context *context)
 {
-	GError *error = NULL;
+	int fd = g_socket_get_fd(context->socket);
+
+	int epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd is -1) {
+		dbg(LOG_ERR, DEBUG_NET, "Error creating epoll descriptor for %s: %s", context->description, strerror(errno));
+		exit (1);
+	}
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(struct epoll_event));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) is -1) {
+		dbg(LOG_ERR, DEBUG_NET, "Error adding %s socket to epoll: %s", context->description, strerror(errno));
+		exit (1);
+	}
+
+	magma_incoming_request *batch[MAGMA_UDP_RECEIVE_BATCH];
+	struct mmsghdr msgs[MAGMA_UDP_RECEIVE_BATCH];
+	struct iovec iovecs[MAGMA_UDP_RECEIVE_BATCH];
+	struct sockaddr_storage addrs[MAGMA_UDP_RECEIVE_BATCH];
+	union {
+		gchar buffer[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} controls[MAGMA_UDP_RECEIVE_BATCH];
+	int ready = 0;
+
+	gboolean gro = magma_udp_enable_gro(context->socket);
 
 	while (1) {
 		/*
-		 * allocate the incoming buffer
+		 * Wait for available data
 		 */
-		magma_incoming_request *incoming = g_new0(magma_incoming_request, 1);
-		if (!incoming) {
-			g_usleep(100000);
+		struct epoll_event event;
+		int events = epoll_wait(epfd, &event, 1, -1);
+		if (events is -1) {
+			if (errno isNot EINTR) {
+				dbg(LOG_ERR, DEBUG_NET, "Error waiting on %s socket: %s", context->description, strerror(errno));
+				g_usleep(100000);
+			}
 			continue;
 		}
 
-		g_strlcpy(incoming->ip_addr, context->ip_addr, MAX_IP_LENGTH);
-		incoming->port = context->port;
-		incoming->socket = context->socket;
+		/*
+		 * Drain the socket, one batch at time
+		 */
+		while (1) {
+			int i;
+			for (; ready < MAGMA_UDP_RECEIVE_BATCH; ready++) {
+				batch[ready] = magma_get_incoming_request(context);
+			}
+
+			for (i = 0; i < MAGMA_UDP_RECEIVE_BATCH; i++) {
+				iovecs[i].iov_base = batch[i]->buffer;
+				iovecs[i].iov_len = MAGMA_MESSAGE_MAX_SIZE;
+
+				memset(&msgs[i], 0, sizeof(struct mmsghdr));
+				msgs[i].msg_hdr.msg_name = &addrs[i];
+				msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+				msgs[i].msg_hdr.msg_iov = &iovecs[i];
+				msgs[i].msg_hdr.msg_iovlen = 1;
+
+				if (gro) {
+					msgs[i].msg_hdr.msg_control = controls[i].buffer;
+					msgs[i].msg_hdr.msg_controllen = sizeof(controls[i].buffer);
+				}
+			}
+
+			int received = recvmmsg(fd, msgs, MAGMA_UDP_RECEIVE_BATCH, MSG_DONTWAIT, NULL);
+			if (received <= 0) {
+				if (received is -1 && errno isNot EAGAIN && errno isNot EWOULDBLOCK && errno isNot EINTR) {
+					dbg(LOG_INFO, DEBUG_NET, "Error receiving next datagrams: %s", strerror(errno));
+				}
+				break;
+			}
+
+			for (i = 0; i < received; i++) {
+				magma_incoming_request *incoming = batch[i];
+				incoming->length = msgs[i].msg_len;
+
+				if (!incoming->length) {
+					dbg(LOG_INFO, DEBUG_NET, "Empty datagram received");
+					magma_dispose_incoming_request(incoming);
+					continue;
+				}
+
+				incoming->peer = g_socket_address_new_from_native(&addrs[i], msgs[i].msg_hdr.msg_namelen);
+				if (!incoming->peer) {
+					dbg(LOG_INFO, DEBUG_NET, "Datagram from unknown address family discarded");
+					magma_dispose_incoming_request(incoming);
+					continue;
+				}
+
+				if (gro) {
+					magma_split_coalesced_request(context, incoming,
+						magma_udp_gro_segment_size(&msgs[i].msg_hdr, incoming->length));
+				} else {
+					magma_dispatch_incoming_request(context, incoming);
+				}
+			}
+
+			/*
+			 * keep unused requests for the next round
+			 */
+			ready = MAGMA_UDP_RECEIVE_BATCH - received;
+			memmove(batch, batch + received, ready * sizeof(magma_incoming_request *));
+
+			if (received < MAGMA_UDP_RECEIVE_BATCH) break;
+		}
+
+		dbg(LOG_INFO, DEBUG_NET, "Ready for receiving another datagram");
+	}
+
+	return 0;
+}
+
+#else /* MAGMA_UDP_RECVMMSG_ENABLED */
+
+/**
+ * Cycles to receive new packets from the wire and call the proper
+ * callack to service them.
+ *
+ * @param context the context the thread is running in
+ */
+gpointer magma_manage_udp_service(magma_udp_service_context *context)
+{
+	GError *error = NULL;
+
+	while (1) {
+		/*
+		 * get an incoming buffer
+		 */
+		magma_incoming_request *incoming = magma_get_incoming_request(context);
 
 		/*
 		 * Wait for available data
@@ -207,7 +466,7 @@ gpointer magma_manage_udp_service(magma_udp_service_context *context)
 		/*
 		 * Receive a datagram from the net
 		 */
-		gssize length = g_socket_receive_from(
+		incoming->length = g_socket_receive_from(
 			context->socket,
 			&(incoming->peer),
 			incoming->buffer,
@@ -215,19 +474,17 @@ gpointer magma_manage_udp_service(magma_udp_service_context *context)
 			NULL,
 			&error);
 
-		if (length is -1) {
+		if (incoming->length is -1) {
 			dbg(LOG_INFO, DEBUG_NET, "Error receiving next datagram: %s\n", error->message);
 			g_error_free(error);
-			g_object_unref(incoming->peer);
-			g_free(incoming);
+			error = NULL;
+			magma_dispose_incoming_request(incoming);
 			continue;
 		}
 
-		if (length is 0) {
+		if (incoming->length is 0) {
 			dbg(LOG_INFO, DEBUG_NET, "Connection closed by peer\n");
-			g_error_free(error);
-			g_object_unref(incoming->peer);
-			g_free(incoming);
+			magma_dispose_incoming_request(incoming);
 			continue;
 		}
 
@@ -235,40 +492,95 @@ gpointer magma_manage_udp_service(magma_udp_service_context *context)
 		 * if the datagram has been received, call the passed
 		 * callback to manage it
 		 */
-		dbg(LOG_INFO, DEBUG_NET, "Datagram received");
-		if (context->tp) {
-			/* pass the request to the thread pool */
-			error = NULL;
-			g_thread_pool_push(context->tp, incoming, &error);
-			if (error) {
-				dbg(LOG_ERR, DEBUG_NET, "Error pushing new request into thread pool: %s", error->message);
-				g_error_free(error);
-			} else {
-				dbg(LOG_INFO, DEBUG_NET, "New request pushed into thread pool");
-			}
-		} else {
-			/* directly call the callback to manage the request */
-			context->callback(context->socket, incoming->peer, incoming->buffer);
-
-			/* unref GLib objects to allow their disposal */
-			g_object_unref(incoming->peer);
-			g_free(incoming);
-		}
+		magma_dispatch_incoming_request(context, incoming);
 		dbg(LOG_INFO, DEBUG_NET, "Ready for receiving another datagram");
 	}
 
 	return 0;
 }
 
+#endif /* MAGMA_UDP_RECVMMSG_ENABLED */
+
 /**
- * Start a UDP service
+ * Bind the calling thread to the CPUs assigned to a receiver.
+ * With N receivers, receiver i gets every CPU j with j % N == i,
+ * so each receiving socket and its workers share the same cores.
+ * Does nothing when the service has just one receiver.
+ *
+ * @param context the receiver context
  */
-magma_udp_service_context *magma_start_udp_service(
+static void magma_udp_service_set_affinity(magma_udp_service_context *context)
+{
+#ifdef __linux__
+	if (context->receivers < 2) return;
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < (long) context->receivers) return;
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+
+	long cpu = context->receiver;
+	for (; cpu < cpus && cpu < CPU_SETSIZE; cpu += context->receivers) CPU_SET(cpu, &set);
+
+	int res = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set);
+	if (res isNot 0) {
+		dbg(LOG_ERR, DEBUG_NET, "Error setting CPU affinity for %s receiver %u: %s",
+			context->description, context->receiver, strerror(res));
+	}
+#else
+	(void) context;
+#endif
+}
+
+static GPrivate magma_udp_worker_pinned;
+
+/**
+ * Pool entry point for services with more than one receiver.
+ * Binds the worker thread to its receiver CPUs on first use,
+ * then hands the request to the service pool callback.
+ *
+ * @param incoming the incoming request
+ * @param data the receiver context
+ */
+static void magma_udp_service_worker(gpointer incoming, gpointer data)
+{
+	magma_udp_service_context *context = (magma_udp_service_context *) data;
+
+	if (!g_private_get(&magma_udp_worker_pinned)) {
+		magma_udp_service_set_affinity(context);
+		g_private_set(&magma_udp_worker_pinned, GINT_TO_POINTER(1));
+	}
+
+	context->pool_callback(incoming, NULL);
+}
+
+/**
+ * The receiving thread of a UDP service: pins itself to
+ * its CPU set, then enters the receive loop
+ *
+ * @param context the receiver context
+ */
+static gpointer magma_udp_receiver_thread(magma_udp_service_context *context)
+{
+	magma_udp_service_set_affinity(context);
+	return (magma_manage_udp_service(context));
+}
+
+/**
+ * Open and bind one receiving socket on a UDP service port
+ *
+ * @param service_name a description of the service
+ * @param address the local address to bind to
+ * @param port the local port to bind to
+ * @param receivers the total number of receivers sharing the port
+ * @return the bound socket
+ */
+static GSocket *magma_bind_udp_socket(
 	const gchar *service_name,
 	const gchar *address,
 	guint16 port,
-	magma_udp_service_callback callback,
-	GFunc pool_callback)
+	guint receivers)
 {
 	GError * error = NULL;
 
@@ -282,6 +594,21 @@ magma_udp_service_context *magma_start_udp_service(
 		exit (1);
 	}
 
+#ifdef SO_REUSEPORT
+	/*
+	 * Let the kernel spread datagrams among all the receivers
+	 */
+	if (receivers > 1 && !g_socket_set_option(socket, SOL_SOCKET, SO_REUSEPORT, 1, &error)) {
+		dbg(LOG_ERR, DEBUG_NET, "Error setting SO_REUSEPORT on %s: %s", service_name, error->message);
+		g_error_free(error);
+		g_object_unref(socket);
+		exit (1);
+	}
+#else
+	(void) service_name;
+	(void) receivers;
+#endif
+
 	/*
 	 * Parse the address into a GInetAddress
 	 */
@@ -314,6 +641,38 @@ magma_udp_service_context *magma_start_udp_service(
 		exit (1);
 	}
 
+	g_object_unref(inet_address);
+	g_object_unref(saddr);
+
+	return (socket);
+}
+
+/**
+ * Serve a bound datagram socket with its own receiving thread,
+ * free list and worker pool
+ *
+ * @param service_name a description of the service
+ * @param socket the bound socket
+ * @param address the local address, for reference
+ * @param port the local port, for reference
+ * @param callback the function serving each request
+ * @param pool_callback the function run by pool workers, NULL to serve in the receiving thread
+ * @param receiver the index of this receiver
+ * @param receivers the total number of receivers sharing the port
+ * @return the receiver context
+ */
+static magma_udp_service_context *magma_start_udp_receiver(
+	const gchar *service_name,
+	GSocket *socket,
+	const gchar *address,
+	guint16 port,
+	magma_udp_service_callback callback,
+	GFunc pool_callback,
+	guint receiver,
+	guint receivers)
+{
+	GError * error = NULL;
+
 	/*
 	 * Create a context for this service
 	 */
@@ -321,27 +680,41 @@ magma_udp_service_context *magma_start_udp_service(
 	if (!context) {
 		dbg(LOG_INFO, DEBUG_NET, "Internal error allocating UDP context\n");
 		g_object_unref(socket);
-		g_object_unref(inet_address);
-		g_object_unref(saddr);
 		exit (1);
 	}
 
+	context->pool_callback = pool_callback;
+	context->receiver = receiver;
+	context->receivers = receivers;
+
 	/*
-	 * Create a thread pool to manage flare requests
+	 * Create the bounded thread pools to manage requests. With more
+	 * than one receiver, workers get pinned to the receiver CPUs.
 	 */
 	if (pool_callback) {
-		dbg(LOG_INFO, DEBUG_NET, "Starting thread pool for %s", service_name);
-		context->tp = g_thread_pool_new(pool_callback, NULL, -1, FALSE, &error);
-		if (!context->tp) {
+		dbg(LOG_INFO, DEBUG_NET, "Starting thread pools for %s receiver %u", service_name, receiver);
+		gboolean started = (receivers > 1)
+			? magma_scheduler_start_pools(context, magma_udp_service_worker, context, &error)
+			: magma_scheduler_start_pools(context, pool_callback, NULL, &error);
+		if (!started) {
 			dbg(LOG_ERR, DEBUG_NET, "Error spawning thread pool for %s: %s", service_name, error->message);
 			g_error_free(error);
 			g_object_unref(socket);
-			g_object_unref(inet_address);
-			g_object_unref(saddr);
 			exit (1);
 		}
 	}
 
+	/*
+	 * preallocate the incoming requests
+	 */
+	context->free_list = g_async_queue_new();
+	int i = 0;
+	for (; i < MAGMA_UDP_PREALLOCATED_REQUESTS; i++) {
+		magma_incoming_request *incoming = g_new(magma_incoming_request, 1);
+		incoming->free_list = context->free_list;
+		g_async_queue_push(context->free_list, incoming);
+	}
+
 	/*
 	 * fill the rest of the context
 	 */
@@ -354,25 +727,146 @@ magma_udp_service_context *magma_start_udp_service(
 	/*
 	 * Spawn a thread to manage this service
 	 */
-	GThread *thread = g_thread_try_new(service_name, (GThreadFunc) magma_manage_udp_service, context, &error);
+	GThread *thread = g_thread_try_new(service_name, (GThreadFunc) magma_udp_receiver_thread, context, &error);
 	if (!thread) {
 		dbg(LOG_INFO, DEBUG_NET, "Error spawning service thread: %s", error->message);
 		g_error_free(error);
 		g_object_unref(socket);
-		g_object_unref(inet_address);
-		g_object_unref(saddr);
-		g_thread_pool_free(context->tp, TRUE, TRUE);
+		magma_scheduler_free_pools(context);
 		exit (1);
 	}
 
 	return (context);
 }
 
+/**
+ * Start a UDP service. If receivers is greater than one, as many
+ * sockets are bound to the same port with SO_REUSEPORT, each one
+ * with its own receiving thread, free list and worker pool.
+ *
+ * @param service_name a description of the service
+ * @param address the local address to bind to
+ * @param port the local port to bind to
+ * @param callback the function serving each request
+ * @param pool_callback the function run by pool workers, NULL to serve in the receiving thread
+ * @param receivers the number of sockets to open on the port
+ * @return the context of the first receiver, the others are chained on ->next
+ */
+magma_udp_service_context *magma_start_udp_service(
+	const gchar *service_name,
+	const gchar *address,
+	guint16 port,
+	magma_udp_service_callback callback,
+	GFunc pool_callback,
+	guint receivers)
+{
+#ifndef SO_REUSEPORT
+	if (receivers > 1) {
+		dbg(LOG_ERR, DEBUG_NET, "SO_REUSEPORT not supported, %s will use one receiver", service_name);
+		receivers = 1;
+	}
+#endif
+
+	if (receivers < 1) receivers = 1;
+	if (receivers > MAGMA_UDP_MAX_RECEIVERS) receivers = MAGMA_UDP_MAX_RECEIVERS;
+
+	magma_udp_service_context *first = NULL, *last = NULL;
+
+	guint receiver = 0;
+	for (; receiver < receivers; receiver++) {
+		GSocket *socket = magma_bind_udp_socket(service_name, address, port, receivers);
+		magma_udp_service_context *context = magma_start_udp_receiver(
+			service_name, socket, address, port, callback, pool_callback, receiver, receivers);
+
+		if (last) last->next = context; else first = context;
+		last = context;
+	}
+
+	dbg(LOG_INFO, DEBUG_NET, "%s listening on %s:%u with %u receiver(s)", service_name, address, port, receivers);
+
+	return (first);
+}
+
+/**
+ * Start the local side of a UDP service: a unix datagram socket in
+ * the abstract namespace, named after port, served by the same
+ * callbacks. Clients on this host find it and skip the UDP/IP stack.
+ * Failing to open it is not fatal, since clients fall back to UDP.
+ *
+ * @param service_name a description of the service
+ * @param port the UDP port of the service
+ * @param callback the function serving each request
+ * @param pool_callback the function run by pool workers, NULL to serve in the receiving thread
+ * @return the receiver context, NULL on error
+ */
+magma_udp_service_context *magma_start_local_service(
+	const gchar *service_name,
+	guint16 port,
+	magma_udp_service_callback callback,
+	GFunc pool_callback)
+{
+	GError *error = NULL;
+
+	GSocket *socket = g_socket_new(G_SOCKET_FAMILY_UNIX, G_SOCKET_TYPE_DATAGRAM, G_SOCKET_PROTOCOL_DEFAULT, &error);
+	if (!socket) {
+		dbg(LOG_ERR, DEBUG_NET, "Error creating local socket for %s: %s", service_name, error->message);
+		g_error_free(error);
+		return (NULL);
+	}
+
+	GSocketAddress *saddr = magma_local_service_address(port);
+	gboolean bound = g_socket_bind(socket, saddr, FALSE, &error);
+	g_object_unref(saddr);
+
+	if (!bound) {
+		dbg(LOG_ERR, DEBUG_NET, "Error binding local socket for %s: %s", service_name, error->message);
+		g_error_free(error);
+		g_object_unref(socket);
+		return (NULL);
+	}
+
+	/* replies to local clients must not block the workers */
+	g_socket_set_blocking(socket, FALSE);
+
+	magma_udp_service_context *context = magma_start_udp_receiver(
+		service_name, socket, "local", port, callback, pool_callback, 0, 1);
+
+	dbg(LOG_INFO, DEBUG_NET, "%s listening on local socket " MAGMA_LOCAL_SOCKET_FORMAT, service_name, port);
+
+	return (context);
+}
+
 GMutex magma_transaction_mutex;
-guint16 magma_transaction = 0;
+magma_transaction_id magma_transaction = 0;
 
 /**
- * Set request header fields
+ * Create a new transaction ID
+ *
+ * @return the ID, never 0 once shrunk to 16 bits for version 1
+ */
+magma_transaction_id magma_new_transaction_id()
+{
+	/* lock the transaction mutex to synchronize its access */
+	g_mutex_lock(&magma_transaction_mutex);
+
+	/*
+	 * increment the transaction, jumping the MAGMA_TID_WIDE bit and
+	 * the IDs which would be 0 once shrunk to 16 bits for version 1
+	 */
+	magma_transaction = (magma_transaction + 1) & ~MAGMA_TID_WIDE;
+	if (!(magma_transaction & 0xffff)) magma_transaction++; // no zero transaction allowed
+
+	magma_transaction_id tid = magma_transaction;
+	g_mutex_unlock(&magma_transaction_mutex);
+
+	return (tid);
+}
+
+/**
+ * Set request header fields. The header is always written in the
+ * version 2 format, with a 32 bit transaction ID. If the peer only
+ * speaks version 1, magma_fit_request_header() shrinks it before
+ * sending.
  *
  * @param request the request struct
  * @param req_type the MAGMA_OP_TYPE_* type of the request
@@ -396,27 +890,16 @@ gchar *magma_format_request_header(
 
 	/* serialize request type and TTL */
 	ptr = magma_serialize_8(ptr, req_type);
-	ptr = magma_serialize_8(ptr, ttl);
+	ptr = magma_serialize_8(ptr, ttl | MAGMA_TTL_WIDE_TID);
 
 	/*
 	 * Serialize the transaction ID which has been passed or create
 	 * a new ID and serialize it
 	 */
-	if (! *tid) {
-		/* lock the transaction mutex to synchronize its access */
-		g_mutex_lock(&magma_transaction_mutex);
-
-		/* increment the transaction, jumping the 0 ID */
-		magma_transaction++;
-		if (!magma_transaction) magma_transaction++; // no zero transaction allowed
-
-		/* save the transaction id to return it to the caller */
-		*tid = magma_transaction;
-		g_mutex_unlock(&magma_transaction_mutex);
-	}
+	if (! *tid) *tid = magma_new_transaction_id();
 
 	/* serialize the transaction ID */
-	ptr = magma_serialize_16(ptr, *tid);
+	ptr = magma_serialize_32(ptr, *tid & ~MAGMA_TID_WIDE);
 
 	/* serialize UID and GID */
 	ptr = magma_serialize_32(ptr, uid);
@@ -443,7 +926,21 @@ gchar *magma_parse_request_header(gchar *buffer, magma_request *request)
 
 	ptr = magma_deserialize_8 (ptr, &request->generic_request.header.type);
 	ptr = magma_deserialize_8 (ptr, &request->generic_request.header.ttl);
-	ptr = magma_deserialize_16(ptr, &request->generic_request.header.transaction_id);
+
+	/*
+	 * version 2 requests carry a 32 bit transaction ID, which is
+	 * marked with MAGMA_TID_WIDE to be answered in the same format
+	 */
+	if (request->generic_request.header.ttl & MAGMA_TTL_WIDE_TID) {
+		request->generic_request.header.ttl &= ~MAGMA_TTL_WIDE_TID;
+		ptr = magma_deserialize_32(ptr, &request->generic_request.header.transaction_id);
+		request->generic_request.header.transaction_id |= MAGMA_TID_WIDE;
+	} else {
+		guint16 tid = 0;
+		ptr = magma_deserialize_16(ptr, &tid);
+		request->generic_request.header.transaction_id = tid;
+	}
+
 	ptr = magma_deserialize_32(ptr, &request->generic_request.header.uid);
 	ptr = magma_deserialize_32(ptr, &request->generic_request.header.gid);
 
@@ -472,9 +969,15 @@ gchar *magma_format_response_header(
 	}
 
 	gchar *ptr = response;
-	ptr = magma_serialize_16(ptr, err_no);
-	ptr = magma_serialize_32(ptr, res);
-	ptr = magma_serialize_16(ptr, transaction_id);
+	if (transaction_id & MAGMA_TID_WIDE) {
+		ptr = magma_serialize_16(ptr, err_no | MAGMA_ERRNO_WIDE_TID);
+		ptr = magma_serialize_32(ptr, res);
+		ptr = magma_serialize_32(ptr, transaction_id & ~MAGMA_TID_WIDE);
+	} else {
+		ptr = magma_serialize_16(ptr, err_no);
+		ptr = magma_serialize_32(ptr, res);
+		ptr = magma_serialize_16(ptr, transaction_id);
+	}
 	ptr = magma_serialize_32(ptr, flags);
 	return (ptr);
 }
@@ -501,7 +1004,16 @@ gchar *magma_parse_response_header(gchar *buffer, magma_response *response)
 
 	ptr = magma_deserialize_16(ptr, (guint16 *) &response->generic_response.header.err_no);
 	ptr = magma_deserialize_32(ptr, (guint32 *) &response->generic_response.header.res);
-	ptr = magma_deserialize_16(ptr, &response->generic_response.header.transaction_id);
+
+	if (response->generic_response.header.err_no & MAGMA_ERRNO_WIDE_TID) {
+		response->generic_response.header.err_no &= ~MAGMA_ERRNO_WIDE_TID;
+		ptr = magma_deserialize_32(ptr, &response->generic_response.header.transaction_id);
+	} else {
+		guint16 tid = 0;
+		ptr = magma_deserialize_16(ptr, &tid);
+		response->generic_response.header.transaction_id = tid;
+	}
+
 	ptr = magma_deserialize_32(ptr, &response->generic_response.header.flags);
 
 	return (ptr);
@@ -561,6 +1073,28 @@ gchar *magma_serialize_string(gchar *buffer, const gchar *string) {
 	return (ptr);
 }
 
+/**
+ * Serialize an integer in as few bytes as it needs: seven bits per
+ * byte, least significant first, the high bit set on all the bytes
+ * but the last. Values below 128 take one byte, a 64 bit value at
+ * most MAGMA_VARINT_MAX_SIZE.
+ *
+ * @param buffer the destination buffer
+ * @param src the value
+ * @return a pointer inside buffer to the next available location for insertion
+ */
+gchar *magma_serialize_varint(gchar *buffer, guint64 src) {
+	guint8 *ptr = (guint8 *) buffer;
+
+	while (src >= 0x80) {
+		*ptr++ = (guint8) (src | 0x80);
+		src >>= 7;
+	}
+	*ptr++ = (guint8) src;
+
+	return ((gchar *) ptr);
+}
+
 /**
  * Extracts size byted from buffer and copy them into dst.
  * Returns a pointer to next available byte for copy
@@ -597,6 +1131,37 @@ gchar *magma_deserialize_8(gchar *buffer, guint8 *dst) {
 	return magma_extract_from_buffer(buffer, (gchar *) dst, sizeof(guint8));
 }
 
+/**
+ * Deserialize an integer written by magma_serialize_varint(). Unlike
+ * fixed size fields, its length is known only while reading it, so
+ * the end of the received data must be given.
+ *
+ * @param buffer the source buffer
+ * @param end the first byte past the received data
+ * @param dst the value
+ * @return a pointer inside buffer to the next byte, NULL if the value
+ *         runs past end or is longer than MAGMA_VARINT_MAX_SIZE
+ */
+gchar *magma_deserialize_varint(gchar *buffer, gchar *end, guint64 *dst) {
+	guint8 *ptr = (guint8 *) buffer;
+	guint64 value = 0;
+	guint shift = 0;
+
+	for (; shift < 7 * MAGMA_VARINT_MAX_SIZE; shift += 7) {
+		if (ptr >= (guint8 *) end) return (NULL);
+
+		guint8 byte = *ptr++;
+		value |= (guint64) (byte & 0x7f) << shift;
+
+		if (!(byte & 0x80)) {
+			*dst = value;
+			return ((gchar *) ptr);
+		}
+	}
+
+	return (NULL);
+}
+
 gchar *magma_deserialize_string(gchar *buffer, gchar *dst) {
 	/*
 	 * First deserialize the string length
@@ -616,41 +1181,249 @@ gchar *magma_deserialize_string(gchar *buffer, gchar *dst) {
 }
 
 /**
- * Performs a perfect send and receive loop. The buffer is sent
- * MAGMA_RETRY_LIMIT times until a response is received. After every
- * transmission, the response is waited for MAGMA_AGAIN_LIMIT times
- * before sending the request again.
+ * Shrink a request header written by magma_format_request_header()
+ * to the version 1 format if the peer doesn't speak version 2.
+ *
+ * @param buffer the serialized request
+ * @param length the request length
+ * @param wide TRUE if the peer accepts 32 bit transaction IDs
+ * @param wire_tid where the transaction ID as sent on the wire is saved
+ * @return the new request length
+ */
+gsize magma_fit_request_header(gchar *buffer, gsize length, gboolean wide, magma_transaction_id *wire_tid)
+{
+	guint32 tid = 0;
+	magma_deserialize_32(buffer + 2, &tid);
+
+	if (wide) {
+		*wire_tid = tid;
+		return (length);
+	}
+
+	buffer[1] &= ~MAGMA_TTL_WIDE_TID;
+	magma_serialize_16(buffer + 2, tid);
+	memmove(buffer + 4, buffer + 6, length - 6);
+
+	*wire_tid = tid & 0xffff;
+	return (length - 2);
+}
+
+/**
+ * Read the transaction ID of a serialized response
+ *
+ * @param buffer the response
+ * @param length the response length
+ * @return the transaction ID, 0 if the response is too short
+ */
+magma_transaction_id magma_peek_response_tid(gchar *buffer, gssize length)
+{
+	if (length < 8) return (0);
+
+	guint16 err_no = 0;
+	magma_deserialize_16(buffer, &err_no);
+
+	if (err_no & MAGMA_ERRNO_WIDE_TID) {
+		if (length < 10) return (0);
+		guint32 tid = 0;
+		magma_deserialize_32(buffer + 6, &tid);
+		return (tid);
+	}
+
+	guint16 tid = 0;
+	magma_deserialize_16(buffer + 6, &tid);
+	return (tid);
+}
+
+/**
+ * Read the result of a serialized response
+ *
+ * @param buffer the response
+ * @param length the response length
+ * @return the result, -1 if the response is too short
+ */
+magma_result magma_peek_response_result(gchar *buffer, gssize length)
+{
+	if (length < 6) return (-1);
+
+	guint32 res = 0;
+	magma_deserialize_32(buffer + 2, &res);
+	return ((magma_result) res);
+}
+
+/**
+ * Read the flags of a serialized response
+ *
+ * @param buffer the response
+ * @param length the response length
+ * @return the flags, 0 if the response is too short
+ */
+magma_flags magma_peek_response_flags(gchar *buffer, gssize length)
+{
+	if (length < 12) return (0);
+
+	guint16 err_no = 0;
+	magma_deserialize_16(buffer, &err_no);
+
+	gssize offset = (err_no & MAGMA_ERRNO_WIDE_TID) ? 10 : 8;
+	if (length < offset + 4) return (0);
+
+	guint32 flags = 0;
+	magma_deserialize_32(buffer + offset, &flags);
+	return ((magma_flags) flags);
+}
+
+/**
+ * Tell if a request moves enough data to be better
+ * sent over a stream connection
+ *
+ * @param type the request type
+ * @return TRUE for bulk operations
+ */
+gboolean magma_request_is_bulk(magma_optype type)
+{
+	return ((
+		type is MAGMA_OP_TYPE_READ ||
+		type is MAGMA_OP_TYPE_WRITE ||
+		type is MAGMA_OP_TYPE_F_OPENDIR ||
+		type is MAGMA_OP_TYPE_TRANSMIT_KEY) ? TRUE : FALSE);
+}
+
+/**
+ * Send a request without waiting for its answer, shrinking
+ * its header if the peer only speaks protocol version 1
  *
  * @param socket a GSocket object
  * @param peer a GSocketAddress object
- * @param request_buffer the serialized request
- * @param buffer_length the length in bytes of request_buffer
+ * @param buffer the request as written by magma_format_request_header()
+ * @param length the request length
+ */
+GIOStatus magma_send_request(GSocket *socket, GSocketAddress *peer, gchar *buffer, gsize length)
+{
+	magma_transaction_id wire_tid = 0;
+	length = magma_fit_request_header(buffer, length, magma_demux_wide_tids(socket), &wire_tid);
+	return (magma_send_buffer(socket, peer, buffer, length));
+}
+
+/**
+ * Performs a perfect send and receive loop. The request is sent
+ * MAGMA_RETRY_LIMIT times until a response is received.
+ *
+ * On cached sockets the reply is waited for the retransmission
+ * timeout of the peer, which doubles after every unanswered
+ * transmission and is measured again on replies to requests sent
+ * only once. On other sockets, the response is waited for
+ * MAGMA_AGAIN_LIMIT times before sending the request again.
+ *
+ * Bulk requests go over a stream connection if the peer offers
+ * one, falling back to datagrams if the stream fails.
+ *
+ * Between magma_compound_begin() and magma_compound_end() requests
+ * that can be batched are recorded and answered later instead.
+ *
+ * Datagrams wait for room in the congestion window of the peer;
+ * replies grow it and unanswered transmissions shrink it.
+ *
+ * @param socket a GSocket object
+ * @param peer a GSocketAddress object
+ * @param vectors the request, split in one or more buffers
+ * @param num_vectors the number of elements in vectors
  * @param receiver a callback function to receive the response (usually a magma_pktar_* function)
  * @param response a pointer to a magma_response struct to hold the response
  */
-void magma_send_and_receive_base(
+void magma_send_vectors_and_receive_base(
 	GSocket *socket,
 	GSocketAddress *peer,
-	gchar *request_buffer,
-	guint16 buffer_length,
+	GOutputVector *vectors,
+	gint num_vectors,
 	magma_receiver_func receiver,
 	magma_response *response)
 {
+	/*
+	 * fit the header to the peer protocol version and tell the
+	 * demultiplexer which reply this thread is waiting for
+	 */
+	magma_transaction_id wire_tid = 0;
+	vectors[0].size = magma_fit_request_header((gchar *) vectors[0].buffer, vectors[0].size,
+		magma_demux_wide_tids(socket), &wire_tid);
+
+	/*
+	 * inside magma_compound_begin() the request is only recorded
+	 */
+	if (magma_compound_record(socket, vectors, num_vectors, receiver, response)) return;
+
+	if (magma_request_is_bulk(((guint8 *) vectors[0].buffer)[0])) {
+		GSocket *stream = magma_stream_checkout(socket);
+		if (stream) {
+			GIOStatus status = magma_send_vectors(stream, peer, vectors, num_vectors);
+			if (status is G_IO_STATUS_NORMAL) {
+				receiver(stream, peer, response);
+				status = response->generic_response.header.status;
+			}
+
+			magma_stream_checkin(socket, stream, status is G_IO_STATUS_NORMAL);
+			if (status is G_IO_STATUS_NORMAL) return;
+
+			dbg(LOG_ERR, DEBUG_NET, "Stream transaction %u failed, sending as datagram", wire_tid);
+		}
+	}
+
+	magma_demux_expect(socket, wire_tid);
+
+	/* the request takes its place in the congestion window of the peer */
+	guint granted = magma_cwnd_acquire(socket, 1, TRUE);
+
+	gboolean adaptive = magma_rtt_adaptive(socket);
+	int again_limit = adaptive ? 1 : MAGMA_AGAIN_LIMIT;
+
 	int retry_counter = 0;
 	for (; retry_counter < MAGMA_RETRY_LIMIT; retry_counter++) {
-		magma_send_buffer(socket, peer, request_buffer, buffer_length);
+		gint64 sent = g_get_monotonic_time();
+		magma_send_vectors(socket, peer, vectors, num_vectors);
 
 		int again_counter = 0;
-		for (; again_counter < MAGMA_AGAIN_LIMIT; again_counter++) {
+		for (; again_counter < again_limit; again_counter++) {
 			receiver(socket, peer, response);
 			if (response->generic_response.header.status isNot G_IO_STATUS_AGAIN) {
 				// response->generic_response.header.err_no = EIO; // ENOTCONN - ECONNREFUSED - EHOSTDOWN - EHOSTUNREACH
-				return;
+				break;
 			}
 		}
 
-		if (response->generic_response.header.status is G_IO_STATUS_NORMAL) return;
+		if (response->generic_response.header.status isNot G_IO_STATUS_AGAIN) {
+			if (!retry_counter) magma_rtt_sample(socket, g_get_monotonic_time() - sent);
+			break;
+		}
+
+		if (adaptive) {
+			magma_rtt_backoff(socket);
+			magma_cwnd_loss(socket);
+		}
 	}
+
+	magma_cwnd_release(socket, granted, (retry_counter < MAGMA_RETRY_LIMIT) ? 1 : 0);
+	magma_demux_forget(socket);
+}
+
+/**
+ * Performs a perfect send and receive loop on a contiguous buffer.
+ *
+ * @param socket a GSocket object
+ * @param peer a GSocketAddress object
+ * @param request_buffer the serialized request
+ * @param buffer_length the length in bytes of request_buffer
+ * @param receiver a callback function to receive the response (usually a magma_pktar_* function)
+ * @param response a pointer to a magma_response struct to hold the response
+ */
+void magma_send_and_receive_base(
+	GSocket *socket,
+	GSocketAddress *peer,
+	gchar *request_buffer,
+	guint16 buffer_length,
+	magma_receiver_func receiver,
+	magma_response *response)
+{
+	GOutputVector vector = { request_buffer, buffer_length };
+	magma_send_vectors_and_receive_base(socket, peer, &vector, 1, receiver, response);
 }
 
 // vim:ts=4:nocindent:autoindent
@@ -33,8 +33,83 @@ typedef struct {
 	gchar buffer[MAGMA_MESSAGE_MAX_SIZE];
 	gchar ip_addr[MAX_IP_LENGTH];
 	guint16 port;
+
+	/* bytes received into buffer */
+	gssize length;
+
+	/* the free list this request returns to once served, NULL to g_free() it */
+	GAsyncQueue *free_list;
+
+	/* the stream connection the request came from, held until served */
+	GSocket *stream;
 } magma_incoming_request;
 
+extern void magma_dispose_incoming_request(magma_incoming_request *incoming);
+
+/**
+ * if TRUE, UDP services wait with epoll() and read datagrams in
+ * batches with recvmmsg() into preallocated requests. Linux only,
+ * other systems use g_socket_receive_from() one datagram at time.
+ */
+#define MAGMA_UDP_USE_RECVMMSG TRUE
+
+#if MAGMA_UDP_USE_RECVMMSG && defined(__linux__)
+#define MAGMA_UDP_RECVMMSG_ENABLED 1
+#else
+#define MAGMA_UDP_RECVMMSG_ENABLED 0
+#endif
+
+/** max datagrams read by one recvmmsg() call */
+#define MAGMA_UDP_RECEIVE_BATCH 32
+
+/** incoming requests preallocated by each UDP service */
+#define MAGMA_UDP_PREALLOCATED_REQUESTS 256
+
+/** upper limit to the receiving sockets a UDP service can open on its port */
+#define MAGMA_UDP_MAX_RECEIVERS 64
+
+/**
+ * classes of requests, each one served by its own bounded worker pool
+ */
+typedef enum {
+	MAGMA_CLASS_METADATA = 0,	/** getattr, mknod, chmod, rename... */
+	MAGMA_CLASS_DATA,			/** read and write */
+	MAGMA_CLASS_DIRLIST,		/** readdir and f_opendir */
+	MAGMA_CLASS_NODE,			/** node protocol and replication */
+	MAGMA_SCHEDULER_CLASSES
+} magma_request_class;
+
+/**
+ * the configuration and the counters of a request class
+ */
+typedef struct {
+	const gchar *name;		/** used in logs and in -P specifications */
+	gint workers;			/** max threads serving this class */
+	guint queue_limit;		/** max requests waiting for a worker */
+	guint priority;			/** 0 is the highest, shed last under pressure */
+	volatile gint admitted;	/** requests queued so far */
+	volatile gint rejected;	/** requests dropped so far */
+} magma_scheduler_class;
+
+/*
+ * default pool sizes, overridden by magmad -P class:workers:queue:priority
+ */
+#define MAGMA_SCHEDULER_METADATA_WORKERS 8
+#define MAGMA_SCHEDULER_METADATA_QUEUE 512
+#define MAGMA_SCHEDULER_DATA_WORKERS 8
+#define MAGMA_SCHEDULER_DATA_QUEUE 256
+#define MAGMA_SCHEDULER_DIRLIST_WORKERS 2
+#define MAGMA_SCHEDULER_DIRLIST_QUEUE 64
+#define MAGMA_SCHEDULER_NODE_WORKERS 4
+#define MAGMA_SCHEDULER_NODE_QUEUE 256
+
+/** queued requests in a service above which lower priority classes get shed */
+#define MAGMA_SCHEDULER_BACKLOG 256
+
+extern magma_scheduler_class *magma_scheduler_get_class(magma_request_class class);
+extern gboolean magma_scheduler_configure(const gchar *spec);
+extern magma_request_class magma_scheduler_classify(gchar *buffer);
+
 #include "balancer/protocol_balancer.h"
 #include "console/protocol_console.h"
 #include "flare/protocol_flare.h"
@@ -57,6 +132,7 @@ typedef union {
 	magma_node_request node_request;
 } magma_request;
 
+extern magma_transaction_id magma_new_transaction_id();
 extern gchar *magma_format_request_header(
 	gchar *request, magma_optype req_type, uid_t uid, gid_t gid, magma_transaction_id *tid, magma_ttl ttl);
 
@@ -151,9 +227,37 @@ typedef struct {
 	GSocketAddress *peer;
 
 	/*
-	 * A pointer to the pool
+	 * worker pools, one per request class, or NULL
+	 * if requests are served by the receiving thread
+	 */
+	GThreadPool *pools[MAGMA_SCHEDULER_CLASSES];
+
+	/*
+	 * preallocated incoming requests ready to be received into
+	 */
+	GAsyncQueue *free_list;
+
+	/*
+	 * the function the pool workers run on each request
 	 */
-	GThreadPool *tp;
+	GFunc pool_callback;
+
+	/*
+	 * this receiver among all the sockets sharing the port
+	 * with SO_REUSEPORT, used to choose its CPU affinity set
+	 */
+	guint receiver;
+	guint receivers;
+
+	/*
+	 * the next receiver on the same port, NULL if last
+	 */
+	gpointer next;
+
+	/*
+	 * the connections open on a stream service
+	 */
+	volatile gint connections;
 } magma_udp_service_context;
 
 extern magma_udp_service_context *magma_start_udp_service(
@@ -161,8 +265,21 @@ extern magma_udp_service_context *magma_start_udp_service(
 	const gchar *address,
 	guint16 port,
 	magma_udp_service_callback callback,
+	GFunc pool_callback,
+	guint receivers);
+
+extern magma_udp_service_context *magma_start_local_service(
+	const gchar *service_name,
+	guint16 port,
+	magma_udp_service_callback callback,
 	GFunc pool_callback);
 
+extern magma_udp_service_context *magma_start_stream_service(magma_udp_service_context *udp);
+
+extern gboolean magma_scheduler_start_pools(magma_udp_service_context *context, GFunc func, gpointer data, GError **error);
+extern void magma_scheduler_free_pools(magma_udp_service_context *context);
+extern gboolean magma_scheduler_admit(magma_udp_service_context *context, magma_incoming_request *incoming);
+
 /**
  * like strlen but +1, to host the ending '\0'.
  * Useful in calculating packet sizes.
@@ -227,12 +344,18 @@ extern gchar *magma_serialize_16(gchar *buffer, guint16 src);
 extern gchar *magma_serialize_8(gchar *buffer, guint8 src);
 extern gchar *magma_serialize_string(gchar *buffer, const gchar *string);
 
+/** the longest varint: a 64 bit value in groups of seven bits */
+#define MAGMA_VARINT_MAX_SIZE 10
+
+extern gchar *magma_serialize_varint(gchar *buffer, guint64 src);
+
 extern gchar *magma_extract_from_buffer(gchar *buffer, gchar *dst, guint16 size);
 extern gchar *magma_deserialize_64(gchar *buffer, guint64 *dst);
 extern gchar *magma_deserialize_32(gchar *buffer, guint32 *dst);
 extern gchar *magma_deserialize_16(gchar *buffer, guint16 *dst);
 extern gchar *magma_deserialize_8(gchar *buffer, guint8 *dst);
 extern gchar *magma_deserialize_string(gchar *buffer, gchar *dst);
+extern gchar *magma_deserialize_varint(gchar *buffer, gchar *end, guint64 *dst);
 
 /**
  * This function prototype must be conformed to by function
@@ -257,10 +380,46 @@ extern void magma_send_and_receive_base(
 	magma_receiver_func receiver,
 	magma_response *response);
 
+/**
+ * Like magma_send_and_receive, but the request is gathered
+ * from an array of GOutputVector, so payloads can be sent
+ * without being copied after the request header
+ */
+#define magma_send_vectors_and_receive(socket, peer, vectors, num_vectors, receiver, response) \
+	magma_send_vectors_and_receive_base(socket, peer, vectors, num_vectors, \
+		(magma_receiver_func) receiver, (magma_response *) response)
+
+extern gsize magma_fit_request_header(gchar *buffer, gsize length, gboolean wide, magma_transaction_id *wire_tid);
+extern magma_transaction_id magma_peek_response_tid(gchar *buffer, gssize length);
+extern magma_result magma_peek_response_result(gchar *buffer, gssize length);
+extern magma_flags magma_peek_response_flags(gchar *buffer, gssize length);
+extern gboolean magma_request_is_bulk(magma_optype type);
+extern GIOStatus magma_send_request(GSocket *socket, GSocketAddress *peer, gchar *buffer, gsize length);
+
+extern void magma_send_vectors_and_receive_base(
+	GSocket *socket,
+	GSocketAddress *peer,
+	GOutputVector *vectors,
+	gint num_vectors,
+	magma_receiver_func receiver,
+	magma_response *response);
+
+extern gboolean magma_compound_record(
+	GSocket *socket,
+	GOutputVector *vectors,
+	gint num_vectors,
+	magma_receiver_func receiver,
+	magma_response *response);
+
+/**
+ * room for the serialized part of a request or response sent with
+ * magma_send_vectors(): headers, numeric fields and a path
+ */
+#define MAGMA_VECTOR_HEADER_SIZE (MAX_PATH_LENGTH + 64)
+
 #define magma_log_transaction(opstring, tid, peer) {\
-	gchar *remote = g_inet_address_to_string(g_inet_socket_address_get_address(G_INET_SOCKET_ADDRESS(peer)));\
-	guint16 port = g_inet_socket_address_get_port(G_INET_SOCKET_ADDRESS(peer));\
-	dbg(LOG_INFO, DEBUG_NET, "Sending " #opstring "#%05d to %s:%d", tid, remote, port);\
+	gchar *remote = magma_get_peer_name(peer);\
+	dbg(LOG_INFO, DEBUG_NET, "Sending " #opstring "#%05d to %s", tid, remote);\
 	g_free(remote);\
 }
 
@@ -282,6 +441,8 @@ extern void magma_send_and_receive_base(
 	dbg(LOG_INFO, DEBUG_FLARE, "Registering %s as flare optype %d (%s)", #callback, optype, #optype);\
 }
 
+#include "protocol_async.h"
+
 #endif /* _MAGMA_PROTOCOL_H */
 
 // vim:ts=4:nocindent
@@ -0,0 +1,440 @@
+/*
+   MAGMA -- protocol_async.c
+   Copyright (C) 2006-2013 Tx0 <tx0@strumentiresistenti.org>
+
+   Asynchronous client requests. Requests are sent by the calling
+   thread and registered on the transaction ID demultiplexer of
+   their socket. A single I/O thread reads the replies, retransmits
+   the requests left unanswered and completes the futures.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include "../magma.h"
+
+/**
+ * A reply handed over by the demultiplexer to the I/O thread
+ */
+typedef struct {
+	magma_future *future;
+	gchar *datagram;
+	gssize length;
+	gint64 received;		/** monotonic arrival time */
+} magma_async_reply;
+
+/** guards magma_async_inflight */
+static GMutex magma_async_lock;
+
+/** signalled when the first request gets in flight */
+static GCond magma_async_cond;
+
+/** the futures waiting for a reply */
+static GList *magma_async_inflight = NULL;
+
+/** replies read but not yet decoded */
+static GAsyncQueue *magma_async_replies = NULL;
+
+/**
+ * Called by the demultiplexer with the socket lock held:
+ * the reply is just queued for the I/O thread
+ */
+static void magma_async_deliver(gpointer data, gchar *datagram, gssize length)
+{
+	magma_async_reply *reply = g_new0(magma_async_reply, 1);
+	reply->future = data;
+	reply->datagram = g_memdup(datagram, length);
+	reply->length = length;
+	reply->received = g_get_monotonic_time();
+	g_async_queue_push(magma_async_replies, reply);
+}
+
+/**
+ * Mark a future as done and notify its owner
+ *
+ * @param future the future
+ */
+static void magma_async_complete(magma_future *future)
+{
+	g_mutex_lock(&magma_async_lock);
+	magma_async_inflight = g_list_remove(magma_async_inflight, future);
+	g_mutex_unlock(&magma_async_lock);
+
+	if (future->callback) {
+		future->done = TRUE;
+		future->callback(future, future->user_data);
+		magma_future_free(future);
+		return;
+	}
+
+	g_mutex_lock(&future->lock);
+	future->done = TRUE;
+	g_cond_broadcast(&future->cond);
+	g_mutex_unlock(&future->lock);
+}
+
+/**
+ * Complete a future with an error
+ *
+ * @param future the future
+ * @param err_no the errno value reported in the response
+ */
+static void magma_async_fail(magma_future *future, magma_errno err_no)
+{
+	future->response->generic_response.header.res = -1;
+	future->response->generic_response.header.err_no = err_no;
+	future->response->generic_response.header.status = G_IO_STATUS_ERROR;
+	magma_async_complete(future);
+}
+
+/**
+ * Decode the replies queued by magma_async_deliver()
+ */
+static void magma_async_drain_replies()
+{
+	magma_async_reply *reply;
+
+	while ((reply = g_async_queue_try_pop(magma_async_replies))) {
+		magma_future *future = reply->future;
+
+		/* Karn: a reply to a retransmitted request is not a sample */
+		if (!future->retries) magma_rtt_sample(future->socket, reply->received - future->sent);
+		magma_cwnd_release(future->socket, 1, 1);
+
+		if (future->decoder(reply->datagram, reply->length, future->response)) {
+			future->response->generic_response.header.status = G_IO_STATUS_NORMAL;
+			magma_async_complete(future);
+		} else {
+			dbg(LOG_ERR, DEBUG_NET, "Malformed reply to transaction %u", future->tid);
+			magma_async_fail(future, EIO);
+		}
+
+		g_free(reply->datagram);
+		g_free(reply);
+	}
+}
+
+/**
+ * Send again the requests whose reply is late, and give up
+ * on the ones which exhausted MAGMA_RETRY_LIMIT attempts
+ */
+static void magma_async_check_timeouts()
+{
+	gint64 now = g_get_monotonic_time();
+	GList *expired = NULL;
+
+	g_mutex_lock(&magma_async_lock);
+	GList *item;
+	for (item = magma_async_inflight; item; item = item->next) {
+		magma_future *future = item->data;
+		if (now < future->deadline) continue;
+
+		if (future->retries < MAGMA_RETRY_LIMIT) {
+			future->retries++;
+			magma_rtt_backoff(future->socket);
+			magma_cwnd_loss(future->socket);
+			future->deadline = now + magma_rtt_timeout(future->socket);
+			dbg(LOG_INFO, DEBUG_NET, "Sending transaction %u again", future->tid);
+			magma_send_buffer(future->socket, future->peer, future->request, future->length);
+		} else {
+			expired = g_list_prepend(expired, future);
+		}
+	}
+	g_mutex_unlock(&magma_async_lock);
+
+	for (item = expired; item; item = item->next) {
+		magma_future *future = item->data;
+
+		/* a reply which just arrived is already in magma_async_replies */
+		if (magma_demux_cancel(future->socket, future->tid)) {
+			dbg(LOG_ERR, DEBUG_NET, "Transaction %u timed out", future->tid);
+			magma_cwnd_release(future->socket, 1, 0);
+			magma_async_fail(future, EIO);
+		}
+	}
+	g_list_free(expired);
+}
+
+/**
+ * The I/O thread: polls the sockets with requests in flight and
+ * completes their futures
+ */
+static gpointer magma_async_io_thread(gpointer data)
+{
+	(void) data;
+
+	for (;;) {
+		g_mutex_lock(&magma_async_lock);
+		while (!magma_async_inflight && !g_async_queue_length(magma_async_replies)) {
+			g_cond_wait(&magma_async_cond, &magma_async_lock);
+		}
+
+		/*
+		 * collect the sockets of the requests in flight, once each
+		 */
+		guint max_sockets = g_list_length(magma_async_inflight);
+		GSocket **sockets = g_new0(GSocket *, max_sockets + 1);
+		GPollFD *fds = g_new0(GPollFD, max_sockets + 1);
+		guint count = 0;
+
+		GList *item;
+		for (item = magma_async_inflight; item; item = item->next) {
+			magma_future *future = item->data;
+
+			guint i;
+			for (i = 0; i < count; i++) if (sockets[i] is future->socket) break;
+			if (i < count) continue;
+
+			sockets[count] = g_object_ref(future->socket);
+			fds[count].fd = g_socket_get_fd(future->socket);
+			fds[count].events = G_IO_IN;
+			count++;
+		}
+		g_mutex_unlock(&magma_async_lock);
+
+		if (count) g_poll(fds, count, MAGMA_ASYNC_TICK);
+
+		guint i;
+		for (i = 0; i < count; i++) {
+			if (fds[i].revents & G_IO_IN) magma_demux_poll(sockets[i]);
+			g_object_unref(sockets[i]);
+		}
+		g_free(sockets);
+		g_free(fds);
+
+		magma_async_drain_replies();
+		magma_async_check_timeouts();
+	}
+
+	return (NULL);
+}
+
+static gpointer magma_async_start(gpointer data)
+{
+	(void) data;
+
+	magma_async_replies = g_async_queue_new();
+
+	GError *error = NULL;
+	GThread *thread = g_thread_try_new("async I/O", magma_async_io_thread, NULL, &error);
+	if (!thread) {
+		dbg(LOG_ERR, DEBUG_ERR, "Error starting async I/O thread: %s", error->message);
+		g_error_free(error);
+		return (NULL);
+	}
+	g_thread_unref(thread);
+
+	return (thread);
+}
+
+/**
+ * Send a request without waiting for its reply. The reply is
+ * decoded into response by the I/O thread, which then calls the
+ * callback or, if callback is NULL, wakes up magma_future_wait().
+ *
+ * The socket must come from magma_open_client_connection(), since
+ * replies are matched by the demultiplexer of cached sockets. If
+ * the request can't be submitted, the future fails at once.
+ *
+ * @param socket a GSocket object
+ * @param peer a GSocketAddress object
+ * @param request the request, formatted with magma_format_request_header()
+ * @param length the request length
+ * @param decoder the function decoding the reply
+ * @param response a pointer to a magma_response struct to hold the response
+ * @param callback the completion callback or NULL
+ * @param user_data passed to callback
+ * @return the future, owned by the caller only if callback is NULL
+ */
+magma_future *magma_async_submit(
+	GSocket *socket,
+	GSocketAddress *peer,
+	gchar *request,
+	gsize length,
+	magma_async_decoder decoder,
+	magma_response *response,
+	magma_completion_func callback,
+	gpointer user_data)
+{
+	static GOnce magma_async_once = G_ONCE_INIT;
+	gboolean started = g_once(&magma_async_once, magma_async_start, NULL) ? TRUE : FALSE;
+
+	magma_future *future = g_new0(magma_future, 1);
+	future->socket = g_object_ref(socket);
+	future->peer = g_object_ref(peer);
+	future->request = g_memdup(request, length);
+	future->decoder = decoder;
+	future->response = response;
+	future->callback = callback;
+	future->user_data = user_data;
+	g_mutex_init(&future->lock);
+	g_cond_init(&future->cond);
+
+	future->length = magma_fit_request_header(future->request, length, magma_demux_wide_tids(socket), &future->tid);
+
+	if (!started || !magma_demux_submit(socket, future->tid, magma_async_deliver, future)) {
+		dbg(LOG_ERR, DEBUG_NET, "Can't submit transaction %u", future->tid);
+		magma_async_fail(future, EIO);
+		return (callback ? NULL : future);
+	}
+
+	/*
+	 * the request counts in the congestion window of the peer
+	 * without waiting for room: the submitter may be a completion
+	 * callback, running on the thread which gives room back
+	 */
+	magma_cwnd_acquire(socket, 1, FALSE);
+
+	future->sent = g_get_monotonic_time();
+	future->deadline = future->sent + magma_rtt_timeout(socket);
+
+	g_mutex_lock(&magma_async_lock);
+	magma_async_inflight = g_list_prepend(magma_async_inflight, future);
+	g_cond_signal(&magma_async_cond);
+	g_mutex_unlock(&magma_async_lock);
+
+	/*
+	 * a failed transmission is just left to the retransmission timer
+	 */
+	magma_send_buffer(socket, peer, future->request, future->length);
+
+	return (future);
+}
+
+/**
+ * Check whether a future has completed, without blocking
+ *
+ * @param future the future
+ * @return TRUE if the response is available
+ */
+gboolean magma_future_done(magma_future *future)
+{
+	g_mutex_lock(&future->lock);
+	gboolean done = future->done;
+	g_mutex_unlock(&future->lock);
+	return (done);
+}
+
+/**
+ * Wait for a future to complete
+ *
+ * @param future the future
+ * @return the response passed to magma_async_submit()
+ */
+magma_response *magma_future_wait(magma_future *future)
+{
+	g_mutex_lock(&future->lock);
+	while (!future->done) g_cond_wait(&future->cond, &future->lock);
+	g_mutex_unlock(&future->lock);
+	return (future->response);
+}
+
+/**
+ * Free a completed future
+ *
+ * @param future the future
+ */
+void magma_future_free(magma_future *future)
+{
+	if (!future) return;
+
+	g_object_unref(future->socket);
+	g_object_unref(future->peer);
+	g_free(future->request);
+	g_mutex_clear(&future->lock);
+	g_cond_clear(&future->cond);
+	g_free(future);
+}
+
+static gboolean magma_async_decode_getattr(gchar *buffer, gssize length, magma_response *response)
+{
+	gchar *ptr = magma_parse_response_header(buffer, response);
+	if (!ptr || ptr - buffer > length) return (FALSE);
+
+	if (response->flare_response.header.res isNot -1) {
+		magma_decode_stat_struct(ptr, response->flare_response.body.getattr.stbuf);
+	}
+
+	return (TRUE);
+}
+
+/**
+ * Asynchronous version of magma_pktqs_getattr()
+ *
+ * @param response its body.getattr.stbuf must point to a struct stat
+ */
+magma_future *magma_async_getattr(
+	GSocket *socket,
+	GSocketAddress *peer,
+	uid_t uid,
+	gid_t gid,
+	const gchar *path,
+	magma_flare_response *response,
+	magma_completion_func callback,
+	gpointer user_data)
+{
+	MAGMA_IO_BUFFER(buffer);
+
+	magma_transaction_id tid = 0;
+	gchar *ptr = magma_format_request_header(buffer, MAGMA_OP_TYPE_GETATTR, uid, gid, &tid, MAGMA_TERMINAL_TTL);
+	ptr = magma_serialize_string(ptr, path);
+
+	magma_log_transaction(MAGMA_OP_TYPE_GETATTR, tid, peer);
+	return (magma_async_submit(socket, peer, buffer, ptr - buffer,
+		magma_async_decode_getattr, (magma_response *) response, callback, user_data));
+}
+
+static gboolean magma_async_decode_read(gchar *buffer, gssize length, magma_response *response)
+{
+	gchar *ptr = magma_parse_response_header(buffer, response);
+	if (!ptr || ptr - buffer > length) return (FALSE);
+
+	magma_result res = response->flare_response.header.res;
+	if (res > 0) {
+		if (res > length - (ptr - buffer) || res > MAGMA_READ_WRITE_BUFFER_SIZE) return (FALSE);
+		memcpy(response->flare_response.body.read.buffer, ptr, res);
+	}
+
+	return (TRUE);
+}
+
+/**
+ * Asynchronous version of magma_pktqs_read()
+ */
+magma_future *magma_async_read(
+	GSocket *socket,
+	GSocketAddress *peer,
+	uid_t uid,
+	gid_t gid,
+	guint32 size,
+	guint64 offset,
+	const gchar *path,
+	magma_flare_response *response,
+	magma_completion_func callback,
+	gpointer user_data)
+{
+	MAGMA_IO_BUFFER(buffer);
+
+	magma_transaction_id tid = 0;
+	gchar *ptr = magma_format_request_header(buffer, MAGMA_OP_TYPE_READ, uid, gid, &tid, MAGMA_TERMINAL_TTL);
+	ptr = magma_serialize_32(ptr, size);
+	ptr = magma_serialize_64(ptr, offset);
+	ptr = magma_serialize_string(ptr, path);
+
+	magma_log_transaction(MAGMA_OP_TYPE_READ, tid, peer);
+	return (magma_async_submit(socket, peer, buffer, ptr - buffer,
+		magma_async_decode_read, (magma_response *) response, callback, user_data));
+}
+
+// vim:ts=4:nocindent:autoindent
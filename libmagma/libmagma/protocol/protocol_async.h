@@ -0,0 +1,108 @@
+/*
+   MAGMA -- protocol_async.h
+   Copyright (C) 2006-2013 Tx0 <tx0@strumentiresistenti.org>
+
+   Asynchronous client requests.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#ifndef _MAGMA_PROTOCOL_ASYNC_H
+#define _MAGMA_PROTOCOL_ASYNC_H
+
+/** how often the I/O thread checks its sockets and timeouts, in milliseconds */
+#define MAGMA_ASYNC_TICK 10
+
+typedef struct magma_future magma_future;
+
+/**
+ * Called by the I/O thread when a request completes. The future
+ * is freed when the callback returns.
+ */
+typedef void (*magma_completion_func)(magma_future *future, gpointer user_data);
+
+/**
+ * Decodes a reply datagram into a response. All the magma_async_*
+ * operations provide their own decoder.
+ */
+typedef gboolean (*magma_async_decoder)(gchar *buffer, gssize length, magma_response *response);
+
+/**
+ * A request in flight. Without a callback, the caller polls it with
+ * magma_future_done() or blocks on magma_future_wait(), and releases
+ * it with magma_future_free().
+ */
+struct magma_future {
+	GSocket *socket;
+	GSocketAddress *peer;
+
+	gchar *request;					/** the request, already fitted to the peer protocol version */
+	gsize length;
+	magma_transaction_id tid;		/** the transaction ID as sent on the wire */
+
+	magma_async_decoder decoder;
+	magma_response *response;
+
+	guint retries;
+	gint64 sent;					/** monotonic time of the first transmission */
+	gint64 deadline;				/** monotonic time of the next retransmission */
+
+	magma_completion_func callback;
+	gpointer user_data;
+
+	GMutex lock;
+	GCond cond;
+	gboolean done;
+};
+
+extern magma_future *magma_async_submit(
+	GSocket *socket,
+	GSocketAddress *peer,
+	gchar *request,
+	gsize length,
+	magma_async_decoder decoder,
+	magma_response *response,
+	magma_completion_func callback,
+	gpointer user_data);
+
+extern gboolean magma_future_done(magma_future *future);
+extern magma_response *magma_future_wait(magma_future *future);
+extern void magma_future_free(magma_future *future);
+
+extern magma_future *magma_async_getattr(
+	GSocket *socket,
+	GSocketAddress *peer,
+	uid_t uid,
+	gid_t gid,
+	const gchar *path,
+	magma_flare_response *response,
+	magma_completion_func callback,
+	gpointer user_data);
+
+extern magma_future *magma_async_read(
+	GSocket *socket,
+	GSocketAddress *peer,
+	uid_t uid,
+	gid_t gid,
+	guint32 size,
+	guint64 offset,
+	const gchar *path,
+	magma_flare_response *response,
+	magma_completion_func callback,
+	gpointer user_data);
+
+#endif /* _MAGMA_PROTOCOL_ASYNC_H */
+
+// vim:ts=4:nocindent:autoindent
@@ -86,6 +86,15 @@ extern const magma_optype MAGMA_OP_TYPE_INIT;		/* optional */
 extern const magma_optype MAGMA_OP_TYPE_DESTROY;	/* optional */
 extern const magma_optype MAGMA_OP_TYPE_READDIR_EXTENDED; /* implemented */
 extern const magma_optype MAGMA_OP_TYPE_READDIR_OFFSET; /* implemented */
+extern const magma_optype MAGMA_OP_TYPE_READ_LARGE;	/* implemented, protocol version 3 */
+extern const magma_optype MAGMA_OP_TYPE_WRITE_LARGE;	/* implemented, protocol version 3 */
+extern const magma_optype MAGMA_OP_TYPE_COMPOUND;	/* implemented, protocol version 4 */
+extern const magma_optype MAGMA_OP_TYPE_READ_PMTU;	/* implemented, protocol version 5 */
+extern const magma_optype MAGMA_OP_TYPE_WRITE_PMTU;	/* implemented, protocol version 5 */
+extern const magma_optype MAGMA_OP_TYPE_READDIR_COMPACT;	/* implemented, protocol version 6 */
+extern const magma_optype MAGMA_OP_TYPE_OPEN_HANDLE;	/* implemented, protocol version 7 */
+extern const magma_optype MAGMA_OP_TYPE_READ_HANDLE;	/* implemented, protocol version 7 */
+extern const magma_optype MAGMA_OP_TYPE_WRITE_HANDLE;	/* implemented, protocol version 7 */
 
 extern const magma_optype MAGMA_OP_TYPE_ADD_FLARE_TO_PARENT;
 extern const magma_optype MAGMA_OP_TYPE_REMOVE_FLARE_FROM_PARENT;
@@ -109,10 +118,14 @@ extern const magma_optype MAGMA_OP_TYPE_PUT_KEY;			/* release a key to sibling n
 extern const magma_optype MAGMA_OP_TYPE_DROP_KEY;			/* drop key, because it has been assigned to another node */
 extern const magma_optype MAGMA_OP_TYPE_GET_KEY_CONTENT;	/* get key content */
 extern const magma_optype MAGMA_OP_TYPE_NETWORK_BUILT;		/* network loaded and ready to operate */
+extern const magma_optype MAGMA_OP_TYPE_REPLAY_JOURNAL;		/* replay journaled operations to a redundant node */
+extern const magma_optype MAGMA_OP_TYPE_TRANSMIT_METADATA;	/* transmit a batch of flare records */
+extern const magma_optype MAGMA_OP_TYPE_JOURNAL_CHECKPOINT;	/* journal applied on a redundant node up to a sequence */
 
 /*
  * generic utilities
  */
+extern const magma_optype MAGMA_OP_TYPE_NEGOTIATE;			/* agree on the protocol version */
 extern const magma_optype MAGMA_OP_TYPE_CLOSECONNECTION;	/* close connection to MAGMA server */
 extern const magma_optype MAGMA_OP_TYPE_SHUTDOWN;			/* shutdown the lava network */
 extern const magma_optype MAGMA_OP_TYPE_HEARTBEAT;			/* see if server is still available */
@@ -151,6 +164,26 @@ extern const int16_t NEXT_NODE;
 #define MAGMA_MESSAGE_MAX_SIZE 65507 // the size of the UDP packet minus 8 bytes of UDP header and 20 bytes of IP header
 #endif
 
+/**
+ * Protocol version 2 carries 32 bit transaction IDs. Clients start
+ * talking version 1 to a peer and switch once a NEGOTIATE request
+ * has been answered with version 2 or later. Version 3 adds the
+ * fragmented READ_LARGE and WRITE_LARGE operations, version 4 the
+ * COMPOUND operation, version 5 READ_PMTU and WRITE_PMTU, version 6
+ * READDIR_COMPACT, version 7 the file handle operations OPEN_HANDLE,
+ * READ_HANDLE and WRITE_HANDLE.
+ */
+#define MAGMA_PROTOCOL_VERSION 7
+
+/** request TTL bit: the transaction ID takes 32 bits */
+#define MAGMA_TTL_WIDE_TID 0x80
+
+/** response err_no bit: the transaction ID takes 32 bits */
+#define MAGMA_ERRNO_WIDE_TID 0x8000
+
+/** server side transaction ID bit: answer with a 32 bit ID */
+#define MAGMA_TID_WIDE 0x80000000
+
 #if 0
 #define MAGMA_PROTOCOL_ALIGNMENT __attribute__ ((packed,aligned(1)))
 #else
@@ -179,6 +212,9 @@ typedef struct MAGMA_PROTOCOL_ALIGNMENT {
 
 	/** used to report magma_pktar() status and to check for retransmission */
 	GIOStatus status;
+
+	/** the bytes received by magma_pktar(), header included */
+	gssize length;
 } magma_response_header;
 
 #endif /* _MAGMA_PROTOCOL_PKT_H */
@@ -0,0 +1,201 @@
+/*
+   MAGMA -- protocol_scheduler.c
+   Copyright (C) 2006-2013 Tx0 <tx0@strumentiresistenti.org>
+
+   Admission scheduler for UDP services. Incoming requests are
+   classified by operation type and handed to a bounded worker
+   pool per class. Requests exceeding the class queue limit are
+   dropped and left to client retransmission.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA. 
+*/
+
+#include "../magma.h"
+
+/**
+ * class configuration and counters, indexed by magma_request_class
+ */
+static magma_scheduler_class magma_scheduler_classes[MAGMA_SCHEDULER_CLASSES] = {
+	{ "metadata",	MAGMA_SCHEDULER_METADATA_WORKERS,	MAGMA_SCHEDULER_METADATA_QUEUE,	0, 0, 0 },
+	{ "data",		MAGMA_SCHEDULER_DATA_WORKERS,		MAGMA_SCHEDULER_DATA_QUEUE,		2, 0, 0 },
+	{ "dirlist",	MAGMA_SCHEDULER_DIRLIST_WORKERS,	MAGMA_SCHEDULER_DIRLIST_QUEUE,	3, 0, 0 },
+	{ "node",		MAGMA_SCHEDULER_NODE_WORKERS,		MAGMA_SCHEDULER_NODE_QUEUE,		1, 0, 0 },
+};
+
+/**
+ * Return a request class by its index
+ *
+ * @param class the class
+ * @return a pointer to the class descriptor
+ */
+magma_scheduler_class *magma_scheduler_get_class(magma_request_class class)
+{
+	return (&magma_scheduler_classes[class]);
+}
+
+/**
+ * Set the workers, queue limit and priority of a class from
+ * a string like "data:8:256:2". Must be called before the
+ * UDP services are started.
+ *
+ * @param spec the class specification
+ * @return TRUE on success, FALSE if spec can't be parsed
+ */
+gboolean magma_scheduler_configure(const gchar *spec)
+{
+	gchar **fields = g_strsplit(spec, ":", 4);
+	gboolean res = FALSE;
+
+	if (!fields[0] || !fields[1] || !fields[2] || !fields[3]) goto out;
+
+	magma_request_class class = 0;
+	for (; class < MAGMA_SCHEDULER_CLASSES; class++) {
+		if (strcmp(fields[0], magma_scheduler_classes[class].name) is 0) break;
+	}
+	if (class is MAGMA_SCHEDULER_CLASSES) goto out;
+
+	gint workers = atoi(fields[1]);
+	gint queue_limit = atoi(fields[2]);
+	gint priority = atoi(fields[3]);
+	if (workers < 1 || queue_limit < 1 || priority < 0) goto out;
+
+	magma_scheduler_classes[class].workers = workers;
+	magma_scheduler_classes[class].queue_limit = queue_limit;
+	magma_scheduler_classes[class].priority = priority;
+	res = TRUE;
+
+	dbg(LOG_INFO, DEBUG_BOOT, "Scheduler class %s: %d workers, %d queued requests, priority %d",
+		fields[0], workers, queue_limit, priority);
+
+out:
+	g_strfreev(fields);
+	return (res);
+}
+
+/**
+ * Tell the class of a request by looking at its operation type
+ *
+ * @param buffer the incoming datagram
+ * @return the request class
+ */
+magma_request_class magma_scheduler_classify(gchar *buffer)
+{
+	magma_optype type = (magma_optype) buffer[0];
+
+	if (type is MAGMA_OP_TYPE_READ ||
+		type is MAGMA_OP_TYPE_WRITE ||
+		type is MAGMA_OP_TYPE_READ_LARGE ||
+		type is MAGMA_OP_TYPE_WRITE_LARGE ||
+		type is MAGMA_OP_TYPE_READ_PMTU ||
+		type is MAGMA_OP_TYPE_WRITE_PMTU ||
+		type is MAGMA_OP_TYPE_READ_HANDLE ||
+		type is MAGMA_OP_TYPE_WRITE_HANDLE)
+		return (MAGMA_CLASS_DATA);
+
+	if (type is MAGMA_OP_TYPE_READDIR ||
+		type is MAGMA_OP_TYPE_READDIR_EXTENDED ||
+		type is MAGMA_OP_TYPE_READDIR_COMPACT ||
+		type is MAGMA_OP_TYPE_READDIR_OFFSET ||
+		type is MAGMA_OP_TYPE_GETDIR ||
+		type is MAGMA_OP_TYPE_OPENDIR ||
+		(type >= MAGMA_OP_TYPE_F_OPENDIR && type <= MAGMA_OP_TYPE_F_READDIR))
+		return (MAGMA_CLASS_DIRLIST);
+
+	if (type >= MAGMA_OP_TYPE_JOIN ||
+		type is MAGMA_OP_TYPE_ADD_FLARE_TO_PARENT ||
+		type is MAGMA_OP_TYPE_REMOVE_FLARE_FROM_PARENT)
+		return (MAGMA_CLASS_NODE);
+
+	return (MAGMA_CLASS_METADATA);
+}
+
+/**
+ * Create the bounded worker pools of a UDP service context.
+ * Pools are not exclusive, so idle classes don't hold threads.
+ *
+ * @param context the service context
+ * @param func the function run by workers
+ * @param data the data passed to func
+ * @param error a GError to report failures
+ * @return TRUE on success, FALSE otherwise
+ */
+gboolean magma_scheduler_start_pools(magma_udp_service_context *context, GFunc func, gpointer data, GError **error)
+{
+	magma_request_class class = 0;
+	for (; class < MAGMA_SCHEDULER_CLASSES; class++) {
+		context->pools[class] = g_thread_pool_new(func, data, magma_scheduler_classes[class].workers, FALSE, error);
+		if (!context->pools[class]) return (FALSE);
+	}
+	return (TRUE);
+}
+
+/**
+ * Release the worker pools of a UDP service context
+ *
+ * @param context the service context
+ */
+void magma_scheduler_free_pools(magma_udp_service_context *context)
+{
+	magma_request_class class = 0;
+	for (; class < MAGMA_SCHEDULER_CLASSES; class++) {
+		if (context->pools[class]) g_thread_pool_free(context->pools[class], TRUE, TRUE);
+		context->pools[class] = NULL;
+	}
+}
+
+/**
+ * Decide if a request can be queued and push it into its class pool.
+ *
+ * A class accepts requests while its queue is shorter than its limit.
+ * Once the whole context backlog reaches MAGMA_SCHEDULER_BACKLOG, each
+ * class limit is halved for every priority level, so lower priority
+ * classes are shed first and metadata keeps flowing.
+ *
+ * @param context the service context
+ * @param incoming the request
+ * @return TRUE if the request has been queued, FALSE if it must be dropped
+ */
+gboolean magma_scheduler_admit(magma_udp_service_context *context, magma_incoming_request *incoming)
+{
+	magma_request_class class = magma_scheduler_classify(incoming->buffer);
+	magma_scheduler_class *sc = &magma_scheduler_classes[class];
+
+	guint backlog = 0;
+	magma_request_class c = 0;
+	for (; c < MAGMA_SCHEDULER_CLASSES; c++) backlog += g_thread_pool_unprocessed(context->pools[c]);
+
+	guint limit = sc->queue_limit;
+	if (backlog >= MAGMA_SCHEDULER_BACKLOG) limit >>= MIN(sc->priority, 31);
+
+	if (g_thread_pool_unprocessed(context->pools[class]) >= limit) {
+		g_atomic_int_inc(&sc->rejected);
+		dbg(LOG_WARNING, DEBUG_NET, "%s overloaded, dropping %s request (backlog %u)",
+			context->description, sc->name, backlog);
+		return (FALSE);
+	}
+
+	GError *error = NULL;
+	g_thread_pool_push(context->pools[class], incoming, &error);
+	if (error) {
+		dbg(LOG_ERR, DEBUG_NET, "Error pushing new request into %s pool: %s", sc->name, error->message);
+		g_error_free(error);
+		return (FALSE);
+	}
+
+	g_atomic_int_inc(&sc->admitted);
+	return (TRUE);
+}
+
+// vim:ts=4:nocindent:autoindent
@@ -0,0 +1,208 @@
+/*
+   MAGMA -- protocol_stream.c
+   Copyright (C) 2006-2013 Tx0 <tx0@strumentiresistenti.org>
+
+   Stream (TCP) services. A stream service listens on the same port
+   of a UDP service and accepts persistent connections carrying the
+   same packets, each one preceded by its length. Requests are served
+   by the same callbacks and worker pools of the UDP service, which
+   answer on the connection they came from.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include "../magma.h"
+
+/**
+ * A connection accepted by a stream service
+ */
+typedef struct {
+	magma_udp_service_context *context;
+	GSocket *stream;
+} magma_stream_connection;
+
+/**
+ * Read requests from a stream connection until the peer closes it.
+ *
+ * Requests go through the admission of the UDP service, whose
+ * pools they share. A request which is shed closes the connection:
+ * the client, waiting for its answer, sends it again as a datagram.
+ *
+ * @param connection the connection
+ */
+static gpointer magma_stream_connection_thread(magma_stream_connection *connection)
+{
+	magma_udp_service_context *context = connection->context;
+	GSocket *stream = connection->stream;
+	g_free(connection);
+
+	GSocketAddress *peer = g_socket_get_remote_address(stream, NULL);
+
+	for (;;) {
+		magma_incoming_request *incoming = g_new(magma_incoming_request, 1);
+		incoming->free_list = NULL;
+
+		GIOStatus status = magma_stream_receive(stream, incoming->buffer, MAGMA_MESSAGE_MAX_SIZE, &incoming->length);
+		if (status isNot G_IO_STATUS_NORMAL) {
+			g_free(incoming);
+			break;
+		}
+
+		g_strlcpy(incoming->ip_addr, context->ip_addr, MAX_IP_LENGTH);
+		incoming->port = context->port;
+		incoming->socket = stream;
+		incoming->stream = g_object_ref(stream);
+		incoming->peer = peer ? g_object_ref(peer) : NULL;
+
+		if (context->pool_callback) {
+			if (!magma_scheduler_admit(context, incoming)) {
+				magma_dispose_incoming_request(incoming);
+				break;
+			}
+		} else {
+			context->callback(stream, incoming->peer, incoming->buffer);
+			magma_dispose_incoming_request(incoming);
+		}
+	}
+
+	dbg(LOG_INFO, DEBUG_NET, "%s stream connection closed", context->description);
+
+	/* requests still being served hold their own reference */
+	g_socket_close(stream, NULL);
+	g_object_unref(stream);
+	if (peer) g_object_unref(peer);
+
+	g_atomic_int_add(&context->connections, -1);
+	return (NULL);
+}
+
+/**
+ * Accept connections on a stream service. Past
+ * MAGMA_STREAM_MAX_CONNECTIONS, new connections are closed at
+ * once and their clients go on with datagrams.
+ *
+ * @param context the service context
+ */
+static gpointer magma_stream_accept_thread(magma_udp_service_context *context)
+{
+	for (;;) {
+		GError *error = NULL;
+		GSocket *stream = g_socket_accept(context->socket, NULL, &error);
+		if (!stream) {
+			dbg(LOG_ERR, DEBUG_NET, "Error accepting on %s: %s", context->description, error->message);
+			g_error_free(error);
+			continue;
+		}
+
+		if (g_atomic_int_get(&context->connections) >= MAGMA_STREAM_MAX_CONNECTIONS) {
+			dbg(LOG_WARNING, DEBUG_NET, "%s has %d connections, refusing one more",
+				context->description, g_atomic_int_get(&context->connections));
+			g_socket_close(stream, NULL);
+			g_object_unref(stream);
+			continue;
+		}
+
+		magma_stream_setup(stream, 0);
+		g_atomic_int_inc(&context->connections);
+
+		magma_stream_connection *connection = g_new0(magma_stream_connection, 1);
+		connection->context = context;
+		connection->stream = stream;
+
+		GThread *thread = g_thread_try_new(context->description, (GThreadFunc) magma_stream_connection_thread, connection, &error);
+		if (!thread) {
+			dbg(LOG_ERR, DEBUG_NET, "Error spawning stream connection thread: %s", error->message);
+			g_error_free(error);
+			g_atomic_int_add(&context->connections, -1);
+			g_socket_close(stream, NULL);
+			g_object_unref(stream);
+			g_free(connection);
+			continue;
+		}
+		g_thread_unref(thread);
+	}
+
+	return (NULL);
+}
+
+/**
+ * Start a stream service next to a UDP service, on the same address
+ * and port. Its requests are served by the callback and the worker
+ * pools of the UDP service, and admitted by the same scheduler, so
+ * both transports share one backlog. Clients learn it's available
+ * from the NEGOTIATE answer, so magma_environment.stream should be
+ * set too.
+ *
+ * @param udp the context returned by magma_start_udp_service()
+ * @return the service context
+ */
+magma_udp_service_context *magma_start_stream_service(magma_udp_service_context *udp)
+{
+	GError *error = NULL;
+	const gchar *address = udp->ip_addr;
+	guint16 port = udp->port;
+
+	GSocket *socket = g_socket_new(G_SOCKET_FAMILY_IPV4, G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_TCP, &error);
+	if (!socket) {
+		dbg(LOG_ERR, DEBUG_NET, "Error creating the stream socket: %s", error->message);
+		g_error_free(error);
+		exit (1);
+	}
+
+	GInetAddress *inet_address = g_inet_address_new_from_string(address);
+	if (!inet_address) {
+		dbg(LOG_ERR, DEBUG_NET, "Address %s could not be parsed", address);
+		g_object_unref(socket);
+		exit (1);
+	}
+
+	GSocketAddress *saddr = g_inet_socket_address_new(inet_address, port);
+	g_object_unref(inet_address);
+
+	if (!g_socket_bind(socket, saddr, TRUE, &error) || !g_socket_listen(socket, &error)) {
+		dbg(LOG_ERR, DEBUG_NET, "Error listening on %s:%u: %s", address, port, error->message);
+		g_error_free(error);
+		g_object_unref(socket);
+		g_object_unref(saddr);
+		exit (1);
+	}
+	g_object_unref(saddr);
+
+	magma_udp_service_context *context = g_new0(magma_udp_service_context, 1);
+	context->description = g_strdup_printf("%s (stream)", udp->description);
+	context->callback = udp->callback;
+	context->pool_callback = udp->pool_callback;
+	context->socket = socket;
+	context->receivers = 1;
+	g_strlcpy(context->ip_addr, address, MAX_IP_LENGTH);
+	context->port = port;
+
+	/* the pools are borrowed, never freed through this context */
+	memcpy(context->pools, udp->pools, sizeof(context->pools));
+
+	GThread *thread = g_thread_try_new(context->description, (GThreadFunc) magma_stream_accept_thread, context, &error);
+	if (!thread) {
+		dbg(LOG_ERR, DEBUG_NET, "Error spawning stream service thread: %s", error->message);
+		g_error_free(error);
+		exit (1);
+	}
+	g_thread_unref(thread);
+
+	dbg(LOG_INFO, DEBUG_NET, "%s listening on %s:%u", context->description, address, port);
+
+	return (context);
+}
+
+// vim:ts=4:nocindent:autoindent
@@ -120,6 +120,25 @@ magma_volcano *magma_route_path(const char *path)
 	return (node);
 }
 
+/**
+ * route a flare in key space, using the hash it already carries
+ *
+ * @param flare the flare to be routed
+ * @return pointer to owner node, NULL in case of failure.
+ */
+magma_volcano *magma_route_flare(magma_flare_t *flare)
+{
+	if (!flare || !flare->hash) {
+		dbg(LOG_ERR, DEBUG_ERR, "magma_route_flare called with NULL flare or hash");
+		return (NULL);
+	}
+
+	assert(lava isNot NULL);
+	assert(lava->first_node isNot NULL);
+
+	return (magma_route_key(flare->hash, lava->first_node));
+}
+
 /**
  * Compares two nodes to check if are the same.
  *
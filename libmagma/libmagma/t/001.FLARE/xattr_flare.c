@@ -0,0 +1,129 @@
+/*
+   Magma test suite -- xattr_flare.c
+   Copyright (C) 2006-2013 Tx0 <tx0@strumentiresistenti.org>
+
+   Round trip of flare metadata through the extended attribute of
+   the contents file: magma_flare_xattr_save() writes type, uid,
+   gid, commit time and a commit path with spaces in it, and
+   magma_flare_xattr_load() must read the same values back on a
+   fresh flare. A contents file without the attribute, or with a
+   malformed one, must not load. If the temporary directory doesn't
+   support user.* attributes the test is skipped.
+
+   Usage: xattr_flare [directory]
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../magma.h"
+
+magma_environment_t magma_environment;
+
+static int failures = 0;
+
+#define check(condition, message) {\
+	if (condition) {\
+		fprintf(stderr, "  ok: %s\n", message);\
+	} else {\
+		fprintf(stderr, "  FAILED: %s\n", message);\
+		failures++;\
+	}\
+}
+
+int main(int argc, char **argv)
+{
+#ifndef HAVE_LSETXATTR
+	(void) argc;
+	(void) argv;
+	fprintf(stderr, "Built without lsetxattr(): SKIPPED\n");
+	return (0);
+#else
+	gchar *dir = (argc > 1) ? g_strdup(argv[1]) : g_dir_make_tmp("xattr_flare-XXXXXX", NULL);
+	if (!dir) {
+		fprintf(stderr, "Error creating the temporary directory\n");
+		return (1);
+	}
+
+	gchar *contents = g_build_filename(dir, "contents", NULL);
+	g_file_set_contents(contents, "", 0, NULL);
+
+	magma_flare_t saved;
+	memset(&saved, 0, sizeof(magma_flare_t));
+	saved.path = "/xattr/round trip";
+	saved.contents = contents;
+	saved.type = 'r';
+	saved.st.st_uid = 1234;
+	saved.st.st_gid = 5678;
+	saved.commit_time = "1381000000";
+	saved.commit_path = "/xattr/round trip";
+
+	magma_flare_t loaded;
+	memset(&loaded, 0, sizeof(magma_flare_t));
+	loaded.path = saved.path;
+	loaded.contents = contents;
+
+	fprintf(stderr, "Missing attribute:\n");
+	check(!magma_flare_xattr_load(&loaded), "contents without the attribute not loaded");
+
+	if (!magma_flare_xattr_save(&saved)) {
+		fprintf(stderr, "%s doesn't support user.* extended attributes: SKIPPED\n", dir);
+		unlink(contents);
+		rmdir(dir);
+		return (0);
+	}
+
+	fprintf(stderr, "Round trip:\n");
+	check(magma_flare_xattr_load(&loaded), "attribute loaded");
+	check(loaded.type is saved.type, "type");
+	check(loaded.st.st_uid is saved.st.st_uid, "uid");
+	check(loaded.st.st_gid is saved.st.st_gid, "gid");
+	check(!g_strcmp0(loaded.commit_time, saved.commit_time), "commit time");
+	check(!g_strcmp0(loaded.commit_path, saved.commit_path), "commit path with spaces");
+
+	fprintf(stderr, "Uncommitted flare:\n");
+	saved.commit_time = NULL;
+	check(!magma_flare_xattr_save(&saved), "flare without commit time not saved");
+
+	fprintf(stderr, "Malformed attribute:\n");
+	const gchar *malformed = "r nonsense";
+	lsetxattr(contents, MAGMA_METADATA_XATTR, malformed, strlen(malformed), 0);
+	magma_flare_t broken;
+	memset(&broken, 0, sizeof(magma_flare_t));
+	broken.path = saved.path;
+	broken.contents = contents;
+	check(!magma_flare_xattr_load(&broken), "malformed attribute not loaded");
+
+	g_free(loaded.commit_time);
+	g_free(loaded.commit_path);
+	unlink(contents);
+	g_free(contents);
+	rmdir(dir);
+	g_free(dir);
+
+	if (failures) {
+		fprintf(stderr, "FAILED\n");
+		return (1);
+	}
+
+	fprintf(stderr, "OK\n");
+	return (0);
+#endif
+}
+
+// vim:ts=4:nocindent:autoindent
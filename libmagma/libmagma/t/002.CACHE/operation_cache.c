@@ -0,0 +1,170 @@
+/*
+   Magma test suite -- operation_cache.c
+   Copyright (C) 2006-2013 Tx0 <tx0@strumentiresistenti.org>
+
+   Checks the duplicate request cache. The cache is sized for one
+   change per second, which leaves two slots in each shard: three
+   keys of the same shard are saved and the first one must be
+   evicted. Results must not be answered past their expiration.
+   A retransmission claiming an operation which is still running
+   must wait for its result instead of running it again, even when
+   more results than the shard holds are saved meanwhile.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../magma.h"
+
+magma_environment_t magma_environment;
+
+static int failures = 0;
+
+#define check(condition, message) {\
+	if (condition) {\
+		fprintf(stderr, "  ok: %s\n", message);\
+	} else {\
+		fprintf(stderr, "  FAILED: %s\n", message);\
+		failures++;\
+	}\
+}
+
+/**
+ * Fill a key for the transaction tid of a fake peer
+ */
+static void cache_key(magma_operation_key *key, magma_transaction_id tid)
+{
+	memset(key, 0, sizeof(magma_operation_key));
+	key->address[0] = 127;
+	key->address[3] = 1;
+	key->port = 12000;
+	key->family = G_SOCKET_FAMILY_IPV4;
+	key->tid = tid;
+}
+
+/**
+ * Fill keys with count transaction IDs from tid on landing in the same shard
+ */
+static void cache_same_shard(magma_operation_key *keys, int count, magma_transaction_id tid)
+{
+	magma_operation_key key;
+	int found = 0;
+
+	cache_key(&key, tid);
+	guint shard = magma_operation_key_hash(&key) % MAGMA_OPERATION_CACHE_SHARDS;
+
+	while (found < count) {
+		cache_key(&key, tid++);
+		if (magma_operation_key_hash(&key) % MAGMA_OPERATION_CACHE_SHARDS is shard) {
+			keys[found++] = key;
+		}
+	}
+}
+
+static magma_operation_key running_key;
+static gint running_answered = 0;
+
+/**
+ * A retransmission of the running operation
+ */
+static gpointer cache_retransmit(gpointer data)
+{
+	(void) data;
+	magma_operation_result result;
+
+	if (magma_operation_cache_claim(&running_key, &result) && result.res is 42) {
+		g_atomic_int_set(&running_answered, 1);
+	} else {
+		g_atomic_int_set(&running_answered, -1);
+	}
+	return (NULL);
+}
+
+int main(int argc, char **argv)
+{
+	(void) argc;
+	(void) argv;
+
+	magma_operation_result result;
+	magma_operation_key keys[5];
+
+	/* one change per second: 2 slots per shard, results kept for 1 second */
+	magma_operation_cache_configure(1, 1);
+
+	fprintf(stderr, "Eviction:\n");
+	cache_same_shard(keys, 3, 1);
+	magma_operation_cache_save_result(&keys[0], 10, 0);
+	magma_operation_cache_save_result(&keys[1], 11, 0);
+	check(magma_operation_cache_lookup(&keys[0], &result) && result.res is 10, "first result cached");
+	magma_operation_cache_save_result(&keys[2], 12, EEXIST);
+	check(!magma_operation_cache_lookup(&keys[0], &result), "oldest result evicted by the third one");
+	check(magma_operation_cache_lookup(&keys[1], &result) && result.res is 11, "second result kept");
+	check(magma_operation_cache_lookup(&keys[2], &result) && result.err_no is EEXIST, "third result kept");
+
+	fprintf(stderr, "Expiration:\n");
+	g_usleep(2 * G_USEC_PER_SEC);
+	check(!magma_operation_cache_lookup(&keys[1], &result), "expired result not answered");
+	check(!magma_operation_cache_claim(&keys[2], &result), "expired result claimed again");
+	magma_operation_cache_save_result(&keys[2], 13, 0);
+	check(magma_operation_cache_lookup(&keys[2], &result) && result.res is 13, "new result answered");
+
+	fprintf(stderr, "Running operations:\n");
+	cache_key(&running_key, 1000000);
+	check(!magma_operation_cache_claim(&running_key, &result), "new operation claimed");
+	check(!magma_operation_cache_lookup(&running_key, &result), "running operation has no result");
+
+	GThread *retransmit = g_thread_new("retransmit", cache_retransmit, NULL);
+	g_usleep(G_USEC_PER_SEC / 5);
+	check(g_atomic_int_get(&running_answered) is 0, "retransmission waits for the running operation");
+
+	magma_operation_cache_save_result(&running_key, 42, 0);
+	g_thread_join(retransmit);
+	check(g_atomic_int_get(&running_answered) is 1, "retransmission answered with the result");
+
+	fprintf(stderr, "Wrapping the ring:\n");
+	cache_same_shard(keys, 5, 2000000);
+	check(!magma_operation_cache_claim(&keys[0], &result), "first operation claimed");
+	check(!magma_operation_cache_claim(&keys[1], &result), "second operation claimed");
+	magma_operation_cache_save_result(&keys[2], 20, 0);
+	magma_operation_cache_save_result(&keys[3], 21, 0);
+	magma_operation_cache_save_result(&keys[4], 22, 0);
+	check(magma_operation_cache_lookup(&keys[3], &result) && result.res is 21, "result saved while every slot runs kept");
+	check(magma_operation_cache_lookup(&keys[4], &result) && result.res is 22, "newest result kept");
+
+	running_key = keys[0];
+	g_atomic_int_set(&running_answered, 0);
+	retransmit = g_thread_new("retransmit", cache_retransmit, NULL);
+	g_usleep(G_USEC_PER_SEC / 5);
+	check(g_atomic_int_get(&running_answered) is 0, "running operation not evicted by the ring wrapping");
+
+	magma_operation_cache_save_result(&keys[0], 42, 0);
+	magma_operation_cache_save_result(&keys[1], 43, 0);
+	g_thread_join(retransmit);
+	check(g_atomic_int_get(&running_answered) is 1, "retransmission answered after the wrapping");
+	check(magma_operation_cache_lookup(&keys[1], &result) && result.res is 43, "second operation saved in its slot");
+
+	if (failures) {
+		fprintf(stderr, "FAILED\n");
+		return (1);
+	}
+
+	fprintf(stderr, "OK\n");
+	return (0);
+}
+
+// vim:ts=4:nocindent:autoindent
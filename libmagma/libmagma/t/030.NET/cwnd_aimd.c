@@ -0,0 +1,125 @@
+/*
+   Magma test suite -- cwnd_aimd.c
+   Copyright (C) 2006-2013 Tx0 <tx0@strumentiresistenti.org>
+
+   Checks the arithmetic of the congestion window kept for each peer
+   host: slow start doubles it over a round of acknowledged
+   datagrams, a loss halves it, more losses within the same round
+   trip count as one, above the slow start threshold a whole window
+   of acknowledgements grows it by one datagram, and repeated losses
+   never take it below MAGMA_CWND_MIN. The window is measured by
+   asking room for more datagrams than it can hold. Nothing needs
+   to answer on the peer port.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../magma.h"
+
+magma_environment_t magma_environment;
+
+/** a port nobody is expected to listen on */
+#define CWND_PEER_PORT 9
+
+static int failures = 0;
+
+/**
+ * Measure the window: with nothing in flight, the room granted
+ * is the whole window. Nothing is acknowledged, so it doesn't grow.
+ */
+static guint cwnd_window(GSocket *socket)
+{
+	guint granted = magma_cwnd_acquire(socket, 100 * MAGMA_CWND_MAX, TRUE);
+	magma_cwnd_release(socket, granted, 0);
+	return (granted);
+}
+
+/**
+ * Send and acknowledge a number of datagrams
+ */
+static void cwnd_ack(GSocket *socket, guint datagrams)
+{
+	guint granted = magma_cwnd_acquire(socket, datagrams, FALSE);
+	magma_cwnd_release(socket, granted, granted);
+}
+
+static void cwnd_check(guint window, guint expected, const gchar *message)
+{
+	gboolean ok = (window is expected) ? TRUE : FALSE;
+	fprintf(stderr, "  %s: %s, window %u (expected %u)\n", ok ? "ok" : "FAILED", message, window, expected);
+	if (!ok) failures++;
+}
+
+int main(int argc, char **argv)
+{
+	(void) argc;
+	(void) argv;
+
+	magma_init_net_layer();
+
+	GSocketAddress *peer = NULL;
+	GSocket *socket = magma_open_client_connection("127.0.0.1", CWND_PEER_PORT, &peer);
+	if (!socket) {
+		fprintf(stderr, "Can't open a client socket\nFAILED\n");
+		return (1);
+	}
+
+	if (!magma_rtt_adaptive(socket)) {
+		fprintf(stderr, "Sockets are not cached, no congestion window is kept\nSKIPPED\n");
+		return (0);
+	}
+
+	fprintf(stderr, "Slow start:\n");
+	guint window = cwnd_window(socket);
+	cwnd_check(window, MAGMA_CWND_INITIAL, "initial window");
+
+	cwnd_ack(socket, window);
+	guint doubled = MIN(2 * window, MAGMA_CWND_MAX);
+	cwnd_check(cwnd_window(socket), doubled, "a round of acknowledgements doubles it");
+
+	fprintf(stderr, "Multiplicative decrease:\n");
+	magma_cwnd_loss(socket);
+	guint halved = MAX(doubled / 2, MAGMA_CWND_MIN);
+	cwnd_check(cwnd_window(socket), halved, "a loss halves it");
+
+	magma_cwnd_loss(socket);
+	cwnd_check(cwnd_window(socket), halved, "a second loss in the same round trip is ignored");
+
+	fprintf(stderr, "Additive increase:\n");
+	cwnd_ack(socket, halved + 2);
+	cwnd_check(cwnd_window(socket), halved + 1, "a window of acknowledgements adds one datagram");
+
+	fprintf(stderr, "Floor:\n");
+	int i;
+	for (i = 0; i < 16; i++) {
+		g_usleep(MAGMA_RTO_INITIAL + G_USEC_PER_SEC / 10);
+		magma_cwnd_loss(socket);
+	}
+	cwnd_check(cwnd_window(socket), MAGMA_CWND_MIN, "repeated losses stop at the minimum");
+
+	if (failures) {
+		fprintf(stderr, "FAILED\n");
+		return (1);
+	}
+
+	fprintf(stderr, "OK\n");
+	return (0);
+}
+
+// vim:ts=4:nocindent:autoindent
@@ -0,0 +1,171 @@
+/*
+   Magma test suite -- udp_receive_rate.c
+   Copyright (C) 2006-2013 Tx0 <tx0@strumentiresistenti.org>
+
+   Loopback benchmark of the UDP receive loop. A service is started
+   with magma_start_udp_service(), as magmad does, and sender threads
+   flood its port with small datagrams while a callback counts the
+   ones served: first in the receiving thread, then through the
+   worker pools, then with one receiver per sender sharing the port
+   with SO_REUSEPORT. Each run gets a port of its own, since services
+   can't be stopped.
+
+   Usage: udp_receive_rate [seconds] [datagram size] [receivers]
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../../magma.h"
+
+magma_environment_t magma_environment;
+
+#define BATCH 32
+
+static volatile gboolean running = TRUE;
+static int datagram_size = 64;
+static struct sockaddr_in target;
+static volatile gint served = 0;
+
+/**
+ * flood the service with datagrams until running is cleared
+ */
+static gpointer sender(gpointer data)
+{
+	(void) data;
+
+	int s = socket(AF_INET, SOCK_DGRAM, 0);
+	gchar payload[MAGMA_MESSAGE_MAX_SIZE];
+	memset(payload, 'm', datagram_size);
+
+	struct mmsghdr msgs[BATCH];
+	struct iovec iov;
+	iov.iov_base = payload;
+	iov.iov_len = datagram_size;
+
+	int i;
+	for (i = 0; i < BATCH; i++) {
+		memset(&msgs[i], 0, sizeof(struct mmsghdr));
+		msgs[i].msg_hdr.msg_name = &target;
+		msgs[i].msg_hdr.msg_namelen = sizeof(target);
+		msgs[i].msg_hdr.msg_iov = &iov;
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	while (running) sendmmsg(s, msgs, BATCH, 0);
+
+	close(s);
+	return (NULL);
+}
+
+/**
+ * count a request served in the receiving thread
+ */
+static void count_request(GSocket *socket, GSocketAddress *peer, gchar buffer[MAGMA_MESSAGE_MAX_SIZE])
+{
+	(void) socket;
+	(void) peer;
+	(void) buffer;
+	g_atomic_int_inc(&served);
+}
+
+/**
+ * count a request served by a pool worker
+ */
+static void count_pooled_request(magma_incoming_request *incoming, gpointer data)
+{
+	(void) data;
+	g_atomic_int_inc(&served);
+	magma_dispose_incoming_request(incoming);
+}
+
+/**
+ * find a loopback port nobody is listening on
+ */
+static guint16 free_port()
+{
+	int s = socket(AF_INET, SOCK_DGRAM, 0);
+
+	memset(&target, 0, sizeof(target));
+	target.sin_family = AF_INET;
+	target.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	target.sin_port = 0;
+
+	socklen_t len = sizeof(target);
+	if (bind(s, (struct sockaddr *) &target, sizeof(target)) is -1 ||
+		getsockname(s, (struct sockaddr *) &target, &len) is -1) {
+		fprintf(stderr, "Error finding a free port: %s\n", strerror(errno));
+		exit (1);
+	}
+
+	close(s);
+	return (ntohs(target.sin_port));
+}
+
+static void run(const gchar *description, GFunc pool_callback, guint receivers, int seconds)
+{
+	guint16 port = free_port();
+	magma_start_udp_service(description, "127.0.0.1", port, count_request, pool_callback, receivers);
+
+	g_atomic_int_set(&served, 0);
+	running = TRUE;
+
+	GThread **senders = g_new0(GThread *, receivers);
+	guint i;
+	for (i = 0; i < receivers; i++) senders[i] = g_thread_new("sender", sender, NULL);
+
+	g_usleep(seconds * G_USEC_PER_SEC);
+	guint64 packets = g_atomic_int_get(&served);
+
+	running = FALSE;
+	for (i = 0; i < receivers; i++) g_thread_join(senders[i]);
+	g_free(senders);
+
+	printf("%-40s %10lu packets %10lu packets/s\n", description, packets, packets / seconds);
+}
+
+int main(int argc, char **argv)
+{
+	int seconds = (argc > 1) ? atoi(argv[1]) : 5;
+	if (argc > 2) datagram_size = atoi(argv[2]);
+	int receivers = (argc > 3) ? atoi(argv[3]) : 4;
+
+	if (seconds <= 0) seconds = 5;
+	if (datagram_size <= 0 || datagram_size > MAGMA_MESSAGE_MAX_SIZE - 1024) datagram_size = 64;
+	if (receivers <= 1 || receivers > MAGMA_UDP_MAX_RECEIVERS) receivers = 4;
+
+	printf("Receiving %d bytes datagrams on loopback for %d seconds\n", datagram_size, seconds);
+
+	run("served in the receiving thread", NULL, 1, seconds);
+	run("served by the worker pools", (GFunc) count_pooled_request, 1, seconds);
+
+	gchar *description = g_strdup_printf("%d receivers, SO_REUSEPORT", receivers);
+	run(description, (GFunc) count_pooled_request, receivers, seconds);
+	g_free(description);
+
+	return (0);
+}
+
+// vim:ts=4:nocindent:autoindent
@@ -0,0 +1,181 @@
+/*
+   Magma test suite -- contents_io_rate.c
+   Copyright (C) 2006-2013 Tx0 <tx0@strumentiresistenti.org>
+
+   Benchmark of small random reads and writes on flare contents
+   files. Each request opens the file, reads or writes one block
+   and closes it, like magma_read() and magma_write() do: first
+   with plain open(), pread()/pwrite() and close(), then through
+   magma_contents_pread() and magma_contents_pwrite(), which use
+   io_uring when libmagma is built with liburing and the kernel
+   supports it.
+
+   Usage: contents_io_rate [seconds] [threads] [block size]
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../magma.h"
+
+magma_environment_t magma_environment;
+
+#define FILES 16
+#define FILE_SIZE (1024 * 1024)
+#define MAX_BLOCK_SIZE 65536
+
+static int seconds = 5;
+static int threads = 4;
+static int block_size = 4096;
+static gchar *paths[FILES];
+
+typedef gboolean (*request_func)(const gchar *path, gchar *buffer, off_t offset, gboolean write);
+
+/**
+ * open(), pread() or pwrite(), close()
+ */
+static gboolean request_syscalls(const gchar *path, gchar *buffer, off_t offset, gboolean write)
+{
+	int fd = open(path, O_RDWR|O_CREAT, S_IRWXU);
+	if (fd is -1) return (FALSE);
+
+	ssize_t res = write ? pwrite(fd, buffer, block_size, offset) : pread(fd, buffer, block_size, offset);
+	close(fd);
+
+	return ((res is -1) ? FALSE : TRUE);
+}
+
+/**
+ * magma_contents_pread() or magma_contents_pwrite()
+ */
+static gboolean request_contents(const gchar *path, gchar *buffer, off_t offset, gboolean write)
+{
+	ssize_t res = write ?
+		magma_contents_pwrite(path, buffer, block_size, offset) :
+		magma_contents_pread(path, buffer, block_size, offset);
+
+	return ((res is -1) ? FALSE : TRUE);
+}
+
+typedef struct {
+	request_func request;
+	guint64 reads;
+	guint64 writes;
+	guint64 errors;
+} worker_state;
+
+static gpointer worker(gpointer data)
+{
+	worker_state *state = data;
+
+	gchar *buffer = g_malloc(block_size);
+	memset(buffer, 'm', block_size);
+
+	GRand *rand = g_rand_new();
+	gint64 stop = g_get_monotonic_time() + seconds * G_USEC_PER_SEC;
+	int blocks = FILE_SIZE / block_size;
+
+	while (g_get_monotonic_time() < stop) {
+		const gchar *path = paths[g_rand_int_range(rand, 0, FILES)];
+		off_t offset = (off_t) g_rand_int_range(rand, 0, blocks) * block_size;
+		gboolean write = g_rand_boolean(rand);
+
+		if (!state->request(path, buffer, offset, write)) {
+			state->errors++;
+		} else if (write) {
+			state->writes++;
+		} else {
+			state->reads++;
+		}
+	}
+
+	g_rand_free(rand);
+	g_free(buffer);
+
+	return (NULL);
+}
+
+static void run(const gchar *description, request_func request)
+{
+	worker_state *states = g_new0(worker_state, threads);
+	GThread **workers = g_new0(GThread *, threads);
+
+	int i;
+	for (i = 0; i < threads; i++) {
+		states[i].request = request;
+		workers[i] = g_thread_new("worker", worker, &states[i]);
+	}
+
+	guint64 reads = 0, writes = 0, errors = 0;
+	for (i = 0; i < threads; i++) {
+		g_thread_join(workers[i]);
+		reads += states[i].reads;
+		writes += states[i].writes;
+		errors += states[i].errors;
+	}
+
+	printf("%-48s %10lu reads/s %10lu writes/s %10lu ops/s (%lu errors)\n", description,
+		reads / seconds, writes / seconds, (reads + writes) / seconds, errors);
+
+	g_free(workers);
+	g_free(states);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1) seconds = atoi(argv[1]);
+	if (argc > 2) threads = atoi(argv[2]);
+	if (argc > 3) block_size = atoi(argv[3]);
+
+	if (seconds <= 0) seconds = 5;
+	if (threads <= 0) threads = 4;
+	if (block_size <= 0 || block_size > MAX_BLOCK_SIZE) block_size = 4096;
+
+	gchar *dir = g_dir_make_tmp("magma-contents-io-XXXXXX", NULL);
+	if (!dir) {
+		fprintf(stderr, "Error creating the temporary directory\n");
+		exit (1);
+	}
+
+	gchar *block = g_malloc0(FILE_SIZE);
+	int i;
+	for (i = 0; i < FILES; i++) {
+		paths[i] = g_strdup_printf("%s/contents%02d", dir, i);
+		g_file_set_contents(paths[i], block, FILE_SIZE, NULL);
+	}
+	g_free(block);
+
+	printf("Random %d bytes reads and writes on %d files from %d threads for %d seconds\n",
+		block_size, FILES, threads, seconds);
+
+	run("open() + pread()/pwrite() + close()", request_syscalls);
+	run(magma_contents_io_uring() ?
+		"magma_contents_pread()/pwrite() on io_uring" :
+		"magma_contents_pread()/pwrite() on system calls", request_contents);
+
+	for (i = 0; i < FILES; i++) {
+		unlink(paths[i]);
+		g_free(paths[i]);
+	}
+	rmdir(dir);
+	g_free(dir);
+
+	return (0);
+}
+
+// vim:ts=4:nocindent:autoindent
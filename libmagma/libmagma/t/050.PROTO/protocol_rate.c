@@ -0,0 +1,656 @@
+/*
+   Magma test suite -- protocol_rate.c
+   Copyright (C) 2006-2013 Tx0 <tx0@strumentiresistenti.org>
+
+   Microbenchmark of the flare and node protocols. First the
+   serialization primitives are timed alone; then every operation
+   type is round-tripped in memory: the answer (pktas) is captured
+   in a buffer, the request (pktqs) is captured while the answer is
+   replayed to its receiver (pktar), and the captured request is
+   parsed back (magma_parse_request_header() and pktqr), so nothing
+   goes on the wire. Last, an in-process server is started on
+   127.0.0.1 with a temporary hash path, and the operations which
+   leave the filesystem as they found it are sent to it over UDP
+   through the loopback. The server doesn't open its local socket,
+   since clients on the same host would use it instead of UDP.
+
+   For each test the time and the heap allocations per operation
+   are reported. Allocations are counted process wide, so the
+   loopback figures include what the server does to serve the
+   request. No other magmad must be running on this host, since
+   the server binds the standard ports.
+
+   Usage: protocol_rate [memory iterations] [loopback iterations]
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/statfs.h>
+
+#include "../../magma.h"
+
+magma_environment_t magma_environment;
+
+#define BENCH_PATH "/protocol_rate"
+#define BENCH_DIR_ENTRIES 20
+#define BENCH_IO_SIZE 4096
+
+static int memory_iterations = 100000;
+static int loopback_iterations = 10000;
+
+/*
+ * heap allocations are counted by wrapping the allocator
+ * of the C library
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static volatile gulong allocations = 0;
+
+void *malloc(size_t size)
+{
+	__sync_fetch_and_add(&allocations, 1);
+	return (__libc_malloc(size));
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	__sync_fetch_and_add(&allocations, 1);
+	return (__libc_calloc(nmemb, size));
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	__sync_fetch_and_add(&allocations, 1);
+	return (__libc_realloc(ptr, size));
+}
+
+static gint64 now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((gint64) ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+/*
+ * the measure of a test, started by bench_start()
+ * and printed by bench_stop()
+ */
+static gint64 started;
+static gulong allocated;
+
+static void bench_start()
+{
+	allocated = allocations;
+	started = now_ns();
+}
+
+static void bench_stop(const gchar *section, const gchar *name, int iterations)
+{
+	gint64 elapsed = now_ns() - started;
+	gulong count = allocations - allocated;
+
+	printf("%-10s %-26s %10.1f ns/op %8.2f allocs/op\n", section, name,
+		(double) elapsed / iterations, (double) count / iterations);
+}
+
+/*
+ * the data served and sent by the operations
+ */
+static magma_flare_t bench_flare;
+static magma_flare_handle bench_handle;
+static struct stat bench_stat;
+static struct statfs bench_statfs;
+static gchar bench_data[BENCH_IO_SIZE];
+static gchar bench_compact[MAGMA_COMPACT_READDIR_PAYLOAD];
+static magma_flare_response bench_listing;
+static magma_flare_response bench_compact_listing;
+static magma_response bench_response;
+static magma_request bench_request;
+
+static void bench_prepare_data()
+{
+	memset(&bench_flare, 0, sizeof(magma_flare_t));
+	bench_flare.path = (char *) BENCH_PATH;
+	bench_flare.commit_url = (char *) "";
+	bench_flare.binhash = magma_sha1_data(BENCH_PATH, strlen(BENCH_PATH));
+	bench_flare.generation = 1;
+	bench_flare.st.st_mode = S_IFREG|0644;
+
+	memcpy(bench_handle.binhash, bench_flare.binhash, SHA_DIGEST_LENGTH);
+	bench_handle.generation = bench_flare.generation;
+
+	stat("/", &bench_stat);
+	statfs("/", &bench_statfs);
+	memset(bench_data, 'm', BENCH_IO_SIZE);
+
+	memset(&bench_listing, 0, sizeof(magma_flare_response));
+	bench_listing.header.res = BENCH_DIR_ENTRIES;
+	bench_listing.body.readdir_extended.entry_number = BENCH_DIR_ENTRIES;
+
+	gchar *ptr = bench_compact;
+	int i = 0;
+	for (; i < BENCH_DIR_ENTRIES; i++) {
+		magma_extended_readdir_entry *entry = &bench_listing.body.readdir_extended.entries[i];
+		g_snprintf(entry->path, MAGMA_TERMINATED_DIRENTRY_LENGTH, "entry-%04d", i);
+		entry->st.mode = S_IFREG|0644;
+		entry->st.size = i * 1000;
+		entry->st.nlink = 1;
+		entry->st.mtime = bench_stat.st_mtime;
+		ptr = magma_encode_compact_readdir_entry(ptr, entry->path, &entry->st);
+	}
+
+	memset(&bench_compact_listing, 0, sizeof(magma_flare_response));
+	bench_compact_listing.header.res = BENCH_DIR_ENTRIES;
+	bench_compact_listing.body.readdir_compact.entry_number = BENCH_DIR_ENTRIES;
+	bench_compact_listing.body.readdir_compact.entries = bench_compact;
+	bench_compact_listing.body.readdir_compact.length = ptr - bench_compact;
+}
+
+/*
+ * An operation under test: answer sends a canned response, request
+ * sends the request and receives its response, parse reads the body
+ * of the request as the server does
+ */
+typedef void (*bench_answer)(GSocket *socket, GSocketAddress *peer, magma_transaction_id tid);
+typedef void (*bench_send)(GSocket *socket, GSocketAddress *peer, magma_response *response);
+typedef void (*bench_parse)(gchar *buffer, magma_request *request);
+
+typedef struct {
+	const gchar *name;
+	bench_answer answer;
+	bench_send request;
+	bench_parse parse;
+	gboolean node;			/** on the node port */
+	gboolean loopback;		/** safe to repeat against the server */
+} bench_op;
+
+#define FLARE_PARSER(op) static void parse_##op(gchar *buffer, magma_request *request) \
+	{ magma_pktqr_##op(buffer, &request->flare_request); }
+
+#define NODE_PARSER(op) static void parse_##op(gchar *buffer, magma_request *request) \
+	{ magma_pktqr_##op(buffer, &request->node_request); }
+
+/* GETATTR */
+static void answer_getattr(GSocket *s, GSocketAddress *p, magma_transaction_id tid)
+	{ magma_pktas_getattr(s, p, 0, &bench_stat, 0, tid, 0); }
+static void request_getattr(GSocket *s, GSocketAddress *p, magma_response *r)
+	{ magma_pktqs_getattr(s, p, 0, 0, BENCH_PATH, &r->flare_response); }
+FLARE_PARSER(getattr)
+
+/* READLINK */
+static void answer_readlink(GSocket *s, GSocketAddress *p, magma_transaction_id tid)
+	{ magma_pktas_readlink(s, p, 0, "/some/where/else", 0, tid, 0); }
+static void request_readlink(GSocket *s, GSocketAddress *p, magma_response *r)
+	{ magma_pktqs_readlink(s, p, 0, 0, BENCH_PATH, &r->flare_response); }
+FLARE_PARSER(readlink)
+
+/* MKNOD */
+static void answer_ok(GSocket *s, GSocketAddress *p, magma_transaction_id tid)
+	{ magma_pktas_mknod(s, p, 0, 0, tid, 0); }
+static void request_mknod(GSocket *s, GSocketAddress *p, magma_response *r)
+	{ magma_pktqs_mknod(s, p, MAGMA_TERMINAL_TTL, 0, 0, S_IFREG|0644, 0, BENCH_PATH, &r->flare_response); }
+FLARE_PARSER(mknod)
+
+/* MKDIR */
+static void request_mkdir(GSocket *s, GSocketAddress *p, magma_response *r)
+	{ magma_pktqs_mkdir(s, p, MAGMA_TERMINAL_TTL, 0, 0, 0755, BENCH_PATH, &r->flare_response); }
+FLARE_PARSER(mkdir)
+
+/* UNLINK */
+static void request_unlink(GSocket *s, GSocketAddress *p, magma_response *r)
+	{ magma_pktqs_unlink(s, p, MAGMA_TERMINAL_TTL, 0, 0, BENCH_PATH, &r->flare_response); }
+FLARE_PARSER(unlink)
+
+/* RMDIR */
+static void request_rmdir(GSocket *s, GSocketAddress *p, magma_response *r)
+	{ magma_pktqs_rmdir(s, p, MAGMA_TERMINAL_TTL, 0, 0, BENCH_PATH, &r->flare_response); }
+FLARE_PARSER(rmdir)
+
+/* SYMLINK */
+static void request_symlink(GSocket *s, GSocketAddress *p, magma_response *r)
+	{ magma_pktqs_symlink(s, p, MAGMA_TERMINAL_TTL, 0, 0, "/some/where/else", BENCH_PATH, &r->flare_response); }
+FLARE_PARSER(symlink)
+
+/* RENAME */
+static void request_rename(GSocket *s, GSocketAddress *p, magma_response *r)
+	{ magma_pktqs_rename(s, p, MAGMA_TERMINAL_TTL, 0, 0, BENCH_PATH, BENCH_PATH ".renamed", &r->flare_response); }
+FLARE_PARSER(rename)
+
+/* CHMOD */
+static void request_chmod(GSocket *s, GSocketAddress *p, magma_response *r)
+	{ magma_pktqs_chmod(s, p, MAGMA_TERMINAL_TTL, 0, 0, BENCH_PATH, 0644, &r->flare_response); }
+FLARE_PARSER(chmod)
+
+/* CHOWN */
+static void request_chown(GSocket *s, GSocketAddress *p, magma_response *r)
+	{ magma_pktqs_chown(s, p, MAGMA_TERMINAL_TTL, 0, 0, BENCH_PATH, 0, 0, &r->flare_response); }
+FLARE_PARSER(chown)
+
+/* TRUNCATE */
+static void request_truncate(GSocket *s, GSocketAddress *p, magma_response *r)
+	{ magma_pktqs_truncate(s, p, MAGMA_TERMINAL_TTL, 0, 0, BENCH_PATH, BENCH_IO_SIZE, &r->flare_response); }
+FLARE_PARSER(truncate)
+
+/* UTIME */
+static void request_utime(GSocket *s, GSocketAddress *p, magma_response *r)
+	{ magma_pktqs_utime(s, p, MAGMA_TERMINAL_TTL, 0, 0, bench_stat.st_atime, bench_stat.st_mtime, BENCH_PATH, &r->flare_response); }
+FLARE_PARSER(utime)
+
+/* OPEN */
+static void answer_open(GSocket *s, GSocketAddress *p, magma_transaction_id tid)
+	{ magma_pktas_open(s, p, 0, 0, &bench_flare, tid, 0); }
+static void request_open(GSocket *s, GSocketAddress *p, magma_response *r)
+	{ magma_pktqs_open(s, p, 0, 0, O_RDWR, BENCH_PATH, &r->flare_response); }
+FLARE_PARSER(open)
+
+/* OPEN_HANDLE */
+static void answer_open_handle(GSocket *s, GSocketAddress *p, magma_transaction_id tid)
+	{ magma_pktas_open_handle(s, p, 0, 0, &bench_flare, tid, 0); }
+static void request_open_handle(GSocket *s, GSocketAddress *p, magma_response *r)
+	{ magma_pktqs_open_handle(s, p, 0, 0, O_RDWR, BENCH_PATH, &r->flare_response); }
+
+/* READ */
+static void answer_read(GSocket *s, GSocketAddress *p, magma_transaction_id tid)
+	{ magma_pktas_read(s, p, BENCH_IO_SIZE, 0, bench_data, tid, 0); }
+static void request_read(GSocket *s, GSocketAddress *p, magma_response *r)
+	{ magma_pktqs_read(s, p, 0, 0, BENCH_IO_SIZE, 0, BENCH_PATH, &r->flare_response); }
+FLARE_PARSER(read)
+
+/* READ_HANDLE */
+static void request_read_handle(GSocket *s, GSocketAddress *p, magma_response *r)
+	{ magma_pktqs_read_handle(s, p, 0, 0, BENCH_IO_SIZE, 0, &bench_handle, &r->flare_response); }
+FLARE_PARSER(read_handle)
+
+/* WRITE */
+static void answer_write(GSocket *s, GSocketAddress *p, magma_transaction_id tid)
+	{ magma_pktas_write(s, p, BENCH_IO_SIZE, 0, tid, 0); }
+static void request_write(GSocket *s, GSocketAddress *p, magma_response *r)
+	{ magma_pktqs_write(s, p, MAGMA_TERMINAL_TTL, 0, 0, BENCH_IO_SIZE, 0, BENCH_PATH, bench_data, &r->flare_response); }
+FLARE_PARSER(write)
+
+/* WRITE_HANDLE */
+static void request_write_handle(GSocket *s, GSocketAddress *p, magma_response *r)
+	{ magma_pktqs_write_handle(s, p, MAGMA_TERMINAL_TTL, 0, 0, BENCH_IO_SIZE, 0, &bench_handle, bench_data, &r->flare_response); }
+FLARE_PARSER(write_handle)
+
+/* STATFS */
+static void answer_statfs(GSocket *s, GSocketAddress *p, magma_transaction_id tid)
+	{ magma_pktas_statfs(s, p, 0, &bench_statfs, 0, tid, 0); }
+static void request_statfs(GSocket *s, GSocketAddress *p, magma_response *r)
+	{ magma_pktqs_statfs(s, p, 0, 0, "/", &r->flare_response); }
+FLARE_PARSER(statfs)
+
+/* READDIR_EXTENDED */
+static void answer_readdir_extended(GSocket *s, GSocketAddress *p, magma_transaction_id tid)
+	{ magma_pktas_readdir_extended(s, p, &bench_listing, tid, 0); }
+static void request_readdir_extended(GSocket *s, GSocketAddress *p, magma_response *r)
+	{ magma_pktqs_readdir_extended(s, p, 0, 0, "/", 0, &r->flare_response); }
+FLARE_PARSER(readdir_extended)
+
+/* READDIR_COMPACT, parsed as READDIR_EXTENDED */
+static void answer_readdir_compact(GSocket *s, GSocketAddress *p, magma_transaction_id tid)
+	{ magma_pktas_readdir_compact(s, p, &bench_compact_listing, tid, 0); }
+static gchar bench_compact_received[MAGMA_COMPACT_READDIR_PAYLOAD];
+static void request_readdir_compact(GSocket *s, GSocketAddress *p, magma_response *r)
+{
+	r->flare_response.body.readdir_compact.entries = bench_compact_received;
+	magma_pktqs_readdir_compact(s, p, 0, 0, "/", 0, &r->flare_response);
+}
+
+/* HEARTBEAT */
+static void answer_heartbeat(GSocket *s, GSocketAddress *p, magma_transaction_id tid)
+	{ magma_pktas_heartbeat(s, p, &myself, tid, 0); }
+static void request_heartbeat(GSocket *s, GSocketAddress *p, magma_response *r)
+	{ magma_pktqs_heartbeat(s, p, &r->node_response); }
+NODE_PARSER(heartbeat)
+
+/* JOIN_NETWORK */
+static void answer_join_network(GSocket *s, GSocketAddress *p, magma_transaction_id tid)
+	{ magma_pktas_join_network(s, p, 0, &myself, tid, 0); }
+static void request_join_network(GSocket *s, GSocketAddress *p, magma_response *r)
+	{ magma_pktqs_join_network(s, p, &myself, &r->node_response); }
+NODE_PARSER(join_network)
+
+/* FINISH_JOIN_NETWORK */
+static void answer_finish_join_network(GSocket *s, GSocketAddress *p, magma_transaction_id tid)
+	{ magma_pktas_finish_join_network(s, p, 0, 2, tid, 0); }
+static void request_finish_join_network(GSocket *s, GSocketAddress *p, magma_response *r)
+	{ magma_pktqs_finish_join_network(s, p, &myself, &myself, 2, &r->node_response); }
+NODE_PARSER(finish_join_network)
+
+/* TRANSMIT_KEY */
+static void answer_transmit_key(GSocket *s, GSocketAddress *p, magma_transaction_id tid)
+	{ magma_pktas_transmit_key(s, p, 0, 0, tid, 0); }
+static void request_transmit_key(GSocket *s, GSocketAddress *p, magma_response *r)
+	{ magma_pktqs_transmit_key(s, p, 0, BENCH_IO_SIZE, bench_data, &bench_flare, &r->node_response); }
+NODE_PARSER(transmit_key)
+
+/* ADD_FLARE_TO_PARENT */
+static void answer_add_flare_to_parent(GSocket *s, GSocketAddress *p, magma_transaction_id tid)
+	{ magma_pktas_add_flare_to_parent(s, p, 0, tid, 0); }
+static void request_add_flare_to_parent(GSocket *s, GSocketAddress *p, magma_response *r)
+	{ magma_pktqs_add_flare_to_parent(s, p, BENCH_PATH, &r->node_response); }
+NODE_PARSER(add_flare_to_parent)
+
+/* REMOVE_FLARE_FROM_PARENT */
+static void answer_remove_flare_from_parent(GSocket *s, GSocketAddress *p, magma_transaction_id tid)
+	{ magma_pktas_remove_flare_from_parent(s, p, 0, tid, 0); }
+static void request_remove_flare_from_parent(GSocket *s, GSocketAddress *p, magma_response *r)
+	{ magma_pktqs_remove_flare_from_parent(s, p, BENCH_PATH, &r->node_response); }
+NODE_PARSER(remove_flare_from_parent)
+
+/* REPLAY_JOURNAL */
+static void answer_replay_journal(GSocket *s, GSocketAddress *p, magma_transaction_id tid)
+	{ magma_pktas_replay_journal(s, p, 0, 1000, tid, 0); }
+static void request_replay_journal(GSocket *s, GSocketAddress *p, magma_response *r)
+	{ magma_pktqs_replay_journal(s, p, myself.node_name, 0, &r->node_response); }
+NODE_PARSER(replay_journal)
+
+/* TRANSMIT_TOPOLOGY */
+static void answer_transmit_topology(GSocket *s, GSocketAddress *p, magma_transaction_id tid)
+	{ magma_pktas_transmit_topology(s, p, lava, 0, tid, 0); }
+static void request_transmit_topology(GSocket *s, GSocketAddress *p, magma_response *r)
+	{ magma_pktqs_transmit_topology(s, p, 0, &r->node_response); }
+NODE_PARSER(transmit_topology)
+
+/* TRANSMIT_NODE */
+static void answer_transmit_node(GSocket *s, GSocketAddress *p, magma_transaction_id tid)
+	{ magma_pktas_transmit_node(s, p, &myself, 0, tid, 0); }
+static void request_transmit_node(GSocket *s, GSocketAddress *p, magma_response *r)
+	{ magma_pktqs_transmit_node(s, p, myself.start_key, 0, &r->node_response); }
+NODE_PARSER(transmit_node)
+
+/* NETWORK_BUILT */
+static void answer_network_built(GSocket *s, GSocketAddress *p, magma_transaction_id tid)
+	{ magma_pktas_network_built(s, p, tid, 0); }
+static void request_network_built(GSocket *s, GSocketAddress *p, magma_response *r)
+	{ magma_pktqs_network_built(s, p, magma_network_ready, &r->node_response); }
+NODE_PARSER(network_built)
+
+static bench_op bench_ops[] = {
+	{ "getattr",                  answer_getattr,                  request_getattr,                  parse_getattr,                  FALSE, TRUE  },
+	{ "readlink",                 answer_readlink,                 request_readlink,                 parse_readlink,                 FALSE, FALSE },
+	{ "mknod",                    answer_ok,                       request_mknod,                    parse_mknod,                    FALSE, FALSE },
+	{ "mkdir",                    answer_ok,                       request_mkdir,                    parse_mkdir,                    FALSE, FALSE },
+	{ "unlink",                   answer_ok,                       request_unlink,                   parse_unlink,                   FALSE, FALSE },
+	{ "rmdir",                    answer_ok,                       request_rmdir,                    parse_rmdir,                    FALSE, FALSE },
+	{ "symlink",                  answer_ok,                       request_symlink,                  parse_symlink,                  FALSE, FALSE },
+	{ "rename",                   answer_ok,                       request_rename,                   parse_rename,                   FALSE, FALSE },
+	{ "chmod",                    answer_ok,                       request_chmod,                    parse_chmod,                    FALSE, TRUE  },
+	{ "chown",                    answer_ok,                       request_chown,                    parse_chown,                    FALSE, TRUE  },
+	{ "truncate",                 answer_ok,                       request_truncate,                 parse_truncate,                 FALSE, TRUE  },
+	{ "utime",                    answer_ok,                       request_utime,                    parse_utime,                    FALSE, TRUE  },
+	{ "open",                     answer_open,                     request_open,                     parse_open,                     FALSE, TRUE  },
+	{ "open_handle",              answer_open_handle,              request_open_handle,              parse_open,                     FALSE, TRUE  },
+	{ "read",                     answer_read,                     request_read,                     parse_read,                     FALSE, TRUE  },
+	{ "read_handle",              answer_read,                     request_read_handle,              parse_read_handle,              FALSE, TRUE  },
+	{ "write",                    answer_write,                    request_write,                    parse_write,                    FALSE, TRUE  },
+	{ "write_handle",             answer_write,                    request_write_handle,             parse_write_handle,             FALSE, TRUE  },
+	{ "statfs",                   answer_statfs,                   request_statfs,                   parse_statfs,                   FALSE, TRUE  },
+	{ "readdir_extended",         answer_readdir_extended,         request_readdir_extended,         parse_readdir_extended,         FALSE, TRUE  },
+	{ "readdir_compact",          answer_readdir_compact,          request_readdir_compact,          parse_readdir_extended,         FALSE, TRUE  },
+	{ "heartbeat",                answer_heartbeat,                request_heartbeat,                parse_heartbeat,                TRUE,  TRUE  },
+	{ "join_network",             answer_join_network,             request_join_network,             parse_join_network,             TRUE,  FALSE },
+	{ "finish_join_network",      answer_finish_join_network,      request_finish_join_network,      parse_finish_join_network,      TRUE,  FALSE },
+	{ "transmit_key",             answer_transmit_key,             request_transmit_key,             parse_transmit_key,             TRUE,  FALSE },
+	{ "add_flare_to_parent",      answer_add_flare_to_parent,      request_add_flare_to_parent,      parse_add_flare_to_parent,      TRUE,  FALSE },
+	{ "remove_flare_from_parent", answer_remove_flare_from_parent, request_remove_flare_from_parent, parse_remove_flare_from_parent, TRUE,  FALSE },
+	{ "replay_journal",           answer_replay_journal,           request_replay_journal,           parse_replay_journal,           TRUE,  FALSE },
+	{ "transmit_topology",        answer_transmit_topology,        request_transmit_topology,        parse_transmit_topology,        TRUE,  TRUE  },
+	{ "transmit_node",            answer_transmit_node,            request_transmit_node,            parse_transmit_node,            TRUE,  FALSE },
+	{ "network_built",            answer_network_built,            request_network_built,            parse_network_built,            TRUE,  FALSE },
+	{ NULL, NULL, NULL, NULL, FALSE, FALSE }
+};
+
+/**
+ * time the serialization primitives
+ */
+static void bench_primitives()
+{
+	MAGMA_IO_BUFFER(buffer);
+	gchar string[MAGMA_TERMINATED_PATH_LENGTH];
+	guint64 v64 = 0;
+	guint32 v32 = 0;
+	guint16 v16 = 0;
+	guint8 v8 = 0;
+	int i = 0;
+
+	bench_start();
+	for (i = 0; i < memory_iterations; i++) {
+		gchar *ptr = magma_serialize_64(buffer, i);
+		ptr = magma_serialize_32(ptr, i);
+		ptr = magma_serialize_16(ptr, i);
+		ptr = magma_serialize_8(ptr, i);
+		ptr = magma_deserialize_64(buffer, &v64);
+		ptr = magma_deserialize_32(ptr, &v32);
+		ptr = magma_deserialize_16(ptr, &v16);
+		ptr = magma_deserialize_8(ptr, &v8);
+	}
+	bench_stop("primitive", "integers 64/32/16/8", memory_iterations);
+
+	bench_start();
+	for (i = 0; i < memory_iterations; i++) {
+		gchar *ptr = magma_serialize_varint(buffer, (guint64) i * 2654435761U);
+		magma_deserialize_varint(buffer, ptr, &v64);
+	}
+	bench_stop("primitive", "varint", memory_iterations);
+
+	bench_start();
+	for (i = 0; i < memory_iterations; i++) {
+		magma_serialize_string(buffer, "/some/rather/long/path/to/a/flare");
+		magma_deserialize_string(buffer, string);
+	}
+	bench_stop("primitive", "string", memory_iterations);
+
+	struct stat st;
+	bench_start();
+	for (i = 0; i < memory_iterations; i++) {
+		magma_encode_stat_struct(&bench_stat, buffer);
+		magma_decode_stat_struct(buffer, &st);
+	}
+	bench_stop("primitive", "struct stat", memory_iterations);
+
+	magma_extended_readdir_entry entry;
+	bench_start();
+	for (i = 0; i < memory_iterations; i++) {
+		gchar *ptr = magma_encode_compact_readdir_entry(buffer, "entry-0000", &bench_listing.body.readdir_extended.entries[0].st);
+		magma_decode_compact_readdir_entry(buffer, ptr, &entry);
+	}
+	bench_stop("primitive", "compact readdir entry", memory_iterations);
+
+	bench_start();
+	for (i = 0; i < memory_iterations; i++) {
+		magma_serialize_handle(buffer, &bench_handle);
+		magma_deserialize_handle(buffer, &bench_handle);
+	}
+	bench_stop("primitive", "handle", memory_iterations);
+}
+
+/**
+ * round-trip every operation in memory
+ *
+ * @param socket a socket nothing is sent on
+ * @param peer its peer
+ */
+static void bench_memory(GSocket *socket, GSocketAddress *peer)
+{
+	MAGMA_IO_BUFFER(request);
+	MAGMA_IO_BUFFER(reply);
+
+	bench_op *op = bench_ops;
+	for (; op->name; op++) {
+		int i = 0;
+		bench_start();
+		for (; i < memory_iterations; i++) {
+			magma_capture_begin(socket, reply, MAGMA_MAX_BUFFER_SIZE);
+			op->answer(socket, peer, i);
+			gssize reply_length = magma_capture_end();
+
+			magma_capture_begin(socket, request, MAGMA_MAX_BUFFER_SIZE);
+			magma_replay_begin(socket, reply, reply_length);
+			op->request(socket, peer, &bench_response);
+			magma_replay_end();
+			magma_capture_end();
+
+			gchar *body = magma_parse_request_header(request, &bench_request);
+			op->parse(body, &bench_request);
+		}
+		bench_stop("memory", op->name, memory_iterations);
+
+		if (bench_response.generic_response.header.status isNot G_IO_STATUS_NORMAL)
+			printf("%-10s %-26s did not receive its response\n", "memory", op->name);
+	}
+}
+
+/**
+ * send the operations which can be repeated to the server over UDP
+ *
+ * @param flare_port the flare protocol port of the server
+ */
+static void bench_loopback(guint16 flare_port)
+{
+	GSocketAddress *flare_peer = NULL, *node_peer = NULL;
+	GSocket *flare_socket = magma_open_client_connection(myself.ip_addr, flare_port, &flare_peer);
+	GSocket *node_socket = magma_open_client_connection(myself.ip_addr, MAGMA_NODE_PORT, &node_peer);
+
+	if (!flare_socket || !node_socket) {
+		printf("Can't connect to the server on %s\n", myself.ip_addr);
+		return;
+	}
+
+	/* another server on this host may offer a local socket on the same port */
+	if (magma_socket_is_local(flare_socket))
+		printf("The flare port is reached through a local socket: the loopback figures measure AF_UNIX\n\n");
+
+	/* the file the operations work on */
+	request_mknod(flare_socket, flare_peer, &bench_response);
+	request_write(flare_socket, flare_peer, &bench_response);
+	request_open_handle(flare_socket, flare_peer, &bench_response);
+	if (bench_response.flare_response.header.res isNot -1)
+		bench_handle = bench_response.flare_response.body.open.handle;
+
+	bench_op *op = bench_ops;
+	for (; op->name; op++) {
+		if (!op->loopback) continue;
+
+		GSocket *socket = op->node ? node_socket : flare_socket;
+		GSocketAddress *peer = op->node ? node_peer : flare_peer;
+		int failed = 0, i = 0;
+
+		bench_start();
+		for (; i < loopback_iterations; i++) {
+			op->request(socket, peer, &bench_response);
+			if (bench_response.generic_response.header.status isNot G_IO_STATUS_NORMAL ||
+				bench_response.generic_response.header.res is -1) failed++;
+		}
+		bench_stop("loopback", op->name, loopback_iterations);
+
+		if (failed) printf("%-10s %-26s %d of %d failed\n", "loopback", op->name, failed, loopback_iterations);
+	}
+
+	request_unlink(flare_socket, flare_peer, &bench_response);
+}
+
+/**
+ * start a single node network on 127.0.0.1, as magmad does
+ * but with UDP services only
+ *
+ * @return the flare protocol port
+ */
+static guint16 bench_start_server()
+{
+	gchar *hashpath = g_dir_make_tmp("protocol_rate-XXXXXX", NULL);
+
+	magma_environment.progname = "protocol_rate";
+	magma_environment.nickname = "bench";
+	magma_environment.servername = "localhost";
+	magma_environment.ipaddr = "127.0.0.1";
+	magma_environment.port = MAGMA_PORT;
+	magma_environment.hashpath = hashpath;
+	magma_environment.bandwidth = 100;
+	magma_environment.storage = 1;
+	magma_environment.bootstrap = 1;
+	magma_environment.receivers = 1;
+
+	magma_config_myself(
+		magma_environment.nickname,
+		magma_environment.servername,
+		magma_environment.ipaddr,
+		magma_environment.port,
+		magma_environment.bandwidth,
+		magma_environment.storage,
+		magma_environment.hashpath);
+
+	magma_flare_system_init();
+
+	magma_start_udp_service("magma node protocol", myself.ip_addr, MAGMA_NODE_PORT,
+		magma_manage_udp_node_protocol, (GFunc) magma_manage_udp_node_protocol_pool, 1);
+
+	magma_build_network(1, NULL, MAGMA_NODE_PORT, 0);
+
+	magma_start_udp_service("magma flare protocol", myself.ip_addr, MAGMA_PORT,
+		magma_manage_udp_flare_protocol, (GFunc) magma_manage_udp_flare_protocol_pool, 1);
+
+	/*
+	 * no local socket: the client would talk to it instead of
+	 * UDP and the loopback figures would measure AF_UNIX
+	 */
+
+	printf("Server started on %s, hash path %s\n\n", myself.ip_addr, hashpath);
+	return (MAGMA_PORT);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1) memory_iterations = atoi(argv[1]);
+	if (argc > 2) loopback_iterations = atoi(argv[2]);
+	if (memory_iterations < 1) memory_iterations = 1;
+	if (loopback_iterations < 1) loopback_iterations = 1;
+
+	guint16 flare_port = bench_start_server();
+	bench_prepare_data();
+
+	/* an unbound datagram socket: replies are replayed, requests captured */
+	GSocket *socket = g_socket_new(G_SOCKET_FAMILY_IPV4, G_SOCKET_TYPE_DATAGRAM, G_SOCKET_PROTOCOL_UDP, NULL);
+	GInetAddress *address = g_inet_address_new_loopback(G_SOCKET_FAMILY_IPV4);
+	GSocketAddress *peer = g_inet_socket_address_new(address, MAGMA_PORT);
+
+	printf("%d in-memory iterations, %d loopback iterations\n\n", memory_iterations, loopback_iterations);
+
+	bench_primitives();
+	printf("\n");
+	bench_memory(socket, peer);
+	printf("\n");
+	bench_loopback(flare_port);
+
+	g_object_unref(peer);
+	g_object_unref(address);
+	g_object_unref(socket);
+
+	return (0);
+}
+
+// vim:ts=4:nocindent:autoindent
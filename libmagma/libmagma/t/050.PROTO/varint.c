@@ -0,0 +1,107 @@
+/*
+   Magma test suite -- varint.c
+   Copyright (C) 2006-2013 Tx0 <tx0@strumentiresistenti.org>
+
+   Checks magma_serialize_varint() and magma_deserialize_varint():
+   values on the boundaries of the seven bit groups must take the
+   expected number of bytes and come back unchanged, while values
+   cut by the end of the received data, or longer than
+   MAGMA_VARINT_MAX_SIZE bytes, must be refused.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../magma.h"
+
+magma_environment_t magma_environment;
+
+static int failures = 0;
+
+/**
+ * Encode a value, check its size, decode it back and check
+ * that any shorter buffer is refused
+ */
+static void varint_round_trip(guint64 value, gsize expected_size)
+{
+	gchar buffer[MAGMA_VARINT_MAX_SIZE + 1];
+	memset(buffer, 0xff, sizeof(buffer));
+
+	gchar *end = magma_serialize_varint(buffer, value);
+	gsize size = end - buffer;
+
+	guint64 decoded = 0;
+	gchar *next = magma_deserialize_varint(buffer, end, &decoded);
+
+	gboolean ok = (size is expected_size && next is end && decoded is value) ? TRUE : FALSE;
+
+	gsize truncated = 0;
+	for (; truncated < size; truncated++) {
+		if (magma_deserialize_varint(buffer, buffer + truncated, &decoded)) {
+			fprintf(stderr, "  %" G_GUINT64_FORMAT " cut to %zu bytes was accepted\n", value, truncated);
+			ok = FALSE;
+		}
+	}
+
+	fprintf(stderr, "  %s: %" G_GUINT64_FORMAT " in %zu bytes (expected %zu)\n",
+		ok ? "ok" : "FAILED", value, size, expected_size);
+	if (!ok) failures++;
+}
+
+int main(int argc, char **argv)
+{
+	(void) argc;
+	(void) argv;
+
+	fprintf(stderr, "Round trips:\n");
+	varint_round_trip(0, 1);
+	varint_round_trip(127, 1);
+	varint_round_trip(128, 2);
+	varint_round_trip(16383, 2);
+	varint_round_trip(16384, 3);
+	varint_round_trip(G_GUINT64_CONSTANT(1) << 63, MAGMA_VARINT_MAX_SIZE);
+	varint_round_trip(G_MAXUINT64, MAGMA_VARINT_MAX_SIZE);
+
+	fprintf(stderr, "Malformed input:\n");
+
+	/* continuation bits set on more bytes than a 64 bit value needs */
+	gchar overlong[MAGMA_VARINT_MAX_SIZE + 1];
+	memset(overlong, 0x80, sizeof(overlong));
+	overlong[MAGMA_VARINT_MAX_SIZE] = 0x01;
+
+	guint64 decoded = 0;
+	gboolean refused = magma_deserialize_varint(overlong, overlong + sizeof(overlong), &decoded) ? FALSE : TRUE;
+	fprintf(stderr, "  %s: %d bytes long varint refused\n", refused ? "ok" : "FAILED", MAGMA_VARINT_MAX_SIZE + 1);
+	if (!refused) failures++;
+
+	/* a continuation bit on the last received byte */
+	gchar dangling[2] = { (gchar) 0x81, (gchar) 0x81 };
+	refused = magma_deserialize_varint(dangling, dangling + sizeof(dangling), &decoded) ? FALSE : TRUE;
+	fprintf(stderr, "  %s: varint running past the datagram refused\n", refused ? "ok" : "FAILED");
+	if (!refused) failures++;
+
+	if (failures) {
+		fprintf(stderr, "FAILED\n");
+		return (1);
+	}
+
+	fprintf(stderr, "OK\n");
+	return (0);
+}
+
+// vim:ts=4:nocindent:autoindent
@@ -0,0 +1,143 @@
+/*
+   Magma test suite -- replica_order.c
+   Copyright (C) 2006-2013 Tx0 <tx0@strumentiresistenti.org>
+
+   Checks that magma_queue_replica() keeps the operations on the
+   same key in the order they were queued. A few keys are changed
+   many times with CHMOD, each carrying its own sequence number as
+   the mode, and a SYMLINK is created on each key halfway through.
+   A fake replica function takes a random time to run and checks
+   that every key sees its sequence numbers growing. Many more
+   operations than a lane holds are queued, so the producer is held
+   back by the full lanes and no operation must get lost.
+
+   Usage: replica_order [operations per key]
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../magma.h"
+
+magma_environment_t magma_environment;
+
+#define ORDER_KEYS 8
+
+static int operations = 2000;
+
+static GMutex order_lock;
+static GCond order_done;
+static gint last_seen[ORDER_KEYS];
+static int executed = 0;
+static int misordered = 0;
+
+/**
+ * Return the index of a key from its path
+ */
+static int order_key(const gchar *path)
+{
+	return (atoi(path + strlen("/order/")));
+}
+
+/**
+ * Check that the sequence number of an operation on a key
+ * is greater than the last one seen on that key
+ */
+static void order_check(const gchar *path, gint sequence)
+{
+	g_usleep(g_random_int_range(0, 200));
+
+	g_mutex_lock(&order_lock);
+
+	int key = order_key(path);
+	if (sequence <= last_seen[key]) {
+		fprintf(stderr, "%s: #%d replicated after #%d\n", path, sequence, last_seen[key]);
+		misordered++;
+	}
+	last_seen[key] = sequence;
+
+	executed++;
+	g_cond_signal(&order_done);
+	g_mutex_unlock(&order_lock);
+}
+
+static void order_chmod(magma_flare_request *request, magma_volcano *node)
+{
+	(void) node;
+	order_check(request->body.chmod.path, request->body.chmod.mode);
+}
+
+static void order_symlink(magma_flare_request *request, magma_volcano *node)
+{
+	(void) node;
+	order_check(request->body.symlink.to, atoi(request->body.symlink.from));
+}
+
+int main(int argc, char **argv)
+{
+	if (argc > 1) operations = atoi(argv[1]);
+
+	magma_init_server_flare();
+
+	magma_volcano node;
+	memset(&node, 0, sizeof(magma_volcano));
+	g_strlcpy(node.node_name, "replica_order", MAX_HOSTNAME_LENGTH);
+
+	magma_flare_request request;
+	int sequence, key;
+
+	for (sequence = 1; sequence <= operations; sequence++) {
+		for (key = 0; key < ORDER_KEYS; key++) {
+			memset(&request, 0, sizeof(magma_flare_request));
+
+			if (sequence is operations / 2) {
+				/* the symlink is the flare named by "to" */
+				request.header.type = MAGMA_OP_TYPE_SYMLINK;
+				g_snprintf(request.body.symlink.from, MAGMA_TERMINATED_PATH_LENGTH, "%d", sequence);
+				g_snprintf(request.body.symlink.to, MAGMA_TERMINATED_PATH_LENGTH, "/order/%d", key);
+				magma_queue_replica(order_symlink, &request, &node);
+			} else {
+				request.header.type = MAGMA_OP_TYPE_CHMOD;
+				request.body.chmod.mode = sequence;
+				g_snprintf(request.body.chmod.path, MAGMA_TERMINATED_PATH_LENGTH, "/order/%d", key);
+				magma_queue_replica(order_chmod, &request, &node);
+			}
+		}
+	}
+
+	int expected = operations * ORDER_KEYS;
+	gint64 deadline = g_get_monotonic_time() + 60 * G_TIME_SPAN_SECOND;
+
+	g_mutex_lock(&order_lock);
+	while (executed < expected) {
+		if (!g_cond_wait_until(&order_done, &order_lock, deadline)) break;
+	}
+	g_mutex_unlock(&order_lock);
+
+	fprintf(stderr, "%d operations queued, %d replicated, %d out of order\n", expected, executed, misordered);
+
+	if (executed isNot expected || misordered) {
+		fprintf(stderr, "FAILED\n");
+		return (1);
+	}
+
+	fprintf(stderr, "OK\n");
+	return (0);
+}
+
+// vim:ts=4:nocindent:autoindent
@@ -451,14 +451,47 @@ void magma_clean_group_cache()
 	}
 }
 
+/**
+ * Get the IP address of a peer as a string. Peers on a local
+ * socket are on this host, so they get its address.
+ *
+ * @param peer the peer
+ * @return the address, to be freed with g_free()
+ */
 gchar *magma_get_peer_addr(GSocketAddress *peer)
 {
+	if (g_socket_address_get_family(peer) is G_SOCKET_FAMILY_UNIX) return (g_strdup(myself.ip_addr));
+
 	GInetSocketAddress *_peer = G_INET_SOCKET_ADDRESS(peer);
 	GInetAddress *addr = g_inet_socket_address_get_address(_peer);
 	gchar *addr_string = g_inet_address_to_string(addr);
 	return (addr_string);
 }
 
+/**
+ * Get a string telling a peer from any other: address and port
+ * for UDP peers, the socket name for local peers
+ *
+ * @param peer the peer
+ * @return the name, to be freed with g_free()
+ */
+gchar *magma_get_peer_name(GSocketAddress *peer)
+{
+	if (g_socket_address_get_family(peer) is G_SOCKET_FAMILY_UNIX) {
+		struct sockaddr_un address;
+		memset(&address, 0, sizeof(struct sockaddr_un));
+		if (!g_socket_address_to_native(peer, &address, sizeof(struct sockaddr_un), NULL)) return (g_strdup("local"));
+
+		/* abstract names start with a nul byte */
+		return (g_strdup_printf("local:%s", address.sun_path[0] ? address.sun_path : address.sun_path + 1));
+	}
+
+	gchar *addr_string = magma_get_peer_addr(peer);
+	gchar *name = g_strdup_printf("%s:%d", addr_string, g_inet_socket_address_get_port(G_INET_SOCKET_ADDRESS(peer)));
+	g_free(addr_string);
+	return (name);
+}
+
 /**
  * log a stack trace
  */
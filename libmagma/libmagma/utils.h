@@ -90,6 +90,7 @@ extern gid_t *magma_get_user_groups(uid_t uid);
 extern void magma_clean_group_cache();
 
 extern gchar *magma_get_peer_addr(GSocketAddress *peer);
+extern gchar *magma_get_peer_name(GSocketAddress *peer);
 
 extern void magma_log_stacktrace(int levels);
 
@@ -0,0 +1,84 @@
+/*
+   Magma tools -- create.c
+   Copyright (C) 2006-2013 Tx0 <tx0@strumentiresistenti.org>
+
+   Accept a server, a port and a list of paths. Create every path as
+   an empty regular file and read back its attributes, sending the
+   MKNOD and the GETATTR of each file in one COMPOUND datagram.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#define MAGMA_DEBUG_STDERR 1
+#include <magma/magma.h>
+
+int main(int argc, char **argv)
+{
+	magma_environment.debug = DEBUG_ERR;
+
+	if (argc < 4) {
+		dbg(LOG_ERR, DEBUG_ERR, "Usage: %s <server> <port> <path> [<path> ...]", argv[0]);
+		exit(1);
+	}
+
+	GSocketAddress *peer = NULL;
+	GSocket *socket = magma_open_client_connection(argv[1], atoi(argv[2]), &peer);
+	if (!socket) {
+		dbg(LOG_ERR, DEBUG_ERR, "Can't connect to %s:%s", argv[1], argv[2]);
+		exit(2);
+	}
+
+	int count = argc - 3, created = 0, compounds = 0;
+	gint64 start = g_get_monotonic_time();
+
+	/*
+	 * a failed MKNOD cancels the GETATTR of its file only,
+	 * so every file gets its own compound
+	 */
+	int i;
+	for (i = 0; i < count; i++) {
+		const gchar *path = argv[i + 3];
+		magma_flare_response mknod, getattr;
+		struct stat st;
+
+		memset(&st, 0, sizeof(struct stat));
+		getattr.body.getattr.stbuf = &st;
+
+		gboolean compound = magma_compound_begin(socket, peer);
+		magma_pktqs_mknod(socket, peer, MAGMA_DEFAULT_TTL, getuid(), getgid(), S_IFREG | 0644, 0, path, &mknod);
+		magma_pktqs_getattr(socket, peer, getuid(), getgid(), path, &getattr);
+		if (compound) {
+			magma_compound_end();
+			compounds++;
+		}
+
+		if (mknod.header.res is -1) {
+			fprintf(stderr, "%s: %s\n", path, strerror(mknod.header.err_no));
+		} else if (getattr.header.res is -1) {
+			fprintf(stderr, "%s: created, but %s\n", path, strerror(getattr.header.err_no));
+		} else {
+			printf("%s: mode %o, %lu bytes\n", path, st.st_mode, (unsigned long) st.st_size);
+			created++;
+		}
+	}
+
+	gint64 end = g_get_monotonic_time();
+
+	printf("%d of %d files created in %ld us, %d compounds\n", created, count, (long) (end - start), compounds);
+
+	return (0);
+}
+
+// vim:ts=4:nocindent:autoindent
@@ -0,0 +1,122 @@
+/*
+   Magma tools -- fanout.c
+   Copyright (C) 2006-2013 Tx0 <tx0@strumentiresistenti.org>
+
+   Accept a server, a port and a list of paths. Send all the GETATTR
+   requests at once using the asynchronous API, then read the first
+   chunk of every regular file in parallel.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#define MAGMA_DEBUG_STDERR 1
+#include <magma/magma.h>
+
+/** a path being examined */
+typedef struct {
+	gchar *path;
+	struct stat st;
+	magma_flare_response getattr;
+	magma_flare_response read;
+	magma_future *future;
+} fanout_entry;
+
+/** read replies still to come */
+static gint fanout_reads_pending = 0;
+
+/**
+ * Completion callback of the reads: runs in the I/O thread
+ */
+static void fanout_read_done(magma_future *future, gpointer user_data)
+{
+	fanout_entry *entry = user_data;
+	magma_response_header *header = &future->response->flare_response.header;
+
+	if (header->res is -1) {
+		fprintf(stderr, "%s: read failed: %s\n", entry->path, strerror(header->err_no));
+	} else {
+		printf("%s: read %d bytes\n", entry->path, header->res);
+	}
+
+	g_atomic_int_add(&fanout_reads_pending, -1);
+}
+
+int main(int argc, char **argv)
+{
+	magma_environment.debug = DEBUG_ERR;
+
+	if (argc < 4) {
+		dbg(LOG_ERR, DEBUG_ERR, "Usage: %s <server> <port> <path> [<path> ...]", argv[0]);
+		exit(1);
+	}
+
+	GSocketAddress *peer = NULL;
+	GSocket *socket = magma_open_client_connection(argv[1], atoi(argv[2]), &peer);
+	if (!socket) {
+		dbg(LOG_ERR, DEBUG_ERR, "Can't connect to %s:%s", argv[1], argv[2]);
+		exit(2);
+	}
+
+	int count = argc - 3;
+	fanout_entry *entries = g_new0(fanout_entry, count);
+	gint64 start = g_get_monotonic_time();
+
+	/*
+	 * send all the GETATTR at once, then wait for them
+	 */
+	int i;
+	for (i = 0; i < count; i++) {
+		entries[i].path = argv[i + 3];
+		entries[i].getattr.body.getattr.stbuf = &entries[i].st;
+		entries[i].future = magma_async_getattr(socket, peer, getuid(), getgid(),
+			entries[i].path, &entries[i].getattr, NULL, NULL);
+	}
+
+	for (i = 0; i < count; i++) {
+		magma_future_wait(entries[i].future);
+		magma_future_free(entries[i].future);
+	}
+
+	gint64 attributes = g_get_monotonic_time();
+
+	/*
+	 * read the first chunk of each regular file, completing in the callback
+	 */
+	for (i = 0; i < count; i++) {
+		if (entries[i].getattr.header.res is -1) {
+			fprintf(stderr, "%s: %s\n", entries[i].path, strerror(entries[i].getattr.header.err_no));
+			continue;
+		}
+
+		printf("%s: mode %o, %lu bytes\n", entries[i].path, entries[i].st.st_mode, (unsigned long) entries[i].st.st_size);
+		if (!S_ISREG(entries[i].st.st_mode)) continue;
+
+		g_atomic_int_inc(&fanout_reads_pending);
+		magma_async_read(socket, peer, getuid(), getgid(), MAGMA_READ_WRITE_BUFFER_SIZE, 0,
+			entries[i].path, &entries[i].read, fanout_read_done, &entries[i]);
+	}
+
+	while (g_atomic_int_get(&fanout_reads_pending)) g_usleep(1000);
+
+	gint64 end = g_get_monotonic_time();
+
+	printf("%d getattr in %ld us, reads in %ld us\n", count,
+		(long) (attributes - start), (long) (end - attributes));
+
+	g_free(entries);
+	return (0);
+}
+
+// vim:ts=4:nocindent:autoindent
@@ -66,18 +66,28 @@ void create_service(gchar *address, uint16_t port, GCallback *callback, gulong *
 /**
  * Open the FLARE protocol port and bind the
  * magma_manage_udp_flare_protocol callback to
- * manage incoming connections
+ * manage incoming connections. The same callback
+ * serves the local socket used by clients on this host.
  */
 static void magma_open_flare_socket()
 {
 	uint16_t port = myself.port ? myself.port : MAGMA_PORT;
 
-	magma_start_udp_service(
+	magma_udp_service_context *udp = magma_start_udp_service(
 		"magma flare protocol",
 		myself.ip_addr,
 		port,
 		magma_manage_udp_flare_protocol,
+		MAGMAD_USE_FLARE_POOL ? (GFunc) magma_manage_udp_flare_protocol_pool : NULL,
+		magma_environment.receivers);
+
+	magma_start_local_service(
+		"magma flare protocol",
+		port,
+		magma_manage_udp_flare_protocol,
 		MAGMAD_USE_FLARE_POOL ? (GFunc) magma_manage_udp_flare_protocol_pool : NULL);
+
+	if (magma_environment.stream) magma_start_stream_service(udp);
 }
 
 /**
@@ -87,12 +97,21 @@ static void magma_open_flare_socket()
  */
 static void magma_open_node_socket()
 {
-	magma_start_udp_service(
+	magma_udp_service_context *udp = magma_start_udp_service(
 		"magma node protocol",
 		myself.ip_addr,
 		MAGMA_NODE_PORT,
 		magma_manage_udp_node_protocol,
+		MAGMAD_USE_NODE_POOL ? (GFunc) magma_manage_udp_node_protocol_pool : NULL,
+		magma_environment.receivers);
+
+	magma_start_local_service(
+		"magma node protocol",
+		MAGMA_NODE_PORT,
+		magma_manage_udp_node_protocol,
 		MAGMAD_USE_NODE_POOL ? (GFunc) magma_manage_udp_node_protocol_pool : NULL);
+
+	if (magma_environment.stream) magma_start_stream_service(udp);
 }
 
 /**
@@ -258,6 +277,14 @@ int main(int argc, char **argv)
 	 */
 	magma_open_flare_socket();
 
+	/*
+	 * After a restart, ask the node we are redundant for
+	 * to replay the operations we missed while down
+	 */
+	if (!magma_environment.bootstrap && !magma_environment.bootserver) {
+		magma_journal_catch_up();
+	}
+
 	/*
 	 * Create the GLib main loop
 	 */
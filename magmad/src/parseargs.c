@@ -58,6 +58,13 @@ void magma_usage(char *msg)
 	fprintf(stderr, "    -r <IP>       Remote boot server (if missing new Magmanet is created)\n");
 	fprintf(stderr, "                  bootserver syntax is bootserver[:port]\n");
 	fprintf(stderr, "  * -k <STRING>   Secret keyphrase used to join the net\n");
+	fprintf(stderr, "    -R <NUM>      Receiving sockets per UDP port (SO_REUSEPORT, defaults to 1)\n");
+	fprintf(stderr, "    -P <SPEC>     Worker pool as class:workers:queue:priority, may be repeated\n");
+	fprintf(stderr, "                  classes are metadata, data, dirlist and node\n");
+	fprintf(stderr, "    -C            Also serve bulk operations over TCP connections on the same ports\n");
+	fprintf(stderr, "    -X            Also keep flare metadata in extended attributes of the hash path\n");
+	fprintf(stderr, "    -W <NUM>      Replication workers per redundant node (defaults to %d)\n", MAGMA_REPLICA_WORKERS);
+	fprintf(stderr, "    -O <NUM>      Changes per second remembered against retransmissions (defaults to %d)\n", MAGMA_OPERATION_CACHE_RATE);
 	fprintf(stderr, "    -l            Load last active status from disk (require -n)\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "  Debug mask can contain:\n\n");
@@ -90,12 +97,14 @@ void magma_parse_args(int argc, char **argv)
 	magma_environment.bandwidth = MAGMA_DEFAULT_BANDWIDTH;	/* Declared bandwidth */
 	magma_environment.storage = MAGMA_DEFAULT_STORAGE;		/* Declared storage */
 	magma_environment.bootstrap = 0;						/* If true, this node should bootstrap a new network, if false this node should join an existing one */
+	magma_environment.receivers = 1;						/* Receiving sockets per UDP service */
+	magma_environment.replica_workers = MAGMA_REPLICA_WORKERS;	/* Replication lanes per redundant node */
 
 	/*
 	 * cycling through options
 	 */
 	char c;
-	while ((c = getopt(argc, argv, "blhHA?D:Tp:i:n:s:d:w:r:k:" )) != -1) {
+	while ((c = getopt(argc, argv, "blhHA?D:CXp:i:n:s:d:w:r:k:R:P:W:O:" )) != -1) {
 		switch (c) {
 			case 'b':
 				if (magma_environment.bootserver) {
@@ -187,6 +196,40 @@ void magma_parse_args(int argc, char **argv)
 					dbg(LOG_INFO, DEBUG_BOOT, "Secret Key is [%s]", magma_environment.secretkey);
 				}
 				break;
+			case 'R':
+				if (optarg) {
+					magma_environment.receivers = atoi(optarg);
+					if (magma_environment.receivers < 1) magma_environment.receivers = 1;
+					dbg(LOG_INFO, DEBUG_BOOT, "UDP receivers per port: %d", magma_environment.receivers);
+				}
+				break;
+			case 'C':
+				magma_environment.stream = 1;
+				dbg(LOG_INFO, DEBUG_BOOT, "Serving bulk operations over TCP too");
+				break;
+			case 'X':
+				magma_environment.metadata_xattr = 1;
+				dbg(LOG_INFO, DEBUG_BOOT, "Keeping flare metadata in extended attributes too");
+				break;
+			case 'W':
+				if (optarg) {
+					magma_environment.replica_workers = atoi(optarg);
+					if (magma_environment.replica_workers < 1) magma_environment.replica_workers = 1;
+					dbg(LOG_INFO, DEBUG_BOOT, "Replication workers per node: %d", magma_environment.replica_workers);
+				}
+				break;
+			case 'O':
+				if (optarg) {
+					magma_environment.operation_rate = atoi(optarg);
+					if (magma_environment.operation_rate < 1) magma_environment.operation_rate = 1;
+					dbg(LOG_INFO, DEBUG_BOOT, "Duplicate request cache sized for %d changes/s", magma_environment.operation_rate);
+				}
+				break;
+			case 'P':
+				if (optarg && !magma_scheduler_configure(optarg)) {
+					magma_usage("Worker pool specification must be class:workers:queue:priority");
+				}
+				break;
 			case '?':
 				if (isprint(optopt)) {
 					dbg(LOG_ERR, DEBUG_ERR, "Unknown option -%c", optopt);
@@ -75,12 +75,15 @@ magma_environment_t magma_environment;
 typedef struct {
 	gchar commit_url[2 * MAGMA_TERMINATED_PATH_LENGTH];
 	gchar key[SHA_READABLE_DIGEST_LENGTH];
+	magma_flare_handle handle;	/** answered by OPEN_HANDLE */
+	gboolean has_handle;
 } magma_fd;
 
 /**
  * The hash table used to save magma_fd file descriptors
  */
 GHashTable *magma_fds;
+GMutex magma_fds_mutex;
 
 GMutex magma_refresh_topology_mutex;
 
@@ -288,6 +291,31 @@ static int magma_client_readlink(const char *path, char *buf, size_t size)
 
 #if MAGMA_OPTIMIZE_READDIR
 
+/**
+ * Hand a directory entry received from a server to FUSE
+ *
+ * @return the filler result: not 0 if the FUSE buffer is full
+ */
+static int magma_client_fill_entry(void *buf, fuse_fill_dir_t filler, magma_extended_readdir_entry *entry)
+{
+	struct stat st;
+	st.st_dev     = entry->st.dev;
+	st.st_ino     = entry->st.ino;
+	st.st_size    = entry->st.size;
+	st.st_blocks  = entry->st.blocks;
+	st.st_atime   = entry->st.atime;
+	st.st_ctime   = entry->st.ctime;
+	st.st_mtime   = entry->st.mtime;
+	st.st_mode    = entry->st.mode;
+	st.st_nlink   = entry->st.nlink;
+	st.st_uid     = entry->st.uid;
+	st.st_gid     = entry->st.gid;
+	st.st_rdev    = entry->st.rdev;
+	st.st_blksize = entry->st.blksize;
+
+	return (filler(buf, entry->path, &st, 0));
+}
+
 static int magma_client_readdir(
 	const char *path,
 	void *buf,
@@ -317,8 +345,20 @@ static int magma_client_readdir(
 	off_t looping_offset = offset;
 	gboolean refresh_topology = FALSE;
 
+	/*
+	 * servers speaking READDIR_COMPACT send as many entries as
+	 * fit a datagram, the others MAGMA_MAX_READDIR_ENTRIES
+	 */
+	gboolean compact = (magma_demux_peer_version(socket) >= MAGMA_COMPACT_READDIR_VERSION) ? TRUE : FALSE;
+	MAGMA_IO_BUFFER(entries);
+
 	while (1) {
-		magma_pktqs_readdir_extended(socket, peer, uid, gid, path, looping_offset, &response);
+		if (compact) {
+			response.body.readdir_compact.entries = entries;
+			magma_pktqs_readdir_compact(socket, peer, uid, gid, path, looping_offset, &response);
+		} else {
+			magma_pktqs_readdir_extended(socket, peer, uid, gid, path, looping_offset, &response);
+		}
 
 		/*
 		 * check for network problems
@@ -329,26 +369,24 @@ static int magma_client_readdir(
 		 * decode all the entries
 		 */
 		int i;
-		for (i = 0; i < response.body.readdir_extended.entry_number; i++) {
-			magma_extended_readdir_entry *entry = &(response.body.readdir_extended.entries[i]);
-
-			struct stat st;
-			st.st_dev     = entry->st.dev;
-			st.st_ino     = entry->st.ino;
-			st.st_size    = entry->st.size;
-			st.st_blocks  = entry->st.blocks;
-			st.st_atime   = entry->st.atime;
-			st.st_ctime   = entry->st.ctime;
-			st.st_mtime   = entry->st.mtime;
-			st.st_mode    = entry->st.mode;
-			st.st_nlink   = entry->st.nlink;
-			st.st_uid     = entry->st.uid;
-			st.st_gid     = entry->st.gid;
-			st.st_rdev    = entry->st.rdev;
-			st.st_blksize = entry->st.blksize;
-
-			if (filler(buf, entry->path, &st, 0)) {
-				return (0);
+		if (compact) {
+			gchar *ptr = entries;
+			gchar *end = entries + response.body.readdir_compact.length;
+
+			for (i = 0; i < response.body.readdir_compact.entry_number; i++) {
+				magma_extended_readdir_entry entry;
+				ptr = magma_decode_compact_readdir_entry(ptr, end, &entry);
+				if (!ptr) break;
+
+				if (magma_client_fill_entry(buf, filler, &entry)) {
+					return (0);
+				}
+			}
+		} else {
+			for (i = 0; i < response.body.readdir_extended.entry_number; i++) {
+				if (magma_client_fill_entry(buf, filler, &(response.body.readdir_extended.entries[i]))) {
+					return (0);
+				}
 			}
 		}
 
@@ -364,7 +402,7 @@ static int magma_client_readdir(
 		/*
 		 * update loop offset
 		 */
-		looping_offset = response.body.readdir_extended.offset;
+		looping_offset = compact ? response.body.readdir_compact.offset : response.body.readdir_extended.offset;
 	}
 
 #if !MAGMA_CACHE_SOCKETS
@@ -904,6 +942,61 @@ static int magma_client_utime(const char *path, struct utimbuf *buf)
 	return ((response.header.res is -1) ? -response.header.err_no : 0);
 }
 
+/**
+ * Save the answer of an OPEN in the global file store
+ *
+ * @param has_handle TRUE if the answer is an OPEN_HANDLE one
+ * @return TRUE on success, FALSE if out of memory
+ */
+static gboolean magma_client_store_fd(const char *path, magma_flare_response *response, gboolean has_handle)
+{
+	magma_fd *fd = g_new0(magma_fd, 1);
+	if (!fd) return (FALSE);
+
+	g_strlcpy(fd->commit_url, response->body.open.commit_url, 2 * MAGMA_TERMINATED_PATH_LENGTH);
+	unsigned char* binhash = magma_sha1_data(fd->commit_url, strlen(fd->commit_url));
+	gchar *armour = magma_armour_hash(binhash);
+	strcpy(fd->key, armour);
+	g_free(armour);
+	g_free(binhash);
+
+	if (has_handle) {
+		fd->handle = response->body.open.handle;
+		fd->has_handle = TRUE;
+	}
+
+	g_mutex_lock(&magma_fds_mutex);
+	g_hash_table_insert(magma_fds, g_strdup(path), fd);
+	g_mutex_unlock(&magma_fds_mutex);
+	return (TRUE);
+}
+
+/**
+ * Get the file handle of an open file
+ *
+ * @return TRUE if path has a handle, copied in handle
+ */
+static gboolean magma_client_get_handle(const char *path, magma_flare_handle *handle)
+{
+	g_mutex_lock(&magma_fds_mutex);
+	magma_fd *fd = g_hash_table_lookup(magma_fds, path);
+	gboolean found = (fd && fd->has_handle) ? TRUE : FALSE;
+	if (found) *handle = fd->handle;
+	g_mutex_unlock(&magma_fds_mutex);
+	return (found);
+}
+
+/**
+ * Forget a stale file handle: the file goes on by path
+ */
+static void magma_client_drop_handle(const char *path)
+{
+	g_mutex_lock(&magma_fds_mutex);
+	magma_fd *fd = g_hash_table_lookup(magma_fds, path);
+	if (fd) fd->has_handle = FALSE;
+	g_mutex_unlock(&magma_fds_mutex);
+}
+
 static int magma_client_open(const char *path, struct fuse_file_info *fi)
 {
 	magma_flare_response response;
@@ -924,8 +1017,17 @@ static int magma_client_open(const char *path, struct fuse_file_info *fi)
 		return (-EPROTO);
 	}
 
+	/*
+	 * servers speaking OPEN_HANDLE answer a file handle which
+	 * small reads and writes use in place of the path
+	 */
+	gboolean handles = (magma_demux_peer_version(socket) >= MAGMA_HANDLE_VERSION) ? TRUE : FALSE;
+
 	dbg(LOG_INFO, DEBUG_PFUSE, "Sending OPEN(%s)", path);
-	magma_pktqs_open(socket, peer, uid, gid, (fi->flags), path, &response);
+	if (handles)
+		magma_pktqs_open_handle(socket, peer, uid, gid, (fi->flags), path, &response);
+	else
+		magma_pktqs_open(socket, peer, uid, gid, (fi->flags), path, &response);
 	dbg(LOG_INFO, DEBUG_PFUSE, "Received OPEN(%s)", path);
 
 	if ( response.header.res is -1 ) {
@@ -939,19 +1041,7 @@ static int magma_client_open(const char *path, struct fuse_file_info *fi)
 		/*
 		 * save the file information in the global store
 		 */
-		magma_fd *fd = g_new0(magma_fd, 1);
-		if (fd) {
-			g_strlcpy(fd->commit_url, response.body.open.commit_url, 2 * MAGMA_TERMINATED_PATH_LENGTH);
-			unsigned char* binhash = magma_sha1_data(fd->commit_url, strlen(fd->commit_url));
-			gchar *armour = magma_armour_hash(binhash);
-			strcpy(fd->key, armour);
-			g_free(armour);
-			g_free(binhash);
-
-			g_hash_table_insert(magma_fds, g_strdup(path), fd);
-		} else {
-			return (-ENOMEM);
-		}
+		if (!magma_client_store_fd(path, &response, handles)) return (-ENOMEM);
 	}
 
 #if !MAGMA_CACHE_SOCKETS
@@ -966,6 +1056,69 @@ static int magma_client_open(const char *path, struct fuse_file_info *fi)
 	return ((response.header.res is -1) ? -response.header.err_no : 0);
 }
 
+/**
+ * Create and open a regular file. MKNOD and OPEN travel in one
+ * COMPOUND when the owner speaks it, saving a round trip per file.
+ */
+static int magma_client_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+	magma_flare_response mknod_response, open_response;
+
+	dbg(LOG_INFO, DEBUG_PFUSE, "CREATE(%s, %u)", path, (unsigned int) mode);
+
+	MAGMA_CLIENT_SETUP_CONTEXT();
+
+	magma_volcano *owner = magma_route_path(path);
+	if (!owner) {
+		dbg(LOG_ERR, DEBUG_PFUSE, "Error routing path '%s': no owner found", path);
+		return (-EPROTO);
+	}
+	GSocketAddress *peer = NULL;
+	GSocket *socket = magma_open_client_connection(owner->ip_addr, owner->port, &peer);
+	if (!socket) {
+		dbg(LOG_ERR, DEBUG_PFUSE, "Error routing path '%s': can't create socket", path);
+		return (-EPROTO);
+	}
+
+	gboolean handles = (magma_demux_peer_version(socket) >= MAGMA_HANDLE_VERSION) ? TRUE : FALSE;
+
+	dbg(LOG_INFO, DEBUG_PFUSE, "Sending CREATE(%s)", path);
+	gboolean compound = magma_compound_begin(socket, peer);
+	magma_pktqs_mknod(socket, peer, MAGMA_DEFAULT_TTL, uid, gid, S_IFREG | (mode & ~S_IFMT), 0, path, &mknod_response);
+	if (handles)
+		magma_pktqs_open_handle(socket, peer, uid, gid, fi->flags & ~(O_CREAT|O_EXCL|O_TRUNC), path, &open_response);
+	else
+		magma_pktqs_open(socket, peer, uid, gid, fi->flags & ~(O_CREAT|O_EXCL|O_TRUNC), path, &open_response);
+	if (compound) magma_compound_end();
+	dbg(LOG_INFO, DEBUG_PFUSE, "Received CREATE(%s)", path);
+
+	magma_flare_response *response = &open_response;
+	if (mknod_response.header.res is -1) {
+		response = &mknod_response;
+		dbg(LOG_ERR, DEBUG_ERR, "CREATE(%s) error: %s", path, strerror(response->header.err_no));
+		if (response->header.err_no != ENOENT) {
+			magma_close_client_connection(socket, peer);
+		}
+	} else if (open_response.header.res is -1) {
+		dbg(LOG_ERR, DEBUG_ERR, "CREATE(%s) open error: %s", path, strerror(response->header.err_no));
+	} else {
+		dbg(LOG_INFO, DEBUG_PFUSE, "CREATE(%s) OK!", path);
+		if (!magma_client_store_fd(path, response, handles)) return (-ENOMEM);
+	}
+
+#if !MAGMA_CACHE_SOCKETS
+	g_object_unref(socket);
+	g_object_unref(peer);
+#endif
+
+	if (magma_flag_is_raised(mknod_response.header.flags, MAGMA_FLAG_REFRESH_TOPOLOGY) ||
+		magma_flag_is_raised(open_response.header.flags, MAGMA_FLAG_REFRESH_TOPOLOGY)) {
+		magma_refresh_topology();
+	}
+
+	return ((response->header.res is -1) ? -response->header.err_no : 0);
+}
+
 GMutex magma_read_mutex;
 GHashTable *magma_read_hash_table;
 
@@ -990,8 +1143,28 @@ static int magma_client_read(const char *path, char *buf, size_t size, off_t off
 		return (-EPROTO);
 	}
 
-	dbg(LOG_INFO, DEBUG_PFUSE, "Sending READ(%s)", path);
-	magma_pktqs_read(socket, peer, uid, gid, size, offset, path, &response);
+	/*
+	 * a read fitting a datagram goes by file handle, if the file
+	 * has one; a stale handle is forgotten and the read goes by
+	 * path, as READ_LARGE if the node speaks it and the read is
+	 * larger than a datagram, as a sequence of READs otherwise
+	 */
+	magma_flare_handle handle;
+	gboolean by_handle = FALSE;
+	if (size <= MAGMA_READ_WRITE_BUFFER_SIZE && magma_client_get_handle(path, &handle)) {
+		dbg(LOG_INFO, DEBUG_PFUSE, "Sending READ_HANDLE(%s)", path);
+		magma_pktqs_read_handle(socket, peer, uid, gid, size, offset, &handle, &response);
+		if (response.header.res > 0) memcpy(buf, response.body.read.buffer, response.header.res);
+
+		by_handle = (response.header.res isNot -1 || response.header.err_no isNot ESTALE) ? TRUE : FALSE;
+		if (!by_handle) magma_client_drop_handle(path);
+	}
+
+	if (!by_handle) {
+		dbg(LOG_INFO, DEBUG_PFUSE, "Sending READ(%s)", path);
+		int res = magma_pktqs_read_chunked(socket, peer, uid, gid, size, offset, path, buf, &response);
+		if (res isNot -1) response.header.res = res;
+	}
 	dbg(LOG_INFO, DEBUG_PFUSE, "Received READ(%s)", path);
 
 	if ( response.header.res is -1 ) {
@@ -1003,8 +1176,6 @@ static int magma_client_read(const char *path, char *buf, size_t size, off_t off
 		dbg(LOG_INFO, DEBUG_PFUSE, "READ(%s) OK! [%d bytes]", path, response.header.res);
 	}
 
-	memcpy(buf, response.body.read.buffer, response.header.res);
-
 #if !MAGMA_CACHE_SOCKETS
 	g_object_unref(socket);
 	g_object_unref(peer);
@@ -1038,8 +1209,24 @@ static int magma_client_write(const char *path, const char *buf, size_t size, of
 		return (-EPROTO);
 	}
 
-	dbg(LOG_INFO, DEBUG_PFUSE, "Sending WRITE(%s)", path);
-	magma_pktqs_write(socket, peer, MAGMA_DEFAULT_TTL, uid, gid, size, offset, path, buf, &response);
+	/*
+	 * like reads, a write fitting a datagram goes by file handle
+	 */
+	magma_flare_handle handle;
+	gboolean by_handle = FALSE;
+	if (size <= MAGMA_READ_WRITE_BUFFER_SIZE && magma_client_get_handle(path, &handle)) {
+		dbg(LOG_INFO, DEBUG_PFUSE, "Sending WRITE_HANDLE(%s)", path);
+		magma_pktqs_write_handle(socket, peer, MAGMA_DEFAULT_TTL, uid, gid, size, offset, &handle, buf, &response);
+
+		by_handle = (response.header.res isNot -1 || response.header.err_no isNot ESTALE) ? TRUE : FALSE;
+		if (!by_handle) magma_client_drop_handle(path);
+	}
+
+	if (!by_handle) {
+		dbg(LOG_INFO, DEBUG_PFUSE, "Sending WRITE(%s)", path);
+		int res = magma_pktqs_write_chunked(socket, peer, MAGMA_DEFAULT_TTL, uid, gid, size, offset, path, buf, &response);
+		if (res isNot -1) response.header.res = res;
+	}
 	dbg(LOG_INFO, DEBUG_PFUSE, "Received WRITE(%s)", path);
 
 	if ( response.header.res is -1 ) {
@@ -1199,6 +1386,7 @@ static struct fuse_operations magma_oper = {
     .truncate	= magma_client_truncate,
     .utime		= magma_client_utime,
     .open		= magma_client_open,
+    .create		= magma_client_create,
     .read		= magma_client_read,
     .write		= magma_client_write,
     .statfs		= magma_client_statfs,
@@ -1341,8 +1529,16 @@ int main(int argc, char *argv[])
 
 	fuse_opt_add_arg(&args, "-obig_writes");
 	fuse_opt_add_arg(&args, "-ofsname=magma");
-	fuse_opt_add_arg(&args, "-omax_write=32768");
-	fuse_opt_add_arg(&args, "-omax_read=32768");
+	/*
+	 * FUSE requests up to MAGMA_LARGE_IO_MAX_SIZE are carried by
+	 * READ_LARGE and WRITE_LARGE; the kernel may cap them lower
+	 */
+	gchar *max_write = g_strdup_printf("-omax_write=%d", MAGMA_LARGE_IO_MAX_SIZE);
+	gchar *max_read = g_strdup_printf("-omax_read=%d", MAGMA_LARGE_IO_MAX_SIZE);
+	fuse_opt_add_arg(&args, max_write);
+	fuse_opt_add_arg(&args, max_read);
+	g_free(max_write);
+	g_free(max_read);
 
 	/* saving debug state */
 	if (magma_environment.debug_all) memset(magma_environment.log, 1, 255);